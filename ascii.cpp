@@ -0,0 +1,727 @@
+#include "rainbow/protocol.hpp"
+
+#include "rainbow/slab.hpp"
+#include "rainbow/store.hpp"
+
+#include "mc.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <optional>
+#include <string>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace rainbow {
+
+static const std::string_view version = "0.0.0";
+
+/// Maximum number of tokens on a command line, which bounds the number of
+/// keys in a multi-key GET.
+static constexpr size_t max_tokens = 64;
+
+/// Longest command line, not counting the data block of a storage command.
+static constexpr size_t max_line_len = 8192;
+
+/// Maximum key length allowed by the memcached protocol.
+static constexpr size_t max_key_len = 250;
+
+/// Returns the offset of the first `c` in `str`, or `str.size()` if there is
+/// none. Compares 16 bytes at a time where SSE2 is available.
+static size_t
+find_byte(std::string_view str, char c)
+{
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; i + 16 <= str.size(); i += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str.data() + i));
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; i < str.size(); i++) {
+    if (str[i] == c) {
+      return i;
+    }
+  }
+  return str.size();
+}
+
+/// Splits `line` at spaces into at most `max_tokens` tokens, which point into
+/// `line`. Returns the number of tokens in the line, which is more than
+/// `max_tokens` if some did not fit.
+static size_t
+tokenize(std::string_view line, std::string_view* tokens)
+{
+  size_t nr_tokens = 0;
+  size_t start = 0;
+  auto cut = [&](size_t end) {
+    if (end > start) {
+      if (nr_tokens < max_tokens) {
+        tokens[nr_tokens] = line.substr(start, end - start);
+      }
+      nr_tokens++;
+    }
+    start = end + 1;
+  };
+  size_t i = 0;
+#if defined(__SSE2__)
+  // Find all the spaces of 16 bytes with one compare, and then walk the bits
+  // of the mask.
+  const __m128i spaces = _mm_set1_epi8(' ');
+  for (; i + 16 <= line.size(); i += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line.data() + i));
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, spaces));
+    while (mask) {
+      cut(i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i < line.size(); i++) {
+    if (line[i] == ' ') {
+      cut(i);
+    }
+  }
+  cut(line.size());
+  return nr_tokens;
+}
+
+template<typename T>
+static bool
+parse_number(std::string_view token, T& value)
+{
+  auto [end, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+  return ec == std::errc{} && end == token.data() + token.size();
+}
+
+/// Appends the items of `keys`, with their CAS values for a "gets" if
+/// `with_cas` is set.
+static void
+process_get(Store& store, const std::string_view* keys, size_t nr_keys, bool with_cas, std::string& output)
+{
+  std::string buf;
+  for (size_t i = 0; i < nr_keys; i++) {
+    auto* item = store.get(keys[i]);
+    if (!item) {
+      continue;
+    }
+    auto plain = item->plain_value(buf);
+    if (!plain) {
+      continue;
+    }
+    auto value = *plain;
+    output += "VALUE ";
+    output += keys[i];
+    output += ' ';
+    output += std::to_string(item->flags);
+    output += ' ';
+    output += std::to_string(value.size());
+    if (with_cas) {
+      output += ' ';
+      output += std::to_string(store.cas_of(item));
+    }
+    output += "\r\n";
+    output += value;
+    output += "\r\n";
+  }
+  output += "END\r\n";
+}
+
+/// Stores the value of a storage command, whose data block, with its
+/// trailing "\r\n", is `data`. A "cas" command has a `cas` value.
+static void
+process_set(Store& store,
+            SetMode mode,
+            std::string_view key,
+            uint32_t flags,
+            uint32_t exptime,
+            uint64_t cas,
+            std::string_view data,
+            bool noreply,
+            std::string& output)
+{
+  if (data.substr(data.size() - 2) != "\r\n") {
+    output += "CLIENT_ERROR bad data chunk\r\n";
+    return;
+  }
+  auto result = store.set(key, data.substr(0, data.size() - 2), flags, exptime, mode, cas);
+  if (noreply) {
+    return;
+  }
+  switch (result) {
+    case SetResult::Stored:
+      output += "STORED\r\n";
+      break;
+    case SetResult::NotStored:
+      output += "NOT_STORED\r\n";
+      break;
+    case SetResult::Exists:
+      output += "EXISTS\r\n";
+      break;
+    case SetResult::NotFound:
+      output += "NOT_FOUND\r\n";
+      break;
+    case SetResult::TooLarge:
+      output += "SERVER_ERROR object too large for cache\r\n";
+      break;
+    case SetResult::OutOfMemory:
+      output += "SERVER_ERROR out of memory storing object\r\n";
+      break;
+  }
+}
+
+static void
+process_stats(Store& store, std::string_view group, std::string& output)
+{
+  auto stats = collect_stats(store, group);
+  if (!stats) {
+    output += "ERROR\r\n";
+    return;
+  }
+  for (auto& [name, value] : *stats) {
+    output += "STAT ";
+    output += name;
+    output += ' ';
+    output += value;
+    output += "\r\n";
+  }
+  output += "END\r\n";
+}
+
+/// Returns the number of seconds until `item` expires, or -1 if it never does.
+static int64_t
+ttl_remaining(const Item* item)
+{
+  if (item->exptime == 0) {
+    return -1;
+  }
+  return std::max<int64_t>(int64_t(item->exptime) - int64_t(current_time()), 0);
+}
+
+/// Appends the flags that a meta command returns, such as "c<cas>" and
+/// "O<opaque>", in the order the client asked for them. Item flags are only
+/// returned if there is an item.
+static void
+append_meta_flags(const Store& store,
+                  const std::string_view* flags,
+                  size_t nr_flags,
+                  std::string_view key,
+                  const Item* item,
+                  std::string& output)
+{
+  for (size_t i = 0; i < nr_flags; i++) {
+    char flag = flags[i][0];
+    if (flag == 'O') {
+      output += ' ';
+      output += flags[i];
+      continue;
+    }
+    if (flag == 'k') {
+      output += " k";
+      output += key;
+      continue;
+    }
+    if (!item) {
+      continue;
+    }
+    switch (flag) {
+      case 'c':
+        output += " c";
+        output += std::to_string(store.cas_of(item));
+        break;
+      case 'f':
+        output += " f";
+        output += std::to_string(item->flags);
+        break;
+      case 's':
+        output += " s";
+        output += std::to_string(item->plain_len());
+        break;
+      case 't':
+        output += " t";
+        output += std::to_string(ttl_remaining(item));
+        break;
+    }
+  }
+}
+
+/// mg <key> <flag>*
+///
+/// Besides returning the value and its metadata, a meta get implements
+/// stale-while-revalidate: the first client to see a stale item, an item
+/// that expires within R<ttl> seconds, or a miss with N<ttl>, is told that
+/// it won ("W") the right to recache it. Other clients are told that a
+/// recache is under way ("Z") and keep getting the old value meanwhile.
+static void
+process_meta_get(Store& store, std::string_view key, const std::string_view* flags, size_t nr_flags, std::string& output)
+{
+  bool quiet = false;
+  bool with_value = false;
+  std::optional<uint32_t> touch_ttl, vivify_ttl, recache_ttl;
+  for (size_t i = 0; i < nr_flags; i++) {
+    switch (flags[i][0]) {
+      case 'q':
+        quiet = true;
+        break;
+      case 'v':
+        with_value = true;
+        break;
+      case 'T':
+      case 'N':
+      case 'R': {
+        uint32_t ttl;
+        if (!parse_number(flags[i].substr(1), ttl)) {
+          output += "CLIENT_ERROR bad token in command line format\r\n";
+          return;
+        }
+        auto& target = flags[i][0] == 'T' ? touch_ttl : flags[i][0] == 'N' ? vivify_ttl : recache_ttl;
+        target = ttl;
+        break;
+      }
+      case 'c':
+      case 'f':
+      case 'k':
+      case 'O':
+      case 's':
+      case 't':
+        break;
+      default:
+        output += "CLIENT_ERROR invalid flag\r\n";
+        return;
+    }
+  }
+  bool win = false;
+  auto* item = store.get(key);
+  if (!item && vivify_ttl) {
+    // Turn the miss into an empty item, so that the clients that come after
+    // this one wait for it to fill the item instead of all going to the
+    // backend.
+    if (store.set(key, {}, 0, *vivify_ttl, SetMode::Add) == SetResult::Stored) {
+      item = store.peek(key);
+      store.claim(item);
+      win = true;
+    }
+  }
+  // A value that does not decompress is as good as missing.
+  std::string buf;
+  std::string_view value;
+  if (item && with_value) {
+    auto plain = item->plain_value(buf);
+    if (!plain) {
+      item = nullptr;
+    } else {
+      value = *plain;
+    }
+  }
+  if (!item) {
+    if (!quiet) {
+      output += "EN\r\n";
+    }
+    return;
+  }
+  if (touch_ttl) {
+    store.touch(item, *touch_ttl);
+  }
+  bool lost = false;
+  if (!win) {
+    if (item->won) {
+      lost = true;
+    } else if (item->stale || (recache_ttl && item->exptime && ttl_remaining(item) < int64_t(*recache_ttl))) {
+      store.claim(item);
+      win = true;
+    }
+  }
+  if (with_value) {
+    output += "VA ";
+    output += std::to_string(value.size());
+  } else {
+    output += "HD";
+  }
+  append_meta_flags(store, flags, nr_flags, key, item, output);
+  if (win) {
+    output += " W";
+  }
+  if (item->stale) {
+    output += " X";
+  }
+  if (lost) {
+    output += " Z";
+  }
+  output += "\r\n";
+  if (with_value) {
+    output += value;
+    output += "\r\n";
+  }
+}
+
+/// ms <key> <datalen> <flag>*, whose data block, with its trailing "\r\n",
+/// is `data`.
+static void
+process_meta_set(Store& store,
+                 std::string_view key,
+                 const std::string_view* flags,
+                 size_t nr_flags,
+                 std::string_view data,
+                 std::string& output)
+{
+  bool quiet = false;
+  uint32_t item_flags = 0;
+  uint32_t exptime = 0;
+  uint64_t cas = 0;
+  SetMode mode = SetMode::Set;
+  for (size_t i = 0; i < nr_flags; i++) {
+    auto token = flags[i].substr(1);
+    bool valid = true;
+    switch (flags[i][0]) {
+      case 'q':
+        quiet = true;
+        break;
+      case 'F':
+        valid = parse_number(token, item_flags);
+        break;
+      case 'T':
+        valid = parse_number(token, exptime);
+        break;
+      case 'C':
+        valid = parse_number(token, cas);
+        break;
+      case 'M':
+        if (token == "S" || token == "s") {
+          mode = SetMode::Set;
+        } else if (token == "E" || token == "e") {
+          mode = SetMode::Add;
+        } else if (token == "R" || token == "r") {
+          mode = SetMode::Replace;
+        } else {
+          output += "CLIENT_ERROR invalid mode for ms STORE\r\n";
+          return;
+        }
+        break;
+      case 'c':
+      case 'k':
+      case 'O':
+        break;
+      default:
+        output += "CLIENT_ERROR invalid flag\r\n";
+        return;
+    }
+    if (!valid) {
+      output += "CLIENT_ERROR bad token in command line format\r\n";
+      return;
+    }
+  }
+  if (data.substr(data.size() - 2) != "\r\n") {
+    output += "CLIENT_ERROR bad data chunk\r\n";
+    return;
+  }
+  auto result = store.set(key, data.substr(0, data.size() - 2), item_flags, exptime, mode, cas);
+  switch (result) {
+    case SetResult::Stored:
+      if (quiet) {
+        return;
+      }
+      output += "HD";
+      break;
+    case SetResult::NotStored:
+      output += "NS";
+      break;
+    case SetResult::Exists:
+      output += "EX";
+      break;
+    case SetResult::NotFound:
+      output += "NF";
+      break;
+    case SetResult::TooLarge:
+      output += "SERVER_ERROR object too large for cache\r\n";
+      return;
+    case SetResult::OutOfMemory:
+      output += "SERVER_ERROR out of memory storing object\r\n";
+      return;
+  }
+  append_meta_flags(store, flags, nr_flags, key, result == SetResult::Stored ? store.peek(key) : nullptr, output);
+  output += "\r\n";
+}
+
+/// md <key> <flag>*
+///
+/// With the I flag, the item is marked as stale instead of being removed,
+/// so that meta gets keep serving it while one client recaches it.
+static void
+process_meta_delete(Store& store,
+                    std::string_view key,
+                    const std::string_view* flags,
+                    size_t nr_flags,
+                    std::string& output)
+{
+  bool quiet = false;
+  bool invalidate = false;
+  uint64_t cas = 0;
+  std::optional<uint32_t> exptime;
+  for (size_t i = 0; i < nr_flags; i++) {
+    auto token = flags[i].substr(1);
+    bool valid = true;
+    switch (flags[i][0]) {
+      case 'q':
+        quiet = true;
+        break;
+      case 'I':
+        invalidate = true;
+        break;
+      case 'C':
+        valid = parse_number(token, cas);
+        break;
+      case 'T':
+        exptime.emplace();
+        valid = parse_number(token, *exptime);
+        break;
+      case 'k':
+      case 'O':
+        break;
+      default:
+        output += "CLIENT_ERROR invalid flag\r\n";
+        return;
+    }
+    if (!valid) {
+      output += "CLIENT_ERROR bad token in command line format\r\n";
+      return;
+    }
+  }
+  switch (invalidate ? store.invalidate(key, cas, exptime) : store.remove(key, cas)) {
+    case RemoveResult::Removed:
+      if (quiet) {
+        return;
+      }
+      output += "HD";
+      break;
+    case RemoveResult::NotFound:
+      output += "NF";
+      break;
+    case RemoveResult::Exists:
+      output += "EX";
+      break;
+  }
+  append_meta_flags(store, flags, nr_flags, key, nullptr, output);
+  output += "\r\n";
+}
+
+/// Processes the command at the front of `input`. Returns the number of
+/// bytes consumed, which is zero if the command is not complete yet.
+static tl::expected<size_t, Error>
+process_command(Store& store, std::string_view input, std::string& output)
+{
+  size_t eol = find_byte(input.substr(0, max_line_len), '\n');
+  if (eol == input.size()) {
+    return 0;
+  }
+  if (eol == max_line_len) {
+    return tl::unexpected{"Command line is longer than " + std::to_string(max_line_len) + " bytes"};
+  }
+  auto line = input.substr(0, eol);
+  if (!line.empty() && line.back() == '\r') {
+    line.remove_suffix(1);
+  }
+  size_t len = eol + 1;
+  std::string_view tokens[max_tokens];
+  size_t nr_tokens = tokenize(line, tokens);
+  if (nr_tokens == 0) {
+    output += "ERROR\r\n";
+    return len;
+  }
+  if (nr_tokens > max_tokens) {
+    output += "CLIENT_ERROR line has too many tokens\r\n";
+    return len;
+  }
+  auto command = tokens[0];
+  if (command == "get" || command == "gets") {
+    if (nr_tokens < 2) {
+      output += "ERROR\r\n";
+      return len;
+    }
+    for (size_t i = 1; i < nr_tokens; i++) {
+      if (tokens[i].size() > max_key_len) {
+        output += "CLIENT_ERROR bad command line format\r\n";
+        return len;
+      }
+    }
+    process_get(store, tokens + 1, nr_tokens - 1, command == "gets", output);
+    return len;
+  }
+  if (command == "set" || command == "add" || command == "replace" || command == "cas") {
+    // <command> <key> <flags> <exptime> <bytes> [<cas unique>] [noreply]
+    size_t nr_args = command == "cas" ? 6 : 5;
+    uint32_t flags, exptime;
+    size_t bytes;
+    uint64_t cas = 0;
+    if ((nr_tokens != nr_args && nr_tokens != nr_args + 1) || tokens[1].size() > max_key_len ||
+        !parse_number(tokens[2], flags) || !parse_number(tokens[3], exptime) || !parse_number(tokens[4], bytes) ||
+        (nr_args == 6 && !parse_number(tokens[5], cas))) {
+      output += "CLIENT_ERROR bad command line format\r\n";
+      return len;
+    }
+    // A value that is larger than any slab chunk cannot be stored, and the
+    // stream cannot be resynchronized without reading it.
+    if (bytes > SlabAllocator::page_size) {
+      return tl::unexpected{"Value of " + std::to_string(bytes) + " bytes is too large"};
+    }
+    auto data = input.substr(len);
+    if (data.size() < bytes + 2) {
+      return 0;
+    }
+    SetMode mode = command == "add" ? SetMode::Add : command == "replace" ? SetMode::Replace : SetMode::Set;
+    bool noreply = nr_tokens == nr_args + 1 && tokens[nr_args] == "noreply";
+    process_set(store, mode, tokens[1], flags, exptime, cas, data.substr(0, bytes + 2), noreply, output);
+    return len + bytes + 2;
+  }
+  if (command == "delete") {
+    // Old clients send a hold time of zero after the key.
+    bool noreply = tokens[nr_tokens - 1] == "noreply";
+    size_t nr_args = nr_tokens - noreply;
+    if (nr_args < 2 || nr_args > 3 || (nr_args == 3 && tokens[2] != "0")) {
+      output += "CLIENT_ERROR bad command line format\r\n";
+      return len;
+    }
+    bool removed = store.remove(tokens[1]);
+    if (!noreply) {
+      output += removed ? "DELETED\r\n" : "NOT_FOUND\r\n";
+    }
+    return len;
+  }
+  if (command == "mg" || command == "md") {
+    if (nr_tokens < 2 || tokens[1].size() > max_key_len) {
+      output += "CLIENT_ERROR bad command line format\r\n";
+      return len;
+    }
+    if (command == "mg") {
+      process_meta_get(store, tokens[1], tokens + 2, nr_tokens - 2, output);
+    } else {
+      process_meta_delete(store, tokens[1], tokens + 2, nr_tokens - 2, output);
+    }
+    return len;
+  }
+  if (command == "ms") {
+    size_t bytes;
+    if (nr_tokens < 3 || tokens[1].size() > max_key_len || !parse_number(tokens[2], bytes)) {
+      output += "CLIENT_ERROR bad command line format\r\n";
+      return len;
+    }
+    if (bytes > SlabAllocator::page_size) {
+      return tl::unexpected{"Value of " + std::to_string(bytes) + " bytes is too large"};
+    }
+    auto data = input.substr(len);
+    if (data.size() < bytes + 2) {
+      return 0;
+    }
+    process_meta_set(store, tokens[1], tokens + 3, nr_tokens - 3, data.substr(0, bytes + 2), output);
+    return len + bytes + 2;
+  }
+  if (command == "flush_all") {
+    // flush_all [<delay>] [noreply]
+    bool noreply = tokens[nr_tokens - 1] == "noreply";
+    size_t nr_args = nr_tokens - noreply;
+    uint32_t delay = 0;
+    if (nr_args > 2 || (nr_args == 2 && !parse_number(tokens[1], delay))) {
+      output += "CLIENT_ERROR bad command line format\r\n";
+      return len;
+    }
+    store.flush(delay);
+    if (!noreply) {
+      output += "OK\r\n";
+    }
+    return len;
+  }
+  if (command == "mn") {
+    // Marks the end of a batch of quiet meta commands.
+    output += "MN\r\n";
+    return len;
+  }
+  if (command == "stats") {
+    process_stats(store, nr_tokens > 1 ? tokens[1] : std::string_view{}, output);
+    return len;
+  }
+  if (command == "version") {
+    output += "VERSION ";
+    output += version;
+    output += "\r\n";
+    return len;
+  }
+  if (command == "quit") {
+    return tl::unexpected{std::string{"Client quit"}};
+  }
+  output += "ERROR\r\n";
+  return len;
+}
+
+tl::expected<size_t, Error>
+process_ascii_stream(Store& store, std::string_view input, std::string& output)
+{
+  store.clear_deferred();
+  size_t pos = 0;
+  while (pos < input.size()) {
+    // Leave binary protocol requests to the caller.
+    if (uint8_t(input[pos]) == MC_MAGIC_REQUEST) {
+      break;
+    }
+    size_t output_len = output.size();
+    auto consumed = process_command(store, input.substr(pos), output);
+    if (!consumed) {
+      return consumed;
+    }
+    // Take back what the command wrote, and leave it for later, when the
+    // value it waits for is in from flash.
+    if (store.deferred()) {
+      output.resize(output_len);
+      break;
+    }
+    if (*consumed == 0) {
+      break;
+    }
+    pos += *consumed;
+  }
+  return pos;
+}
+
+tl::expected<size_t, Error>
+process_ascii_request(Store& store, const Packet& request, char* response, size_t capacity, Progress* progress)
+{
+  static thread_local std::string output;
+  output.clear();
+  std::string_view input{request.data, request.len};
+  // Pick up after the commands that ran before the datagram was deferred.
+  size_t done = 0;
+  if (progress && progress->consumed <= input.size()) {
+    done = progress->consumed;
+    output.swap(progress->output);
+  }
+  auto consumed = process_ascii_stream(store, input.substr(done), output);
+  if (!consumed) {
+    return tl::unexpected{consumed.error()};
+  }
+  if (store.deferred()) {
+    if (progress) {
+      progress->consumed = done + *consumed;
+      progress->output.swap(output);
+    }
+    return 0;
+  }
+  if (done + *consumed < input.size()) {
+    return tl::unexpected{std::string{"Request is truncated"}};
+  }
+  if (output.size() > capacity) {
+    std::string_view error = "SERVER_ERROR out of memory writing get response\r\n";
+    if (error.size() > capacity) {
+      return tl::unexpected{"Response does not fit in " + std::to_string(capacity) + " bytes"};
+    }
+    output = error;
+  }
+  std::memcpy(response, output.data(), output.size());
+  return output.size();
+}
+
+}
@@ -11,6 +11,12 @@ struct bpf_map_def {
 	unsigned int numa_node;
 };
 
+static void *(*bpf_map_lookup_elem)(struct bpf_map_def *map, const void *key) =
+	(void *) BPF_FUNC_map_lookup_elem;
+
+static __u32 (*bpf_get_smp_processor_id)(void) =
+	(void *) BPF_FUNC_get_smp_processor_id;
+
 static int (*bpf_redirect_map)(struct bpf_map_def *map, __u32 key, __u64 flags) =
 	(void *) BPF_FUNC_redirect_map;
 
@@ -0,0 +1,57 @@
+#include "rainbow/compress.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <lz4.h>
+
+namespace rainbow {
+
+bool
+compress_value(std::string_view value, std::string& out)
+{
+  int bound = ::LZ4_compressBound(value.size());
+  if (bound <= 0) {
+    return false;
+  }
+  out.resize(compressed_header_len + bound);
+  int len = ::LZ4_compress_default(value.data(), out.data() + compressed_header_len, value.size(), bound);
+  if (len <= 0 || compressed_header_len + len >= value.size()) {
+    return false;
+  }
+  uint32_t raw_len = htonl(value.size());
+  std::memcpy(out.data(), &raw_len, sizeof(raw_len));
+  out.resize(compressed_header_len + len);
+  return true;
+}
+
+std::optional<size_t>
+uncompressed_len(std::string_view value)
+{
+  if (value.size() <= compressed_header_len) {
+    return std::nullopt;
+  }
+  uint32_t raw_len;
+  std::memcpy(&raw_len, value.data(), sizeof(raw_len));
+  raw_len = ntohl(raw_len);
+  if (raw_len == 0 || raw_len > max_uncompressed_len) {
+    return std::nullopt;
+  }
+  return raw_len;
+}
+
+bool
+decompress_value(std::string_view value, std::string& out)
+{
+  auto raw_len = uncompressed_len(value);
+  if (!raw_len) {
+    return false;
+  }
+  out.resize(*raw_len);
+  int len = ::LZ4_decompress_safe(
+    value.data() + compressed_header_len, out.data(), value.size() - compressed_header_len, *raw_len);
+  return len == int(*raw_len);
+}
+
+}
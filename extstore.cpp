@@ -0,0 +1,310 @@
+#include "rainbow/extstore.hpp"
+
+#include "rainbow/store.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace rainbow {
+
+/// Direct I/O transfers whole blocks to and from aligned memory.
+static constexpr size_t block_size = 4096;
+
+/// One buffer is filled while the other one is written.
+static constexpr size_t nr_write_buffers = 2;
+
+static constexpr size_t max_reads_in_flight = 256;
+
+static constexpr unsigned int sq_entries = 512;
+static constexpr unsigned int cq_entries = 1024;
+
+/// The size of a file that is created for the flash tier without one given.
+static constexpr uint64_t default_file_len = uint64_t(1) << 30;
+
+static constexpr uint64_t write_tag = max_reads_in_flight;
+
+static size_t
+align_up(size_t n, size_t alignment)
+{
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+static char*
+alloc_aligned(size_t len)
+{
+  void* ptr = std::aligned_alloc(block_size, align_up(len, block_size));
+  if (!ptr) {
+    throw std::bad_alloc{};
+  }
+  return reinterpret_cast<char*>(ptr);
+}
+
+uint64_t
+Extstore::prepare(const std::string& path, uint64_t len)
+{
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    throw std::system_error(errno, std::system_category(), "open(" + path + ")");
+  }
+  struct ::stat st;
+  if (::fstat(fd, &st) < 0) {
+    int err = errno;
+    ::close(fd);
+    throw std::system_error(err, std::system_category(), "fstat(" + path + ")");
+  }
+  if (S_ISBLK(st.st_mode)) {
+    uint64_t device_len;
+    if (::ioctl(fd, BLKGETSIZE64, &device_len) < 0) {
+      int err = errno;
+      ::close(fd);
+      throw std::system_error(err, std::system_category(), "ioctl(" + path + ", BLKGETSIZE64)");
+    }
+    ::close(fd);
+    if (len > device_len) {
+      throw std::runtime_error(path + " is smaller than " + std::to_string(len) + " bytes");
+    }
+    return len ? len : device_len;
+  }
+  if (!len) {
+    len = default_file_len;
+  }
+  if (::ftruncate(fd, len) < 0) {
+    int err = errno;
+    ::close(fd);
+    throw std::system_error(err, std::system_category(), "ftruncate(" + path + ")");
+  }
+  ::close(fd);
+  int direct_fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | O_DIRECT);
+  if (direct_fd < 0) {
+    std::cout << "warning: " << path << " does not support direct I/O, so the flash tier goes through the page cache."
+              << std::endl;
+  } else {
+    ::close(direct_fd);
+  }
+  return len;
+}
+
+Extstore::Extstore(const std::string& path, uint64_t offset, uint64_t len)
+  : _path{path}
+  , _base{offset}
+  , _nr_segments{uint32_t(len / segment_size)}
+  , _versions(_nr_segments)
+  , _buffers(nr_write_buffers)
+  , _reads(max_reads_in_flight)
+{
+  _fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | O_DIRECT);
+  if (_fd < 0 && errno == EINVAL) {
+    _fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  }
+  if (_fd < 0) {
+    throw std::system_error(errno, std::system_category(), "open(" + path + ")");
+  }
+  for (auto& buffer : _buffers) {
+    buffer.data = alloc_aligned(segment_size);
+  }
+  for (uint32_t i = 0; i < max_reads_in_flight; i++) {
+    _free_reads.push_back(max_reads_in_flight - i - 1);
+  }
+}
+
+Extstore::~Extstore()
+{
+  // The kernel may still be using the buffers.
+  while (_nr_in_flight > 0) {
+    try {
+      _ring->submit(1);
+    } catch (const std::system_error&) {
+      break;
+    }
+    _ring->reap([this](const ::io_uring_cqe&) { _nr_in_flight--; });
+  }
+  _ring.reset();
+  for (auto& read : _reads) {
+    std::free(read.buf);
+  }
+  for (auto& buffer : _buffers) {
+    std::free(buffer.data);
+  }
+  ::close(_fd);
+}
+
+std::optional<ExtLoc>
+Extstore::append(const Item& item, std::string_view key, std::string_view value)
+{
+  size_t len = sizeof(Item) + key.size() + value.size();
+  if (len > segment_size) {
+    return std::nullopt;
+  }
+  if (_filling >= 0 && align_up(_buffers[_filling].len, alignof(Item)) + len > segment_size) {
+    _buffers[_filling].state = Buffer::State::Full;
+    _filling = -1;
+  }
+  if (_filling < 0 && !next_buffer()) {
+    return std::nullopt;
+  }
+  auto& buffer = _buffers[_filling];
+  size_t offset = align_up(buffer.len, alignof(Item));
+  std::memcpy(buffer.data + offset, &item, sizeof(Item));
+  std::memcpy(buffer.data + offset + sizeof(Item), key.data(), key.size());
+  std::memcpy(buffer.data + offset + sizeof(Item) + key.size(), value.data(), value.size());
+  buffer.len = offset + len;
+  _stats.objects_written++;
+  _stats.bytes_written += len;
+  return ExtLoc{buffer.segment, _versions[buffer.segment], uint32_t(offset), uint32_t(len)};
+}
+
+/// Starts filling a free write buffer with the next segment, which drops
+/// what the segment had.
+bool
+Extstore::next_buffer()
+{
+  for (size_t i = 0; i < _buffers.size(); i++) {
+    auto& buffer = _buffers[i];
+    if (buffer.state != Buffer::State::Free) {
+      continue;
+    }
+    uint32_t segment = _next_segment;
+    _next_segment = (_next_segment + 1) % _nr_segments;
+    if (_versions[segment] > 0) {
+      _stats.segments_reclaimed++;
+    }
+    _versions[segment]++;
+    buffer.segment = segment;
+    buffer.len = 0;
+    buffer.state = Buffer::State::Filling;
+    _filling = i;
+    return true;
+  }
+  return false;
+}
+
+/// Sets up the ring on first use, so that it belongs to the thread that
+/// owns the store rather than the one that created the extstore.
+IoRing&
+Extstore::ring()
+{
+  if (!_ring) {
+    _ring = std::make_unique<IoRing>(sq_entries, cq_entries);
+  }
+  return *_ring;
+}
+
+bool
+Extstore::valid(const ExtLoc& loc) const
+{
+  return loc.segment < _nr_segments && _versions[loc.segment] == loc.version;
+}
+
+const Item*
+Extstore::buffered(const ExtLoc& loc) const
+{
+  if (!valid(loc)) {
+    return nullptr;
+  }
+  for (auto& buffer : _buffers) {
+    if (buffer.state != Buffer::State::Free && buffer.segment == loc.segment) {
+      return reinterpret_cast<const Item*>(buffer.data + loc.offset);
+    }
+  }
+  return nullptr;
+}
+
+uint64_t
+Extstore::file_offset(const ExtLoc& loc) const
+{
+  return _base + uint64_t(loc.segment) * segment_size + loc.offset;
+}
+
+bool
+Extstore::read(const ExtLoc& loc, Item* stub, uint64_t cas)
+{
+  if (_free_reads.empty()) {
+    return false;
+  }
+  auto* sqe = ring().get_sqe();
+  if (!sqe) {
+    return false;
+  }
+  uint32_t slot = _free_reads.back();
+  _free_reads.pop_back();
+  auto& read = _reads[slot];
+  uint64_t offset = file_offset(loc);
+  uint64_t aligned = offset / block_size * block_size;
+  read.skip = offset - aligned;
+  size_t len = align_up(read.skip + loc.len, block_size);
+  read.buf = alloc_aligned(len);
+  read.loc = loc;
+  read.stub = stub;
+  read.cas = cas;
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = _fd;
+  sqe->addr = reinterpret_cast<uint64_t>(read.buf);
+  sqe->len = len;
+  sqe->off = aligned;
+  sqe->user_data = slot;
+  _nr_in_flight++;
+  return true;
+}
+
+void
+Extstore::poll(const OnReadFn& fn)
+{
+  for (size_t i = 0; i < _buffers.size(); i++) {
+    auto& buffer = _buffers[i];
+    if (buffer.state != Buffer::State::Full) {
+      continue;
+    }
+    auto* sqe = ring().get_sqe();
+    if (!sqe) {
+      break;
+    }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = _fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer.data);
+    sqe->len = align_up(buffer.len, block_size);
+    sqe->off = file_offset(ExtLoc{buffer.segment, 0, 0, 0});
+    sqe->user_data = write_tag + i;
+    buffer.state = Buffer::State::Writing;
+    _nr_in_flight++;
+  }
+  if (_nr_in_flight == 0) {
+    return;
+  }
+  _ring->submit();
+  _ring->reap([&](const ::io_uring_cqe& cqe) {
+    _nr_in_flight--;
+    if (cqe.user_data >= write_tag) {
+      auto& buffer = _buffers[cqe.user_data - write_tag];
+      if (cqe.res < int(align_up(buffer.len, block_size))) {
+        std::cout << "warning: Cannot write segment to " << _path << ": "
+                  << (cqe.res < 0 ? std::system_category().message(-cqe.res) : "short write") << std::endl;
+        // Drop what the segment was supposed to hold.
+        _versions[buffer.segment]++;
+      }
+      buffer.state = Buffer::State::Free;
+      return;
+    }
+    auto& read = _reads[cqe.user_data];
+    const Item* item = nullptr;
+    if (cqe.res >= int(read.skip + read.loc.len) && valid(read.loc)) {
+      item = reinterpret_cast<const Item*>(read.buf + read.skip);
+      _stats.objects_read++;
+      _stats.bytes_read += read.loc.len;
+    }
+    fn(read.stub, read.cas, item);
+    std::free(read.buf);
+    read.buf = nullptr;
+    _free_reads.push_back(cqe.user_data);
+  });
+}
+
+}
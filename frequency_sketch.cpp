@@ -0,0 +1,74 @@
+#include "rainbow/frequency_sketch.hpp"
+
+#include <algorithm>
+
+namespace rainbow {
+
+/// Spreads the bits of a key hash over 64 bits. Keys of a partition may
+/// share some bits of their hash, which the sketch must not depend on.
+static uint64_t
+spread(uint32_t hash)
+{
+  uint64_t x = hash + 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+FrequencySketch::FrequencySketch(size_t capacity)
+  : _nr_blocks{1}
+  , _sample_size{10 * std::max<size_t>(capacity, 1)}
+{
+  while (_nr_blocks * words_per_block * counters_per_word < capacity) {
+    _nr_blocks *= 2;
+  }
+  _table.reset(new uint64_t[_nr_blocks * words_per_block]());
+}
+
+void
+FrequencySketch::increment(uint32_t hash)
+{
+  uint64_t h = spread(hash);
+  uint64_t* block = &_table[((h >> 32) & (_nr_blocks - 1)) * words_per_block];
+  bool added = false;
+  // Each of the four rows has two words of the block, and a byte of the
+  // hash picks a word and a counter in it.
+  for (int row = 0; row < 4; row++) {
+    uint32_t bits = h >> (row * 8);
+    uint64_t& word = block[row * 2 + (bits & 1)];
+    int shift = ((bits >> 1) & 15) * 4;
+    if (((word >> shift) & max_count) < max_count) {
+      word += uint64_t{1} << shift;
+      added = true;
+    }
+  }
+  if (added && ++_nr_increments >= _sample_size) {
+    age();
+  }
+}
+
+uint32_t
+FrequencySketch::frequency(uint32_t hash) const
+{
+  uint64_t h = spread(hash);
+  const uint64_t* block = &_table[((h >> 32) & (_nr_blocks - 1)) * words_per_block];
+  uint32_t freq = max_count;
+  for (int row = 0; row < 4; row++) {
+    uint32_t bits = h >> (row * 8);
+    uint64_t word = block[row * 2 + (bits & 1)];
+    int shift = ((bits >> 1) & 15) * 4;
+    freq = std::min<uint32_t>(freq, (word >> shift) & max_count);
+  }
+  return freq;
+}
+
+void
+FrequencySketch::age()
+{
+  for (size_t i = 0; i < _nr_blocks * words_per_block; i++) {
+    _table[i] = (_table[i] >> 1) & 0x7777777777777777ULL;
+  }
+  _nr_increments /= 2;
+}
+
+}
@@ -0,0 +1,89 @@
+#include "rainbow/hash.hpp"
+
+#include "keyhash.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace rainbow {
+
+static uint32_t
+murmur3(const char* key, size_t len)
+{
+  return rainbow_key_hash(RAINBOW_KEY_HASH_MURMUR3, key, len, key + len);
+}
+
+static uint32_t
+crc32c(const char* key, size_t len)
+{
+  return rainbow_key_hash(RAINBOW_KEY_HASH_CRC32C, key, len, key + len);
+}
+
+static uint32_t
+xxh32(const char* key, size_t len)
+{
+  return rainbow_key_hash(RAINBOW_KEY_HASH_XXH32, key, len, key + len);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(const char* key, size_t len)
+{
+  if (len > RAINBOW_MAX_KEY_LEN) {
+    len = RAINBOW_MAX_KEY_LEN;
+  }
+  uint64_t crc = ~uint32_t(RAINBOW_KEY_HASH_SEED);
+  while (len >= sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, key, sizeof(word));
+    crc = _mm_crc32_u64(crc, word);
+    key += sizeof(word);
+    len -= sizeof(word);
+  }
+  uint32_t crc32 = crc;
+  while (len--) {
+    crc32 = _mm_crc32_u8(crc32, *key++);
+  }
+  return ~crc32;
+}
+#endif
+
+KeyHash
+parse_key_hash(const std::string& name)
+{
+  if (name == "murmur3") {
+    return KeyHash::Murmur3;
+  } else if (name == "crc32c") {
+    return KeyHash::CRC32C;
+  } else if (name == "xxh32") {
+    return KeyHash::XXH32;
+  }
+  throw std::invalid_argument("key hash is not supported: " + name);
+}
+
+KeyHasher::KeyHasher(KeyHash kind)
+  : _kind{kind}
+{
+  switch (kind) {
+    case KeyHash::Murmur3:
+      _fn = murmur3;
+      break;
+    case KeyHash::CRC32C:
+      _fn = crc32c;
+#if defined(__x86_64__)
+      if (__builtin_cpu_supports("sse4.2")) {
+        _fn = crc32c_sse42;
+      }
+#endif
+      break;
+    case KeyHash::XXH32:
+      _fn = xxh32;
+      break;
+  }
+}
+
+}
@@ -0,0 +1,156 @@
+#include "rainbow/hotkeys.hpp"
+
+#include "rainbow/steering.hpp"
+
+#include "sketch.h"
+#include "steering.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <set>
+#include <system_error>
+
+extern "C" {
+#include <bpf.h>
+#include <libbpf.h>
+}
+
+namespace rainbow {
+
+/// Per-CPU map values are laid out at 8-byte aligned offsets.
+static constexpr size_t
+percpu_value_size(size_t size)
+{
+  return (size + 7) & ~size_t(7);
+}
+
+HotKeyTracker::HotKeyTracker(int sketch_fd, int hot_key_fd, size_t k)
+  : _sketch_fd{sketch_fd}
+  , _hot_key_fd{hot_key_fd}
+  , _k{k}
+{
+  int nr_cpus = libbpf_num_possible_cpus();
+  if (nr_cpus < 0) {
+    throw std::system_error(-nr_cpus, std::system_category(), "libbpf_num_possible_cpus");
+  }
+  _nr_cpus = nr_cpus;
+}
+
+HotKeys
+HotKeyTracker::poll()
+{
+  constexpr size_t sketch_size = percpu_value_size(sizeof(rainbow_sketch));
+  constexpr size_t hot_key_size = percpu_value_size(sizeof(rainbow_hot_key));
+  std::vector<char> sketches(sketch_size * _nr_cpus);
+  uint32_t zero = 0;
+  if (bpf_map_lookup_elem(_sketch_fd, &zero, sketches.data())) {
+    throw std::system_error(errno, std::system_category(), "bpf_map_lookup_elem(sketch_map)");
+  }
+  // Clear the sketch right away to lose as few increments as possible.
+  std::vector<char> zeroes(std::max(sketch_size, hot_key_size) * _nr_cpus);
+  if (bpf_map_update_elem(_sketch_fd, &zero, zeroes.data(), 0)) {
+    throw std::system_error(errno, std::system_category(), "bpf_map_update_elem(sketch_map)");
+  }
+  rainbow_sketch sketch = {};
+  for (unsigned int cpu = 0; cpu < _nr_cpus; cpu++) {
+    auto* cpu_sketch = reinterpret_cast<const rainbow_sketch*>(sketches.data() + cpu * sketch_size);
+    for (int row = 0; row < RAINBOW_SKETCH_DEPTH; row++) {
+      for (int col = 0; col < RAINBOW_SKETCH_WIDTH; col++) {
+        sketch.counters[row][col] += cpu_sketch->counters[row][col];
+      }
+    }
+  }
+  // The same key may have been recorded by more than one CPU.
+  std::set<std::pair<uint32_t, std::string>> candidates;
+  std::vector<char> hot_keys(hot_key_size * _nr_cpus);
+  for (uint32_t slot = 0; slot < RAINBOW_NR_HOT_KEY_SLOTS; slot++) {
+    if (bpf_map_lookup_elem(_hot_key_fd, &slot, hot_keys.data())) {
+      throw std::system_error(errno, std::system_category(), "bpf_map_lookup_elem(hot_key_map)");
+    }
+    bool empty = true;
+    for (unsigned int cpu = 0; cpu < _nr_cpus; cpu++) {
+      auto* hot_key = reinterpret_cast<const rainbow_hot_key*>(hot_keys.data() + cpu * hot_key_size);
+      if (hot_key->count == 0) {
+        continue;
+      }
+      empty = false;
+      size_t key_len = std::min<size_t>(hot_key->key_len, RAINBOW_HOT_KEY_MAX_LEN);
+      candidates.emplace(hot_key->hash, std::string{reinterpret_cast<const char*>(hot_key->key), key_len});
+    }
+    if (!empty && bpf_map_update_elem(_hot_key_fd, &slot, zeroes.data(), 0)) {
+      throw std::system_error(errno, std::system_category(), "bpf_map_update_elem(hot_key_map)");
+    }
+  }
+  HotKeys result;
+  for (auto& [hash, key] : candidates) {
+    uint64_t estimate = UINT64_MAX;
+    for (int row = 0; row < RAINBOW_SKETCH_DEPTH; row++) {
+      estimate = std::min<uint64_t>(estimate, sketch.counters[row][rainbow_sketch_index(hash, row)]);
+    }
+    result.push_back(HotKey{key, hash, estimate});
+  }
+  std::sort(result.begin(), result.end(), [](const HotKey& a, const HotKey& b) { return a.count > b.count; });
+  if (result.size() > _k) {
+    result.resize(_k);
+  }
+  return result;
+}
+
+static std::shared_ptr<const HotKeys> published_hot_keys = std::make_shared<const HotKeys>();
+
+void
+publish_hot_keys(HotKeys hot_keys)
+{
+  std::atomic_store(&published_hot_keys, std::shared_ptr<const HotKeys>{std::make_shared<HotKeys>(std::move(hot_keys))});
+}
+
+std::shared_ptr<const HotKeys>
+hot_keys()
+{
+  return std::atomic_load(&published_hot_keys);
+}
+
+std::vector<BucketMove>
+plan_hot_key_mitigation(const HotKeys& hot_keys, const SteeringTable& steering, double imbalance)
+{
+  std::vector<BucketMove> moves;
+  unsigned int nr_partitions = steering.nr_partitions();
+  if (nr_partitions < 2 || hot_keys.empty()) {
+    return moves;
+  }
+  std::vector<uint64_t> partition_load(nr_partitions);
+  std::map<uint32_t, uint64_t> bucket_load;
+  uint64_t total_load = 0;
+  for (auto& hot_key : hot_keys) {
+    uint32_t bucket = rainbow_bucket(hot_key.hash);
+    partition_load[steering.partition_of(bucket)] += hot_key.count;
+    bucket_load[bucket] += hot_key.count;
+    total_load += hot_key.count;
+  }
+  auto hottest = std::max_element(partition_load.begin(), partition_load.end()) - partition_load.begin();
+  auto coldest = std::min_element(partition_load.begin(), partition_load.end()) - partition_load.begin();
+  double average = double(total_load) / nr_partitions;
+  if (partition_load[hottest] <= average * imbalance) {
+    return moves;
+  }
+  uint32_t hottest_bucket = 0;
+  uint64_t hottest_bucket_load = 0;
+  for (auto [bucket, load] : bucket_load) {
+    if (steering.partition_of(bucket) == hottest && load > hottest_bucket_load) {
+      hottest_bucket = bucket;
+      hottest_bucket_load = load;
+    }
+  }
+  // Moving the bucket only helps if the destination stays cooler than the
+  // source was. Otherwise the hot spot just moves around; a single key that
+  // hot needs replication instead.
+  if (partition_load[coldest] + hottest_bucket_load >= partition_load[hottest]) {
+    return moves;
+  }
+  moves.push_back(BucketMove{hottest_bucket, uint32_t(hottest), uint32_t(coldest)});
+  return moves;
+}
+
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef> /* for size_t */
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace rainbow {
+
+/// A compressed value is the length of the value uncompressed, a 32-bit
+/// integer in network byte order, followed by an LZ4 block. Values are kept
+/// like this in memory and on flash, and are sent like this to binary
+/// protocol clients that ask for it.
+static constexpr size_t compressed_header_len = 4;
+
+/// Compressed values that claim to be larger than this uncompressed are
+/// taken to be corrupt, so that a client cannot make the daemon allocate
+/// arbitrary amounts of memory.
+static constexpr size_t max_uncompressed_len = 16 << 20;
+
+/// Compresses `value` into `out`. Returns false, and leaves `out` undefined,
+/// if compression does not make the value smaller.
+bool
+compress_value(std::string_view value, std::string& out);
+
+/// Returns the length of compressed value `value` uncompressed, or nothing
+/// if `value` cannot be one.
+std::optional<size_t>
+uncompressed_len(std::string_view value);
+
+/// Decompresses compressed value `value` into `out`. Returns false if it is
+/// corrupt.
+bool
+decompress_value(std::string_view value, std::string& out);
+
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <string>
+
+namespace rainbow {
+
+using Error = std::string;
+
+}
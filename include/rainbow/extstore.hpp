@@ -0,0 +1,161 @@
+#pragma once
+
+#include "rainbow/io_ring.hpp"
+
+#include <cstddef> /* for size_t */
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace rainbow {
+
+struct Item;
+
+/// Where the value of an item on flash is.
+struct ExtLoc
+{
+  uint32_t segment;
+  /// The version of the segment when the item was written to it. A segment
+  /// that has been reused since has a newer version.
+  uint32_t version;
+  uint32_t offset;
+  uint32_t len;
+};
+
+struct ExtstoreStats
+{
+  uint64_t objects_written = 0;
+  uint64_t bytes_written = 0;
+  uint64_t objects_read = 0;
+  uint64_t bytes_read = 0;
+  /// Segments that were reused, which drops the items in them.
+  uint64_t segments_reclaimed = 0;
+  /// Lookups of items whose segment had been reused.
+  uint64_t misses = 0;
+};
+
+/// The flash tier of one partition: a range of a file or block device that
+/// holds values the partition keeps only the keys of in memory.
+///
+/// Items are appended to a segment-sized buffer in memory, which is written
+/// out with io_uring in one go once it is full, bypassing the page cache
+/// where the file system allows it. Segments are reused in order, oldest
+/// first, like a log, and every reuse bumps the version of the segment, so
+/// the locations that point into its previous contents no longer match.
+///
+/// Reads are asynchronous too. The store starts them while it serves
+/// requests, and poll() hands it the items that have arrived.
+///
+/// An extstore is used by the thread that owns the store, except that items
+/// can be appended from another thread before the owner first polls it,
+/// such as when a snapshot is loaded.
+class Extstore
+{
+public:
+  static constexpr size_t segment_size = 8 << 20;
+
+  /// Called with an item that was read, which is nullptr if the read failed
+  /// or the segment was reused in the meantime.
+  using OnReadFn = std::function<void(Item* stub, uint64_t cas, const Item* item)>;
+
+private:
+  struct Buffer
+  {
+    enum class State
+    {
+      Free,
+      Filling,
+      Full,
+      Writing,
+    };
+
+    char* data = nullptr;
+    uint32_t segment = 0;
+    size_t len = 0;
+    State state = State::Free;
+  };
+
+  struct Read
+  {
+    char* buf = nullptr;
+    size_t skip = 0;
+    ExtLoc loc = {};
+    Item* stub = nullptr;
+    uint64_t cas = 0;
+  };
+
+  int _fd = -1;
+  std::string _path;
+  uint64_t _base;
+  uint32_t _nr_segments;
+  std::vector<uint32_t> _versions;
+  uint32_t _next_segment = 0;
+  std::vector<Buffer> _buffers;
+  int _filling = -1;
+  std::unique_ptr<IoRing> _ring;
+  std::vector<Read> _reads;
+  std::vector<uint32_t> _free_reads;
+  size_t _nr_in_flight = 0;
+  ExtstoreStats _stats;
+
+public:
+  /// Smallest range that an extstore works with.
+  static constexpr uint64_t min_len = 4 * segment_size;
+
+  /// Creates the file at `path` with `len` bytes, or a default size if
+  /// `len` is zero, unless it is a block device. Returns the number of
+  /// bytes that the flash tiers of all partitions can use.
+  static uint64_t prepare(const std::string& path, uint64_t len);
+
+  /// Uses the `len` bytes at `offset` of the file or block device at `path`,
+  /// which prepare() has set up. Both must be multiples of the segment size.
+  Extstore(const std::string& path, uint64_t offset, uint64_t len);
+  ~Extstore();
+  Extstore(const Extstore&) = delete;
+  Extstore& operator=(const Extstore&) = delete;
+
+  const ExtstoreStats& stats() const;
+  ExtstoreStats& stats();
+
+  /// Appends a copy of `item`, whose header is followed by `key` and
+  /// `value`. Returns nothing if every write buffer is full.
+  std::optional<ExtLoc> append(const Item& item, std::string_view key, std::string_view value);
+
+  /// Returns true if the segment that `loc` points into has not been reused.
+  bool valid(const ExtLoc& loc) const;
+
+  /// Returns the item at `loc` if it is still in a write buffer.
+  const Item* buffered(const ExtLoc& loc) const;
+
+  /// Starts reading the item at `loc`, which poll() hands to its callback
+  /// along with `stub` and `cas`. Returns false if too many reads are in
+  /// flight.
+  bool read(const ExtLoc& loc, Item* stub, uint64_t cas);
+
+  /// Submits full write buffers and started reads, and calls `fn` for every
+  /// read that has completed.
+  void poll(const OnReadFn& fn);
+
+private:
+  bool next_buffer();
+  IoRing& ring();
+  uint64_t file_offset(const ExtLoc& loc) const;
+};
+
+inline const ExtstoreStats&
+Extstore::stats() const
+{
+  return _stats;
+}
+
+inline ExtstoreStats&
+Extstore::stats()
+{
+  return _stats;
+}
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef> /* for size_t */
+#include <cstdint>
+#include <memory>
+
+namespace rainbow {
+
+/// Estimates how often keys are accessed, by key hash, to decide which items
+/// are worth keeping.
+///
+/// The sketch is a count-min sketch of 4-bit counters, packed 16 to a word.
+/// The four counters of a key are in the same cache line, so that counting
+/// an access or estimating a frequency touches one line. Once the sketch has
+/// counted ten accesses per key it was sized for, all counters are halved,
+/// so that the estimates follow changes in popularity.
+class FrequencySketch
+{
+  static constexpr size_t counters_per_word = 16;
+  static constexpr size_t words_per_block = 8;
+  static constexpr uint32_t max_count = 15;
+
+  std::unique_ptr<uint64_t[]> _table;
+  size_t _nr_blocks;
+  size_t _nr_increments = 0;
+  size_t _sample_size;
+
+public:
+  /// Creates a sketch for about `capacity` keys, with a counter per key.
+  explicit FrequencySketch(size_t capacity);
+  FrequencySketch(const FrequencySketch&) = delete;
+  FrequencySketch& operator=(const FrequencySketch&) = delete;
+
+  void increment(uint32_t hash);
+  uint32_t frequency(uint32_t hash) const;
+
+  /// Returns the length of the counters, in bytes.
+  size_t len() const;
+
+private:
+  void age();
+};
+
+inline size_t
+FrequencySketch::len() const
+{
+  return _nr_blocks * words_per_block * sizeof(uint64_t);
+}
+
+}
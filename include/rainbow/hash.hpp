@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef> /* for size_t */
+#include <cstdint>
+#include <string>
+
+namespace rainbow {
+
+/// Key hash function. The values match `enum rainbow_key_hash` in keyhash.h,
+/// which is what the XDP program is configured with.
+enum class KeyHash : uint32_t
+{
+  Murmur3 = 0,
+  CRC32C = 1,
+  XXH32 = 2,
+};
+
+/// Returns the key hash function called `name`, which is "murmur3",
+/// "crc32c", or "xxh32".
+KeyHash
+parse_key_hash(const std::string& name);
+
+/// Hashes keys with a hash function that is selected once, at load time.
+///
+/// The result is bit for bit identical to what the XDP program computes for
+/// the same key, but userspace uses SSE4.2 for CRC32C when the CPU has it.
+/// Like there, a key longer than the memcached maximum of 250 bytes hashes
+/// like its first 250 bytes.
+class KeyHasher
+{
+  using HashFn = uint32_t (*)(const char* key, size_t len);
+
+  KeyHash _kind;
+  HashFn _fn;
+
+public:
+  explicit KeyHasher(KeyHash kind = KeyHash::Murmur3);
+  KeyHash kind() const;
+  uint32_t operator()(const char* key, size_t len) const;
+};
+
+inline KeyHash
+KeyHasher::kind() const
+{
+  return _kind;
+}
+
+inline uint32_t
+KeyHasher::operator()(const char* key, size_t len) const
+{
+  return _fn(key, len);
+}
+
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef> /* for size_t */
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace rainbow {
+
+class SteeringTable;
+
+struct HotKey
+{
+  std::string key;
+  uint32_t hash;
+  /// Estimated number of requests in the last sampling period.
+  uint64_t count;
+};
+
+using HotKeys = std::vector<HotKey>;
+
+/// Extracts the top-K keys from the count-min sketch that the XDP program
+/// maintains.
+class HotKeyTracker
+{
+  int _sketch_fd;
+  int _hot_key_fd;
+  size_t _k;
+  unsigned int _nr_cpus;
+
+public:
+  HotKeyTracker(int sketch_fd, int hot_key_fd, size_t k);
+
+  /// Reads the sketch, returns the hottest keys of the period that ended,
+  /// and starts a new period.
+  HotKeys poll();
+};
+
+/// Publishes the latest hot keys so that reactors can report them in stats.
+void
+publish_hot_keys(HotKeys hot_keys);
+
+std::shared_ptr<const HotKeys>
+hot_keys();
+
+/// Moving a steering bucket from one partition to another.
+struct BucketMove
+{
+  uint32_t bucket;
+  uint32_t src;
+  uint32_t dst;
+};
+
+/// Decides how to shed hot key load. If the hot keys make one partition
+/// carry more than `imbalance` times the average hot key load, its hottest
+/// bucket moves to the partition with the least hot key load, unless that
+/// bucket alone is what makes the partition hot.
+std::vector<BucketMove>
+plan_hot_key_mitigation(const HotKeys& hot_keys, const SteeringTable& steering, double imbalance = 1.5);
+
+}
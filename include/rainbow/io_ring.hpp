@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef> /* for size_t */
+#include <cstdint>
+
+#include <linux/io_uring.h>
+
+namespace rainbow {
+
+/// An io_uring instance, driven with system calls directly.
+///
+/// A ring belongs to the thread that creates it, which is the only one that
+/// submits to it. Submission entries are handed out in ring order and
+/// submitted in batches, and completions are reaped by the owner.
+class IoRing
+{
+  struct Ring
+  {
+    unsigned* head;
+    unsigned* tail;
+    unsigned mask;
+    unsigned entries;
+  };
+
+  int _fd = -1;
+  void* _sq_ptr = nullptr;
+  size_t _sq_len = 0;
+  void* _cq_ptr = nullptr;
+  size_t _cq_len = 0;
+  ::io_uring_sqe* _sqes = nullptr;
+  size_t _sqes_len = 0;
+  ::io_uring_cqe* _cqes = nullptr;
+  Ring _sq = {};
+  Ring _cq = {};
+  /// SQ tail that is not yet visible to the kernel, and how many entries
+  /// up to it the kernel has not consumed.
+  unsigned _sq_tail = 0;
+  unsigned _sq_pending = 0;
+
+public:
+  IoRing(unsigned int sq_entries, unsigned int cq_entries);
+  ~IoRing();
+  IoRing(const IoRing&) = delete;
+  IoRing& operator=(const IoRing&) = delete;
+
+  int fd() const;
+
+  /// Returns a zeroed submission entry, or nullptr if the submission queue
+  /// is still full after submitting what is in it.
+  ::io_uring_sqe* get_sqe();
+
+  /// Submits the pending entries, and waits for `min_complete` completions.
+  void submit(unsigned int min_complete = 0);
+
+  /// Calls `fn` for every completion that has arrived.
+  template<typename Fn>
+  void reap(Fn&& fn);
+
+  /// Registers a resource with the ring, such as a provided buffer ring.
+  void register_resource(unsigned int opcode, void* arg, unsigned int nr_args, const char* name);
+
+private:
+  void unmap();
+};
+
+inline int
+IoRing::fd() const
+{
+  return _fd;
+}
+
+template<typename Fn>
+inline void
+IoRing::reap(Fn&& fn)
+{
+  unsigned head = *_cq.head;
+  unsigned tail = __atomic_load_n(_cq.tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    fn(_cqes[head & _cq.mask]);
+  }
+  __atomic_store_n(_cq.head, head, __ATOMIC_RELEASE);
+}
+
+}
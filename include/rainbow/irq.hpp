@@ -0,0 +1,47 @@
+#pragma once
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace rainbow {
+
+/// Where the interrupts and transmit work of one NIC queue pair should run.
+struct QueuePlan
+{
+  unsigned int queue;
+  /// The core that services the queue, which is core `queue`.
+  unsigned int cpu;
+  /// The partition that owns `cpu`, or -1 if no partition does.
+  int partition;
+  std::vector<unsigned int> irqs;
+};
+
+/// Ties the queues of a NIC to the partitions that own the cores, so that
+/// interrupt and softirq work for a packet runs on the core that processes
+/// the request.
+struct IrqPlan
+{
+  std::string ifname;
+  std::vector<QueuePlan> queues;
+};
+
+/// Plans queue `i` of `ifname` onto core `i` and the partition that owns it.
+/// `partition_cpus[p]` lists the cores of partition `p`. IRQs are found by
+/// matching the device's MSI vectors against the names in /proc/interrupts.
+IrqPlan
+plan_irq_affinity(const std::string& ifname, const std::vector<std::vector<unsigned int>>& partition_cpus);
+
+void
+print_irq_plan(std::ostream& os, const IrqPlan& plan);
+
+/// Returns a description of every IRQ affinity or XPS setting that differs
+/// from the plan.
+std::vector<std::string>
+verify_irq_plan(const IrqPlan& plan);
+
+/// Writes the IRQ affinity and XPS settings of the plan.
+void
+apply_irq_plan(const IrqPlan& plan);
+
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "rainbow/slab.hpp"
+
+#include <cstddef> /* for size_t */
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace rainbow {
+
+struct LogStats
+{
+  /// Bytes of items appended because they were stored, and because the
+  /// cleaner moved them out of a segment it was emptying.
+  uint64_t bytes_written = 0;
+  uint64_t bytes_relocated = 0;
+  uint64_t segments_cleaned = 0;
+  /// Segments whose items were evicted, because cleaning would not have
+  /// freed enough memory.
+  uint64_t segments_evicted = 0;
+};
+
+/// Allocator for item memory that appends items to segments instead of
+/// carving memory into chunks of size classes, so that memory goes to
+/// whatever sizes the items have.
+///
+/// Segments are pages of a slab allocator. Freeing an item leaves a hole in
+/// its segment, and a segment is reused once all of its items are freed,
+/// which the owner speeds up by moving the items that are still live out of
+/// the segments with the most holes.
+class LogAllocator
+{
+public:
+  static constexpr size_t segment_size = SlabAllocator::page_size;
+
+private:
+  struct Segment
+  {
+    /// Bytes appended, and bytes of items that are still live.
+    uint32_t used = 0;
+    uint32_t live = 0;
+    /// Order in which the segments were opened, which is zero for a segment
+    /// that is not in use.
+    uint64_t seq = 0;
+  };
+
+  SlabAllocator& _slabs;
+  /// Segments by page number.
+  std::vector<Segment> _segments;
+  std::vector<uint32_t> _free;
+  /// The segment that items are appended to.
+  std::optional<uint32_t> _head;
+  uint64_t _next_seq = 1;
+  size_t _nr_in_use = 0;
+  uint64_t _live_bytes = 0;
+  LogStats _stats;
+
+public:
+  /// Takes pages for segments from `slabs`, as they are needed.
+  explicit LogAllocator(SlabAllocator& slabs);
+  LogAllocator(const LogAllocator&) = delete;
+  LogAllocator& operator=(const LogAllocator&) = delete;
+
+  /// Returns the length that an item of `len` bytes takes in a segment.
+  static size_t aligned_len(size_t len);
+
+  /// Appends `len` bytes, which are a relocated item if `relocation` is
+  /// set. Returns nullptr if no segment has room.
+  void* alloc(size_t len, bool relocation = false);
+  /// Frees the item of `len` bytes at `ptr`. A segment whose items have all
+  /// been freed is reused.
+  void free(const void* ptr, size_t len);
+
+  /// Returns the number of segments that are free, counting the pages that
+  /// have not been taken yet.
+  size_t nr_free() const;
+  /// Returns the segment, other than the one being appended to, with the
+  /// fewest live bytes, or the one opened first.
+  std::optional<uint32_t> emptiest() const;
+  std::optional<uint32_t> oldest() const;
+
+  size_t segment_of(const void* ptr) const;
+  char* begin(uint32_t segment) const;
+  uint32_t used(uint32_t segment) const;
+  uint32_t live(uint32_t segment) const;
+  uint64_t seq(uint32_t segment) const;
+
+  /// Returns the fraction of the memory in segments that are in use that
+  /// live items take.
+  double utilization() const;
+  const LogStats& stats() const;
+  LogStats& stats();
+
+private:
+  bool open_segment();
+  void release(uint32_t segment);
+};
+
+inline size_t
+LogAllocator::aligned_len(size_t len)
+{
+  return (len + 7) & ~size_t(7);
+}
+
+inline size_t
+LogAllocator::segment_of(const void* ptr) const
+{
+  return _slabs.page_of(ptr);
+}
+
+inline char*
+LogAllocator::begin(uint32_t segment) const
+{
+  return _slabs.page(segment);
+}
+
+inline uint32_t
+LogAllocator::used(uint32_t segment) const
+{
+  return _segments[segment].used;
+}
+
+inline uint32_t
+LogAllocator::live(uint32_t segment) const
+{
+  return _segments[segment].live;
+}
+
+inline uint64_t
+LogAllocator::seq(uint32_t segment) const
+{
+  return _segments[segment].seq;
+}
+
+inline const LogStats&
+LogAllocator::stats() const
+{
+  return _stats;
+}
+
+inline LogStats&
+LogAllocator::stats()
+{
+  return _stats;
+}
+
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "rainbow/spsc_ring.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace rainbow {
+
+class SteeringTable;
+class Store;
+
+/// A change to a migrating bucket, sent from the source partition to the
+/// destination partition.
+struct MigrationRecord
+{
+  enum class Kind
+  {
+    Upsert,
+    Delete,
+    /// The source has sent every item in the bucket.
+    Done,
+    /// The source will send no more records.
+    Close,
+  };
+
+  Kind kind;
+  uint32_t flags = 0;
+  uint32_t exptime = 0;
+  std::string key;
+  std::string value;
+};
+
+/// Moves the items of one steering bucket from one partition to another
+/// while both keep serving requests.
+///
+/// The protocol runs in the following steps:
+///
+///   1. Streaming: the source scans its store in bounded slices and sends
+///      every item in the bucket to the destination over a single-producer,
+///      single-consumer ring. Requests are still steered to the source, which
+///      serves reads locally and forwards every write to the destination
+///      through the same ring, so that the destination sees the changes in
+///      order.
+///
+///   2. Streamed: the destination has applied everything the source had when
+///      the scan finished. The controller now flips the XDP steering entry.
+///
+///   3. Flipped: requests for the bucket go to the destination. Packets that
+///      were already in flight still reach the source, which serves reads
+///      from its copy and keeps forwarding writes.
+///
+///   4. Finished: after a grace period, the source closes the ring and drops
+///      its copy of the bucket. The destination detaches when it sees the
+///      close record.
+///
+/// Once the destination serves a key itself, its own writes are newer than
+/// anything the source still has in flight for the key, so it skips the
+/// records for that key from then on.
+///
+/// If either partition stalls before the flip, the controller aborts the
+/// migration: the source keeps the bucket and stops sending, and the
+/// destination drops what it has received.
+class Migration
+{
+public:
+  enum class State
+  {
+    Streaming,
+    Streamed,
+    Flipped,
+    Finished,
+    Closed,
+    Aborted,
+  };
+
+private:
+  uint32_t _bucket;
+  Store* _src;
+  Store* _dst;
+  SpscRing<std::unique_ptr<MigrationRecord>> _ring{4096};
+  std::atomic<State> _state{State::Streaming};
+
+  // State private to the source partition:
+  std::deque<std::unique_ptr<MigrationRecord>> _backlog;
+  size_t _cursor = 0;
+  size_t _index_size = 0;
+  bool _scan_done = false;
+  bool _close_sent = false;
+  /// Keys of items whose values are being read from flash, to send once
+  /// they are in.
+  std::unordered_set<std::string> _unread;
+
+  // State private to the destination partition:
+  std::unordered_set<std::string> _written;
+  size_t _drop_cursor = 0;
+  size_t _drop_index_size = 0;
+
+public:
+  Migration(uint32_t bucket, Store* src, Store* dst);
+
+  uint32_t bucket() const;
+  Store* source() const;
+  Store* destination() const;
+  State state() const;
+  void set_state(State state);
+
+  /// Moves the migration from state `from` to `to`, unless it has moved on
+  /// in the meantime. Returns true if it did.
+  bool advance(State from, State to);
+
+  /// Queues a record for the destination. Called by the source partition.
+  void send(std::unique_ptr<MigrationRecord> record);
+
+  /// Moves queued records into the ring. Returns true if none are left.
+  bool flush();
+
+  /// Dequeues a record. Called by the destination partition.
+  bool receive(std::unique_ptr<MigrationRecord>& record);
+
+  friend class Store;
+};
+
+inline uint32_t
+Migration::bucket() const
+{
+  return _bucket;
+}
+
+inline Store*
+Migration::source() const
+{
+  return _src;
+}
+
+inline Store*
+Migration::destination() const
+{
+  return _dst;
+}
+
+inline Migration::State
+Migration::state() const
+{
+  return _state.load(std::memory_order_acquire);
+}
+
+inline void
+Migration::set_state(State state)
+{
+  _state.store(state, std::memory_order_release);
+}
+
+inline bool
+Migration::advance(State from, State to)
+{
+  return _state.compare_exchange_strong(from, to, std::memory_order_acq_rel);
+}
+
+/// Moves `bucket` to partition `dst` without a cache-cold period, and flips
+/// its steering entry once the destination has the data. Runs the migration
+/// protocol from a control thread and blocks until it has completed, or until
+/// a step takes longer than `timeout`.
+///
+/// Returns false if the migration was aborted before the flip, in which case
+/// the bucket stays with its old owner. Past the flip the source may already
+/// have dropped part of its copy, so the bucket stays with the destination,
+/// and the partitions finish the close on their own if the wait times out.
+bool
+migrate_bucket(SteeringTable& steering,
+               const std::vector<Store*>& stores,
+               uint32_t bucket,
+               uint32_t dst,
+               std::chrono::milliseconds grace = std::chrono::milliseconds{100},
+               std::chrono::milliseconds timeout = std::chrono::seconds{5});
+
+}
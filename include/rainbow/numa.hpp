@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef> /* for size_t */
+#include <string>
+#include <vector>
+
+struct hwloc_topology;
+
+namespace rainbow {
+
+/// How the cores of the machine are grouped into partitions, each of which
+/// owns a shard of the keyspace and a slice of the memory.
+enum class PartitionMode
+{
+  /// One partition for the whole machine.
+  Machine,
+  /// One partition per NUMA node.
+  Node,
+  /// One partition per hardware thread.
+  Core,
+};
+
+/// Parses a partition mode name: "machine", "node", or "core".
+PartitionMode
+parse_partition_mode(const std::string& name);
+
+/// The machine topology, as discovered by hwloc.
+class Topology
+{
+  ::hwloc_topology* _topology = nullptr;
+
+public:
+  Topology();
+  ~Topology();
+  Topology(const Topology&) = delete;
+  Topology& operator=(const Topology&) = delete;
+
+  ::hwloc_topology* get() const;
+
+  /// Number of NUMA nodes, which is zero on a UMA system.
+  unsigned int nr_nodes() const;
+
+  /// Returns the NUMA node of `cpu`, or -1 if unknown.
+  int node_of_cpu(unsigned int cpu) const;
+
+  /// Binds the pages in [addr, addr + len) to `node`. Pages that have not
+  /// been touched yet are allocated on the node when they are first used.
+  void bind_memory(void* addr, size_t len, int node) const;
+
+  /// Binds the calling thread, and the memory it allocates, to `node`. This
+  /// also covers memory that the kernel allocates on behalf of the thread,
+  /// such as AF_XDP rings.
+  void bind_thread(int node) const;
+
+  /// Runs the calling thread on `cpus` only, leaving its memory binding as
+  /// is.
+  void bind_thread_to_cpus(const std::vector<unsigned int>& cpus) const;
+
+  /// Returns the cores of each partition for `mode`. A machine without NUMA
+  /// information is treated as a single node.
+  std::vector<std::vector<unsigned int>> partition_cpus(PartitionMode mode) const;
+};
+
+inline ::hwloc_topology*
+Topology::get() const
+{
+  return _topology;
+}
+
+/// Returns the NUMA node the network device `ifname` is attached to, or -1
+/// if unknown.
+int
+nic_numa_node(const std::string& ifname);
+
+/// Parses a list of numbers and ranges, such as "0-7,16-23", as used by
+/// sysfs for CPU lists.
+std::vector<unsigned int>
+parse_range_list(const std::string& list);
+
+/// Returns the CPUs that are local to the network device `ifname`.
+std::vector<unsigned int>
+nic_local_cpus(const std::string& ifname);
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+
+namespace rainbow {
+
+/// A pointer that is stored as the distance from its own address to the
+/// object it points to.
+///
+/// Data structures linked with offset pointers stay valid when the memory
+/// that holds them is mapped at a different address, such as a region that
+/// a restarted daemon attaches to, as long as the pointers and their
+/// targets are in the same mapping.
+///
+/// Zero is the null pointer, which makes zeroed memory a valid array of
+/// null pointers. An offset pointer never points to itself.
+template<typename T>
+class OffsetPtr
+{
+  intptr_t _offset = 0;
+
+public:
+  OffsetPtr() = default;
+  OffsetPtr(T* ptr);
+  OffsetPtr(const OffsetPtr& other);
+  OffsetPtr& operator=(const OffsetPtr& other);
+  OffsetPtr& operator=(T* ptr);
+
+  T* get() const;
+  operator T*() const;
+  T* operator->() const;
+};
+
+template<typename T>
+inline OffsetPtr<T>::OffsetPtr(T* ptr)
+{
+  *this = ptr;
+}
+
+template<typename T>
+inline OffsetPtr<T>::OffsetPtr(const OffsetPtr& other)
+{
+  *this = other.get();
+}
+
+template<typename T>
+inline OffsetPtr<T>&
+OffsetPtr<T>::operator=(const OffsetPtr& other)
+{
+  return *this = other.get();
+}
+
+template<typename T>
+inline OffsetPtr<T>&
+OffsetPtr<T>::operator=(T* ptr)
+{
+  _offset = ptr ? reinterpret_cast<intptr_t>(ptr) - reinterpret_cast<intptr_t>(this) : 0;
+  return *this;
+}
+
+template<typename T>
+inline T*
+OffsetPtr<T>::get() const
+{
+  return _offset ? reinterpret_cast<T*>(reinterpret_cast<intptr_t>(this) + _offset) : nullptr;
+}
+
+template<typename T>
+inline OffsetPtr<T>::operator T*() const
+{
+  return get();
+}
+
+template<typename T>
+inline T*
+OffsetPtr<T>::operator->() const
+{
+  return get();
+}
+
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstddef> /* for size_t */
+#include <string>
 
 namespace rainbow {
 
@@ -14,6 +15,16 @@ struct Packet
   Packet trim_front(size_t size) const;
 };
 
+/// How far the commands of a datagram got before one of them had to wait
+/// for a value on flash: the bytes of the datagram that were processed, and
+/// the replies of the commands in them. Processing the datagram again picks
+/// up from there, so that no command runs twice.
+struct Progress
+{
+  size_t consumed = 0;
+  std::string output;
+};
+
 inline Packet::Packet(const char* data, size_t len)
   : data{data}
   , len{len}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "rainbow/error.hpp"
+#include "rainbow/packet.hpp"
+
+#include "expected.hpp"
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace rainbow {
+
+class Store;
+struct Item;
+
+/// A value that is sent straight from item memory instead of being copied
+/// into the response.
+struct ZeroCopyValue
+{
+  /// Largest value the caller can send this way.
+  size_t max_len;
+  /// The item that the value belongs to, which the store holds for the
+  /// caller until it calls Store::release(), or nullptr if the response has
+  /// no zero-copy value.
+  const Item* item = nullptr;
+  std::string_view value = {};
+};
+
+/// Processes one memcached binary protocol request against `store` and
+/// writes the response to `response`, which can hold `capacity` bytes.
+///
+/// If `zero_copy` is given, a large GET value is not written to `response`,
+/// but returned in `zero_copy` to be sent after it.
+///
+/// Returns the length of the response, including any zero-copy value, which
+/// is zero if there is nothing to send back, as is the case for quiet
+/// commands that succeed.
+tl::expected<size_t, Error>
+process_binary_request(Store& store,
+                       const Packet& request,
+                       char* response,
+                       size_t capacity,
+                       ZeroCopyValue* zero_copy = nullptr);
+
+/// Processes the complete memcached binary protocol requests at the front of
+/// a byte stream, such as a TCP connection, and appends their responses to
+/// `output`.
+///
+/// Returns the number of bytes consumed, which leaves a partial request at
+/// the end of `input` for the caller to complete. Processing stops at the
+/// first request that is not a binary protocol request.
+tl::expected<size_t, Error>
+process_binary_stream(Store& store, std::string_view input, std::string& output);
+
+/// Processes the memcached text protocol commands in one datagram, such as
+/// "get k1 k2\r\n", and writes their responses to `response`, which can
+/// hold `capacity` bytes.
+///
+/// If a command has to wait for a value on flash, returns zero and, if
+/// `progress` is given, records there how far the datagram got. Passing the
+/// same `progress` when processing the datagram again resumes from there.
+tl::expected<size_t, Error>
+process_ascii_request(Store& store,
+                      const Packet& request,
+                      char* response,
+                      size_t capacity,
+                      Progress* progress = nullptr);
+
+/// Processes the complete text protocol commands at the front of a byte
+/// stream, and appends their responses to `output`. Returns the number of
+/// bytes consumed.
+tl::expected<size_t, Error>
+process_ascii_stream(Store& store, std::string_view input, std::string& output);
+
+/// Processes a request in either protocol, which are told apart by the first
+/// byte: a binary request starts with its magic, which no text command does.
+tl::expected<size_t, Error>
+process_request(Store& store,
+                const Packet& request,
+                char* response,
+                size_t capacity,
+                ZeroCopyValue* zero_copy = nullptr,
+                Progress* progress = nullptr);
+
+/// Like process_request(), but for the requests at the front of a stream.
+tl::expected<size_t, Error>
+process_stream(Store& store, std::string_view input, std::string& output);
+
+/// Returns the statistics of statistics group `group`, where the empty group
+/// is the general statistics, or nothing if there is no such group.
+std::optional<std::vector<std::pair<std::string, std::string>>>
+collect_stats(Store& store, std::string_view group);
+
+}
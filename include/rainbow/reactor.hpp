@@ -1,18 +1,49 @@
 #pragma once
 
 #include "expected.hpp"
+#include "rainbow/error.hpp"
+#include "rainbow/packet.hpp"
+#include "rainbow/spsc_ring.hpp"
+#include "rainbow/umem.hpp"
 
+#include <deque>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <linux/if_xdp.h>
 
 namespace rainbow {
 
-struct Packet;
+class Topology;
+class XdpProgram;
 
-using Error = std::string;
+/// A buffer that a packet handler writes its reply to. The handler sets
+/// `len` to the length of the reply, or leaves it at zero to send nothing.
+/// It sets `deferred` instead if the request has to wait for a value on
+/// flash, and the datapath hands it the packet again on resume(), along with
+/// the `progress` that the handler made on it.
+struct Frame
+{
+  char* data;
+  size_t len;
+  size_t capacity;
+  /// Bytes that follow the first `len` bytes of the reply, sent straight
+  /// from UMEM memory, such as item memory, instead of being copied.
+  std::string_view payload = {};
+  /// Handed to the TX completion function once the NIC is done with
+  /// `payload`.
+  const void* payload_owner = nullptr;
+  bool deferred = false;
+  Progress progress = {};
+};
 
-using OnPacketFn = std::function<tl::expected<void, Error>(const Packet& packet)>;
+using OnPacketFn = std::function<tl::expected<void, Error>(const Packet& packet, Frame& reply)>;
+
+using OnTxCompleteFn = std::function<void(const void* payload_owner)>;
 
 struct xdp_umem_ring
 {
@@ -30,23 +61,103 @@ struct xdp_ring
   uint32_t mask;
 };
 
+/// Serves one NIC queue over an AF_XDP socket.
 class Reactor
 {
-  unsigned int _ifindex = 0;
+  const XdpProgram* _program = nullptr;
+  uint32_t _queue = 0;
+  uint32_t _slot = 0;
+  /// The reactor whose UMEM and fill ring this one shares, if it receives on
+  /// a queue that another partition serves.
+  Reactor* _owner = nullptr;
+  /// Answers the packets of a reactor that shares a queue.
+  Reactor* _replier = nullptr;
+  /// Frames that a reactor that shares a queue is done with, on their way
+  /// back to the fill ring of the owner.
+  std::unique_ptr<SpscRing<uint64_t>> _returned;
+  /// The reactors of other partitions that share this one's queue.
+  std::vector<Reactor*> _sharers;
+  std::mutex _sharers_lock;
   xdp_umem_ring _fill_ring = {};
+  xdp_umem_ring _completion_ring = {};
   xdp_ring _rx_ring = {};
-  void* _bufs = nullptr;
+  xdp_ring _tx_ring = {};
+  std::vector<uint64_t> _tx_frames;
+  /// The payload owner of every descriptor on the TX ring, in order. Only
+  /// the last descriptor of a packet has one.
+  std::deque<const void*> _tx_owners;
+  Umem* _umem = nullptr;
+  std::unique_ptr<Umem> _own_umem;
+  uint64_t _frame_base = 0;
   int _sockfd = -1;
   OnPacketFn _fn;
+  OnTxCompleteFn _tx_complete_fn;
+  const Topology* _topology = nullptr;
+  int _numa_node = -1;
+  bool _hugepages = false;
+  bool _zero_copy = false;
+  /// A copy of a packet whose request is waiting for a value on flash.
+  struct Parked
+  {
+    std::vector<char> data;
+    Progress progress;
+  };
+
+  std::vector<Parked> _parked;
 
 public:
+  /// Maximum number of TX descriptors a reply is split into.
+  static constexpr size_t max_tx_descs = 16;
+  /// Maximum length of a reply payload. A payload that does not start on a
+  /// frame boundary takes one descriptor more than its length suggests.
+  static constexpr size_t max_payload_len = (max_tx_descs - 2) * Umem::frame_size;
+  /// Maximum number of packets waiting for values on flash. More are
+  /// dropped, and left for the clients to retry.
+  static constexpr size_t max_parked = 1024;
+
   ~Reactor();
   void on_packet(OnPacketFn&& fn);
+  /// Called when the NIC is done sending the payload of a reply.
+  void on_tx_complete(OnTxCompleteFn&& fn);
+  /// Receives the packets that arrive on queue `queue` of the interface of
+  /// `program`, and that the program redirects to entry `slot` of its
+  /// `xsks_map`.
+  void program(const XdpProgram& program, uint32_t queue, uint32_t slot);
+  /// Receives on a queue that `owner`, a reactor of another partition,
+  /// serves, through a socket that shares the owner's UMEM and fill ring.
+  /// Replies go out through `replier`, a reactor of this partition with a
+  /// queue of its own. The owner must be set up before this reactor is, and
+  /// must not run until it is.
+  void share_queue(Reactor& owner, Reactor& replier);
+  uint32_t queue() const;
+  /// Places the UMEM and the rings on NUMA node `node`. The thread that
+  /// calls setup() is bound to the node as well.
+  void numa_node(const Topology& topology, int node);
+  /// Uses frame area `area` of `umem`, which the caller keeps alive, instead
+  /// of a UMEM of its own. Reply payloads must be inside `umem`.
+  void umem(Umem& umem, unsigned int area);
+  /// Backs the UMEM with transparent huge pages.
+  void hugepages(bool enable);
+  /// Requires the driver to DMA straight into the UMEM, instead of letting
+  /// the kernel fall back to copying packets.
+  void zero_copy(bool enable);
   void setup();
   void run_once();
+  /// Processes the packets that were waiting for values on flash again.
+  void resume();
 
 private:
+  void setup_shared(int xsks_map);
+  void process(const Packet& packet, Progress&& progress = {});
+  void reclaim_tx_frames();
+  bool transmit(uint64_t addr, const Frame& reply);
   void teardown();
 };
 
+inline uint32_t
+Reactor::queue() const
+{
+  return _queue;
+}
+
 }
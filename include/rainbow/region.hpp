@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef> /* for size_t */
+#include <cstdint>
+#include <string>
+
+namespace rainbow {
+
+class Topology;
+
+/// Memory of a store that outlives the daemon, kept in a file on tmpfs or
+/// hugetlbfs.
+///
+/// A region starts with a header, followed by the state of the store, its
+/// index, and its item memory. The store links everything with offset
+/// pointers, so a restarted daemon can map the file anywhere and pick up
+/// where the previous one left off.
+///
+/// The header records the layout version and the parameters that the
+/// contents depend on. A daemon only reattaches to a region that has the
+/// same ones, and that the previous daemon closed cleanly. Otherwise, it
+/// starts over with an empty region.
+class Region
+{
+public:
+  /// Bumped whenever the layout of the region, including the items and the
+  /// store state, changes incompatibly.
+  static constexpr uint32_t layout_version = 9;
+
+  /// Sizes of the parts of a region, and the parameters that the contents
+  /// depend on. A region is only reattached if all of them match.
+  struct Layout
+  {
+    uint64_t state_len;
+    uint64_t index_len;
+    uint64_t mem_len;
+    uint32_t item_header_len;
+    uint32_t key_hash;
+    /// Keys are spread over partitions, so a region only holds the right
+    /// keys for the same partition and number of partitions.
+    uint32_t partition;
+    uint32_t nr_partitions;
+  };
+
+private:
+  struct Header;
+
+  std::string _path;
+  int _fd = -1;
+  char* _mem = nullptr;
+  size_t _len = 0;
+  Layout _layout;
+  size_t _state_offset;
+  size_t _index_offset;
+  size_t _mem_offset;
+  bool _reattached = false;
+
+public:
+  /// Maps the region in the file at `path`, which is created if it does not
+  /// exist. The file is locked, so that two daemons never share it.
+  Region(const std::string& path, const Layout& layout, const Topology* topology = nullptr, int numa_node = -1);
+  ~Region();
+  Region(const Region&) = delete;
+  Region& operator=(const Region&) = delete;
+
+  /// Returns true if the contents of the region were left by a previous
+  /// daemon, and false if the region starts out zeroed.
+  bool reattached() const;
+
+  const Layout& layout() const;
+  char* state() const;
+  char* index() const;
+  char* mem() const;
+
+  /// Marks the region as closed cleanly, which lets the next daemon
+  /// reattach to it. Called when the store is consistent and no longer
+  /// changes.
+  void close_cleanly();
+
+private:
+  Header* header() const;
+  bool validate(const Header& header, std::string& reason) const;
+  void reset();
+};
+
+inline bool
+Region::reattached() const
+{
+  return _reattached;
+}
+
+inline const Region::Layout&
+Region::layout() const
+{
+  return _layout;
+}
+
+inline char*
+Region::state() const
+{
+  return _mem + _state_offset;
+}
+
+inline char*
+Region::index() const
+{
+  return _mem + _index_offset;
+}
+
+inline char*
+Region::mem() const
+{
+  return _mem + _mem_offset;
+}
+
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "rainbow/hotkeys.hpp"
+#include "rainbow/spsc_ring.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace rainbow {
+
+class SteeringTable;
+class Store;
+
+/// A change to a read-only replica, sent by the partition that owns the key.
+struct ReplicaUpdate
+{
+  enum class Kind
+  {
+    Fill,
+    Invalidate,
+  };
+
+  Kind kind;
+  uint32_t flags = 0;
+  uint32_t exptime = 0;
+  std::string key;
+  std::string value;
+  /// CAS value of the item at the owner, which reads of the replica return,
+  /// so that clients can update the item with it.
+  uint64_t cas = 0;
+};
+
+/// A request from the control thread to the owner of a key to start
+/// replicating it to `partitions`, or to stop replicating it if the list is
+/// empty.
+struct ReplicationCommand
+{
+  std::string key;
+  std::vector<uint32_t> partitions;
+};
+
+/// Hot key replication between partitions.
+///
+/// Every pair of partitions is connected by a single-producer,
+/// single-consumer ring that carries replica updates from the owner of a key
+/// to the partitions holding a copy of it. The owner publishes the replica
+/// set to the XDP program only after every replica has consumed its copy,
+/// and unpublishes it before invalidating the copies on a write, so reads
+/// that are spread over the replicas see the owner's writes.
+class Replication
+{
+  struct Channel
+  {
+    SpscRing<std::unique_ptr<ReplicaUpdate>> ring{1024};
+    // Private to the producer:
+    std::deque<std::unique_ptr<ReplicaUpdate>> backlog;
+  };
+
+  unsigned int _nr_partitions;
+  int _replica_map_fd;
+  std::vector<std::unique_ptr<Channel>> _channels;
+
+public:
+  Replication(unsigned int nr_partitions, int replica_map_fd);
+
+  unsigned int nr_partitions() const;
+
+  /// Queues an update from partition `src` to partition `dst`. Called by `src`.
+  void send(uint32_t src, uint32_t dst, std::unique_ptr<ReplicaUpdate> update);
+
+  /// Moves queued updates from `src` into the rings. Called by `src`.
+  void flush(uint32_t src);
+
+  /// Returns true if `dst` has consumed every update from `src`.
+  bool drained(uint32_t src, uint32_t dst);
+
+  /// Dequeues an update from `src` to `dst`. Called by `dst`.
+  bool receive(uint32_t src, uint32_t dst, std::unique_ptr<ReplicaUpdate>& update);
+
+  /// Makes the XDP program spread reads for the key with `hash` over `partitions`.
+  void publish(uint32_t hash, const std::vector<uint32_t>& partitions);
+
+  /// Sends reads for the key with `hash` to the owner again.
+  void unpublish(uint32_t hash);
+
+private:
+  Channel& channel(uint32_t src, uint32_t dst);
+};
+
+inline unsigned int
+Replication::nr_partitions() const
+{
+  return _nr_partitions;
+}
+
+/// Decides which hot keys are replicated, and where to.
+class HotKeyReplicator
+{
+  SteeringTable& _steering;
+  std::vector<Store*> _stores;
+  unsigned int _nr_replicas;
+  uint64_t _min_count;
+  /// Replicated keys and their owners.
+  std::map<std::string, std::pair<uint32_t, uint32_t>> _replicated;
+
+public:
+  /// Replicates keys with at least `min_count` requests per period to
+  /// `nr_replicas` partitions, including the owner, or to all partitions if
+  /// `nr_replicas` is zero.
+  HotKeyReplicator(SteeringTable& steering, std::vector<Store*> stores, unsigned int nr_replicas, uint64_t min_count);
+
+  /// Starts replicating keys that became hot and stops replicating keys
+  /// that cooled down.
+  void update(const HotKeys& hot_keys);
+
+  /// Stops replicating the keys in `bucket`. Must be called before the
+  /// bucket changes owner, because only the owner invalidates replicas.
+  void forget_bucket(uint32_t bucket);
+
+private:
+  void unreplicate(const std::string& key, uint32_t owner);
+};
+
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace rainbow {
+
+/// Creates one socket of `type`, SOCK_STREAM or SOCK_DGRAM, per partition,
+/// all bound to `port` with SO_REUSEPORT. Stream sockets are put in the
+/// listening state.
+///
+/// A classic BPF program on the reuseport group hands every new connection
+/// or datagram to the socket of the partition that owns the CPU it arrived
+/// on, so traffic is served by the core that receives its packets.
+///
+/// `partition_cpus[p]` lists the cores of partition `p`, and socket `p` of
+/// the result belongs to partition `p`.
+std::vector<int>
+bind_reuseport_group(int type, uint16_t port, const std::vector<std::vector<unsigned int>>& partition_cpus);
+
+}
@@ -0,0 +1,246 @@
+#pragma once
+
+#include "rainbow/offset_ptr.hpp"
+
+#include <cstddef> /* for size_t */
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace rainbow {
+
+class Topology;
+
+/// Slab allocator for item memory.
+///
+/// Memory is reserved up front and handed out in pages, each of which is
+/// carved into equally sized chunks of one size class. Size classes grow by
+/// a constant factor, so that the internal fragmentation is bounded.
+///
+/// A page can be moved from one size class to another once none of its
+/// chunks are in use, which the owner arranges for by freeing or moving the
+/// items in it.
+class SlabAllocator
+{
+public:
+  static constexpr size_t page_size = 1 << 20;
+  static constexpr size_t min_chunk_size = 64;
+  static constexpr double growth_factor = 1.25;
+  static constexpr size_t max_classes = 64;
+
+private:
+  struct FreeChunk
+  {
+    OffsetPtr<FreeChunk> next;
+  };
+
+  struct SlabClass
+  {
+    size_t chunk_size;
+    OffsetPtr<FreeChunk> free_list;
+    size_t nr_pages;
+    size_t nr_free;
+  };
+
+public:
+  /// Allocator state that refers to item memory, and is kept with it when
+  /// the memory outlives the process. It is followed by the size class of
+  /// every page, plus one, or zero for a page that no class has. All zeros
+  /// is the state of a new allocator.
+  struct State
+  {
+    size_t mem_used;
+    size_t nr_classes;
+    SlabClass classes[max_classes];
+  };
+
+private:
+  /// A page that is being moved to another size class. Its free chunks are
+  /// kept off the free list of its class, so that it empties out.
+  struct Move
+  {
+    size_t page;
+    int cls;
+    std::vector<bool> free;
+    size_t nr_free;
+    /// Where walk_free_list() is in the free list of the class, or nullptr
+    /// once it has walked all of it.
+    OffsetPtr<FreeChunk>* cursor;
+  };
+
+  char* _mem = nullptr;
+  size_t _mem_limit;
+  bool _owns_mem = true;
+  std::unique_ptr<char[]> _owned_state;
+  State* _state;
+  uint8_t* _page_classes;
+  std::optional<Move> _move;
+
+public:
+  /// Reserves `mem_limit` bytes of item memory, on NUMA node `numa_node`
+  /// if a topology is given, and backed by transparent huge pages if
+  /// `hugepages` is set.
+  explicit SlabAllocator(size_t mem_limit,
+                         const Topology* topology = nullptr,
+                         int numa_node = -1,
+                         bool hugepages = false);
+  /// Hands out item memory from [mem, mem + mem_limit), which the caller
+  /// owns. If `state` is given, the allocator keeps its state there, in
+  /// state_len() bytes, and picks up the chunks that were handed out before.
+  SlabAllocator(char* mem, size_t mem_limit, State* state = nullptr);
+  ~SlabAllocator();
+  SlabAllocator(const SlabAllocator&) = delete;
+  SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+  /// Returns the length of the state of an allocator of `mem_limit` bytes.
+  static size_t state_len(size_t mem_limit);
+
+  /// Returns the size class for an allocation of `size` bytes, or -1 if the
+  /// allocation is larger than a page.
+  int class_for(size_t size) const;
+
+  /// Allocates a chunk from size class `cls`, or returns nullptr if the class
+  /// has no free chunks and there are no pages left to give it.
+  void* alloc(int cls);
+
+  void free(int cls, void* chunk);
+
+  /// Hands out a whole page that no size class has, for an allocator that
+  /// carves pages up itself. Returns nullptr if there are no pages left.
+  char* alloc_page();
+  /// Returns the number of the page that `ptr` is in, and the page that has
+  /// number `n`.
+  size_t page_of(const void* ptr) const;
+  char* page(size_t n) const;
+  size_t nr_pages() const;
+  /// Returns the size class that page `n` is carved into, or -1 if it is
+  /// not.
+  int page_class(size_t n) const;
+
+  /// Starts moving page `n` out of its size class. Its chunks are no longer
+  /// handed out, and the ones that are freed stay with the page. The ones
+  /// that are free already are taken back by walk_free_list().
+  void start_move(size_t n);
+  /// Walks up to `budget` chunks of the free list of the class of the page
+  /// that is being moved, and takes the ones of the page off it. Returns
+  /// true once the whole list has been walked. Until then, in_use() does
+  /// not tell the items of the page from its free chunks.
+  bool walk_free_list(size_t budget);
+  /// Returns the page that is being moved, if any, and whether chunk `i` of
+  /// it is in use.
+  std::optional<size_t> moving_page() const;
+  bool in_use(size_t i) const;
+  /// Returns true if none of the chunks of the page that is being moved are
+  /// in use anymore, and the free list has been walked.
+  bool move_ready() const;
+  /// Carves the page that is being moved, which must be ready, into chunks
+  /// of size class `cls`.
+  void finish_move(int cls);
+  /// Gives the free chunks of the page that is being moved back to its size
+  /// class.
+  void abort_move();
+
+  size_t chunk_size(int cls) const;
+  size_t nr_chunks(int cls) const;
+  size_t nr_pages(int cls) const;
+  size_t nr_free(int cls) const;
+  size_t nr_classes() const;
+  size_t mem_limit() const;
+  size_t mem_used() const;
+
+private:
+  void init_classes();
+  bool grow(SlabClass& slab_class);
+  void carve(int cls, char* page);
+  void keep_for_move(void* chunk);
+};
+
+inline size_t
+SlabAllocator::chunk_size(int cls) const
+{
+  return _state->classes[cls].chunk_size;
+}
+
+inline size_t
+SlabAllocator::nr_chunks(int cls) const
+{
+  return page_size / _state->classes[cls].chunk_size;
+}
+
+inline size_t
+SlabAllocator::nr_pages(int cls) const
+{
+  return _state->classes[cls].nr_pages;
+}
+
+inline size_t
+SlabAllocator::nr_free(int cls) const
+{
+  return _state->classes[cls].nr_free;
+}
+
+inline size_t
+SlabAllocator::page_of(const void* ptr) const
+{
+  return (reinterpret_cast<const char*>(ptr) - _mem) / page_size;
+}
+
+inline char*
+SlabAllocator::page(size_t n) const
+{
+  return _mem + n * page_size;
+}
+
+inline size_t
+SlabAllocator::nr_pages() const
+{
+  return _mem_limit / page_size;
+}
+
+inline int
+SlabAllocator::page_class(size_t n) const
+{
+  return int(_page_classes[n]) - 1;
+}
+
+inline std::optional<size_t>
+SlabAllocator::moving_page() const
+{
+  if (!_move) {
+    return std::nullopt;
+  }
+  return _move->page;
+}
+
+inline bool
+SlabAllocator::in_use(size_t i) const
+{
+  return !_move->free[i];
+}
+
+inline bool
+SlabAllocator::move_ready() const
+{
+  return _move && !_move->cursor && _move->nr_free == _move->free.size();
+}
+
+inline size_t
+SlabAllocator::nr_classes() const
+{
+  return _state->nr_classes;
+}
+
+inline size_t
+SlabAllocator::mem_limit() const
+{
+  return _mem_limit;
+}
+
+inline size_t
+SlabAllocator::mem_used() const
+{
+  return _state->mem_used;
+}
+
+}
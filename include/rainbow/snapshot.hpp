@@ -0,0 +1,135 @@
+#pragma once
+
+#include "rainbow/io_ring.hpp"
+
+#include <cstddef> /* for size_t */
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace rainbow {
+
+struct Item;
+class Store;
+
+/// A point-in-time copy of the items of one partition, written to a file
+/// while the partition keeps serving requests.
+///
+/// The store scans its index in bounded slices between packet batches and
+/// appends every item that existed when the snapshot started. Items stored
+/// after that have a newer CAS value and are skipped. An item that is about
+/// to be replaced, removed, or evicted before the scan reaches it is
+/// appended right away instead, so the snapshot has the item as it was.
+///
+/// Records are gathered into large buffers, which io_uring writes to a
+/// temporary file in the background. Once everything is written, the file
+/// header goes out last, the file is synced, and it is renamed into place,
+/// so a snapshot file is always complete.
+///
+/// The file is the header, followed by one record per item: the value
+/// length, flags, expiration time as an absolute Unix time, and key length,
+/// each a 32-bit integer, followed by the key and the value.
+class Snapshot
+{
+public:
+  /// "RBSNAP" in little-endian byte order.
+  static constexpr uint64_t magic = 0x50414e534252;
+  static constexpr uint32_t version = 1;
+
+  struct Header
+  {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t partition;
+    uint32_t nr_partitions;
+    uint32_t reserved;
+    uint64_t nr_items;
+    /// Length of the records that follow the header.
+    uint64_t len;
+  };
+
+  struct Record
+  {
+    uint32_t value_len;
+    uint32_t flags;
+    uint32_t exptime;
+    uint32_t key_len;
+  };
+
+private:
+  std::string _path;
+  std::string _tmp_path;
+  int _fd = -1;
+  IoRing _ring;
+  Header _header = {};
+  /// The buffer that records are appended to, and full ones that wait for
+  /// a write to free up.
+  std::vector<char> _buf;
+  std::deque<std::vector<char>> _full;
+  std::vector<std::vector<char>> _writes;
+  std::vector<uint32_t> _free_writes;
+  std::vector<std::vector<char>> _spare;
+  /// Compressed values are decompressed into this, since snapshots hold
+  /// values as clients stored them.
+  std::string _plain;
+  size_t _nr_in_flight = 0;
+  uint64_t _offset = sizeof(Header);
+  bool _synced = false;
+  bool _done = false;
+  /// Items with a smaller CAS value are in the snapshot.
+  uint64_t _start_cas = 0;
+  /// Index slot that the scan of the store continues from.
+  size_t _cursor = 0;
+
+public:
+  /// Creates the temporary file of a snapshot that is renamed to `path` once
+  /// it is complete.
+  Snapshot(const std::string& path, uint32_t partition, uint32_t nr_partitions);
+  /// Removes the temporary file if the snapshot did not complete.
+  ~Snapshot();
+  Snapshot(const Snapshot&) = delete;
+  Snapshot& operator=(const Snapshot&) = delete;
+
+  const std::string& path() const;
+
+  void append(const Item& item);
+
+  /// Returns true if the writes have fallen behind, and the store should
+  /// not scan more items for now.
+  bool backlogged() const;
+
+  /// Submits full buffers, and reaps completed writes. Throws if a write
+  /// failed.
+  void poll();
+
+  /// Writes out what is left once every item has been appended. Returns
+  /// true when the snapshot is in place, or false if it should be called
+  /// again later.
+  bool finish();
+
+private:
+  void queue_buf();
+
+  friend class Store;
+};
+
+inline const std::string&
+Snapshot::path() const
+{
+  return _path;
+}
+
+/// Loads the items in the snapshot at `path` into `store`, skipping the ones
+/// that have expired and the ones whose key hash `owns` rejects. The
+/// snapshot must have been taken of the same partition. Returns the number
+/// of items loaded, which is zero if there is no snapshot.
+size_t
+load_snapshot(const std::string& path,
+              Store& store,
+              uint32_t partition,
+              uint32_t nr_partitions,
+              const std::function<bool(uint32_t hash)>& owns);
+
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef> /* for size_t */
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace rainbow {
+
+/// Bounded single-producer/single-consumer queue for passing work between
+/// two partitions without locks.
+///
+/// The producer and the consumer each own one index, so the only shared
+/// state is a pair of counters that are kept on separate cache lines.
+template<typename T>
+class SpscRing
+{
+  std::vector<T> _slots;
+  size_t _mask;
+  alignas(64) std::atomic<size_t> _head{0};
+  alignas(64) std::atomic<size_t> _tail{0};
+
+public:
+  explicit SpscRing(size_t capacity);
+
+  /// Called by the producer. Returns false, and leaves `value` alone, if the
+  /// ring is full.
+  bool try_push(T&& value);
+
+  /// Called by the consumer. Returns false if the ring is empty.
+  bool try_pop(T& value);
+
+  bool empty() const;
+};
+
+template<typename T>
+inline SpscRing<T>::SpscRing(size_t capacity)
+  : _slots(capacity)
+  , _mask{capacity - 1}
+{
+  if (capacity == 0 || (capacity & _mask) != 0) {
+    throw std::invalid_argument("ring capacity must be a power of two");
+  }
+}
+
+template<typename T>
+inline bool
+SpscRing<T>::try_push(T&& value)
+{
+  auto tail = _tail.load(std::memory_order_relaxed);
+  if (tail - _head.load(std::memory_order_acquire) == _slots.size()) {
+    return false;
+  }
+  _slots[tail & _mask] = std::move(value);
+  _tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+template<typename T>
+inline bool
+SpscRing<T>::try_pop(T& value)
+{
+  auto head = _head.load(std::memory_order_relaxed);
+  if (head == _tail.load(std::memory_order_acquire)) {
+    return false;
+  }
+  value = std::move(_slots[head & _mask]);
+  _head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+template<typename T>
+inline bool
+SpscRing<T>::empty() const
+{
+  return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+}
+
+}
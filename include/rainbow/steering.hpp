@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef> /* for size_t */
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace rainbow {
+
+/// Userspace view of the XDP bucket-to-partition indirection table.
+///
+/// The table keeps a shadow copy of the BPF array map so that lookups do not
+/// need a system call, and writes every change through to the map.
+class SteeringTable
+{
+  int _map_fd;
+  std::vector<uint32_t> _buckets;
+  unsigned int _nr_partitions = 0;
+
+public:
+  explicit SteeringTable(int map_fd);
+
+  /// Spread all buckets evenly over `nr_partitions` partitions.
+  void fill(unsigned int nr_partitions);
+
+  /// Change the number of partitions, moving as few buckets as possible.
+  /// Returns the number of buckets that changed owner.
+  size_t resize(unsigned int nr_partitions);
+
+  /// Assign `bucket` to `partition`.
+  void assign(uint32_t bucket, uint32_t partition);
+
+  /// Writes the table to `path`, so that a restarted daemon can steer keys
+  /// to the partitions whose items it reattached to.
+  void save(const std::string& path) const;
+
+  /// Replaces the table with the one that save() wrote to `path`, if it is
+  /// for `nr_partitions` partitions. Returns false, and leaves the table
+  /// alone, otherwise.
+  bool load(const std::string& path, unsigned int nr_partitions);
+
+  uint32_t partition_of(uint32_t bucket) const;
+  unsigned int nr_partitions() const;
+};
+
+inline uint32_t
+SteeringTable::partition_of(uint32_t bucket) const
+{
+  return _buckets[bucket];
+}
+
+inline unsigned int
+SteeringTable::nr_partitions() const
+{
+  return _nr_partitions;
+}
+
+}
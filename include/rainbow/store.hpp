@@ -0,0 +1,632 @@
+#pragma once
+
+#include "rainbow/hash.hpp"
+#include "rainbow/offset_ptr.hpp"
+#include "rainbow/region.hpp"
+#include "rainbow/replication.hpp"
+#include "rainbow/slab.hpp"
+#include "rainbow/spsc_ring.hpp"
+
+#include <array>
+#include <cstddef> /* for size_t */
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace rainbow {
+
+class Extstore;
+class FrequencySketch;
+class LogAllocator;
+class Migration;
+class Snapshot;
+class Umem;
+
+/// A key-value pair stored in slab memory. The key and the value follow the
+/// header directly.
+///
+/// Items are linked with offset pointers, so that they can be kept in a
+/// region across restarts. The rest of the header is packed into 24 bytes,
+/// because with many small items it is a large part of item memory.
+struct Item
+{
+  /// Maximum key length allowed by the memcached protocol, which is what
+  /// `key_len` has room for.
+  static constexpr size_t max_key_len = 250;
+  /// Number of bits of `cas`. The CAS values that clients see have the
+  /// partition of the item in the bits above them.
+  static constexpr int cas_bits = 48;
+
+  OffsetPtr<Item> h_next;
+  OffsetPtr<Item> lru_prev;
+  OffsetPtr<Item> lru_next;
+  /// Version of the item, from a counter of its partition, which changes
+  /// whenever the item is stored. It takes years of stores for 48 bits to
+  /// run out.
+  uint64_t cas : cas_bits;
+  uint64_t key_len : 8;
+  uint64_t slab_class : 7;
+  /// In the window of new items of the admission filter, instead of in the
+  /// main LRU list of its class.
+  bool windowed : 1;
+  uint32_t flags;
+  uint32_t exptime;
+  uint32_t value_len : 24;
+  /// A read-only copy of a hot key owned by another partition. The CAS value
+  /// of the owner's item follows the value.
+  bool replica : 1;
+  /// The store has dropped the item, but replies that send the value
+  /// straight from it are still in flight.
+  bool zombie : 1;
+  /// Invalidated by a meta delete, but still served, marked as stale, until
+  /// it is stored again.
+  bool stale : 1;
+  /// A client has been told that it won the right to recache the item.
+  bool won : 1;
+  /// The value is on flash. The key is followed by where it is instead of
+  /// the value, but `value_len` is the length of the value.
+  bool external : 1;
+  /// A copy of an item on flash, read back to serve requests, whose
+  /// `h_next` points to the item in the index.
+  bool staged : 1;
+  /// The value is compressed, and `value_len` is its compressed length.
+  bool compressed : 1;
+  /// The item is a hole in a segment of the log allocator.
+  bool freed : 1;
+  uint32_t hash;
+
+  std::string_view key() const;
+  std::string_view value() const;
+  char* data();
+  /// Returns the length of the value uncompressed.
+  size_t plain_len() const;
+  /// Returns the value uncompressed, which is decompressed into `buf` if
+  /// need be, or nothing if it is corrupt.
+  std::optional<std::string_view> plain_value(std::string& buf) const;
+};
+
+static_assert(sizeof(Item) == 48, "Item header must stay packed");
+
+inline std::string_view
+Item::key() const
+{
+  return std::string_view{reinterpret_cast<const char*>(this + 1), key_len};
+}
+
+inline std::string_view
+Item::value() const
+{
+  return std::string_view{reinterpret_cast<const char*>(this + 1) + key_len, value_len};
+}
+
+inline char*
+Item::data()
+{
+  return reinterpret_cast<char*>(this + 1);
+}
+
+enum class SetMode
+{
+  Set,
+  Add,
+  Replace,
+};
+
+enum class SetResult
+{
+  Stored,
+  NotStored,
+  /// The item has changed since the client read its CAS value.
+  Exists,
+  /// The client gave a CAS value, but there is no item.
+  NotFound,
+  TooLarge,
+  OutOfMemory,
+};
+
+enum class RemoveResult
+{
+  Removed,
+  NotFound,
+  Exists,
+};
+
+struct StoreStats
+{
+  uint64_t nr_items = 0;
+  uint64_t get_hits = 0;
+  uint64_t get_misses = 0;
+  uint64_t evictions = 0;
+  uint64_t expired = 0;
+  /// Total length of the values that were stored compressed, before and
+  /// after compression.
+  uint64_t uncompressed_bytes = 0;
+  uint64_t compressed_bytes = 0;
+  /// Pages moved between size classes, and the items in them that were
+  /// moved to other pages of their class, or evicted.
+  uint64_t slabs_moved = 0;
+  uint64_t slab_reassign_rescues = 0;
+  uint64_t slab_reassign_evictions = 0;
+  /// Evictions where the admission filter moved the least recently used
+  /// new item into the main LRU list, because it was accessed more often
+  /// than the item evicted instead, or evicted it.
+  uint64_t window_admitted = 0;
+  uint64_t window_rejected = 0;
+};
+
+/// Returns the current time in seconds on the clock that item expiration
+/// times are kept in. The clock is shared by all partitions.
+uint32_t
+current_time();
+
+/// Converts a memcached expiration time, which is either relative or an
+/// absolute Unix time, to the store clock.
+uint32_t
+to_exptime(uint32_t exptime);
+
+/// Converts an expiration time on the store clock to an absolute Unix time,
+/// which stays meaningful across reboots. Zero stays zero.
+uint32_t
+to_unix_time(uint32_t exptime);
+
+/// The key-value store of one partition.
+///
+/// A store is owned by exactly one reactor thread and is not thread-safe.
+/// The only way for other threads to talk to it is through the migration
+/// inbox, which the owner drains in poll().
+class Store
+{
+  struct Lru
+  {
+    OffsetPtr<Item> head;
+    OffsetPtr<Item> tail;
+    size_t nr_items;
+  };
+
+  /// State that refers to items, and is kept with them in a region. All
+  /// zeros is the state of a new store.
+  struct State
+  {
+    size_t index_size;
+    /// While the index doubles to `index_size`, the number of chains at the
+    /// end of the lower half that have yet to be split into the upper half.
+    /// Their items are found in the lower half until they are.
+    size_t index_unsplit;
+    uint64_t next_cas;
+    /// Items with a smaller CAS value were stored before the last flush,
+    /// and are gone. A delayed flush takes effect at `flush_at`, on the
+    /// store clock, unless it is zero.
+    uint64_t flush_cas;
+    uint32_t flush_at;
+    StoreStats stats;
+    Lru lru[SlabAllocator::max_classes];
+    /// New items, which only make it into the main LRU list if the
+    /// admission filter finds them accessed more often than what they would
+    /// evict there.
+    Lru window[SlabAllocator::max_classes];
+  };
+
+  /// Keys up to this long are kept in the index, next to the slot of their
+  /// item.
+  static constexpr size_t inline_key_len = 16;
+
+  /// A chain of items in the index, in 8 bytes. The slot has a tag of the
+  /// hash of the first item, and where the index keeps its key if it is
+  /// short, so that most lookups tell a hit from a miss without touching an
+  /// item. All zeros is an empty chain.
+  struct Slot
+  {
+    /// The first item, in 8-byte units from the start of item memory, plus
+    /// one. Items are 8-byte aligned, so this covers 8 TiB.
+    uint64_t head : 40;
+    /// The top bits of the hash of the first item.
+    uint64_t tag : 15;
+    /// There are more items in the chain than the first one.
+    uint64_t chained : 1;
+    /// The length of the key of the first item, if it is inline.
+    uint64_t key_len : 5;
+    /// The entry of the key bucket of the slot that has the key of the first
+    /// item, plus one, or zero if the key is not inline.
+    uint64_t key : 3;
+  };
+
+  static_assert(sizeof(Slot) == 8, "Index slots must stay packed");
+
+  /// Number of slots that share a key bucket, which is a cache line of them,
+  /// and the number of keys the bucket has room for. At the load that the
+  /// index grows at, half to three quarters of the slots have an item, so
+  /// most first items still have their keys inline, at 8 bytes per slot
+  /// instead of 16. The others have their keys compared in the item.
+  static constexpr size_t slots_per_key_bucket = 8;
+  static constexpr size_t keys_per_bucket = 4;
+
+  /// The inline keys of `slots_per_key_bucket` slots.
+  struct KeyBucket
+  {
+    char keys[keys_per_bucket][inline_key_len];
+  };
+
+  /// A key owned by this partition that has read-only replicas elsewhere.
+  struct Replicated
+  {
+    uint32_t hash;
+    std::vector<uint32_t> partitions;
+    bool published = false;
+  };
+
+  std::unique_ptr<Region> _region;
+  std::unique_ptr<State> _owned_state;
+  State* _state;
+  SlabAllocator _slabs;
+  KeyHasher _hasher;
+  /// The index is an array of `_state->index_size` chains, which grows in
+  /// place, up to a capacity that is reserved up front. The key buckets of
+  /// the slots follow the capacity.
+  Slot* _index;
+  KeyBucket* _keys;
+  size_t _index_capacity;
+  SpscRing<std::shared_ptr<Migration>> _migration_inbox{16};
+  std::vector<std::shared_ptr<Migration>> _migrations_out;
+  std::vector<std::shared_ptr<Migration>> _migrations_in;
+  /// Set while a record from a migration is applied, so that it is not
+  /// mistaken for a write of the destination's own.
+  bool _applying_migration = false;
+  Replication* _replication = nullptr;
+  uint32_t _partition = 0;
+  SpscRing<std::unique_ptr<ReplicationCommand>> _replication_inbox{64};
+  /// Commands to replicate keys whose values are being read from flash,
+  /// which are tried again on every poll until they are in.
+  std::vector<std::unique_ptr<ReplicationCommand>> _replication_unread;
+  /// Read-only copies of hot keys owned by other partitions. They live in
+  /// slab memory, but are not in the index or on the LRU lists.
+  std::unordered_map<std::string, Item*> _replicas;
+  std::unordered_map<std::string, Replicated> _replicated;
+  std::unique_ptr<Snapshot> _snapshot;
+  std::unique_ptr<Extstore> _ext;
+  /// Values of at least this many bytes go straight to flash.
+  size_t _ext_item_size = 0;
+  /// Items on flash that are being read, with their CAS value when the read
+  /// started.
+  std::unordered_map<Item*, uint64_t> _ext_reads;
+  /// Copies of items on flash that have been read, by item, which are
+  /// dropped oldest first.
+  std::unordered_map<const Item*, std::unique_ptr<char[]>> _staged;
+  std::deque<const Item*> _staged_order;
+  size_t _staged_len = 0;
+  bool _deferred = false;
+  bool _values_ready = false;
+  bool _demoting = false;
+  /// Number of replies in flight that send the value straight from an
+  /// item, by item. The chunk is not reused until they have all completed.
+  std::unordered_map<const Item*, uint32_t> _holds;
+  std::unique_ptr<LogAllocator> _log;
+  /// The segment that the cleaner is emptying, as of when it was opened,
+  /// and the offset of the next item in it to look at.
+  std::optional<uint32_t> _cleaning;
+  uint64_t _cleaning_seq = 0;
+  uint32_t _clean_pos = 0;
+  /// Evictions and failed allocations by size class since `_window_start`,
+  /// which tell the slab mover what classes need more pages.
+  std::array<uint64_t, SlabAllocator::max_classes> _pressure{};
+  uint32_t _window_start = 0;
+  /// The class that had the most pressure in the last windows, and for how
+  /// many windows in a row.
+  int _receiver = -1;
+  int _streak = 0;
+  /// The class that the page being moved goes to, and the next chunk of it
+  /// to look at.
+  int _move_to = -1;
+  size_t _move_pos = 0;
+  std::unique_ptr<FrequencySketch> _sketch;
+  /// The last flush of all partitions that the store has picked up, and
+  /// the next index slot to reclaim the items of a flush from.
+  uint32_t _flush_seen = 0;
+  std::optional<size_t> _sweep;
+  /// Values of at least this many bytes are compressed, unless it is zero.
+  size_t _compress_threshold = 0;
+  std::string _compress_buf;
+
+public:
+  /// Creates a store with `mem_limit` bytes of item memory, which is placed
+  /// on NUMA node `numa_node` if a topology is given, and backed by huge
+  /// pages if `hugepages` is set.
+  Store(size_t mem_limit,
+        KeyHasher hasher,
+        const Topology* topology = nullptr,
+        int numa_node = -1,
+        bool hugepages = false);
+  /// Creates a store whose item memory is the item area of `umem`, so that
+  /// replies can send values straight from it.
+  Store(Umem& umem, KeyHasher hasher);
+  /// Creates a store whose state, index, and item memory are in `region`,
+  /// which must have the layout that region_layout() returns. If the region
+  /// was reattached, the store has the items of the previous daemon.
+  Store(std::unique_ptr<Region> region, KeyHasher hasher);
+  /// Closes the region of the store cleanly, if it has one.
+  ~Store();
+  Store(const Store&) = delete;
+  Store& operator=(const Store&) = delete;
+
+  /// Returns the layout of a region for a store with `mem_limit` bytes of
+  /// item memory.
+  static Region::Layout region_layout(size_t mem_limit, KeyHasher hasher);
+
+  const KeyHasher& hasher() const;
+  const StoreStats& stats() const;
+  /// Returns true if the store has the items that a previous daemon left in
+  /// its region.
+  bool reattached() const;
+
+  /// Looks up `key`. The returned item is valid until the store is modified.
+  const Item* get(std::string_view key);
+  /// Like get(), but does not count towards statistics or the LRU order.
+  const Item* peek(std::string_view key);
+  /// Stores `value` under `key`. If `cas` is not zero, the store only
+  /// replaces an item whose CAS value is `cas`. If `compressed` is set,
+  /// `value` is a compressed value, which is stored as is.
+  SetResult set(std::string_view key,
+                std::string_view value,
+                uint32_t flags,
+                uint32_t exptime,
+                SetMode mode = SetMode::Set,
+                uint64_t cas = 0,
+                bool compressed = false);
+  bool remove(std::string_view key);
+  /// Removes `key`, if its CAS value is `cas` or `cas` is zero.
+  RemoveResult remove(std::string_view key, uint64_t cas);
+  /// Marks `key` as stale instead of removing it, if its CAS value is `cas`
+  /// or `cas` is zero, and gives it a new expiration time if one is given.
+  RemoveResult invalidate(std::string_view key, uint64_t cas, std::optional<uint32_t> exptime);
+  /// Flushes the items of all partitions, once `exptime`, a memcached
+  /// expiration time, has passed, or right away if it is zero. Partitions
+  /// only drop the items they have when the flush takes effect, and
+  /// reclaim their memory in the background. Replaces a flush that has not
+  /// taken effect yet.
+  void flush(uint32_t exptime);
+  /// Gives `item` a new expiration time.
+  void touch(const Item* item, uint32_t exptime);
+  /// Records that a client was told to recache `item`, so that no other
+  /// client is told the same until the item is stored again.
+  void claim(const Item* item);
+
+  /// Keeps the memory of `item` alive, even if it is removed or replaced,
+  /// until a matching release(). Used for replies that send the value
+  /// without copying it.
+  void hold(const Item* item);
+  void release(const Item* item);
+
+  /// Hands a migration over to the store. Called by the migration
+  /// controller thread, which must be the only thread that does so.
+  bool submit_migration(std::shared_ptr<Migration> migration);
+
+  /// Makes the store partition `partition`, which must be called before
+  /// anything is stored.
+  void set_partition(uint32_t partition);
+  uint32_t partition() const;
+
+  /// Returns the CAS value of `item` as clients see it, which is unique
+  /// across partitions without them sharing a counter.
+  uint64_t cas_of(const Item* item) const;
+  /// Returns the CAS value of the item that was stored last.
+  uint64_t last_cas() const;
+
+  /// Connects the store to hot key replication.
+  void attach_replication(Replication* replication);
+
+  /// Asks the store to start or stop replicating a key it owns. Called by
+  /// the replication controller thread, which must be the only thread that
+  /// does so. Returns false, and leaves `command` alone, if the inbox is full.
+  bool submit_replication(std::unique_ptr<ReplicationCommand>&& command);
+
+  /// Starts writing `snapshot` of the items in the store, which poll() does a
+  /// slice at a time. Returns false if a snapshot is already in progress.
+  bool start_snapshot(std::unique_ptr<Snapshot> snapshot);
+  bool snapshotting() const;
+
+  /// Gives the store a flash tier, which takes values of at least
+  /// `item_size` bytes, and the values of items that would otherwise be
+  /// evicted.
+  void attach_extstore(std::unique_ptr<Extstore> ext, size_t item_size);
+  const Extstore* extstore() const;
+
+  const SlabAllocator& slabs() const;
+
+  /// Makes the store append items to segments of a log, which a cleaner
+  /// compacts, instead of keeping them in chunks of size classes. Must be
+  /// called before anything is stored.
+  void use_log_allocator();
+  const LogAllocator* log_allocator() const;
+
+  /// Makes the store keep new items in a small window, and only move them
+  /// into the main LRU lists, when memory is full, if they are accessed
+  /// more often than the items they would evict there, so that keys that
+  /// are used once do not push out the ones that are used all the time.
+  void use_admission_filter();
+  bool filters_admission() const;
+
+  /// Makes the store compress values of at least `threshold` bytes with
+  /// LZ4, if that makes them smaller. Zero turns compression off.
+  void compress_values(size_t threshold);
+
+  /// Returns true if a lookup since clear_deferred() found an item whose
+  /// value is still being read from flash. The request that did the lookup
+  /// should be processed again once values_ready() returns true, instead of
+  /// being answered.
+  bool deferred() const;
+  void clear_deferred();
+  /// Returns true, once, when poll() has read values from flash that
+  /// deferred requests may be waiting for.
+  bool values_ready();
+
+  /// Runs background work, such as migrations, for a bounded amount of time.
+  /// Called by the owner between packet batches.
+  void poll();
+
+private:
+  static size_t index_len(size_t capacity);
+  void init_state();
+  Item* find(std::string_view key, uint32_t hash);
+  bool is_dead(const Item* item, uint32_t now) const;
+  void poll_flush();
+  void sweep();
+  size_t slot_index(uint32_t hash) const;
+  Slot& slot_for(uint32_t hash);
+  Item* head_of(const Slot& slot) const;
+  void set_head(size_t i, Item* item);
+  void replace_in_chain(size_t i, Item* item, Item* next);
+  void refresh_slot(size_t i);
+  SetResult store(std::string_view key,
+                  uint32_t hash,
+                  std::string_view value,
+                  uint32_t flags,
+                  uint32_t exptime,
+                  SetMode mode,
+                  uint64_t cas = 0,
+                  bool compressed = false);
+  bool erase(std::string_view key, uint32_t hash);
+  Item* alloc_item(int cls, size_t len);
+  void free_item(Item* item);
+  void free_memory(Item* item);
+  void evict(Item* item);
+  bool evict_segment();
+  void clean_log();
+  bool relocate(Item* item);
+  void move_slabs();
+  void pick_slab_move();
+  void unlink(Item* item);
+  void link(Item* item);
+  void lru_bump(Item* item);
+  Lru& lru_of(const Item* item);
+  void lru_insert(Lru& lru, Item* item);
+  void lru_remove(Lru& lru, Item* item);
+  Item* eviction_victim(int cls);
+  void maybe_grow_index();
+  void grow_index();
+  void poll_migrations();
+  size_t stream_bucket(Migration& migration, size_t budget);
+  bool send_unread(Migration& migration);
+  size_t drop_bucket(uint32_t bucket, size_t& cursor, size_t& index_size, size_t budget);
+  void forward(uint32_t hash, std::string_view key, Item* item);
+  void shadow_migrations(uint32_t hash, std::string_view key);
+  Item* find_replica(std::string_view key);
+  void poll_replication();
+  bool replicate(const std::string& key, const std::vector<uint32_t>& partitions);
+  void invalidate_replicas(std::string_view key);
+  void fill_replica(const std::string& key, std::string_view value, uint32_t flags, uint32_t exptime, uint64_t cas);
+  void drop_replica(const std::string& key);
+  void poll_snapshot();
+  Item* store_external(std::string_view key, uint32_t hash, std::string_view value);
+  bool demote(Item* victim);
+  const Item* stage(Item* stub, bool& pending);
+  const Item* stage_copy(Item* stub, const Item* image);
+  void drop_staged(const Item* stub);
+  void complete_read(Item* stub, uint64_t cas, const Item* image);
+  std::optional<std::string> value_of(Item* item, bool& pending);
+
+  friend class Migration;
+};
+
+inline const KeyHasher&
+Store::hasher() const
+{
+  return _hasher;
+}
+
+inline uint32_t
+Store::partition() const
+{
+  return _partition;
+}
+
+inline uint64_t
+Store::cas_of(const Item* item) const
+{
+  if (item->replica) {
+    uint64_t cas;
+    std::memcpy(&cas, reinterpret_cast<const char*>(item + 1) + item->key_len + item->value_len, sizeof(cas));
+    return cas;
+  }
+  return uint64_t{_partition} << Item::cas_bits | item->cas;
+}
+
+inline uint64_t
+Store::last_cas() const
+{
+  return uint64_t{_partition} << Item::cas_bits | (_state->next_cas - 1);
+}
+
+inline const StoreStats&
+Store::stats() const
+{
+  return _state->stats;
+}
+
+inline bool
+Store::reattached() const
+{
+  return _region && _region->reattached();
+}
+
+inline bool
+Store::snapshotting() const
+{
+  return _snapshot != nullptr;
+}
+
+inline const Extstore*
+Store::extstore() const
+{
+  return _ext.get();
+}
+
+inline const SlabAllocator&
+Store::slabs() const
+{
+  return _slabs;
+}
+
+inline const LogAllocator*
+Store::log_allocator() const
+{
+  return _log.get();
+}
+
+inline bool
+Store::filters_admission() const
+{
+  return _sketch != nullptr;
+}
+
+inline void
+Store::compress_values(size_t threshold)
+{
+  _compress_threshold = threshold;
+}
+
+inline bool
+Store::deferred() const
+{
+  return _deferred;
+}
+
+inline void
+Store::clear_deferred()
+{
+  _deferred = false;
+}
+
+inline bool
+Store::values_ready()
+{
+  bool ready = _values_ready;
+  _values_ready = false;
+  return ready;
+}
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "expected.hpp"
+#include "rainbow/error.hpp"
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace rainbow {
+
+/// Consumes complete requests from the front of `input` and appends their
+/// responses to `output`. Returns the number of bytes consumed, which is
+/// zero if `input` does not hold a complete request yet.
+using OnStreamFn = std::function<tl::expected<size_t, Error>(std::string_view input, std::string& output)>;
+
+/// Serves the TCP connections of one partition.
+///
+/// Like a reactor, a server is polled by the partition thread with
+/// run_once() and never blocks.
+class TcpServer
+{
+  struct Connection
+  {
+    std::string input;
+    std::string output;
+    size_t output_pos = 0;
+    bool want_write = false;
+  };
+
+  int _listen_fd;
+  int _epoll_fd = -1;
+  OnStreamFn _fn;
+  std::unordered_map<int, Connection> _connections;
+
+public:
+  /// Takes ownership of the listening socket `listen_fd`.
+  explicit TcpServer(int listen_fd);
+  ~TcpServer();
+  TcpServer(const TcpServer&) = delete;
+  TcpServer& operator=(const TcpServer&) = delete;
+
+  void on_stream(OnStreamFn&& fn);
+  void setup();
+  void run_once();
+  /// Processes the input that was left waiting for values on flash again.
+  void resume();
+
+private:
+  void accept_connections();
+  void receive(int fd, Connection& conn);
+  void process(int fd, Connection& conn);
+  void transmit(int fd, Connection& conn);
+  void close_connection(int fd);
+};
+
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef> /* for size_t */
+#include <cstdint>
+
+namespace rainbow {
+
+class Topology;
+
+/// Memory that AF_XDP sockets register as their UMEM.
+///
+/// The front of the region is split into one packet frame area per reactor.
+/// The rest, if any, holds the item memory of a store. Because every
+/// reactor registers the whole region, a reply can point the NIC at the
+/// bytes of an item instead of copying them into a frame.
+class Umem
+{
+  char* _mem = nullptr;
+  size_t _len = 0;
+  unsigned int _nr_frame_areas;
+  size_t _item_len;
+
+public:
+  static constexpr size_t frame_size = 2048;
+  static constexpr size_t nr_frames = 131072;
+  static constexpr size_t frame_area_len = frame_size * nr_frames;
+
+  /// Allocates `nr_frame_areas` frame areas followed by `item_len` bytes of
+  /// item memory, rounded down to a whole number of frames. The region is
+  /// placed on NUMA node `numa_node` if a topology is given, and backed by
+  /// transparent huge pages if `hugepages` is set.
+  Umem(unsigned int nr_frame_areas,
+       size_t item_len,
+       const Topology* topology = nullptr,
+       int numa_node = -1,
+       bool hugepages = false);
+  ~Umem();
+  Umem(const Umem&) = delete;
+  Umem& operator=(const Umem&) = delete;
+
+  char* data() const;
+  size_t len() const;
+  unsigned int nr_frame_areas() const;
+
+  /// Returns the UMEM address, which is the offset into the region, of the
+  /// first frame of area `area`.
+  uint64_t frame_area(unsigned int area) const;
+
+  char* items() const;
+  size_t item_len() const;
+
+  /// Returns true if [ptr, ptr + len) is inside the region.
+  bool contains(const void* ptr, size_t len) const;
+};
+
+inline char*
+Umem::data() const
+{
+  return _mem;
+}
+
+inline size_t
+Umem::len() const
+{
+  return _len;
+}
+
+inline unsigned int
+Umem::nr_frame_areas() const
+{
+  return _nr_frame_areas;
+}
+
+inline uint64_t
+Umem::frame_area(unsigned int area) const
+{
+  return uint64_t(area) * frame_area_len;
+}
+
+inline char*
+Umem::items() const
+{
+  return _mem + _nr_frame_areas * frame_area_len;
+}
+
+inline size_t
+Umem::item_len() const
+{
+  return _item_len;
+}
+
+inline bool
+Umem::contains(const void* ptr, size_t len) const
+{
+  auto* p = reinterpret_cast<const char*>(ptr);
+  return p >= _mem && len <= _len && size_t(p - _mem) <= _len - len;
+}
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "rainbow/io_ring.hpp"
+#include "rainbow/reactor.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace rainbow {
+
+/// Serves a UDP socket with io_uring, for machines where AF_XDP is not
+/// available.
+///
+/// A single multishot recvmsg request receives datagrams into a ring of
+/// provided buffers, and the replies of every datagram received in one
+/// run_once() go out as one batch of sendmsg requests, so the reactor makes
+/// one system call per iteration regardless of load.
+///
+/// The packet handler sees the UDP payload instead of an Ethernet frame,
+/// and its reply is the UDP payload to send back to the sender.
+class UringReactor
+{
+  /// A reply in flight, which the kernel reads until its sendmsg completes.
+  struct SendSlot
+  {
+    ::msghdr msg;
+    ::iovec iov[2];
+    ::sockaddr_storage addr;
+    const void* payload_owner;
+    char data[Umem::frame_size];
+  };
+
+  /// A copy of a datagram whose request is waiting for a value on flash.
+  struct Parked
+  {
+    std::vector<char> data;
+    ::sockaddr_storage addr;
+    size_t namelen;
+    Progress progress;
+  };
+
+  int _sockfd;
+  std::unique_ptr<IoRing> _ring;
+  ::io_uring_buf_ring* _buf_ring = nullptr;
+  size_t _buf_ring_len = 0;
+  char* _bufs = nullptr;
+  uint16_t _buf_tail = 0;
+  ::msghdr _recv_msg = {};
+  bool _recv_armed = false;
+  std::unique_ptr<SendSlot[]> _send_slots;
+  std::vector<uint32_t> _free_send_slots;
+  std::vector<Parked> _parked;
+  OnPacketFn _fn;
+  OnTxCompleteFn _tx_complete_fn;
+
+public:
+  /// Number of receive buffers, which bounds the datagrams in flight.
+  static constexpr unsigned int nr_recv_bufs = 1024;
+  /// Number of replies in flight.
+  static constexpr unsigned int nr_send_slots = 1024;
+  /// Maximum length of a reply payload sent from outside the reply buffer.
+  static constexpr size_t max_payload_len = 65507 - Umem::frame_size;
+  /// Maximum number of datagrams waiting for values on flash. More are
+  /// dropped, and left for the clients to retry.
+  static constexpr size_t max_parked = 1024;
+
+  /// Takes ownership of the bound UDP socket `sockfd`.
+  explicit UringReactor(int sockfd);
+  ~UringReactor();
+  UringReactor(const UringReactor&) = delete;
+  UringReactor& operator=(const UringReactor&) = delete;
+
+  void on_packet(OnPacketFn&& fn);
+  /// Called when the kernel is done sending the payload of a reply.
+  void on_tx_complete(OnTxCompleteFn&& fn);
+  void setup();
+  void run_once();
+  /// Processes the datagrams that were waiting for values on flash again.
+  void resume();
+
+private:
+  void arm_recv();
+  void recycle_buf(uint16_t bid);
+  void receive(const ::io_uring_cqe& cqe);
+  void process(const Packet& packet, const void* name, size_t namelen, Progress&& progress = {});
+  void complete_send(uint32_t slot, int res);
+};
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "rainbow/hash.hpp"
+
+#include <cstdint>
+#include <string>
+
+struct bpf_object;
+
+namespace rainbow {
+
+/// An XDP program attached to a network interface.
+///
+/// There is one program per interface, which the reactors of all the queues
+/// share: each reactor registers its AF_XDP socket in the program's
+/// `xsks_map`, under its queue id, or under rainbow_xsk_slot() if the program
+/// steers by key.
+class XdpProgram
+{
+  std::string _ifname;
+  unsigned int _ifindex = 0;
+  ::bpf_object* _obj = nullptr;
+
+public:
+  /// Loads the program in object file `path` and attaches it to `ifname`.
+  /// Programs that steer or filter requests are configured with the key hash
+  /// function and UDP port of the store before they see the first packet.
+  XdpProgram(const std::string& ifname, const std::string& path, KeyHash key_hash, uint16_t port);
+  ~XdpProgram();
+  XdpProgram(const XdpProgram&) = delete;
+  XdpProgram& operator=(const XdpProgram&) = delete;
+
+  const std::string& ifname() const;
+  unsigned int ifindex() const;
+
+  /// Returns the file descriptor of map `name`, or -1 if the program does not
+  /// have one.
+  int map_fd(const char* name) const;
+
+  /// Returns true if the program steers requests to the partition that owns
+  /// their key, through `bucket_map`, instead of to the one that serves the
+  /// queue they arrive on.
+  bool steers_by_key() const;
+};
+
+inline const std::string&
+XdpProgram::ifname() const
+{
+  return _ifname;
+}
+
+inline unsigned int
+XdpProgram::ifindex() const
+{
+  return _ifindex;
+}
+
+}
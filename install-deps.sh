@@ -5,9 +5,9 @@ set -e
 . /etc/os-release
 
 if [ "$ID" = "fedora" ]; then
-    sudo dnf -y install make clang llvm gcc-c++ elfutils-devel
+    sudo dnf -y install make clang llvm gcc-c++ elfutils-devel hwloc-devel lz4-devel
 elif [ "$ID" = "ubuntu" ]; then
-    sudo apt install --yes clang g++ linux-libc-dev libelf-dev
+    sudo apt install --yes clang g++ linux-libc-dev libelf-dev libhwloc-dev liblz4-dev
 else
     echo "Warning: '$ID' is not a supported OS."
 fi
@@ -0,0 +1,156 @@
+#include "rainbow/io_ring.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <system_error>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace rainbow {
+
+static int
+io_uring_setup(unsigned int entries, ::io_uring_params* params)
+{
+  return ::syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+  return ::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int
+io_uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+  return ::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void*
+map_ring(int fd, size_t len, off_t offset, const char* name)
+{
+  void* ptr = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  if (ptr == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(), std::string{"mmap("} + name + ")");
+  }
+  return ptr;
+}
+
+IoRing::IoRing(unsigned int sq_entries, unsigned int cq_entries)
+{
+  ::io_uring_params params{};
+  // Only the owner submits, and it reaps completions on every iteration, so
+  // the kernel can defer completion work until then instead of interrupting
+  // the thread.
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  params.cq_entries = cq_entries;
+  _fd = io_uring_setup(sq_entries, &params);
+  if (_fd < 0 && errno == EINVAL) {
+    params = {};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+    _fd = io_uring_setup(sq_entries, &params);
+  }
+  if (_fd < 0) {
+    throw std::system_error(errno, std::system_category(), "io_uring_setup");
+  }
+  try {
+    _sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cq_len = params.cq_off.cqes + params.cq_entries * sizeof(::io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      _sq_len = _cq_len = std::max(_sq_len, _cq_len);
+      _sq_ptr = _cq_ptr = map_ring(_fd, _sq_len, IORING_OFF_SQ_RING, "IORING_OFF_SQ_RING");
+    } else {
+      _sq_ptr = map_ring(_fd, _sq_len, IORING_OFF_SQ_RING, "IORING_OFF_SQ_RING");
+      _cq_ptr = map_ring(_fd, _cq_len, IORING_OFF_CQ_RING, "IORING_OFF_CQ_RING");
+    }
+    _sqes_len = params.sq_entries * sizeof(::io_uring_sqe);
+    _sqes = reinterpret_cast<::io_uring_sqe*>(map_ring(_fd, _sqes_len, IORING_OFF_SQES, "IORING_OFF_SQES"));
+  } catch (...) {
+    unmap();
+    throw;
+  }
+  auto* sq = reinterpret_cast<char*>(_sq_ptr);
+  _sq.head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  _sq.tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  _sq.mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  _sq.entries = params.sq_entries;
+  // Submission entries are used in ring order, so the indirection array
+  // never changes.
+  auto* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++) {
+    array[i] = i;
+  }
+  _sq_tail = *_sq.tail;
+  auto* cq = reinterpret_cast<char*>(_cq_ptr);
+  _cq.head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  _cq.tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  _cq.mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  _cq.entries = params.cq_entries;
+  _cqes = reinterpret_cast<::io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+IoRing::~IoRing()
+{
+  unmap();
+}
+
+void
+IoRing::unmap()
+{
+  if (_sqes) {
+    ::munmap(_sqes, _sqes_len);
+  }
+  if (_cq_ptr && _cq_ptr != _sq_ptr) {
+    ::munmap(_cq_ptr, _cq_len);
+  }
+  if (_sq_ptr) {
+    ::munmap(_sq_ptr, _sq_len);
+  }
+  if (_fd >= 0) {
+    ::close(_fd);
+  }
+}
+
+::io_uring_sqe*
+IoRing::get_sqe()
+{
+  if (_sq_tail - __atomic_load_n(_sq.head, __ATOMIC_ACQUIRE) >= _sq.entries) {
+    submit();
+    if (_sq_tail - __atomic_load_n(_sq.head, __ATOMIC_ACQUIRE) >= _sq.entries) {
+      return nullptr;
+    }
+  }
+  auto* sqe = &_sqes[_sq_tail & _sq.mask];
+  std::memset(sqe, 0, sizeof(*sqe));
+  _sq_tail++;
+  _sq_pending++;
+  return sqe;
+}
+
+void
+IoRing::submit(unsigned int min_complete)
+{
+  __atomic_store_n(_sq.tail, _sq_tail, __ATOMIC_RELEASE);
+  int ret = io_uring_enter(_fd, _sq_pending, min_complete, IORING_ENTER_GETEVENTS);
+  if (ret < 0) {
+    if (errno == EAGAIN || errno == EBUSY || errno == EINTR) {
+      return;
+    }
+    throw std::system_error(errno, std::system_category(), "io_uring_enter");
+  }
+  _sq_pending -= std::min(unsigned(ret), _sq_pending);
+}
+
+void
+IoRing::register_resource(unsigned int opcode, void* arg, unsigned int nr_args, const char* name)
+{
+  if (io_uring_register(_fd, opcode, arg, nr_args) < 0) {
+    throw std::system_error(errno, std::system_category(), std::string{"io_uring_register("} + name + ")");
+  }
+}
+
+}
@@ -0,0 +1,229 @@
+#include "rainbow/irq.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <system_error>
+
+namespace rainbow {
+
+namespace fs = std::filesystem;
+
+static std::string
+sysfs_net(const std::string& ifname)
+{
+  return "/sys/class/net/" + ifname;
+}
+
+static unsigned int
+nr_queues(const std::string& ifname, const std::string& prefix)
+{
+  unsigned int nr = 0;
+  std::error_code ec;
+  for (auto& entry : fs::directory_iterator{sysfs_net(ifname) + "/queues", ec}) {
+    if (entry.path().filename().string().rfind(prefix, 0) == 0) {
+      nr++;
+    }
+  }
+  return nr;
+}
+
+/// Returns the queue number that a driver encodes at the end of an IRQ name,
+/// for example 3 for "eth0-TxRx-3" or "mlx5_comp3@pci:0000:3b:00.0", or -1.
+static int
+queue_of_irq_name(std::string name)
+{
+  auto at = name.find('@');
+  if (at != std::string::npos) {
+    name.resize(at);
+  }
+  size_t end = name.size();
+  size_t start = end;
+  while (start > 0 && std::isdigit(static_cast<unsigned char>(name[start - 1]))) {
+    start--;
+  }
+  if (start == end) {
+    return -1;
+  }
+  return std::stoi(name.substr(start));
+}
+
+/// Maps the IRQs of the device behind `ifname` to the queues they serve.
+static std::map<unsigned int, std::vector<unsigned int>>
+queue_irqs(const std::string& ifname)
+{
+  std::vector<unsigned int> device_irqs;
+  std::error_code ec;
+  for (auto& entry : fs::directory_iterator{sysfs_net(ifname) + "/device/msi_irqs", ec}) {
+    device_irqs.push_back(std::stoul(entry.path().filename().string()));
+  }
+  std::map<unsigned int, std::vector<unsigned int>> irqs;
+  std::ifstream interrupts{"/proc/interrupts"};
+  std::string line;
+  while (std::getline(interrupts, line)) {
+    std::istringstream is{line};
+    unsigned int irq;
+    char colon;
+    if (!(is >> irq >> colon)) {
+      continue;
+    }
+    // Without MSI information, fall back to IRQs named after the interface.
+    bool ours = device_irqs.empty() ? line.find(ifname) != std::string::npos
+                                    : std::count(device_irqs.begin(), device_irqs.end(), irq) > 0;
+    if (!ours) {
+      continue;
+    }
+    // The action name is the last field on the line.
+    auto name = line.substr(line.find_last_of(" \t") + 1);
+    int queue = queue_of_irq_name(name);
+    if (queue >= 0) {
+      irqs[queue].push_back(irq);
+    }
+  }
+  return irqs;
+}
+
+IrqPlan
+plan_irq_affinity(const std::string& ifname, const std::vector<std::vector<unsigned int>>& partition_cpus)
+{
+  IrqPlan plan{ifname, {}};
+  auto irqs = queue_irqs(ifname);
+  unsigned int nr_rx_queues = nr_queues(ifname, "rx-");
+  for (unsigned int queue = 0; queue < nr_rx_queues; queue++) {
+    QueuePlan queue_plan{queue, queue, -1, irqs[queue]};
+    for (size_t partition = 0; partition < partition_cpus.size(); partition++) {
+      auto& cpus = partition_cpus[partition];
+      if (std::find(cpus.begin(), cpus.end(), queue) != cpus.end()) {
+        queue_plan.partition = partition;
+        break;
+      }
+    }
+    plan.queues.push_back(queue_plan);
+  }
+  return plan;
+}
+
+void
+print_irq_plan(std::ostream& os, const IrqPlan& plan)
+{
+  os << "IRQ plan for " << plan.ifname << ":" << std::endl;
+  for (auto& queue : plan.queues) {
+    os << "  queue " << queue.queue << ": cpu=" << queue.cpu << ", partition=";
+    if (queue.partition >= 0) {
+      os << queue.partition;
+    } else {
+      os << "none";
+    }
+    os << ", irqs=";
+    for (size_t i = 0; i < queue.irqs.size(); i++) {
+      os << (i ? "," : "") << queue.irqs[i];
+    }
+    if (queue.irqs.empty()) {
+      os << "none";
+    }
+    os << std::endl;
+  }
+}
+
+/// Formats a CPU mask the way sysfs does, as comma-separated 32-bit words in
+/// hexadecimal, most significant first.
+static std::string
+cpu_mask(unsigned int cpu)
+{
+  std::ostringstream os;
+  unsigned int nr_words = cpu / 32 + 1;
+  for (unsigned int word = nr_words; word > 0; word--) {
+    uint32_t bits = (word - 1 == cpu / 32) ? (1U << (cpu % 32)) : 0;
+    char buf[9];
+    std::snprintf(buf, sizeof(buf), "%08x", bits);
+    os << (word == nr_words ? "" : ",") << buf;
+  }
+  return os.str();
+}
+
+static bool
+read_line(const std::string& path, std::string& line)
+{
+  std::ifstream file{path};
+  return bool(std::getline(file, line));
+}
+
+static void
+write_line(const std::string& path, const std::string& value)
+{
+  std::ofstream file{path};
+  file << value << std::endl;
+  if (!file) {
+    throw std::system_error(errno, std::system_category(), "write(" + path + ")");
+  }
+}
+
+/// Compares two sysfs CPU masks, ignoring leading zero words.
+static bool
+same_mask(std::string a, std::string b)
+{
+  auto strip = [](std::string& mask) {
+    mask.erase(std::remove(mask.begin(), mask.end(), ','), mask.end());
+    mask.erase(0, std::min(mask.find_first_not_of('0'), mask.size()));
+  };
+  strip(a);
+  strip(b);
+  return a == b;
+}
+
+static std::string
+xps_path(const IrqPlan& plan, const QueuePlan& queue)
+{
+  return sysfs_net(plan.ifname) + "/queues/tx-" + std::to_string(queue.queue) + "/xps_cpus";
+}
+
+std::vector<std::string>
+verify_irq_plan(const IrqPlan& plan)
+{
+  std::vector<std::string> mismatches;
+  unsigned int nr_tx_queues = nr_queues(plan.ifname, "tx-");
+  for (auto& queue : plan.queues) {
+    for (auto irq : queue.irqs) {
+      std::string affinity;
+      if (!read_line("/proc/irq/" + std::to_string(irq) + "/smp_affinity_list", affinity)) {
+        mismatches.push_back("IRQ " + std::to_string(irq) + " of queue " + std::to_string(queue.queue) +
+                             " has no readable affinity");
+      } else if (affinity != std::to_string(queue.cpu)) {
+        mismatches.push_back("IRQ " + std::to_string(irq) + " of queue " + std::to_string(queue.queue) +
+                             " runs on CPUs " + affinity + ", expected " + std::to_string(queue.cpu));
+      }
+    }
+    // Not every device supports XPS, in which case the file is unreadable.
+    std::string xps;
+    if (queue.queue < nr_tx_queues && read_line(xps_path(plan, queue), xps)) {
+      if (!same_mask(xps, cpu_mask(queue.cpu))) {
+        mismatches.push_back("XPS of queue " + std::to_string(queue.queue) + " is " + xps + ", expected " +
+                             cpu_mask(queue.cpu));
+      }
+    }
+  }
+  return mismatches;
+}
+
+void
+apply_irq_plan(const IrqPlan& plan)
+{
+  unsigned int nr_tx_queues = nr_queues(plan.ifname, "tx-");
+  for (auto& queue : plan.queues) {
+    for (auto irq : queue.irqs) {
+      write_line("/proc/irq/" + std::to_string(irq) + "/smp_affinity_list", std::to_string(queue.cpu));
+    }
+    std::string xps;
+    if (queue.queue < nr_tx_queues && read_line(xps_path(plan, queue), xps)) {
+      write_line(xps_path(plan, queue), cpu_mask(queue.cpu));
+    }
+  }
+}
+
+}
@@ -0,0 +1,147 @@
+#ifndef RAINBOW_KEYHASH_H
+#define RAINBOW_KEYHASH_H
+
+/*
+ * Key hash functions shared by the XDP program and userspace.
+ *
+ * Both sides must agree bit for bit on the hash of a key, because the XDP
+ * stage steers a request to the partition that the userspace store expects
+ * to own the key. Everything here is therefore written once, in plain C that
+ * the BPF verifier accepts: loops are bounded by RAINBOW_MAX_KEY_LEN, and
+ * every load is a single byte checked against the end of the key. Userspace
+ * passes `key + len` as the end pointer and may substitute a faster, but
+ * equivalent, implementation (see hash.cpp).
+ *
+ * Keys are at most RAINBOW_MAX_KEY_LEN bytes in the memcached protocol, but
+ * the hash functions all take longer ones the same way: a longer key hashes
+ * like its first RAINBOW_MAX_KEY_LEN bytes.
+ */
+
+/* Only the 32-bit variant of MurmurHash3 is used. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "murmur3.h"
+#pragma GCC diagnostic pop
+
+#include <linux/types.h>
+
+/* Maximum key length allowed by the memcached protocol. */
+#define RAINBOW_MAX_KEY_LEN 250
+
+#define RAINBOW_KEY_HASH_SEED 1
+
+enum rainbow_key_hash {
+	RAINBOW_KEY_HASH_MURMUR3 = 0,
+	RAINBOW_KEY_HASH_CRC32C = 1,
+	RAINBOW_KEY_HASH_XXH32 = 2,
+};
+
+/* Castagnoli polynomial, bit-reflected. */
+#define RAINBOW_CRC32C_POLY 0x82f63b78
+
+static FORCE_INLINE __u32 rainbow_crc32c(const __u8 *key, __u32 len, const void *end, __u32 seed)
+{
+	__u32 crc = ~seed;
+	for (__u32 i = 0; i < RAINBOW_MAX_KEY_LEN; i++) {
+		if (i >= len || (const void *)(key + i + 1) > end)
+			break;
+		crc ^= key[i];
+		for (int k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (RAINBOW_CRC32C_POLY & -(crc & 1));
+	}
+	return ~crc;
+}
+
+#define RAINBOW_XXH32_PRIME1 0x9e3779b1U
+#define RAINBOW_XXH32_PRIME2 0x85ebca77U
+#define RAINBOW_XXH32_PRIME3 0xc2b2ae3dU
+#define RAINBOW_XXH32_PRIME4 0x27d4eb2fU
+#define RAINBOW_XXH32_PRIME5 0x165667b1U
+
+static FORCE_INLINE __u32 rainbow_xxh32_read32(const __u8 *p)
+{
+	return (__u32)p[0] | ((__u32)p[1] << 8) | ((__u32)p[2] << 16) | ((__u32)p[3] << 24);
+}
+
+static FORCE_INLINE __u32 rainbow_xxh32_round(__u32 acc, __u32 lane)
+{
+	acc += lane * RAINBOW_XXH32_PRIME2;
+	acc = rotl32(acc, 13);
+	return acc * RAINBOW_XXH32_PRIME1;
+}
+
+/*
+ * XXH32, as specified by the xxHash reference implementation. Lanes are
+ * assembled byte by byte so that the result is independent of host byte
+ * order and alignment.
+ */
+static FORCE_INLINE __u32 rainbow_xxh32(const __u8 *key, __u32 len, const void *end, __u32 seed)
+{
+	__u32 h;
+	__u32 i = 0;
+
+	if (len > RAINBOW_MAX_KEY_LEN)
+		len = RAINBOW_MAX_KEY_LEN;
+	if ((const void *)(key + len) > end)
+		return 0;
+	if (len >= 16) {
+		__u32 v1 = seed + RAINBOW_XXH32_PRIME1 + RAINBOW_XXH32_PRIME2;
+		__u32 v2 = seed + RAINBOW_XXH32_PRIME2;
+		__u32 v3 = seed;
+		__u32 v4 = seed - RAINBOW_XXH32_PRIME1;
+		for (int n = 0; n < RAINBOW_MAX_KEY_LEN / 16; n++) {
+			if (i + 16 > len)
+				break;
+			v1 = rainbow_xxh32_round(v1, rainbow_xxh32_read32(key + i));
+			v2 = rainbow_xxh32_round(v2, rainbow_xxh32_read32(key + i + 4));
+			v3 = rainbow_xxh32_round(v3, rainbow_xxh32_read32(key + i + 8));
+			v4 = rainbow_xxh32_round(v4, rainbow_xxh32_read32(key + i + 12));
+			i += 16;
+		}
+		h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+	} else {
+		h = seed + RAINBOW_XXH32_PRIME5;
+	}
+	h += len;
+	for (int n = 0; n < 4; n++) {
+		if (i + 4 > len)
+			break;
+		h += rainbow_xxh32_read32(key + i) * RAINBOW_XXH32_PRIME3;
+		h = rotl32(h, 17) * RAINBOW_XXH32_PRIME4;
+		i += 4;
+	}
+	for (int n = 0; n < 4; n++) {
+		if (i >= len)
+			break;
+		h += key[i] * RAINBOW_XXH32_PRIME5;
+		h = rotl32(h, 11) * RAINBOW_XXH32_PRIME1;
+		i++;
+	}
+	h ^= h >> 15;
+	h *= RAINBOW_XXH32_PRIME2;
+	h ^= h >> 13;
+	h *= RAINBOW_XXH32_PRIME3;
+	h ^= h >> 16;
+	return h;
+}
+
+static FORCE_INLINE __u32 rainbow_key_hash(__u32 fn, const void *key, __u32 len, const void *end)
+{
+	__u32 hash = 0;
+
+	if (len > RAINBOW_MAX_KEY_LEN)
+		len = RAINBOW_MAX_KEY_LEN;
+	switch (fn) {
+	case RAINBOW_KEY_HASH_CRC32C:
+		return rainbow_crc32c((const __u8 *)key, len, end, RAINBOW_KEY_HASH_SEED);
+	case RAINBOW_KEY_HASH_XXH32:
+		return rainbow_xxh32((const __u8 *)key, len, end, RAINBOW_KEY_HASH_SEED);
+	default:
+		if ((const void *)((const __u8 *)key + len) > end)
+			return 0;
+		MurmurHash3_x86_32(key, len, RAINBOW_KEY_HASH_SEED, (void *)&hash);
+		return hash;
+	}
+}
+
+#endif
@@ -0,0 +1,125 @@
+#include "rainbow/log_allocator.hpp"
+
+namespace rainbow {
+
+LogAllocator::LogAllocator(SlabAllocator& slabs)
+  : _slabs{slabs}
+  , _segments(slabs.nr_pages())
+{
+}
+
+void*
+LogAllocator::alloc(size_t len, bool relocation)
+{
+  len = aligned_len(len);
+  if (len > segment_size) {
+    return nullptr;
+  }
+  if ((!_head || _segments[*_head].used + len > segment_size) && !open_segment()) {
+    return nullptr;
+  }
+  auto& segment = _segments[*_head];
+  char* ptr = begin(*_head) + segment.used;
+  segment.used += len;
+  segment.live += len;
+  _live_bytes += len;
+  if (relocation) {
+    _stats.bytes_relocated += len;
+  } else {
+    _stats.bytes_written += len;
+  }
+  return ptr;
+}
+
+/// Makes a free segment, or a page that has not been taken yet, the one
+/// that items are appended to.
+bool
+LogAllocator::open_segment()
+{
+  uint32_t next;
+  if (!_free.empty()) {
+    next = _free.back();
+    _free.pop_back();
+  } else if (char* page = _slabs.alloc_page()) {
+    next = _slabs.page_of(page);
+  } else {
+    return false;
+  }
+  auto old = _head;
+  _head = next;
+  _segments[next].seq = _next_seq++;
+  _nr_in_use++;
+  // The old head was only kept because items were still being appended.
+  if (old && _segments[*old].live == 0) {
+    release(*old);
+  }
+  return true;
+}
+
+void
+LogAllocator::free(const void* ptr, size_t len)
+{
+  len = aligned_len(len);
+  uint32_t n = segment_of(ptr);
+  auto& segment = _segments[n];
+  segment.live -= len;
+  _live_bytes -= len;
+  if (segment.live == 0 && n != _head) {
+    release(n);
+  }
+}
+
+void
+LogAllocator::release(uint32_t segment)
+{
+  _segments[segment] = Segment{};
+  _free.push_back(segment);
+  _nr_in_use--;
+}
+
+size_t
+LogAllocator::nr_free() const
+{
+  return _free.size() + (_slabs.mem_limit() - _slabs.mem_used()) / segment_size;
+}
+
+std::optional<uint32_t>
+LogAllocator::emptiest() const
+{
+  std::optional<uint32_t> best;
+  for (uint32_t i = 0; i < _segments.size(); i++) {
+    if (_segments[i].seq == 0 || i == _head) {
+      continue;
+    }
+    if (!best || _segments[i].live < _segments[*best].live) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+std::optional<uint32_t>
+LogAllocator::oldest() const
+{
+  std::optional<uint32_t> best;
+  for (uint32_t i = 0; i < _segments.size(); i++) {
+    if (_segments[i].seq == 0 || i == _head) {
+      continue;
+    }
+    if (!best || _segments[i].seq < _segments[*best].seq) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+double
+LogAllocator::utilization() const
+{
+  if (_nr_in_use == 0) {
+    return 0;
+  }
+  return double(_live_bytes) / (_nr_in_use * segment_size);
+}
+
+}
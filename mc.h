@@ -1,6 +1,53 @@
 #ifndef RAINBOW_MC_H
 #define RAINBOW_MC_H
 
+#include <linux/types.h>
+
+/* Memcached binary protocol. All multi-byte fields are in network byte order. */
+
+#define MC_MAGIC_REQUEST	0x80
+#define MC_MAGIC_RESPONSE	0x81
+
+#define MC_OP_GET		0x00
+#define MC_OP_SET		0x01
+#define MC_OP_ADD		0x02
+#define MC_OP_REPLACE		0x03
+#define MC_OP_DELETE		0x04
+#define MC_OP_FLUSH		0x08
+#define MC_OP_GETQ		0x09
+#define MC_OP_NOOP		0x0a
+#define MC_OP_VERSION		0x0b
+#define MC_OP_GETK		0x0c
+#define MC_OP_GETKQ		0x0d
+#define MC_OP_STAT		0x10
+#define MC_OP_SETQ		0x11
+#define MC_OP_ADDQ		0x12
+#define MC_OP_REPLACEQ		0x13
+#define MC_OP_DELETEQ		0x14
+#define MC_OP_FLUSHQ		0x18
+
+/* Data types. A client that sets MC_DATA_TYPE_LZ4 in a GET gets the value as it is
+   stored if it is compressed, and one that sets it in a SET sends a compressed value,
+   which is the length of the value uncompressed, 32 bits, followed by an LZ4 block. */
+#define MC_DATA_TYPE_RAW	0x00
+#define MC_DATA_TYPE_LZ4	0x08
+
+#define MC_STATUS_OK			0x0000
+#define MC_STATUS_KEY_ENOENT		0x0001
+#define MC_STATUS_KEY_EEXISTS		0x0002
+#define MC_STATUS_E2BIG			0x0003
+#define MC_STATUS_EINVAL		0x0004
+#define MC_STATUS_NOT_STORED		0x0005
+#define MC_STATUS_UNKNOWN_COMMAND	0x0081
+#define MC_STATUS_ENOMEM		0x0082
+
+/*
+ * Memcached text protocol. A command line is a command name followed by
+ * space-separated arguments, the first of which is the key.
+ */
+
+#define MC_ASCII_MAX_COMMAND_LEN	8
+
 struct mchdr {
 	__u8 magic;
 	__u8 opcode;
@@ -0,0 +1,105 @@
+#include "rainbow/migration.hpp"
+
+#include "rainbow/steering.hpp"
+#include "rainbow/store.hpp"
+
+#include <stdexcept>
+#include <thread>
+
+namespace rainbow {
+
+Migration::Migration(uint32_t bucket, Store* src, Store* dst)
+  : _bucket{bucket}
+  , _src{src}
+  , _dst{dst}
+{
+}
+
+void
+Migration::send(std::unique_ptr<MigrationRecord> record)
+{
+  if (!_backlog.empty() || !_ring.try_push(std::move(record))) {
+    _backlog.push_back(std::move(record));
+  }
+}
+
+bool
+Migration::flush()
+{
+  while (!_backlog.empty()) {
+    if (!_ring.try_push(std::move(_backlog.front()))) {
+      return false;
+    }
+    _backlog.pop_front();
+  }
+  return true;
+}
+
+bool
+Migration::receive(std::unique_ptr<MigrationRecord>& record)
+{
+  return _ring.try_pop(record);
+}
+
+/// Waits for the partitions to move `migration` to `state`. Returns false if
+/// they have not done so by `deadline`.
+static bool
+wait_for(const Migration& migration, Migration::State state, std::chrono::steady_clock::time_point deadline)
+{
+  while (migration.state() != state) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds{100});
+  }
+  return true;
+}
+
+static bool
+submit(Store* store, const std::shared_ptr<Migration>& migration, std::chrono::steady_clock::time_point deadline)
+{
+  while (!store->submit_migration(migration)) {
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+bool
+migrate_bucket(SteeringTable& steering,
+               const std::vector<Store*>& stores,
+               uint32_t bucket,
+               uint32_t dst,
+               std::chrono::milliseconds grace,
+               std::chrono::milliseconds timeout)
+{
+  uint32_t src = steering.partition_of(bucket);
+  if (src >= stores.size() || dst >= stores.size()) {
+    throw std::out_of_range("partition out of range");
+  }
+  if (src == dst) {
+    return true;
+  }
+  auto migration = std::make_shared<Migration>(bucket, stores[src], stores[dst]);
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  if (!submit(stores[dst], migration, deadline)) {
+    return false;
+  }
+  if (!submit(stores[src], migration, deadline) || !wait_for(*migration, Migration::State::Streamed, deadline)) {
+    // The steering entry still points at the source, which keeps the bucket.
+    // The destination may set Streamed at any moment, but it never moves the
+    // migration on from Aborted.
+    migration->set_state(Migration::State::Aborted);
+    return false;
+  }
+  steering.assign(bucket, dst);
+  migration->set_state(Migration::State::Flipped);
+  std::this_thread::sleep_for(grace);
+  migration->set_state(Migration::State::Finished);
+  wait_for(*migration, Migration::State::Closed, std::chrono::steady_clock::now() + timeout);
+  return true;
+}
+
+}
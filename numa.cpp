@@ -0,0 +1,202 @@
+#include "rainbow/numa.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <hwloc.h>
+
+namespace rainbow {
+
+PartitionMode
+parse_partition_mode(const std::string& name)
+{
+  if (name == "machine") {
+    return PartitionMode::Machine;
+  } else if (name == "node") {
+    return PartitionMode::Node;
+  } else if (name == "core") {
+    return PartitionMode::Core;
+  }
+  throw std::invalid_argument("partition mode is not supported: " + name);
+}
+
+Topology::Topology()
+{
+  if (::hwloc_topology_init(&_topology) < 0) {
+    throw std::system_error(errno, std::system_category(), "hwloc_topology_init");
+  }
+  if (::hwloc_topology_load(_topology) < 0) {
+    ::hwloc_topology_destroy(_topology);
+    throw std::system_error(errno, std::system_category(), "hwloc_topology_load");
+  }
+}
+
+Topology::~Topology()
+{
+  ::hwloc_topology_destroy(_topology);
+}
+
+unsigned int
+Topology::nr_nodes() const
+{
+  int nr_nodes = ::hwloc_get_nbobjs_by_type(_topology, HWLOC_OBJ_NUMANODE);
+  return nr_nodes > 0 ? nr_nodes : 0;
+}
+
+int
+Topology::node_of_cpu(unsigned int cpu) const
+{
+  ::hwloc_obj_t pu = ::hwloc_get_pu_obj_by_os_index(_topology, cpu);
+  if (!pu) {
+    return -1;
+  }
+  ::hwloc_obj_t node = ::hwloc_get_next_obj_covering_cpuset_by_type(_topology, pu->cpuset, HWLOC_OBJ_NUMANODE, nullptr);
+  if (!node) {
+    return -1;
+  }
+  return node->os_index;
+}
+
+static ::hwloc_bitmap_t
+nodeset_of(int node)
+{
+  ::hwloc_bitmap_t nodeset = ::hwloc_bitmap_alloc();
+  ::hwloc_bitmap_only(nodeset, node);
+  return nodeset;
+}
+
+void
+Topology::bind_memory(void* addr, size_t len, int node) const
+{
+  ::hwloc_bitmap_t nodeset = nodeset_of(node);
+  int err = ::hwloc_set_area_membind(_topology, addr, len, nodeset, HWLOC_MEMBIND_BIND, HWLOC_MEMBIND_BYNODESET);
+  ::hwloc_bitmap_free(nodeset);
+  if (err < 0) {
+    throw std::system_error(errno, std::system_category(), "hwloc_set_area_membind");
+  }
+}
+
+void
+Topology::bind_thread(int node) const
+{
+  ::hwloc_obj_t obj = ::hwloc_get_numanode_obj_by_os_index(_topology, node);
+  if (!obj) {
+    throw std::invalid_argument("NUMA node does not exist: " + std::to_string(node));
+  }
+  if (::hwloc_set_cpubind(_topology, obj->cpuset, HWLOC_CPUBIND_THREAD) < 0) {
+    throw std::system_error(errno, std::system_category(), "hwloc_set_cpubind");
+  }
+  if (::hwloc_set_membind(_topology, obj->nodeset, HWLOC_MEMBIND_BIND, HWLOC_MEMBIND_THREAD | HWLOC_MEMBIND_BYNODESET) <
+      0) {
+    throw std::system_error(errno, std::system_category(), "hwloc_set_membind");
+  }
+}
+
+void
+Topology::bind_thread_to_cpus(const std::vector<unsigned int>& cpus) const
+{
+  ::hwloc_bitmap_t cpuset = ::hwloc_bitmap_alloc();
+  for (auto cpu : cpus) {
+    ::hwloc_bitmap_set(cpuset, cpu);
+  }
+  int err = ::hwloc_set_cpubind(_topology, cpuset, HWLOC_CPUBIND_THREAD);
+  ::hwloc_bitmap_free(cpuset);
+  if (err < 0) {
+    throw std::system_error(errno, std::system_category(), "hwloc_set_cpubind");
+  }
+}
+
+static std::vector<unsigned int>
+cpus_of(::hwloc_obj_t obj)
+{
+  std::vector<unsigned int> cpus;
+  unsigned int cpu;
+  hwloc_bitmap_foreach_begin(cpu, obj->cpuset)
+  {
+    cpus.push_back(cpu);
+  }
+  hwloc_bitmap_foreach_end();
+  return cpus;
+}
+
+std::vector<std::vector<unsigned int>>
+Topology::partition_cpus(PartitionMode mode) const
+{
+  ::hwloc_obj_type_t type = HWLOC_OBJ_MACHINE;
+  switch (mode) {
+    case PartitionMode::Machine:
+      type = HWLOC_OBJ_MACHINE;
+      break;
+    case PartitionMode::Node:
+      type = HWLOC_OBJ_NUMANODE;
+      break;
+    case PartitionMode::Core:
+      type = HWLOC_OBJ_PU;
+      break;
+  }
+  if (::hwloc_get_nbobjs_by_type(_topology, type) <= 0) {
+    std::cerr << "warning: No NUMA topology information found. Assuming a UMA system." << std::endl;
+    type = HWLOC_OBJ_MACHINE;
+  }
+  std::vector<std::vector<unsigned int>> partitions;
+  for (int i = 0; i < ::hwloc_get_nbobjs_by_type(_topology, type); i++) {
+    auto cpus = cpus_of(::hwloc_get_obj_by_type(_topology, type, i));
+    // Memory-only nodes have no cores to run a partition on.
+    if (!cpus.empty()) {
+      partitions.push_back(std::move(cpus));
+    }
+  }
+  return partitions;
+}
+
+int
+nic_numa_node(const std::string& ifname)
+{
+  std::ifstream file{"/sys/class/net/" + ifname + "/device/numa_node"};
+  int node = -1;
+  if (!(file >> node)) {
+    return -1;
+  }
+  return node;
+}
+
+std::vector<unsigned int>
+parse_range_list(const std::string& list)
+{
+  std::vector<unsigned int> values;
+  std::istringstream ranges{list};
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    unsigned int first, last;
+    char dash;
+    std::istringstream is{range};
+    if (!(is >> first)) {
+      throw std::invalid_argument("invalid range: '" + range + "'");
+    }
+    last = first;
+    if (is >> dash && (dash != '-' || !(is >> last) || last < first || is >> dash)) {
+      throw std::invalid_argument("invalid range: '" + range + "'");
+    }
+    for (unsigned int value = first; value <= last; value++) {
+      values.push_back(value);
+    }
+  }
+  return values;
+}
+
+std::vector<unsigned int>
+nic_local_cpus(const std::string& ifname)
+{
+  std::ifstream file{"/sys/class/net/" + ifname + "/device/local_cpulist"};
+  std::string list;
+  if (!std::getline(file, list)) {
+    return {};
+  }
+  return parse_range_list(list);
+}
+
+}
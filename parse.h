@@ -0,0 +1,125 @@
+#ifndef RAINBOW_PARSE_H
+#define RAINBOW_PARSE_H
+
+/*
+ * Packet header parsing shared by the XDP programs and userspace.
+ *
+ * The XDP stage and the userspace packet path must agree on where the UDP
+ * payload of a frame starts, so both walk the headers with this routine. It
+ * is written in C that both the BPF verifier and a C++ compiler accept: every
+ * header is checked against the end of the frame before it is read, and the
+ * VLAN loop is bounded.
+ */
+
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/types.h>
+#include <linux/udp.h>
+
+/* Outer and inner tag of a QinQ frame. */
+#define RAINBOW_MAX_VLAN_TAGS 2
+
+#define RAINBOW_IP_MF		0x2000
+#define RAINBOW_IP_OFFSET	0x1fff
+#define RAINBOW_IP6_OFFSET	0xfff8
+
+enum rainbow_parse_result {
+	/* A UDP datagram, or the first fragment of one. */
+	RAINBOW_PARSE_UDP = 0,
+	/* Anything else, which belongs to the kernel network stack. */
+	RAINBOW_PARSE_OTHER = 1,
+	/* A fragment without the UDP header, which nobody can steer or serve. */
+	RAINBOW_PARSE_DROP = 2,
+};
+
+struct rainbow_vlan_hdr {
+	__be16 tci;
+	__be16 proto;
+};
+
+struct rainbow_ipv6_frag_hdr {
+	__u8 nexthdr;
+	__u8 reserved;
+	__be16 frag_off;
+	__be32 identification;
+};
+
+/* Offsets are from the start of the frame. */
+struct rainbow_headers {
+	/* ETH_P_IP or ETH_P_IPV6, in host byte order. */
+	__u16 l3_proto;
+	/* Network header, after the Ethernet header and any VLAN tags. */
+	__u16 l3_offset;
+	/* UDP header, after any IPv4 options or IPv6 fragment header. */
+	__u16 l4_offset;
+	/* Transport protocol, which is IPPROTO_UDP for RAINBOW_PARSE_UDP. */
+	__u8 l4_proto;
+};
+
+static inline __u16 rainbow_ntohs(__be16 n)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return __builtin_bswap16(n);
+#else
+	return n;
+#endif
+}
+
+static inline int rainbow_parse_headers(const void *start, const void *end, struct rainbow_headers *hdrs)
+{
+	const __u8 *data = (const __u8 *)start;
+	const struct ethhdr *eth = (const struct ethhdr *)data;
+	if ((const void *)(eth + 1) > end)
+		return RAINBOW_PARSE_OTHER;
+	__u16 proto = rainbow_ntohs(eth->h_proto);
+	__u32 offset = sizeof(*eth);
+	for (int i = 0; i < RAINBOW_MAX_VLAN_TAGS; i++) {
+		if (proto != ETH_P_8021Q && proto != ETH_P_8021AD)
+			break;
+		const struct rainbow_vlan_hdr *vlan = (const struct rainbow_vlan_hdr *)(data + offset);
+		if ((const void *)(vlan + 1) > end)
+			return RAINBOW_PARSE_OTHER;
+		proto = rainbow_ntohs(vlan->proto);
+		offset += sizeof(*vlan);
+	}
+	hdrs->l3_proto = proto;
+	hdrs->l3_offset = offset;
+	if (proto == ETH_P_IP) {
+		const struct iphdr *iph = (const struct iphdr *)(data + offset);
+		if ((const void *)(iph + 1) > end)
+			return RAINBOW_PARSE_OTHER;
+		if (iph->ihl < 5)
+			return RAINBOW_PARSE_OTHER;
+		if (rainbow_ntohs(iph->frag_off) & RAINBOW_IP_OFFSET)
+			return RAINBOW_PARSE_DROP;
+		offset += iph->ihl * 4;
+		hdrs->l4_proto = iph->protocol;
+	} else if (proto == ETH_P_IPV6) {
+		const struct ipv6hdr *ip6h = (const struct ipv6hdr *)(data + offset);
+		if ((const void *)(ip6h + 1) > end)
+			return RAINBOW_PARSE_OTHER;
+		offset += sizeof(*ip6h);
+		hdrs->l4_proto = ip6h->nexthdr;
+		if (hdrs->l4_proto == IPPROTO_FRAGMENT) {
+			const struct rainbow_ipv6_frag_hdr *frag = (const struct rainbow_ipv6_frag_hdr *)(data + offset);
+			if ((const void *)(frag + 1) > end)
+				return RAINBOW_PARSE_OTHER;
+			if (rainbow_ntohs(frag->frag_off) & RAINBOW_IP6_OFFSET)
+				return RAINBOW_PARSE_DROP;
+			offset += sizeof(*frag);
+			hdrs->l4_proto = frag->nexthdr;
+		}
+	} else {
+		return RAINBOW_PARSE_OTHER;
+	}
+	hdrs->l4_offset = offset;
+	if (hdrs->l4_proto != IPPROTO_UDP)
+		return RAINBOW_PARSE_OTHER;
+	if ((const void *)(data + offset + sizeof(struct udphdr)) > end)
+		return RAINBOW_PARSE_OTHER;
+	return RAINBOW_PARSE_UDP;
+}
+
+#endif
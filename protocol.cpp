@@ -0,0 +1,442 @@
+#include "rainbow/protocol.hpp"
+
+#include "rainbow/compress.hpp"
+#include "rainbow/extstore.hpp"
+#include "rainbow/hotkeys.hpp"
+#include "rainbow/log_allocator.hpp"
+#include "rainbow/store.hpp"
+
+#include "mc.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace rainbow {
+
+static const std::string_view version = "0.0.0";
+
+/// Values smaller than this are cheaper to copy than to send from item
+/// memory in a descriptor of their own.
+static constexpr size_t zero_copy_threshold = 1024;
+
+/// Largest response to a single request on a stream, which is a GET of the
+/// largest item with its key.
+static constexpr size_t max_stream_response_len = SlabAllocator::page_size + 1024;
+
+/// Writes a response to `response`. The last `tail_len` bytes of the body
+/// are not written, because the caller sends them from elsewhere.
+/// `data_type` describes the value, and `cas` is the CAS value of the item,
+/// both of which apply to successful responses.
+static tl::expected<size_t, Error>
+write_response(char* response,
+               size_t capacity,
+               const mchdr& req,
+               uint16_t status,
+               std::string_view extras = {},
+               std::string_view key = {},
+               std::string_view value = {},
+               size_t tail_len = 0,
+               uint8_t data_type = MC_DATA_TYPE_RAW,
+               uint64_t cas = 0)
+{
+  size_t body_len = extras.size() + key.size() + value.size() + tail_len;
+  size_t len = sizeof(mchdr) + body_len - tail_len;
+  if (len > capacity) {
+    if (status == MC_STATUS_OK && tail_len == 0 && sizeof(mchdr) <= capacity) {
+      return write_response(response, capacity, req, MC_STATUS_E2BIG);
+    }
+    return tl::unexpected{"Response does not fit in " + std::to_string(capacity) + " bytes"};
+  }
+  auto* hdr = reinterpret_cast<mchdr*>(response);
+  hdr->magic = MC_MAGIC_RESPONSE;
+  hdr->opcode = req.opcode;
+  hdr->key_len = ::htons(key.size());
+  hdr->extras_len = extras.size();
+  hdr->data_type = data_type;
+  hdr->vbucket_id = ::htons(status);
+  hdr->body_len = ::htonl(body_len);
+  hdr->opaque = req.opaque;
+  hdr->cas = ::htobe64(cas);
+  char* body = response + sizeof(mchdr);
+  std::memcpy(body, extras.data(), extras.size());
+  std::memcpy(body + extras.size(), key.data(), key.size());
+  std::memcpy(body + extras.size() + key.size(), value.data(), value.size());
+  return len + tail_len;
+}
+
+static tl::expected<size_t, Error>
+process_get(Store& store,
+            const mchdr& req,
+            std::string_view key,
+            char* response,
+            size_t capacity,
+            ZeroCopyValue* zero_copy)
+{
+  bool quiet = req.opcode == MC_OP_GETQ || req.opcode == MC_OP_GETKQ;
+  bool with_key = req.opcode == MC_OP_GETK || req.opcode == MC_OP_GETKQ;
+  auto* item = store.get(key);
+  if (!item) {
+    if (quiet) {
+      return 0;
+    }
+    return write_response(response, capacity, req, MC_STATUS_KEY_ENOENT, {}, with_key ? key : std::string_view{});
+  }
+  uint32_t flags = ::htonl(item->flags);
+  std::string_view extras{reinterpret_cast<const char*>(&flags), sizeof(flags)};
+  auto value = item->value();
+  // Compressed values go out as they are to clients that can decompress
+  // them, and are decompressed for the others.
+  uint8_t data_type = MC_DATA_TYPE_RAW;
+  std::string buf;
+  bool decompressed = false;
+  if (item->compressed && (req.data_type & MC_DATA_TYPE_LZ4)) {
+    data_type = MC_DATA_TYPE_LZ4;
+  } else if (item->compressed) {
+    auto plain = item->plain_value(buf);
+    if (!plain) {
+      return write_response(response, capacity, req, MC_STATUS_KEY_ENOENT, {}, with_key ? key : std::string_view{});
+    }
+    value = *plain;
+    decompressed = true;
+  }
+  // A copy of an item on flash is not in item memory, and may be dropped
+  // before the reply is sent. Neither is a value that was decompressed.
+  if (zero_copy && !item->staged && !decompressed && value.size() >= zero_copy_threshold && value.size() <= zero_copy->max_len) {
+    auto len = write_response(response,
+                              capacity,
+                              req,
+                              MC_STATUS_OK,
+                              extras,
+                              with_key ? key : std::string_view{},
+                              {},
+                              value.size(),
+                              data_type,
+                              store.cas_of(item));
+    if (len) {
+      store.hold(item);
+      zero_copy->item = item;
+      zero_copy->value = value;
+    }
+    return len;
+  }
+  return write_response(response,
+                        capacity,
+                        req,
+                        MC_STATUS_OK,
+                        extras,
+                        with_key ? key : std::string_view{},
+                        value,
+                        0,
+                        data_type,
+                        store.cas_of(item));
+}
+
+static tl::expected<size_t, Error>
+process_set(Store& store,
+            const mchdr& req,
+            std::string_view extras,
+            std::string_view key,
+            std::string_view value,
+            char* response,
+            size_t capacity)
+{
+  if (extras.size() != 8) {
+    return write_response(response, capacity, req, MC_STATUS_EINVAL);
+  }
+  uint32_t flags, exptime;
+  std::memcpy(&flags, extras.data(), sizeof(flags));
+  std::memcpy(&exptime, extras.data() + sizeof(flags), sizeof(exptime));
+  SetMode mode = SetMode::Set;
+  bool quiet = false;
+  switch (req.opcode) {
+    case MC_OP_SETQ:
+      quiet = true;
+      break;
+    case MC_OP_ADD:
+    case MC_OP_ADDQ:
+      mode = SetMode::Add;
+      quiet = req.opcode == MC_OP_ADDQ;
+      break;
+    case MC_OP_REPLACE:
+    case MC_OP_REPLACEQ:
+      mode = SetMode::Replace;
+      quiet = req.opcode == MC_OP_REPLACEQ;
+      break;
+  }
+  bool compressed = req.data_type & MC_DATA_TYPE_LZ4;
+  if (compressed && !uncompressed_len(value)) {
+    return write_response(response, capacity, req, MC_STATUS_EINVAL);
+  }
+  // A CAS value makes the store compare and swap.
+  switch (store.set(key, value, ::ntohl(flags), ::ntohl(exptime), mode, ::be64toh(req.cas), compressed)) {
+    case SetResult::Stored:
+      if (quiet) {
+        return 0;
+      }
+      return write_response(response, capacity, req, MC_STATUS_OK, {}, {}, {}, 0, MC_DATA_TYPE_RAW, store.last_cas());
+    case SetResult::NotStored:
+      return write_response(
+        response, capacity, req, mode == SetMode::Add ? MC_STATUS_KEY_EEXISTS : MC_STATUS_KEY_ENOENT);
+    case SetResult::Exists:
+      return write_response(response, capacity, req, MC_STATUS_KEY_EEXISTS);
+    case SetResult::NotFound:
+      return write_response(response, capacity, req, MC_STATUS_KEY_ENOENT);
+    case SetResult::TooLarge:
+      return write_response(response, capacity, req, MC_STATUS_E2BIG);
+    case SetResult::OutOfMemory:
+      return write_response(response, capacity, req, MC_STATUS_ENOMEM);
+  }
+  return 0;
+}
+
+std::optional<std::vector<std::pair<std::string, std::string>>>
+collect_stats(Store& store, std::string_view group)
+{
+  std::vector<std::pair<std::string, std::string>> stats;
+  if (group.empty()) {
+    auto& store_stats = store.stats();
+    stats.emplace_back("curr_items", std::to_string(store_stats.nr_items));
+    stats.emplace_back("get_hits", std::to_string(store_stats.get_hits));
+    stats.emplace_back("get_misses", std::to_string(store_stats.get_misses));
+    stats.emplace_back("evictions", std::to_string(store_stats.evictions));
+    stats.emplace_back("reclaimed", std::to_string(store_stats.expired));
+    if (store_stats.compressed_bytes > 0) {
+      stats.emplace_back("compress_bytes_in", std::to_string(store_stats.uncompressed_bytes));
+      stats.emplace_back("compress_bytes_out", std::to_string(store_stats.compressed_bytes));
+      char ratio[32];
+      std::snprintf(ratio, sizeof(ratio), "%.2f", double(store_stats.uncompressed_bytes) / store_stats.compressed_bytes);
+      stats.emplace_back("compress_ratio", ratio);
+    }
+    if (auto* ext = store.extstore()) {
+      auto& ext_stats = ext->stats();
+      stats.emplace_back("extstore_objects_written", std::to_string(ext_stats.objects_written));
+      stats.emplace_back("extstore_bytes_written", std::to_string(ext_stats.bytes_written));
+      stats.emplace_back("extstore_objects_read", std::to_string(ext_stats.objects_read));
+      stats.emplace_back("extstore_bytes_read", std::to_string(ext_stats.bytes_read));
+      stats.emplace_back("extstore_segments_reclaimed", std::to_string(ext_stats.segments_reclaimed));
+      stats.emplace_back("extstore_misses", std::to_string(ext_stats.misses));
+    }
+    if (!store.log_allocator()) {
+      stats.emplace_back("slabs_moved", std::to_string(store_stats.slabs_moved));
+      stats.emplace_back("slab_reassign_rescues", std::to_string(store_stats.slab_reassign_rescues));
+      stats.emplace_back("slab_reassign_evictions", std::to_string(store_stats.slab_reassign_evictions));
+    }
+    if (store.filters_admission()) {
+      stats.emplace_back("window_admitted", std::to_string(store_stats.window_admitted));
+      stats.emplace_back("window_rejected", std::to_string(store_stats.window_rejected));
+    }
+    if (auto* log = store.log_allocator()) {
+      auto& log_stats = log->stats();
+      stats.emplace_back("log_bytes_written", std::to_string(log_stats.bytes_written));
+      stats.emplace_back("log_bytes_relocated", std::to_string(log_stats.bytes_relocated));
+      stats.emplace_back("log_segments_cleaned", std::to_string(log_stats.segments_cleaned));
+      stats.emplace_back("log_segments_evicted", std::to_string(log_stats.segments_evicted));
+      char buf[32];
+      double written = log_stats.bytes_written;
+      std::snprintf(buf, sizeof(buf), "%.2f", written ? (written + log_stats.bytes_relocated) / written : 1.0);
+      stats.emplace_back("log_write_amplification", buf);
+      std::snprintf(buf, sizeof(buf), "%.2f", log->utilization());
+      stats.emplace_back("log_utilization", buf);
+    }
+  } else if (group == "slabs") {
+    auto& slabs = store.slabs();
+    size_t active = 0;
+    for (size_t cls = 0; cls < slabs.nr_classes(); cls++) {
+      if (slabs.nr_pages(cls) == 0) {
+        continue;
+      }
+      auto prefix = std::to_string(cls) + ":";
+      stats.emplace_back(prefix + "chunk_size", std::to_string(slabs.chunk_size(cls)));
+      stats.emplace_back(prefix + "total_pages", std::to_string(slabs.nr_pages(cls)));
+      stats.emplace_back(prefix + "free_chunks", std::to_string(slabs.nr_free(cls)));
+      active++;
+    }
+    stats.emplace_back("active_slabs", std::to_string(active));
+    stats.emplace_back("total_malloced", std::to_string(slabs.mem_used()));
+  } else if (group == "hotkeys") {
+    auto keys = hot_keys();
+    for (size_t i = 0; i < keys->size(); i++) {
+      auto& hot_key = (*keys)[i];
+      stats.emplace_back("hotkey_" + std::to_string(i), hot_key.key + " " + std::to_string(hot_key.count));
+    }
+  } else {
+    return std::nullopt;
+  }
+  return stats;
+}
+
+/// Writes statistics as a sequence of responses, one per statistic, followed
+/// by an empty response that terminates the sequence.
+static tl::expected<size_t, Error>
+process_stat(Store& store, const mchdr& req, std::string_view group, char* response, size_t capacity)
+{
+  auto stats = collect_stats(store, group);
+  if (!stats) {
+    return write_response(response, capacity, req, MC_STATUS_KEY_ENOENT);
+  }
+  size_t len = 0;
+  for (auto& [name, value] : *stats) {
+    auto ret = write_response(response + len, capacity - len, req, MC_STATUS_OK, {}, name, value);
+    if (!ret) {
+      return ret;
+    }
+    len += *ret;
+  }
+  auto ret = write_response(response + len, capacity - len, req, MC_STATUS_OK);
+  if (!ret) {
+    return ret;
+  }
+  return len + *ret;
+}
+
+tl::expected<size_t, Error>
+process_binary_request(Store& store, const Packet& request, char* response, size_t capacity, ZeroCopyValue* zero_copy)
+{
+  if (request.len < sizeof(mchdr)) {
+    return tl::unexpected{"Request is too short. Expected at least " + std::to_string(sizeof(mchdr)) +
+                          ", but was: " + std::to_string(request.len)};
+  }
+  mchdr req;
+  std::memcpy(&req, request.data, sizeof(req));
+  if (req.magic != MC_MAGIC_REQUEST) {
+    return tl::unexpected{"Invalid request magic: " + std::to_string(req.magic)};
+  }
+  size_t key_len = ::ntohs(req.key_len);
+  size_t body_len = ::ntohl(req.body_len);
+  if (body_len > request.len - sizeof(mchdr) || req.extras_len + key_len > body_len) {
+    return tl::unexpected{std::string{"Request body is truncated"}};
+  }
+  const char* body = request.data + sizeof(mchdr);
+  std::string_view extras{body, req.extras_len};
+  std::string_view key{body + req.extras_len, key_len};
+  std::string_view value{body + req.extras_len + key_len, body_len - req.extras_len - key_len};
+  switch (req.opcode) {
+    case MC_OP_GET:
+    case MC_OP_GETQ:
+    case MC_OP_GETK:
+    case MC_OP_GETKQ:
+      return process_get(store, req, key, response, capacity, zero_copy);
+    case MC_OP_SET:
+    case MC_OP_SETQ:
+    case MC_OP_ADD:
+    case MC_OP_ADDQ:
+    case MC_OP_REPLACE:
+    case MC_OP_REPLACEQ:
+      return process_set(store, req, extras, key, value, response, capacity);
+    case MC_OP_DELETE:
+    case MC_OP_DELETEQ:
+      switch (store.remove(key, ::be64toh(req.cas))) {
+        case RemoveResult::Removed:
+          break;
+        case RemoveResult::NotFound:
+          return write_response(response, capacity, req, MC_STATUS_KEY_ENOENT);
+        case RemoveResult::Exists:
+          return write_response(response, capacity, req, MC_STATUS_KEY_EEXISTS);
+      }
+      if (req.opcode == MC_OP_DELETEQ) {
+        return 0;
+      }
+      return write_response(response, capacity, req, MC_STATUS_OK);
+    case MC_OP_FLUSH:
+    case MC_OP_FLUSHQ: {
+      // The extras are an optional expiration time.
+      uint32_t exptime = 0;
+      if (extras.size() == sizeof(exptime)) {
+        std::memcpy(&exptime, extras.data(), sizeof(exptime));
+      } else if (!extras.empty()) {
+        return write_response(response, capacity, req, MC_STATUS_EINVAL);
+      }
+      store.flush(::ntohl(exptime));
+      if (req.opcode == MC_OP_FLUSHQ) {
+        return 0;
+      }
+      return write_response(response, capacity, req, MC_STATUS_OK);
+    }
+    case MC_OP_STAT:
+      return process_stat(store, req, key, response, capacity);
+    case MC_OP_NOOP:
+      return write_response(response, capacity, req, MC_STATUS_OK);
+    case MC_OP_VERSION:
+      return write_response(response, capacity, req, MC_STATUS_OK, {}, {}, version);
+    default:
+      return write_response(response, capacity, req, MC_STATUS_UNKNOWN_COMMAND);
+  }
+}
+
+tl::expected<size_t, Error>
+process_binary_stream(Store& store, std::string_view input, std::string& output)
+{
+  static thread_local std::vector<char> response(max_stream_response_len);
+  store.clear_deferred();
+  size_t pos = 0;
+  while (input.size() - pos >= sizeof(mchdr)) {
+    mchdr req;
+    std::memcpy(&req, input.data() + pos, sizeof(req));
+    // Leave text protocol commands to the caller.
+    if (req.magic != MC_MAGIC_REQUEST) {
+      break;
+    }
+    size_t len = sizeof(mchdr) + ::ntohl(req.body_len);
+    if (input.size() - pos < len) {
+      break;
+    }
+    auto response_len =
+      process_binary_request(store, Packet{input.data() + pos, len}, response.data(), response.size());
+    if (!response_len) {
+      return tl::unexpected{response_len.error()};
+    }
+    // Leave the request for later, when its value is in from flash.
+    if (store.deferred()) {
+      break;
+    }
+    output.append(response.data(), *response_len);
+    pos += len;
+  }
+  return pos;
+}
+
+tl::expected<size_t, Error>
+process_request(Store& store,
+                const Packet& request,
+                char* response,
+                size_t capacity,
+                ZeroCopyValue* zero_copy,
+                Progress* progress)
+{
+  store.clear_deferred();
+  if (request.len > 0 && uint8_t(request.data[0]) == MC_MAGIC_REQUEST) {
+    return process_binary_request(store, request, response, capacity, zero_copy);
+  }
+  return process_ascii_request(store, request, response, capacity, progress);
+}
+
+tl::expected<size_t, Error>
+process_stream(Store& store, std::string_view input, std::string& output)
+{
+  size_t pos = 0;
+  while (pos < input.size()) {
+    // A client may switch protocols between requests.
+    tl::expected<size_t, Error> consumed;
+    if (uint8_t(input[pos]) == MC_MAGIC_REQUEST) {
+      consumed = process_binary_stream(store, input.substr(pos), output);
+    } else {
+      consumed = process_ascii_stream(store, input.substr(pos), output);
+    }
+    if (!consumed) {
+      return consumed;
+    }
+    pos += *consumed;
+    if (*consumed == 0 || store.deferred()) {
+      break;
+    }
+  }
+  return pos;
+}
+
+}
@@ -1,75 +1,261 @@
 #include <linux/bpf.h>
-#include <linux/if_ether.h>
-#include <linux/ip.h>
-#include <linux/in.h>
-#include <linux/udp.h>
 
-#include "murmur3.h"
+#include "bpf_helpers.h"
+#include "keyhash.h"
 #include "mc.h"
-
-#define MAX_CPUS 64
+#include "parse.h"
+#include "sketch.h"
+#include "steering.h"
 
 #define SEC(NAME) __attribute__((section(NAME), used))
 
-static int (*bpf_redirect_map)(void *map, int key, int flags) = (void *) BPF_FUNC_redirect_map;
+/* AF_XDP sockets, indexed by rainbow_xsk_slot(). */
+struct bpf_map_def SEC("maps") xsks_map = {
+	.type		= BPF_MAP_TYPE_XSKMAP,
+	.key_size	= sizeof(__u32),
+	.value_size	= sizeof(__u32),
+	.max_entries	= RAINBOW_MAX_QUEUES * RAINBOW_MAX_PARTITIONS,
+};
+
+/* Key hash function (enum rainbow_key_hash), set by userspace at load time. */
+struct bpf_map_def SEC("maps") key_hash_map = {
+	.type		= BPF_MAP_TYPE_ARRAY,
+	.key_size	= sizeof(__u32),
+	.value_size	= sizeof(__u32),
+	.max_entries	= 1,
+};
+
+/* UDP port of the store, in network byte order, set by userspace at load time. */
+struct bpf_map_def SEC("maps") port_map = {
+	.type		= BPF_MAP_TYPE_ARRAY,
+	.key_size	= sizeof(__u32),
+	.value_size	= sizeof(__u32),
+	.max_entries	= 1,
+};
 
-struct bpf_map_info SEC("maps") cpu_map = {
-	.type		= BPF_MAP_TYPE_CPUMAP,
+/* Bucket to partition indirection table, filled in by userspace. */
+struct bpf_map_def SEC("maps") bucket_map = {
+	.type		= BPF_MAP_TYPE_ARRAY,
 	.key_size	= sizeof(__u32),
 	.value_size	= sizeof(__u32),
-	.max_entries	= MAX_CPUS,
+	.max_entries	= RAINBOW_NR_BUCKETS,
+};
+
+/* Replicated hot keys, maintained by the owning partitions. */
+struct bpf_map_def SEC("maps") replica_map = {
+	.type		= BPF_MAP_TYPE_HASH,
+	.key_size	= sizeof(__u32),
+	.value_size	= sizeof(struct rainbow_replicas),
+	.max_entries	= RAINBOW_MAX_REPLICATED_KEYS,
+};
+
+/* Per-CPU count-min sketch of request keys, read and cleared by userspace. */
+struct bpf_map_def SEC("maps") sketch_map = {
+	.type		= BPF_MAP_TYPE_PERCPU_ARRAY,
+	.key_size	= sizeof(__u32),
+	.value_size	= sizeof(struct rainbow_sketch),
+	.max_entries	= 1,
+};
+
+/* Keys whose estimated count crossed RAINBOW_HOT_KEY_THRESHOLD. */
+struct bpf_map_def SEC("maps") hot_key_map = {
+	.type		= BPF_MAP_TYPE_PERCPU_ARRAY,
+	.key_size	= sizeof(__u32),
+	.value_size	= sizeof(struct rainbow_hot_key),
+	.max_entries	= RAINBOW_NR_HOT_KEY_SLOTS,
 };
 
-static __u16 htons(__u16 n)
+static void count_key(const __u8 *key, __u32 key_len, void *end, __u32 hash)
 {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-	return __builtin_bswap16(n);
-#else
-	return n;
-#endif
+	__u32 zero = 0;
+	struct rainbow_sketch *sketch = bpf_map_lookup_elem(&sketch_map, &zero);
+	if (!sketch) {
+		return;
+	}
+	/* The sketch is per-CPU, so there is no need for atomic increments. */
+	__u32 estimate = ~0U;
+#pragma unroll
+	for (int row = 0; row < RAINBOW_SKETCH_DEPTH; row++) {
+		__u32 *counter = &sketch->counters[row][rainbow_sketch_index(hash, row)];
+		*counter += 1;
+		if (*counter < estimate) {
+			estimate = *counter;
+		}
+	}
+	if (estimate < RAINBOW_HOT_KEY_THRESHOLD) {
+		return;
+	}
+	__u32 slot = rainbow_hot_key_slot(hash);
+	struct rainbow_hot_key *hot = bpf_map_lookup_elem(&hot_key_map, &slot);
+	if (!hot) {
+		return;
+	}
+	if (hot->hash != hash || hot->key_len != key_len) {
+		/* Keep the heavier of two keys that collide on a slot. */
+		if (estimate <= hot->count) {
+			return;
+		}
+		hot->hash = hash;
+		hot->key_len = key_len;
+		for (__u32 i = 0; i < RAINBOW_HOT_KEY_MAX_LEN; i++) {
+			if (i >= key_len || (void *)(key + i + 1) > end) {
+				break;
+			}
+			hot->key[i] = key[i];
+		}
+	}
+	hot->count = estimate;
 }
 
-static int process_packet(void *start, void *end)
+static int is_get(__u8 opcode)
 {
-	struct ethhdr *eth = start;
-	__u64 offset = sizeof(*eth);
-	if (start + offset > end) {
-		return XDP_PASS;
+	return opcode == MC_OP_GET || opcode == MC_OP_GETQ || opcode == MC_OP_GETK || opcode == MC_OP_GETKQ;
+}
+
+/* Finds the key of a binary protocol request. */
+static int binary_key(void *payload, void *end, __u8 **key, __u32 *key_len, int *get)
+{
+	struct mchdr *mch = payload;
+	if ((void *)(mch + 1) > end) {
+		return -1;
 	}
-	if (eth->h_proto != htons(ETH_P_IP)) {
-		return XDP_PASS;
+	__u32 len = rainbow_ntohs(mch->key_len);
+	if (len > RAINBOW_MAX_KEY_LEN) {
+		return -1;
 	}
-	struct iphdr *iph = start + offset;
-	offset += sizeof(*iph);
-	if (start + offset > end) {
-		return XDP_PASS;
+	__u8 *start = (void *)(mch + 1) + mch->extras_len;
+	if ((void *)(start + len) > end) {
+		return -1;
+	}
+	*key = start;
+	*key_len = len;
+	*get = is_get(mch->opcode);
+	return 0;
+}
+
+/*
+ * Finds the first key of a text protocol command, which is its second
+ * token, as in "get <key> ...", "set <key> <flags> ..." and the meta commands
+ * "mg <key> <flags>*". The key ends at a space or at the end of the line.
+ * Commands without a key, such as "mn", are steered by the empty key, like
+ * binary protocol requests without one.
+ */
+static int ascii_key(__u8 *payload, void *end, __u8 **key, __u32 *key_len, int *get)
+{
+	__u32 cmd_len;
+	__u8 c = 0;
+	for (cmd_len = 0; cmd_len < MC_ASCII_MAX_COMMAND_LEN; cmd_len++) {
+		if ((void *)(payload + cmd_len + 1) > end) {
+			return -1;
+		}
+		c = payload[cmd_len];
+		if (c == ' ' || c == '\r' || c == '\n') {
+			break;
+		}
+	}
+	if (cmd_len == 0 || cmd_len == MC_ASCII_MAX_COMMAND_LEN) {
+		return -1;
 	}
-	if (iph->protocol != IPPROTO_UDP) {
+	*key = payload + cmd_len;
+	*key_len = 0;
+	/* Only "get" and "gets" are spread over replicas, which have the CAS
+	 * values of the owner's items, but no stale-while-revalidate state for
+	 * meta gets to return. */
+	*get = (cmd_len == 3 || (cmd_len == 4 && payload[3] == 's')) && payload[0] == 'g' && payload[1] == 'e' &&
+	       payload[2] == 't';
+	if (c != ' ') {
+		return 0;
+	}
+	__u8 *start = payload + cmd_len + 1;
+	__u32 len;
+	for (len = 0; len < RAINBOW_MAX_KEY_LEN; len++) {
+		if ((void *)(start + len + 1) > end) {
+			break;
+		}
+		c = start[len];
+		if (c == ' ' || c == '\r' || c == '\n') {
+			break;
+		}
+	}
+	*key = start;
+	*key_len = len;
+	return 0;
+}
+
+/* Hands the packet to the socket of `partition` on the receiving queue. */
+static int redirect(__u32 queue, __u32 partition)
+{
+	if (queue >= RAINBOW_MAX_QUEUES || partition >= RAINBOW_MAX_PARTITIONS) {
+		return XDP_DROP;
+	}
+	return bpf_redirect_map(&xsks_map, rainbow_xsk_slot(queue, partition), 0);
+}
+
+static int process_packet(void *start, void *end, __u32 queue)
+{
+	struct rainbow_headers hdrs;
+	switch (rainbow_parse_headers(start, end, &hdrs)) {
+	case RAINBOW_PARSE_UDP:
+		break;
+	case RAINBOW_PARSE_DROP:
+		return XDP_DROP;
+	default:
 		return XDP_PASS;
 	}
+	__u64 offset = hdrs.l4_offset;
 	struct udphdr *udph = start + offset;
 	offset += sizeof(*udph);
 	if (start + offset > end) {
 		return XDP_PASS;
 	}
-	struct mchdr *mch = start + offset;
-	offset += sizeof(*mch);
-	offset += mch->extras_len;
-	void *key_start = start + offset;
-	offset += mch->key_len;
-	if (start + offset > end) {
+	__u32 zero = 0;
+	__u32 *port = bpf_map_lookup_elem(&port_map, &zero);
+	if (port && *port && udph->dest != (__u16)*port) {
+		return XDP_PASS;
+	}
+	void *payload = start + offset;
+	if (payload + 1 > end) {
+		return XDP_PASS;
+	}
+	__u8 *key_start;
+	__u32 key_len;
+	int get;
+	/* No text protocol command starts with the binary request magic. */
+	if (*(__u8 *)payload == MC_MAGIC_REQUEST) {
+		if (binary_key(payload, end, &key_start, &key_len, &get) < 0) {
+			return XDP_PASS;
+		}
+	} else {
+		if (ascii_key(payload, end, &key_start, &key_len, &get) < 0) {
+			return XDP_PASS;
+		}
+	}
+	__u32 *key_hash = bpf_map_lookup_elem(&key_hash_map, &zero);
+	__u32 hash = rainbow_key_hash(key_hash ? *key_hash : RAINBOW_KEY_HASH_MURMUR3, key_start, key_len, end);
+	count_key(key_start, key_len, end, hash);
+	if (get) {
+		struct rainbow_replicas *replicas = bpf_map_lookup_elem(&replica_map, &hash);
+		if (replicas && replicas->nr_partitions > 0) {
+			/* Read from the replica the receiving CPU maps to, so that
+			 * a flow keeps hitting the same warm copy. */
+			__u32 idx = bpf_get_smp_processor_id() % replicas->nr_partitions;
+			if (idx < RAINBOW_MAX_REPLICAS) {
+				return redirect(queue, replicas->partitions[idx]);
+			}
+		}
+	}
+	__u32 bucket = rainbow_bucket(hash);
+	__u32 *partition = bpf_map_lookup_elem(&bucket_map, &bucket);
+	if (!partition) {
 		return XDP_PASS;
 	}
-	__u64 seed = 1;
-	__u32 hash;
-	MurmurHash3_x86_32(key_start, mch->key_len, seed, (void*) &hash);
-	__u32 cpu_dest = hash % MAX_CPUS;
-	return bpf_redirect_map(&cpu_map, cpu_dest, 0);
+	return redirect(queue, *partition);
 }
 
+SEC("xdp_sock")
 int xdp_program(struct xdp_md *ctx)
 {
 	void *start = (void *)(long)ctx->data;
 	void *end = (void *)(long)ctx->data_end;
-	return process_packet(start, end);
+	return process_packet(start, end, ctx->rx_queue_index);
 }
@@ -1,9 +1,10 @@
 #include <linux/bpf.h>
 #include "bpf_helpers.h"
+#include "parse.h"
 
 #define SEC(NAME) __attribute__((section(NAME), used))
 
-#define MAX_SOCKS 4
+#define MAX_SOCKS 64
 
 struct bpf_map_def SEC("maps") xsks_map = {
         .type = BPF_MAP_TYPE_XSKMAP,
@@ -12,8 +13,46 @@ struct bpf_map_def SEC("maps") xsks_map = {
         .max_entries = MAX_SOCKS,
 };
 
+/* UDP port of the store, in network byte order, set by userspace at load time. */
+struct bpf_map_def SEC("maps") port_map = {
+	.type		= BPF_MAP_TYPE_ARRAY,
+	.key_size	= sizeof(__u32),
+	.value_size	= sizeof(__u32),
+	.max_entries	= 1,
+};
+
+/*
+ * Returns RAINBOW_PARSE_UDP for UDP packets to the store's port. Everything
+ * else, such as TCP connections to the store, goes to the kernel network
+ * stack, except for fragments that cannot be served at all.
+ */
+static int classify_packet(void *start, void *end)
+{
+	struct rainbow_headers hdrs;
+	int ret = rainbow_parse_headers(start, end, &hdrs);
+	if (ret != RAINBOW_PARSE_UDP)
+		return ret;
+	struct udphdr *udph = start + hdrs.l4_offset;
+	if ((void *)(udph + 1) > end)
+		return RAINBOW_PARSE_OTHER;
+	__u32 zero = 0;
+	__u32 *port = bpf_map_lookup_elem(&port_map, &zero);
+	if (port && *port && udph->dest != (__u16)*port)
+		return RAINBOW_PARSE_OTHER;
+	return RAINBOW_PARSE_UDP;
+}
+
 SEC("xdp_sock")
 int xdp_sock_prog(struct xdp_md *ctx)
 {
-	return bpf_redirect_map(&xsks_map, 0, 0);
+	switch (classify_packet((void *)(long)ctx->data, (void *)(long)ctx->data_end)) {
+	case RAINBOW_PARSE_UDP:
+		break;
+	case RAINBOW_PARSE_DROP:
+		return XDP_DROP;
+	default:
+		return XDP_PASS;
+	}
+	/* Each queue has its own socket, registered under the queue id. */
+	return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, 0);
 }
@@ -1,82 +1,742 @@
+#include "rainbow/extstore.hpp"
+#include "rainbow/hotkeys.hpp"
+#include "rainbow/irq.hpp"
+#include "rainbow/migration.hpp"
+#include "rainbow/numa.hpp"
 #include "rainbow/packet.hpp"
+#include "rainbow/protocol.hpp"
 #include "rainbow/reactor.hpp"
+#include "rainbow/region.hpp"
+#include "rainbow/replication.hpp"
+#include "rainbow/reuseport.hpp"
+#include "rainbow/snapshot.hpp"
+#include "rainbow/steering.hpp"
+#include "rainbow/store.hpp"
+#include "rainbow/tcp.hpp"
+#include "rainbow/umem.hpp"
+#include "rainbow/uring.hpp"
+#include "rainbow/xdp.hpp"
 
 #include <arpa/inet.h>
+#include <getopt.h>
 #include <linux/if_ether.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/udp.h>
+#include <unistd.h>
 
 #include "expected.hpp"
+#include "parse.h"
+#include "steering.h"
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <condition_variable>
 #include <csignal>
+#include <cctype>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
 
-static tl::expected<void, rainbow::Error>
-process_message(const rainbow::Packet& packet)
+static constexpr size_t nr_hot_keys = 16;
+
+static constexpr auto hot_key_period = std::chrono::seconds{1};
+
+/// Number of partitions a hot key is replicated to, or zero for all of them.
+static constexpr unsigned int nr_hot_key_replicas = 0;
+
+/// Requests per period that make a hot key worth replicating.
+static constexpr uint64_t hot_key_replication_threshold = 100000;
+
+static uint16_t
+ip_checksum(const void* data, size_t len)
 {
-  for (size_t i = 0; i < packet.len; i++) {
-    unsigned char ch = packet.data[i];
-    printf("%02x ", ch);
+  auto* words = reinterpret_cast<const uint16_t*>(data);
+  uint32_t sum = 0;
+  for (size_t i = 0; i < len / 2; i++) {
+    sum += words[i];
   }
-  printf("  |");
-  for (size_t i = 0; i < packet.len; i++) {
-    char ch = packet.data[i];
-    if (std::isprint(ch)) {
-      printf("%c", ch);
-    } else {
-      printf(".");
-    }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
   }
-  printf("|\n");
-  return {};
+  return ~sum;
 }
 
-static tl::expected<void, rainbow::Error>
-process_ipv4_udp_packet(const rainbow::Packet& packet)
+/// Adds `len` bytes to the one's complement sum `sum` of 16-bit words in
+/// network byte order. The bytes start at an odd offset of the checksummed
+/// data if `odd` is set.
+static uint32_t
+checksum_add(uint32_t sum, const void* data, size_t len, bool odd)
+{
+  auto* bytes = reinterpret_cast<const uint8_t*>(data);
+  uint64_t acc = 0;
+  size_t i = 0;
+  for (; i + 1 < len; i += 2) {
+    acc += (uint32_t(bytes[i]) << 8) | bytes[i + 1];
+  }
+  if (i < len) {
+    acc += uint32_t(bytes[i]) << 8;
+  }
+  while (acc >> 16) {
+    acc = (acc & 0xffff) + (acc >> 16);
+  }
+  // Summing words that straddle the original word boundaries swaps the bytes
+  // of the result.
+  if (odd) {
+    acc = ((acc & 0xff) << 8) | (acc >> 8);
+  }
+  return sum + acc;
+}
+
+/// Computes the UDP checksum of a reply over IPv6, where it is mandatory.
+/// The datagram is the `len` bytes at `udph`, followed by `payload`.
+static uint16_t
+udp6_checksum(const ::ipv6hdr* ip6h, const ::udphdr* udph, size_t len, std::string_view payload)
+{
+  uint32_t udp_len = len + payload.size();
+  uint32_t sum = 0;
+  sum = checksum_add(sum, &ip6h->saddr, sizeof(ip6h->saddr), false);
+  sum = checksum_add(sum, &ip6h->daddr, sizeof(ip6h->daddr), false);
+  sum += (udp_len >> 16) + (udp_len & 0xffff) + IPPROTO_UDP;
+  sum = checksum_add(sum, udph, len, false);
+  sum = checksum_add(sum, payload.data(), payload.size(), len % 2);
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  uint16_t check = ~sum;
+  // Zero means that the sender did not compute a checksum.
+  return ::htons(check ? check : 0xffff);
+}
+
+/// What the packet path of a partition works on.
+struct Server
+{
+  rainbow::Store& store;
+  uint16_t port;
+  /// Largest value to send straight from item memory, or zero to copy all
+  /// values into the reply.
+  size_t max_zero_copy_len;
+};
+
+static tl::expected<size_t, rainbow::Error>
+process_message(const Server& server,
+                const rainbow::Packet& packet,
+                char* reply,
+                size_t capacity,
+                rainbow::ZeroCopyValue& zero_copy,
+                rainbow::Progress& progress)
+{
+  auto len = rainbow::process_request(server.store, packet, reply, capacity, &zero_copy, &progress);
+  // Nothing goes out until the values that the request waits for are in
+  // from flash, and it is processed again from where `progress` says it
+  // stopped.
+  if (len && server.store.deferred()) {
+    return 0;
+  }
+  return len;
+}
+
+static tl::expected<size_t, rainbow::Error>
+process_udp_packet(const Server& server,
+                   const rainbow::Packet& packet,
+                   char* reply,
+                   size_t capacity,
+                   rainbow::ZeroCopyValue& zero_copy,
+                   rainbow::Progress& progress)
 {
   auto* udph = reinterpret_cast<const ::udphdr*>(packet.data);
   if (packet.len < sizeof(*udph)) {
     return tl::unexpected{"Packet is too short. Expected at least " + std::to_string(sizeof(*udph)) + ", but was: " + std::to_string(packet.len)};
   }
-  std::cout << "UDP/IPv4 packet: " << ::htons(udph->len) << " bytes" << std::endl;
-  return process_message(packet.trim_front(sizeof(*udph)));
+  if (::ntohs(udph->dest) != server.port) {
+    return 0;
+  }
+  // The frame may be padded past the end of the datagram, or, for the first
+  // fragment of a datagram, end before it.
+  size_t udp_len = ::ntohs(udph->len);
+  if (udp_len < sizeof(*udph) || udp_len > packet.len) {
+    return tl::unexpected{"Invalid UDP length " + std::to_string(udp_len) + " in a packet of " + std::to_string(packet.len) + " bytes"};
+  }
+  if (capacity < sizeof(*udph)) {
+    return 0;
+  }
+  auto message = rainbow::Packet{packet.data, udp_len}.trim_front(sizeof(*udph));
+  auto len =
+    process_message(server, message, reply + sizeof(*udph), capacity - sizeof(*udph), zero_copy, progress);
+  if (!len || *len == 0) {
+    return len;
+  }
+  auto* reply_udph = reinterpret_cast<::udphdr*>(reply);
+  reply_udph->source = udph->dest;
+  reply_udph->dest = udph->source;
+  reply_udph->len = ::htons(sizeof(*reply_udph) + *len);
+  reply_udph->check = 0;
+  return sizeof(*reply_udph) + *len;
+}
+
+/// Serves the UDP `datagram` of the IPv4 packet with header `iph`. The reply
+/// has no IP options.
+static tl::expected<size_t, rainbow::Error>
+process_ipv4_packet(const Server& server,
+                    const ::iphdr* iph,
+                    const rainbow::Packet& datagram,
+                    char* reply,
+                    size_t capacity,
+                    rainbow::ZeroCopyValue& zero_copy,
+                    rainbow::Progress& progress)
+{
+  if (capacity < sizeof(*iph)) {
+    return 0;
+  }
+  auto len =
+    process_udp_packet(server, datagram, reply + sizeof(*iph), capacity - sizeof(*iph), zero_copy, progress);
+  if (!len || *len == 0) {
+    return len;
+  }
+  auto* reply_iph = reinterpret_cast<::iphdr*>(reply);
+  *reply_iph = *iph;
+  reply_iph->ihl = sizeof(*reply_iph) / 4;
+  reply_iph->tot_len = ::htons(sizeof(*reply_iph) + *len);
+  reply_iph->frag_off = 0;
+  reply_iph->ttl = 64;
+  reply_iph->saddr = iph->daddr;
+  reply_iph->daddr = iph->saddr;
+  reply_iph->check = 0;
+  reply_iph->check = ip_checksum(reply_iph, sizeof(*reply_iph));
+  return sizeof(*reply_iph) + *len;
+}
+
+/// Serves the UDP `datagram` of the IPv6 packet with header `ip6h`. The
+/// reply has no extension headers.
+static tl::expected<size_t, rainbow::Error>
+process_ipv6_packet(const Server& server,
+                    const ::ipv6hdr* ip6h,
+                    const rainbow::Packet& datagram,
+                    char* reply,
+                    size_t capacity,
+                    rainbow::ZeroCopyValue& zero_copy,
+                    rainbow::Progress& progress)
+{
+  if (capacity < sizeof(*ip6h)) {
+    return 0;
+  }
+  auto len =
+    process_udp_packet(server, datagram, reply + sizeof(*ip6h), capacity - sizeof(*ip6h), zero_copy, progress);
+  if (!len || *len == 0) {
+    return len;
+  }
+  auto* reply_ip6h = reinterpret_cast<::ipv6hdr*>(reply);
+  *reply_ip6h = *ip6h;
+  reply_ip6h->payload_len = ::htons(*len);
+  reply_ip6h->nexthdr = IPPROTO_UDP;
+  reply_ip6h->hop_limit = 64;
+  reply_ip6h->saddr = ip6h->daddr;
+  reply_ip6h->daddr = ip6h->saddr;
+  auto* reply_udph = reinterpret_cast<::udphdr*>(reply + sizeof(*reply_ip6h));
+  size_t frame_len = *len - (zero_copy.item ? zero_copy.value.size() : 0);
+  reply_udph->check =
+    udp6_checksum(reply_ip6h, reply_udph, frame_len, zero_copy.item ? zero_copy.value : std::string_view{});
+  return sizeof(*reply_ip6h) + *len;
 }
 
 static tl::expected<void, rainbow::Error>
-process_ipv4_packet(const rainbow::Packet& packet)
-{
-  auto* iph = reinterpret_cast<const ::iphdr*>(packet.data);
-  switch (iph->protocol) {
-    case IPPROTO_UDP:
-      return process_ipv4_udp_packet(packet.trim_front(sizeof(*iph)));
-    case IPPROTO_TCP:
-      return tl::unexpected{std::string{"TCP/IPv4 is not supported"}};
+process_packet(const Server& server, const rainbow::Packet& packet, rainbow::Frame& reply)
+{
+  ::rainbow_headers hdrs{};
+  switch (::rainbow_parse_headers(packet.data, packet.data + packet.len, &hdrs)) {
+    case RAINBOW_PARSE_UDP:
+      break;
+    case RAINBOW_PARSE_DROP:
+      // The XDP program drops these already, unless it was not attached.
+      return {};
     default:
-      return tl::unexpected{"Unsupported IPv4 protocol: " + std::to_string(iph->protocol)};
+      return tl::unexpected{"Unsupported packet: EtherType " + std::to_string(hdrs.l3_proto) + ", protocol " + std::to_string(hdrs.l4_proto) + ", length " + std::to_string(packet.len)};
+  }
+  if (reply.capacity < hdrs.l3_offset) {
+    return {};
+  }
+  rainbow::ZeroCopyValue zero_copy{server.max_zero_copy_len};
+  auto datagram = packet.trim_front(hdrs.l4_offset);
+  char* reply_l3 = reply.data + hdrs.l3_offset;
+  size_t capacity = reply.capacity - hdrs.l3_offset;
+  tl::expected<size_t, rainbow::Error> len;
+  if (hdrs.l3_proto == ETH_P_IP) {
+    auto* iph = reinterpret_cast<const ::iphdr*>(packet.data + hdrs.l3_offset);
+    len = process_ipv4_packet(server, iph, datagram, reply_l3, capacity, zero_copy, reply.progress);
+  } else {
+    auto* ip6h = reinterpret_cast<const ::ipv6hdr*>(packet.data + hdrs.l3_offset);
+    len = process_ipv6_packet(server, ip6h, datagram, reply_l3, capacity, zero_copy, reply.progress);
+  }
+  if (!len) {
+    return tl::unexpected{len.error()};
+  }
+  if (*len == 0) {
+    reply.deferred = server.store.deferred();
+    return {};
+  }
+  // Keep the VLAN tags of the request, and send the reply back to where the
+  // request came from.
+  auto* eth = reinterpret_cast<const ::ethhdr*>(packet.data);
+  std::memcpy(reply.data, packet.data, hdrs.l3_offset);
+  auto* reply_eth = reinterpret_cast<::ethhdr*>(reply.data);
+  std::memcpy(reply_eth->h_dest, eth->h_source, ETH_ALEN);
+  std::memcpy(reply_eth->h_source, eth->h_dest, ETH_ALEN);
+  reply.len = hdrs.l3_offset + *len;
+  // The value is not in the frame, but the lengths in the headers count it.
+  if (zero_copy.item) {
+    reply.len -= zero_copy.value.size();
+    reply.payload = zero_copy.value;
+    reply.payload_owner = zero_copy.item;
   }
   return {};
 }
 
+/// Processes the payload of a UDP datagram that the io_uring datapath
+/// received. The kernel takes care of the headers of the reply.
 static tl::expected<void, rainbow::Error>
-process_packet(const rainbow::Packet& packet)
+process_datagram(const Server& server, const rainbow::Packet& packet, rainbow::Frame& reply)
 {
-  auto* eth = reinterpret_cast<const ::ethhdr*>(packet.data);
-  auto offset = sizeof(*eth);
-  if (offset >= packet.len) {
-    return tl::unexpected{"Packet is too short. Expected at least " + std::to_string(offset) + ", but was: " + std::to_string(packet.len)};
-  }
-  auto proto = ::htons(eth->h_proto);
-  switch (proto) {
-    case ETH_P_IP:
-      return process_ipv4_packet(packet.trim_front(sizeof(*eth)));
-    case ETH_P_IPV6:
-      return tl::unexpected{std::string{"IPv6 is not supported"}};
-    default:
-      return tl::unexpected{"Unsupported EtherType: " + std::to_string(proto)};
+  rainbow::ZeroCopyValue zero_copy{server.max_zero_copy_len};
+  auto len = process_message(server, packet, reply.data, reply.capacity, zero_copy, reply.progress);
+  if (!len) {
+    return tl::unexpected{len.error()};
+  }
+  reply.len = *len;
+  reply.deferred = *len == 0 && server.store.deferred();
+  if (zero_copy.item) {
+    reply.len -= zero_copy.value.size();
+    reply.payload = zero_copy.value;
+    reply.payload_owner = zero_copy.item;
+  }
+  return {};
+}
+
+/// Parses a memory size such as "512M" or "4G". A plain number is in
+/// megabytes, like memcached's -m option.
+static std::optional<size_t>
+parse_size(const std::string& str)
+{
+  size_t pos;
+  unsigned long long size;
+  if (str.empty() || !std::isdigit(static_cast<unsigned char>(str[0]))) {
+    return std::nullopt;
+  }
+  try {
+    size = std::stoull(str, &pos);
+  } catch (const std::exception&) {
+    return std::nullopt;
   }
+  std::string suffix = str.substr(pos);
+  if (suffix == "K" || suffix == "k") {
+    return size << 10;
+  } else if (suffix == "M" || suffix == "m" || suffix.empty()) {
+    return size << 20;
+  } else if (suffix == "G" || suffix == "g") {
+    return size << 30;
+  }
+  return std::nullopt;
+}
+
+static std::optional<uint16_t>
+parse_port(const char* str)
+{
+  char* end;
+  unsigned long port = std::strtoul(str, &end, 10);
+  if (*str == '\0' || *end != '\0' || port > 65535) {
+    return std::nullopt;
+  }
+  return port;
+}
+
+static std::optional<uint32_t>
+parse_uint32(const char* str)
+{
+  char* end;
+  unsigned long value = std::strtoul(str, &end, 10);
+  if (!std::isdigit(static_cast<unsigned char>(*str)) || *end != '\0' || value > UINT32_MAX) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+#define DEFAULT_PARTITION_MODE "node"
+#define DEFAULT_INTERFACE "lo"
+#define DEFAULT_QUEUES "0"
+#define DEFAULT_MEMORY "64M"
+#define DEFAULT_PORT 11211
+#define DEFAULT_TCP_PORT 11211
+#define DEFAULT_XDP_PROGRAM "rainbow_pass_kern.o"
+#define DEFAULT_STEERING_XDP_PROGRAM "rainbow_kern.o"
+#define DEFAULT_IRQ_MODE "off"
+#define DEFAULT_BACKEND "auto"
+#define DEFAULT_EXTSTORE_ITEM_SIZE 1024
+#define DEFAULT_ALLOCATOR "slab"
+#define DEFAULT_ADMISSION "all"
+#define DEFAULT_KEY_HASH "murmur3"
+
+struct Args
+{
+  rainbow::PartitionMode partition_mode = rainbow::parse_partition_mode(DEFAULT_PARTITION_MODE);
+  std::string ifname = DEFAULT_INTERFACE;
+  std::vector<unsigned int> queues = rainbow::parse_range_list(DEFAULT_QUEUES);
+  size_t mem_limit = *parse_size(DEFAULT_MEMORY);
+  uint16_t port = DEFAULT_PORT;
+  uint16_t tcp_port = DEFAULT_TCP_PORT;
+  /// Set if --tcp-port was given, rather than left at the default.
+  bool tcp_port_given = false;
+  bool hugepages = false;
+  bool zero_copy = false;
+  bool zero_copy_values = false;
+  /// Empty to pick one of the default programs by the partitions.
+  std::string xdp_program;
+  std::string irq_mode = DEFAULT_IRQ_MODE;
+  std::string backend = DEFAULT_BACKEND;
+  std::string warm_restart_dir;
+  std::string snapshot_dir;
+  uint32_t snapshot_interval = 0;
+  std::string extstore_path;
+  uint64_t extstore_size = 0;
+  uint32_t extstore_item_size = DEFAULT_EXTSTORE_ITEM_SIZE;
+  uint32_t compress_threshold = 0;
+  std::string allocator = DEFAULT_ALLOCATOR;
+  std::string admission = DEFAULT_ADMISSION;
+  rainbow::KeyHash key_hash = rainbow::parse_key_hash(DEFAULT_KEY_HASH);
+};
+
+static std::string program;
+
+static void
+print_opt_error(const std::string& option, const std::string& reason)
+{
+  std::cerr << program << ": " << reason << " '" << option << "' option" << std::endl;
+  std::cerr << "Try '" << program << " --help' for more information" << std::endl;
+}
+
+static void
+print_unrecognized_opt(const std::string& option)
+{
+  print_opt_error(option, "unrecognized");
+}
+
+static void
+print_version()
+{
+  std::cout << "Rainbow 0.0.0" << std::endl;
+}
+
+static void
+print_usage()
+{
+  std::cout << "Usage: " << program << " [OPTION]..." << std::endl;
+  std::cout << "Start the Rainbow daemon." << std::endl;
+  std::cout << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  -P, --partition-mode mode   Partitioning mode: machine, node, or core. (default: "
+            << DEFAULT_PARTITION_MODE << ")" << std::endl;
+  std::cout << "  -i, --interface name        Network interface to serve. (default: " << DEFAULT_INTERFACE << ")"
+            << std::endl;
+  std::cout << "  -q, --queues list           NIC queues to serve, such as 0-3,8. (default: " << DEFAULT_QUEUES << ")"
+            << std::endl;
+  std::cout << "  -m, --memory size           Item memory of all partitions, in megabytes or with a K, M, or G"
+            << std::endl;
+  std::cout << "                              suffix. (default: " << DEFAULT_MEMORY << ")" << std::endl;
+  std::cout << "  -p, --port port             UDP port to serve. (default: " << DEFAULT_PORT << ")" << std::endl;
+  std::cout << "  -t, --tcp-port port         TCP port to serve, or 0 for none. Only a single partition serves TCP."
+            << std::endl;
+  std::cout << "                              (default: " << DEFAULT_TCP_PORT << ", or none with more partitions)"
+            << std::endl;
+  std::cout << "  -H, --hugepages             Back item memory and UMEM with transparent huge pages." << std::endl;
+  std::cout << "  -Z, --zero-copy             Require zero-copy AF_XDP sockets." << std::endl;
+  std::cout << "  -z, --zero-copy-values      Keep items in the UMEM and send large values without copying them."
+            << std::endl;
+  std::cout << "  -X, --xdp-program file      XDP object file to attach. (default: " << DEFAULT_STEERING_XDP_PROGRAM
+            << " if more" << std::endl;
+  std::cout << "                              than one partition serves NIC queues, " << DEFAULT_XDP_PROGRAM
+            << " otherwise)" << std::endl;
+  std::cout << "  -I, --irq mode              IRQ and XPS affinity: off, dry-run, verify, or apply. (default: "
+            << DEFAULT_IRQ_MODE << ")" << std::endl;
+  std::cout << "  -B, --backend backend       Datapath: xdp, io_uring, or auto, which falls back to io_uring if XDP"
+            << std::endl;
+  std::cout << "                              cannot be attached. (default: " << DEFAULT_BACKEND << ")" << std::endl;
+  std::cout << "  -W, --warm-restart dir      Keep items in files in dir, such as a tmpfs or hugetlbfs mount, and"
+            << std::endl;
+  std::cout << "                              reattach to them after a restart." << std::endl;
+  std::cout << "  -S, --snapshot dir          Write snapshots of the partitions to dir on SIGUSR1, and load them at"
+            << std::endl;
+  std::cout << "                              startup." << std::endl;
+  std::cout << "  -s, --snapshot-interval sec Also write snapshots every sec seconds. (default: 0, which is never)"
+            << std::endl;
+  std::cout << "  -E, --extstore path         Keep large values, and values that would be evicted, in path, a file"
+            << std::endl;
+  std::cout << "                              or an NVMe device." << std::endl;
+  std::cout << "  -e, --extstore-size size    Size of the file to create at the --extstore path, like --memory."
+            << std::endl;
+  std::cout << "                              (default: 1G, or all of a device)" << std::endl;
+  std::cout << "  -x, --extstore-item-size n  Store values of at least n bytes on flash right away. (default: "
+            << DEFAULT_EXTSTORE_ITEM_SIZE << ")" << std::endl;
+  std::cout << "  -C, --compress-threshold n  Compress values of at least n bytes with LZ4. (default: 0, which is"
+            << std::endl;
+  std::cout << "                              never)" << std::endl;
+  std::cout << "  -A, --allocator allocator   Item memory allocator: slab, or log, which appends items to segments"
+            << std::endl;
+  std::cout << "                              that are compacted in the background. (default: " << DEFAULT_ALLOCATOR
+            << ")" << std::endl;
+  std::cout << "  -a, --admission policy      Admission of new items when memory is full: all, or tinylfu, which"
+            << std::endl;
+  std::cout << "                              only keeps the ones used more often than what they would evict."
+            << std::endl;
+  std::cout << "                              (default: " << DEFAULT_ADMISSION << ")" << std::endl;
+  std::cout << "  -K, --key-hash hash         Hash that places keys in the index and steers them to partitions:"
+            << std::endl;
+  std::cout << "                              murmur3, crc32c, or xxh32. (default: " << DEFAULT_KEY_HASH << ")"
+            << std::endl;
+  std::cout << "      --help                  print this help text and exit" << std::endl;
+  std::cout << "      --version               print Rainbow version and exit" << std::endl;
+  std::cout << std::endl;
+}
+
+static Args
+parse_cmd_line(int argc, char* argv[])
+{
+  static struct option long_options[] = {{"partition-mode", required_argument, 0, 'P'},
+                                         {"interface", required_argument, 0, 'i'},
+                                         {"queues", required_argument, 0, 'q'},
+                                         {"memory", required_argument, 0, 'm'},
+                                         {"port", required_argument, 0, 'p'},
+                                         {"tcp-port", required_argument, 0, 't'},
+                                         {"hugepages", no_argument, 0, 'H'},
+                                         {"zero-copy", no_argument, 0, 'Z'},
+                                         {"zero-copy-values", no_argument, 0, 'z'},
+                                         {"xdp-program", required_argument, 0, 'X'},
+                                         {"irq", required_argument, 0, 'I'},
+                                         {"backend", required_argument, 0, 'B'},
+                                         {"warm-restart", required_argument, 0, 'W'},
+                                         {"snapshot", required_argument, 0, 'S'},
+                                         {"snapshot-interval", required_argument, 0, 's'},
+                                         {"extstore", required_argument, 0, 'E'},
+                                         {"extstore-size", required_argument, 0, 'e'},
+                                         {"extstore-item-size", required_argument, 0, 'x'},
+                                         {"compress-threshold", required_argument, 0, 'C'},
+                                         {"allocator", required_argument, 0, 'A'},
+                                         {"admission", required_argument, 0, 'a'},
+                                         {"key-hash", required_argument, 0, 'K'},
+                                         {"help", no_argument, 0, 'h'},
+                                         {"version", no_argument, 0, 'v'},
+                                         {0, 0, 0, 0}};
+  Args args;
+  int opt, long_index;
+  while ((opt = ::getopt_long(argc, argv, "P:i:q:m:p:t:HZzX:I:B:W:S:s:E:e:x:C:A:a:K:hv", long_options, &long_index)) != -1) {
+    switch (opt) {
+      case 'P':
+        try {
+          args.partition_mode = rainbow::parse_partition_mode(optarg);
+        } catch (const std::invalid_argument&) {
+          print_opt_error("--partition-mode", "invalid argument '" + std::string{optarg} + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        break;
+      case 'i':
+        args.ifname = optarg;
+        break;
+      case 'q':
+        try {
+          args.queues = rainbow::parse_range_list(optarg);
+        } catch (const std::invalid_argument&) {
+          args.queues.clear();
+        }
+        if (args.queues.empty()) {
+          print_opt_error("--queues", "invalid argument '" + std::string{optarg} + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        break;
+      case 'm': {
+        auto size = parse_size(optarg);
+        if (!size || *size == 0) {
+          print_opt_error("--memory", "invalid argument '" + std::string{optarg} + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        args.mem_limit = *size;
+        break;
+      }
+      case 'p': {
+        auto port = parse_port(optarg);
+        if (!port || *port == 0) {
+          print_opt_error("--port", "invalid argument '" + std::string{optarg} + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        args.port = *port;
+        break;
+      }
+      case 't': {
+        auto port = parse_port(optarg);
+        if (!port) {
+          print_opt_error("--tcp-port", "invalid argument '" + std::string{optarg} + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        args.tcp_port = *port;
+        args.tcp_port_given = true;
+        break;
+      }
+      case 'H':
+        args.hugepages = true;
+        break;
+      case 'Z':
+        args.zero_copy = true;
+        break;
+      case 'z':
+        args.zero_copy_values = true;
+        break;
+      case 'X':
+        args.xdp_program = optarg;
+        break;
+      case 'I':
+        args.irq_mode = optarg;
+        if (args.irq_mode != "off" && args.irq_mode != "dry-run" && args.irq_mode != "verify" &&
+            args.irq_mode != "apply") {
+          print_opt_error("--irq", "invalid argument '" + args.irq_mode + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        break;
+      case 'B':
+        args.backend = optarg;
+        if (args.backend != "xdp" && args.backend != "io_uring" && args.backend != "auto") {
+          print_opt_error("--backend", "invalid argument '" + args.backend + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        break;
+      case 'W':
+        args.warm_restart_dir = optarg;
+        break;
+      case 'S':
+        args.snapshot_dir = optarg;
+        break;
+      case 's': {
+        auto interval = parse_uint32(optarg);
+        if (!interval) {
+          print_opt_error("--snapshot-interval", "invalid argument '" + std::string{optarg} + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        args.snapshot_interval = *interval;
+        break;
+      }
+      case 'E':
+        args.extstore_path = optarg;
+        break;
+      case 'e': {
+        auto size = parse_size(optarg);
+        if (!size || *size == 0) {
+          print_opt_error("--extstore-size", "invalid argument '" + std::string{optarg} + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        args.extstore_size = *size;
+        break;
+      }
+      case 'x': {
+        auto size = parse_uint32(optarg);
+        if (!size || *size == 0) {
+          print_opt_error("--extstore-item-size", "invalid argument '" + std::string{optarg} + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        args.extstore_item_size = *size;
+        break;
+      }
+      case 'C': {
+        auto threshold = parse_uint32(optarg);
+        if (!threshold) {
+          print_opt_error("--compress-threshold", "invalid argument '" + std::string{optarg} + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        args.compress_threshold = *threshold;
+        break;
+      }
+      case 'A':
+        args.allocator = optarg;
+        if (args.allocator != "slab" && args.allocator != "log") {
+          print_opt_error("--allocator", "invalid argument '" + args.allocator + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        break;
+      case 'a':
+        args.admission = optarg;
+        if (args.admission != "all" && args.admission != "tinylfu") {
+          print_opt_error("--admission", "invalid argument '" + args.admission + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        break;
+      case 'K':
+        try {
+          args.key_hash = rainbow::parse_key_hash(optarg);
+        } catch (const std::invalid_argument&) {
+          print_opt_error("--key-hash", "invalid argument '" + std::string{optarg} + "' for");
+          std::exit(EXIT_FAILURE);
+        }
+        break;
+      case 'h':
+        print_usage();
+        std::exit(EXIT_SUCCESS);
+      case 'v':
+        print_version();
+        std::exit(EXIT_SUCCESS);
+      case '?':
+        print_unrecognized_opt(argv[optind - 1]);
+        std::exit(EXIT_FAILURE);
+      default:
+        print_usage();
+        std::exit(EXIT_FAILURE);
+    }
+  }
+  if (args.snapshot_interval && args.snapshot_dir.empty()) {
+    print_opt_error("--snapshot-interval", "missing --snapshot for");
+    std::exit(EXIT_FAILURE);
+  }
+  if (args.extstore_path.empty() && (args.extstore_size || args.extstore_item_size != DEFAULT_EXTSTORE_ITEM_SIZE)) {
+    print_opt_error(args.extstore_size ? "--extstore-size" : "--extstore-item-size", "missing --extstore for");
+    std::exit(EXIT_FAILURE);
+  }
+  // Where values are on flash is only known to the daemon that wrote them.
+  if (!args.extstore_path.empty() && !args.warm_restart_dir.empty()) {
+    print_opt_error("--extstore", "--warm-restart conflicts with");
+    std::exit(EXIT_FAILURE);
+  }
+  // The state of the log allocator is not kept in the region.
+  if (args.allocator == "log" && !args.warm_restart_dir.empty()) {
+    print_opt_error("--allocator", "--warm-restart conflicts with log for");
+    std::exit(EXIT_FAILURE);
+  }
+  // The log allocator evicts whole segments, not the items the filter picks.
+  if (args.allocator == "log" && args.admission == "tinylfu") {
+    print_opt_error("--admission", "--allocator log conflicts with tinylfu for");
+    std::exit(EXIT_FAILURE);
+  }
+  return args;
+}
+
+/// Ties NIC queue interrupts to the cores of the partitions that serve them.
+/// Returns false if the daemon should exit after printing the plan.
+static bool
+setup_irq_affinity(const Args& args, const std::vector<std::vector<unsigned int>>& partition_cpus)
+{
+  if (args.irq_mode == "off") {
+    return true;
+  }
+  auto plan = rainbow::plan_irq_affinity(args.ifname, partition_cpus);
+  if (args.irq_mode == "dry-run") {
+    rainbow::print_irq_plan(std::cout, plan);
+    return false;
+  }
+  if (args.irq_mode == "apply") {
+    rainbow::apply_irq_plan(plan);
+  }
+  for (auto& mismatch : rainbow::verify_irq_plan(plan)) {
+    std::cerr << "warning: " << mismatch << std::endl;
+  }
+  return true;
 }
 
-static bool running = true;
+static std::atomic<bool> running{true};
 
 static void
 signal_handler(int, siginfo_t*, void*)
@@ -84,11 +744,21 @@ signal_handler(int, siginfo_t*, void*)
   running = false;
 }
 
+/// Bumped on SIGUSR1. Every partition starts a snapshot when it sees a new
+/// value.
+static std::atomic<uint64_t> snapshot_requests{0};
+
+static void
+snapshot_signal_handler(int, siginfo_t*, void*)
+{
+  snapshot_requests++;
+}
+
 static void
-setup_signal(int signum)
+setup_signal(int signum, void (*handler)(int, siginfo_t*, void*) = signal_handler)
 {
   struct ::sigaction sa{};
-  sa.sa_sigaction = signal_handler;
+  sa.sa_sigaction = handler;
   sa.sa_flags = SA_SIGINFO;
   auto err = sigaction(signum, &sa, nullptr);
   if (err) {
@@ -96,17 +766,592 @@ setup_signal(int signum)
   }
 }
 
+/// Periodically extracts hot keys from the XDP sketch and moves hot buckets
+/// away from overloaded partitions.
+static void
+run_control_loop(rainbow::HotKeyTracker& tracker,
+                 rainbow::SteeringTable& steering,
+                 const std::vector<rainbow::Store*>& stores,
+                 rainbow::HotKeyReplicator* replicator)
+{
+  while (running) {
+    std::this_thread::sleep_for(hot_key_period);
+    auto hot_keys = tracker.poll();
+    for (auto& move : rainbow::plan_hot_key_mitigation(hot_keys, steering)) {
+      if (replicator) {
+        replicator->forget_bucket(move.bucket);
+      }
+      if (!rainbow::migrate_bucket(steering, stores, move.bucket, move.dst)) {
+        std::cout << "warning: Moving bucket " << move.bucket << " timed out; it stays where it is." << std::endl;
+      }
+    }
+    if (replicator) {
+      replicator->update(hot_keys);
+    }
+    rainbow::publish_hot_keys(std::move(hot_keys));
+  }
+}
+
+/// The cores, NIC queues, and memory node of one partition.
+struct Partition
+{
+  std::vector<unsigned int> cpus;
+  std::vector<unsigned int> queues;
+  int numa_node;
+};
+
+/// Splits the machine into partitions and hands out the NIC queues to them.
+/// Queue `i` goes to the partition that owns core `i`, which is where the IRQ
+/// planner sends its interrupts; queues beyond the last core are spread
+/// round-robin.
+static std::vector<Partition>
+plan_partitions(const Args& args, const rainbow::Topology& topology)
+{
+  std::vector<Partition> partitions;
+  for (auto& cpus : topology.partition_cpus(args.partition_mode)) {
+    // Place the memory of a partition on its node. A partition that spans
+    // nodes is served from the NIC's node instead, so that packets and items
+    // never cross the socket interconnect.
+    int numa_node = topology.node_of_cpu(cpus.front());
+    for (auto cpu : cpus) {
+      if (topology.node_of_cpu(cpu) != numa_node) {
+        numa_node = rainbow::nic_numa_node(args.ifname);
+        break;
+      }
+    }
+    partitions.push_back(Partition{cpus, {}, numa_node});
+  }
+  for (auto queue : args.queues) {
+    auto owner = std::find_if(partitions.begin(), partitions.end(), [queue](const Partition& partition) {
+      return std::find(partition.cpus.begin(), partition.cpus.end(), queue) != partition.cpus.end();
+    });
+    if (owner == partitions.end()) {
+      owner = partitions.begin() + queue % partitions.size();
+    }
+    owner->queues.push_back(queue);
+  }
+  return partitions;
+}
+
+/// Makes sure that `program` can serve the partitions. Every program needs an
+/// `xsks_map`. A program that does not steer by key leaves a request on the
+/// partition that serves the queue it arrives on, so only one partition may
+/// serve queues, or keys would end up in several stores. A program that does
+/// steer by key needs every partition to have a queue to answer from.
+static void
+check_xdp_program(const Args& args, const rainbow::XdpProgram& program, const std::vector<Partition>& partitions)
+{
+  if (program.map_fd("xsks_map") < 0) {
+    throw std::invalid_argument(args.xdp_program + " has no xsks_map to redirect packets to AF_XDP sockets");
+  }
+  auto nr_serving = std::count_if(
+    partitions.begin(), partitions.end(), [](const Partition& partition) { return !partition.queues.empty(); });
+  if (!program.steers_by_key()) {
+    if (nr_serving > 1) {
+      throw std::invalid_argument(args.xdp_program + " does not steer requests by key, so only one partition can " +
+                                  "serve NIC queues. Use " + DEFAULT_STEERING_XDP_PROGRAM + " instead.");
+    }
+    return;
+  }
+  if (partitions.size() > RAINBOW_MAX_PARTITIONS) {
+    throw std::invalid_argument(args.xdp_program + " steers requests to at most " +
+                                std::to_string(RAINBOW_MAX_PARTITIONS) + " partitions");
+  }
+  for (size_t i = 0; i < partitions.size(); i++) {
+    if (partitions[i].queues.empty()) {
+      throw std::invalid_argument("partition " + std::to_string(i) +
+                                  " has no NIC queue to answer requests from. Serve more queues or use fewer " +
+                                  "partitions.");
+    }
+    for (auto queue : partitions[i].queues) {
+      if (queue >= RAINBOW_MAX_QUEUES) {
+        throw std::invalid_argument(args.xdp_program + " cannot steer requests from queue " + std::to_string(queue));
+      }
+    }
+  }
+}
+
+/// Merges `partitions` into one that spans all of their CPUs. The io_uring
+/// datapath serves a datagram on the partition of the CPU that received it,
+/// whatever its key, so with more than one partition keys would end up in
+/// several stores.
+static Partition
+merge_partitions(const std::vector<Partition>& partitions)
+{
+  Partition merged{{}, {}, partitions.front().numa_node};
+  for (auto& partition : partitions) {
+    merged.cpus.insert(merged.cpus.end(), partition.cpus.begin(), partition.cpus.end());
+    merged.queues.insert(merged.queues.end(), partition.queues.begin(), partition.queues.end());
+    if (partition.numa_node != merged.numa_node) {
+      merged.numa_node = -1;
+    }
+  }
+  std::sort(merged.cpus.begin(), merged.cpus.end());
+  std::sort(merged.queues.begin(), merged.queues.end());
+  return merged;
+}
+
+/// Makes sure that TCP can be served. A connection is served by the partition
+/// of the CPU that accepted it, whatever keys its requests are for, so with
+/// more than one partition keys would end up in several stores. TCP is then
+/// turned off, or refused if a port was asked for.
+static void
+check_tcp(Args& args, const std::vector<Partition>& partitions)
+{
+  if (!args.tcp_port || partitions.size() <= 1) {
+    return;
+  }
+  if (args.tcp_port_given) {
+    throw std::invalid_argument("--tcp-port needs a single partition, but there are " +
+                                std::to_string(partitions.size()) + ". Use --partition-mode machine or --tcp-port 0.");
+  }
+  std::cout << "warning: Not serving TCP, which needs a single partition. Use --partition-mode machine to serve it."
+            << std::endl;
+  args.tcp_port = 0;
+}
+
+/// Lets the partition threads wait for each other between the steps of
+/// setting up their reactors.
+class Barrier
+{
+  std::mutex _lock;
+  std::condition_variable _cond;
+  size_t _nr_missing;
+
+public:
+  explicit Barrier(size_t nr_threads)
+    : _nr_missing{nr_threads}
+  {
+  }
+
+  /// Returns false if the daemon stops before all the threads arrive.
+  bool arrive_and_wait()
+  {
+    std::unique_lock<std::mutex> guard{_lock};
+    if (--_nr_missing == 0) {
+      _cond.notify_all();
+    }
+    while (_nr_missing > 0) {
+      if (!running) {
+        return false;
+      }
+      _cond.wait_for(guard, std::chrono::milliseconds{10});
+    }
+    return true;
+  }
+};
+
+/// The AF_XDP reactors of all the partitions. With a program that steers by
+/// key, a partition also receives on the queues of the others, through
+/// sockets that share their UMEMs and hand the frames back to them. The
+/// partitions therefore set up their reactors in two steps, and the reactors
+/// live until every partition has stopped.
+struct XdpReactors
+{
+  /// The reactors of the queues that each partition serves.
+  std::vector<std::vector<std::unique_ptr<rainbow::Reactor>>> owned;
+  /// The reactors through which each partition receives on the queues of
+  /// the other partitions.
+  std::vector<std::vector<std::unique_ptr<rainbow::Reactor>>> shared;
+  Barrier owned_ready;
+  Barrier shared_ready;
+
+  explicit XdpReactors(size_t nr_partitions)
+    : owned(nr_partitions)
+    , shared(nr_partitions)
+    , owned_ready{nr_partitions}
+    , shared_ready{nr_partitions}
+  {
+  }
+};
+
+static std::string
+snapshot_path(const Args& args, uint32_t partition)
+{
+  return args.snapshot_dir + "/partition-" + std::to_string(partition) + ".snapshot";
+}
+
+/// Starts a snapshot of partition `index`, unless one is in progress.
+static void
+start_snapshot(const Args& args, rainbow::Store& store, uint32_t index, uint32_t nr_partitions)
+{
+  if (store.snapshotting()) {
+    return;
+  }
+  try {
+    store.start_snapshot(std::make_unique<rainbow::Snapshot>(snapshot_path(args, index), index, nr_partitions));
+  } catch (const std::exception& ex) {
+    std::cout << "warning: Cannot start snapshot: " << ex.what() << std::endl;
+  }
+}
+
+/// Splits the flash tier at the --extstore path evenly between the stores of
+/// the partitions.
+static void
+attach_extstores(const Args& args, const std::vector<rainbow::Store*>& stores)
+{
+  uint64_t len = rainbow::Extstore::prepare(args.extstore_path, args.extstore_size);
+  uint64_t partition_len = len / stores.size() / rainbow::Extstore::segment_size * rainbow::Extstore::segment_size;
+  if (partition_len < rainbow::Extstore::min_len) {
+    throw std::runtime_error(args.extstore_path + " is too small to split between " +
+                             std::to_string(stores.size()) + " partitions. Each needs at least " +
+                             std::to_string(rainbow::Extstore::min_len >> 20) + " MiB.");
+  }
+  for (size_t i = 0; i < stores.size(); i++) {
+    stores[i]->attach_extstore(
+      std::make_unique<rainbow::Extstore>(args.extstore_path, i * partition_len, partition_len),
+      args.extstore_item_size);
+  }
+}
+
+/// Loads the snapshots of the partitions that did not reattach to their
+/// regions, in parallel, with one thread on the cores of each partition.
+static void
+load_snapshots(const Args& args,
+               const rainbow::Topology& topology,
+               const std::vector<Partition>& partitions,
+               const std::vector<rainbow::Store*>& stores,
+               const rainbow::SteeringTable* steering)
+{
+  std::vector<std::thread> loaders;
+  for (uint32_t i = 0; i < partitions.size(); i++) {
+    if (stores[i]->reattached()) {
+      continue;
+    }
+    loaders.emplace_back([&, i] {
+      // Items that moved to another partition after the snapshot was taken
+      // are dropped, because requests for them are no longer steered here.
+      auto owns = [&](uint32_t hash) { return !steering || steering->partition_of(rainbow_bucket(hash)) == i; };
+      try {
+        topology.bind_thread_to_cpus(partitions[i].cpus);
+        rainbow::load_snapshot(snapshot_path(args, i), *stores[i], i, partitions.size(), owns);
+      } catch (const std::exception& ex) {
+        std::cout << "warning: Not loading snapshot: " << ex.what() << "." << std::endl;
+      }
+    });
+  }
+  for (auto& loader : loaders) {
+    loader.join();
+  }
+}
+
+/// Serves the queues of a partition from its store until the daemon stops.
+/// Without an XDP program, the partition serves its UDP socket `udp_fd` with
+/// io_uring instead.
+static void
+run_partition(const Args& args,
+              const rainbow::XdpProgram* program,
+              XdpReactors* xdp,
+              const rainbow::Topology* placement,
+              const rainbow::Topology& topology,
+              const Partition& partition,
+              uint32_t index,
+              uint32_t nr_partitions,
+              rainbow::Store& store,
+              rainbow::Umem* umem,
+              int udp_fd,
+              int tcp_listen_fd,
+              const std::atomic<bool>& control_running)
+{
+  size_t max_zero_copy_len = 0;
+  if (umem) {
+    max_zero_copy_len = rainbow::Reactor::max_payload_len;
+  } else if (!program && args.zero_copy_values) {
+    max_zero_copy_len = rainbow::UringReactor::max_payload_len;
+  }
+  Server server{store, args.port, max_zero_copy_len};
+  std::vector<std::unique_ptr<rainbow::Reactor>> no_reactors;
+  auto& reactors = xdp ? xdp->owned[index] : no_reactors;
+  auto& shared_reactors = xdp ? xdp->shared[index] : no_reactors;
+  bool steers_by_key = program && program->steers_by_key();
+  for (size_t i = 0; program && i < partition.queues.size(); i++) {
+    auto queue = partition.queues[i];
+    auto reactor = std::make_unique<rainbow::Reactor>();
+    reactor->program(*program, queue, steers_by_key ? rainbow_xsk_slot(queue, index) : queue);
+    if (umem) {
+      reactor->umem(*umem, i);
+    }
+    if (placement && partition.numa_node >= 0) {
+      reactor->numa_node(*placement, partition.numa_node);
+    }
+    reactor->hugepages(args.hugepages);
+    reactor->zero_copy(args.zero_copy);
+    reactor->on_packet([&server](const rainbow::Packet& packet, rainbow::Frame& reply) {
+      return process_packet(server, packet, reply);
+    });
+    reactor->on_tx_complete(
+      [&store](const void* item) { store.release(reinterpret_cast<const rainbow::Item*>(item)); });
+    reactor->setup();
+    reactors.push_back(std::move(reactor));
+  }
+  if (steers_by_key) {
+    // Requests for the keys of this partition arrive on every queue, so
+    // receive on the queues of the other partitions too, once they have set
+    // them up, and answer through the queues of this one.
+    if (!xdp->owned_ready.arrive_and_wait()) {
+      return;
+    }
+    for (uint32_t other = 0; other < nr_partitions; other++) {
+      for (size_t i = 0; other != index && i < xdp->owned[other].size(); i++) {
+        auto& owner = *xdp->owned[other][i];
+        auto reactor = std::make_unique<rainbow::Reactor>();
+        reactor->program(*program, owner.queue(), rainbow_xsk_slot(owner.queue(), index));
+        if (placement && partition.numa_node >= 0) {
+          reactor->numa_node(*placement, partition.numa_node);
+        }
+        reactor->share_queue(owner, *reactors[shared_reactors.size() % reactors.size()]);
+        reactor->setup();
+        shared_reactors.push_back(std::move(reactor));
+      }
+    }
+    if (!xdp->shared_ready.arrive_and_wait()) {
+      return;
+    }
+  }
+  std::optional<rainbow::UringReactor> uring;
+  if (udp_fd >= 0) {
+    uring.emplace(udp_fd);
+    uring->on_packet([&server](const rainbow::Packet& packet, rainbow::Frame& reply) {
+      return process_datagram(server, packet, reply);
+    });
+    uring->on_tx_complete(
+      [&store](const void* item) { store.release(reinterpret_cast<const rainbow::Item*>(item)); });
+    uring->setup();
+  }
+  std::optional<rainbow::TcpServer> tcp;
+  if (tcp_listen_fd >= 0) {
+    tcp.emplace(tcp_listen_fd);
+    tcp->on_stream([&store](std::string_view input, std::string& output) {
+      return rainbow::process_stream(store, input, output);
+    });
+    tcp->setup();
+  }
+  // Setting up a reactor binds the thread to the whole node, so narrow it
+  // down to the cores of the partition afterwards.
+  topology.bind_thread_to_cpus(partition.cpus);
+  uint64_t snapshot_request = snapshot_requests;
+  uint32_t next_snapshot = args.snapshot_interval ? rainbow::current_time() + args.snapshot_interval : 0;
+  while (running || control_running) {
+    store.poll();
+    if (store.values_ready()) {
+      for (auto& reactor : reactors) {
+        reactor->resume();
+      }
+      if (uring) {
+        uring->resume();
+      }
+      if (tcp) {
+        tcp->resume();
+      }
+    }
+    if (!args.snapshot_dir.empty()) {
+      uint64_t request = snapshot_requests;
+      uint32_t now = next_snapshot ? rainbow::current_time() : 0;
+      if (request != snapshot_request || (next_snapshot && now >= next_snapshot)) {
+        snapshot_request = request;
+        if (next_snapshot) {
+          next_snapshot = now + args.snapshot_interval;
+        }
+        start_snapshot(args, store, index, nr_partitions);
+      }
+    }
+    for (auto& reactor : reactors) {
+      reactor->run_once();
+    }
+    for (auto& reactor : shared_reactors) {
+      reactor->run_once();
+    }
+    if (uring) {
+      uring->run_once();
+    }
+    if (tcp) {
+      tcp->run_once();
+    }
+  }
+}
+
 int
-main()
+main(int argc, char* argv[])
 {
+  program = ::basename(argv[0]);
+
+  auto args = parse_cmd_line(argc, argv);
+
   setup_signal(SIGINT);
   setup_signal(SIGTERM);
+  setup_signal(SIGUSR1, snapshot_signal_handler);
   try {
-    rainbow::Reactor reactor;
-    reactor.on_packet(process_packet);
-    reactor.setup();
-    while (running) {
-        reactor.run_once();
+    rainbow::Topology topology;
+    auto partitions = plan_partitions(args, topology);
+    std::vector<std::vector<unsigned int>> partition_cpus;
+    for (auto& partition : partitions) {
+      partition_cpus.push_back(partition.cpus);
+    }
+    if (!setup_irq_affinity(args, partition_cpus)) {
+      return 0;
+    }
+    const rainbow::Topology* placement = topology.nr_nodes() > 1 ? &topology : nullptr;
+    rainbow::KeyHasher hasher{args.key_hash};
+    if (args.xdp_program.empty()) {
+      auto nr_serving = std::count_if(
+        partitions.begin(), partitions.end(), [](const Partition& partition) { return !partition.queues.empty(); });
+      args.xdp_program = nr_serving > 1 ? DEFAULT_STEERING_XDP_PROGRAM : DEFAULT_XDP_PROGRAM;
+    }
+    std::optional<rainbow::XdpProgram> xdp_program;
+    if (args.backend != "io_uring") {
+      try {
+        xdp_program.emplace(args.ifname, args.xdp_program, hasher.kind(), args.port);
+      } catch (const std::exception& ex) {
+        if (args.backend == "xdp") {
+          throw;
+        }
+        std::cout << "warning: Cannot attach XDP program (" << ex.what() << "). Falling back to io_uring."
+                  << std::endl;
+      }
+    }
+    if (xdp_program) {
+      check_xdp_program(args, *xdp_program, partitions);
+    } else if (partitions.size() > 1) {
+      std::cout << "warning: io_uring does not steer requests by key. Serving them from a single partition."
+                << std::endl;
+      partitions = {merge_partitions(partitions)};
+      partition_cpus = {partitions.front().cpus};
+    }
+    check_tcp(args, partitions);
+    // Set up steering before the stores, because the items that a store
+    // reattaches to or loads are only reachable if keys are steered as they
+    // were.
+    std::optional<rainbow::SteeringTable> steering;
+    int bucket_map = xdp_program ? xdp_program->map_fd("bucket_map") : -1;
+    std::string state_dir = !args.warm_restart_dir.empty() ? args.warm_restart_dir : args.snapshot_dir;
+    std::string steering_path = state_dir + "/steering";
+    bool steering_restored = false;
+    if (bucket_map >= 0) {
+      steering.emplace(bucket_map);
+      steering_restored = !state_dir.empty() && steering->load(steering_path, partitions.size());
+      if (!steering_restored) {
+        steering->fill(partitions.size());
+      }
+    } else if (!state_dir.empty()) {
+      // The table no longer describes where the items are.
+      ::unlink(steering_path.c_str());
+    }
+    bool items_in_umem = args.zero_copy_values && xdp_program;
+    if (items_in_umem && !args.warm_restart_dir.empty()) {
+      std::cout << "warning: Items in the UMEM are not kept across restarts." << std::endl;
+    }
+    std::vector<std::unique_ptr<rainbow::Umem>> umems;
+    std::vector<std::unique_ptr<rainbow::Store>> owned_stores;
+    std::vector<rainbow::Store*> stores;
+    for (uint32_t i = 0; i < partitions.size(); i++) {
+      auto& partition = partitions[i];
+      size_t mem_limit = args.mem_limit / partitions.size();
+      auto* topology = partition.numa_node >= 0 ? placement : nullptr;
+      if (items_in_umem) {
+        // The reactors of the partition share one UMEM, and the items live
+        // in it.
+        umems.push_back(std::make_unique<rainbow::Umem>(
+          partition.queues.size(), mem_limit, topology, partition.numa_node, args.hugepages));
+        owned_stores.push_back(std::make_unique<rainbow::Store>(*umems.back(), hasher));
+      } else if (!args.warm_restart_dir.empty()) {
+        umems.push_back(nullptr);
+        auto path = args.warm_restart_dir + "/partition-" + std::to_string(i);
+        if (steering && !steering_restored) {
+          // Without the table that the items were steered by, they may be
+          // in the wrong partitions.
+          ::unlink(path.c_str());
+        }
+        auto layout = rainbow::Store::region_layout(mem_limit, hasher);
+        layout.partition = i;
+        layout.nr_partitions = partitions.size();
+        auto region = std::make_unique<rainbow::Region>(path, layout, topology, partition.numa_node);
+        owned_stores.push_back(std::make_unique<rainbow::Store>(std::move(region), hasher));
+      } else {
+        umems.push_back(nullptr);
+        owned_stores.push_back(
+          std::make_unique<rainbow::Store>(mem_limit, hasher, topology, partition.numa_node, args.hugepages));
+      }
+      stores.push_back(owned_stores.back().get());
+      stores.back()->set_partition(i);
+      if (args.allocator == "log") {
+        stores.back()->use_log_allocator();
+      }
+      if (args.admission == "tinylfu") {
+        stores.back()->use_admission_filter();
+      }
+      stores.back()->compress_values(args.compress_threshold);
+    }
+    if (!args.extstore_path.empty()) {
+      attach_extstores(args, stores);
+    }
+    if (!args.snapshot_dir.empty()) {
+      load_snapshots(args, topology, partitions, stores, steering ? &*steering : nullptr);
+    }
+    std::vector<int> udp_fds(partitions.size(), -1);
+    if (!xdp_program) {
+      udp_fds = rainbow::bind_reuseport_group(SOCK_DGRAM, args.port, partition_cpus);
+    }
+    std::vector<int> tcp_listen_fds(partitions.size(), -1);
+    if (args.tcp_port) {
+      tcp_listen_fds = rainbow::bind_reuseport_group(SOCK_STREAM, args.tcp_port, partition_cpus);
+    }
+    std::optional<rainbow::HotKeyTracker> tracker;
+    int sketch_map = xdp_program ? xdp_program->map_fd("sketch_map") : -1;
+    int hot_key_map = xdp_program ? xdp_program->map_fd("hot_key_map") : -1;
+    if (steering && sketch_map >= 0 && hot_key_map >= 0) {
+      tracker.emplace(sketch_map, hot_key_map, nr_hot_keys);
+    }
+    std::optional<rainbow::Replication> replication;
+    std::optional<rainbow::HotKeyReplicator> replicator;
+    int replica_map = xdp_program ? xdp_program->map_fd("replica_map") : -1;
+    if (tracker && replica_map >= 0) {
+      replication.emplace(stores.size(), replica_map);
+      for (auto* store : stores) {
+        store->attach_replication(&*replication);
+      }
+      replicator.emplace(*steering, stores, nr_hot_key_replicas, hot_key_replication_threshold);
+    }
+    // The control thread may be in the middle of a migration when we are
+    // asked to stop, so keep polling the stores until it has exited.
+    std::atomic<bool> control_running{tracker.has_value()};
+    std::optional<XdpReactors> xdp_reactors;
+    if (xdp_program) {
+      xdp_reactors.emplace(partitions.size());
+    }
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < partitions.size(); i++) {
+      workers.emplace_back([&, i] {
+        try {
+          run_partition(
+            args, xdp_program ? &*xdp_program : nullptr, xdp_reactors ? &*xdp_reactors : nullptr, placement,
+            topology, partitions[i], i, partitions.size(), *stores[i], umems[i].get(), udp_fds[i],
+            tcp_listen_fds[i], control_running);
+        } catch (const std::exception& ex) {
+          std::cerr << "error: partition " << i << ": " << ex.what() << std::endl;
+          running = false;
+        }
+      });
+    }
+    std::thread control;
+    if (tracker) {
+      control = std::thread{[&] {
+        try {
+          run_control_loop(*tracker, *steering, stores, replicator ? &*replicator : nullptr);
+        } catch (const std::exception& ex) {
+          std::cerr << "error: " << ex.what() << std::endl;
+          running = false;
+        }
+        control_running = false;
+      }};
+    }
+    if (control.joinable()) {
+      control.join();
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    if (steering && !state_dir.empty()) {
+      steering->save(steering_path);
     }
   } catch (const std::exception& ex) {
     std::cerr << "error: " << ex.what() << std::endl;
@@ -1,16 +1,18 @@
 #include "rainbow/reactor.hpp"
 
+#include "rainbow/numa.hpp"
 #include "rainbow/packet.hpp"
+#include "rainbow/xdp.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <iostream>
+#include <stdexcept>
 #include <system_error>
 
 #include "expected.hpp"
 
-#include <net/if.h>
 #include <sys/mman.h>
-#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -32,6 +34,17 @@ namespace rainbow {
 #define SOL_XDP 283
 #endif
 
+#ifndef XDP_USE_SG
+#define XDP_USE_SG (1 << 4)
+#endif
+
+#ifndef XDP_PKT_CONTD
+#define XDP_PKT_CONTD (1 << 0)
+#endif
+
+static constexpr size_t frame_size = Umem::frame_size;
+static constexpr int nr_descs = 1024;
+
 Reactor::~Reactor()
 {
   teardown();
@@ -43,46 +56,84 @@ Reactor::on_packet(OnPacketFn&& fn)
   _fn = std::move(fn);
 }
 
+void
+Reactor::on_tx_complete(OnTxCompleteFn&& fn)
+{
+  _tx_complete_fn = std::move(fn);
+}
+
+void
+Reactor::program(const XdpProgram& program, uint32_t queue, uint32_t slot)
+{
+  _program = &program;
+  _queue = queue;
+  _slot = slot;
+}
+
+void
+Reactor::share_queue(Reactor& owner, Reactor& replier)
+{
+  _owner = &owner;
+  _replier = &replier;
+}
+
+void
+Reactor::numa_node(const Topology& topology, int node)
+{
+  _topology = &topology;
+  _numa_node = node;
+}
+
+void
+Reactor::umem(Umem& umem, unsigned int area)
+{
+  _umem = &umem;
+  _frame_base = umem.frame_area(area);
+}
+
+void
+Reactor::hugepages(bool enable)
+{
+  _hugepages = enable;
+}
+
+void
+Reactor::zero_copy(bool enable)
+{
+  _zero_copy = enable;
+}
+
 void
 Reactor::setup()
 {
-  ::rlimit rlim = {RLIM_INFINITY, RLIM_INFINITY};
-  if (setrlimit(RLIMIT_MEMLOCK, &rlim)) {
-    throw std::system_error(errno, std::system_category(), "setrlimit(RLIMIT_MEMLOCK)");
-  }
-  int err;
-  _ifindex = if_nametoindex("lo");
-  ::bpf_prog_load_attr prog_load_attr = {
-    .prog_type = BPF_PROG_TYPE_XDP,
-  };
-  prog_load_attr.file = "rainbow_pass_kern.o";
-  ::bpf_object* obj;
-  int progfd;
-  err = bpf_prog_load_xattr(&prog_load_attr, &obj, &progfd);
-  if (err < 0) {
-    throw std::system_error(-err, std::system_category(), "bpf_prog_load_xattr");
-  }
-  err = bpf_set_link_xdp_fd(_ifindex, progfd, 0);
-  if (err < 0) {
-    throw std::system_error(-err, std::system_category(), "bpf_set_link_xdp_fd");
-  }
-  ::bpf_map* map = bpf_object__find_map_by_name(obj, "xsks_map");
-  int xsks_map = bpf_map__fd(map);
+  // Bind to the NUMA node before creating the socket so that the rings,
+  // which the kernel allocates on behalf of this thread, are node-local.
+  if (_topology) {
+    _topology->bind_thread(_numa_node);
+  }
+  if (!_program) {
+    throw std::invalid_argument("reactor has no XDP program");
+  }
+  int xsks_map = _program->map_fd("xsks_map");
   if (xsks_map < 0) {
-    throw std::system_error(-xsks_map, std::system_category(), "bpf_map__fd");
+    throw std::invalid_argument("XDP program has no xsks_map");
+  }
+  if (_owner) {
+    setup_shared(xsks_map);
+    return;
   }
   _sockfd = ::socket(AF_XDP, SOCK_RAW, 0);
   if (_sockfd < 0) {
     throw std::system_error(errno, std::system_category(), "socket(AF_XDP)");
   }
-  int frame_size = 2048;
-  int nr_frames = 131072;
-  if (::posix_memalign(&_bufs, ::getpagesize(), nr_frames * frame_size) < 0) {
-    throw std::system_error(errno, std::system_category(), "posix_memalign");
+  if (!_umem) {
+    _own_umem = std::make_unique<Umem>(1, 0, _topology, _numa_node, _hugepages);
+    _umem = _own_umem.get();
+    _frame_base = _umem->frame_area(0);
   }
-  ::xdp_umem_reg umem_region;
-  umem_region.addr = reinterpret_cast<uint64_t>(_bufs);
-  umem_region.len = nr_frames * frame_size;
+  ::xdp_umem_reg umem_region{};
+  umem_region.addr = reinterpret_cast<uint64_t>(_umem->data());
+  umem_region.len = _umem->len();
   umem_region.chunk_size = frame_size;
   umem_region.headroom = 0;
   if (::setsockopt(_sockfd, SOL_XDP, XDP_UMEM_REG, &umem_region, sizeof(umem_region)) < 0) {
@@ -96,7 +147,6 @@ Reactor::setup()
   if (::setsockopt(_sockfd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &completion_queue_size, sizeof(int)) < 0) {
     throw std::system_error(errno, std::system_category(), "setsockopt(SOL_XDP, XDP_UMEM_COMPLETION_RING)");
   }
-  int nr_descs = 1024;
   if (::setsockopt(_sockfd, SOL_XDP, XDP_RX_RING, &nr_descs, sizeof(int)) < 0) {
     throw std::system_error(errno, std::system_category(), "setsockopt(SOL_XDP, XDP_RX_RING)");
   }
@@ -131,11 +181,10 @@ Reactor::setup()
   if (completion_ring_mmap == MAP_FAILED) {
     throw std::system_error(errno, std::system_category(), "mmap(XDP_UMEM_PGOFF_COMPLETION_RING)");
   }
-  xdp_umem_ring completion_ring;
-  completion_ring.desc = reinterpret_cast<uint64_t*>(reinterpret_cast<uint64_t>(completion_ring_mmap) + off.cr.desc);
-  completion_ring.producer = reinterpret_cast<uint32_t*>(reinterpret_cast<uint64_t>(completion_ring_mmap) + off.cr.producer);
-  completion_ring.consumer = reinterpret_cast<uint32_t*>(reinterpret_cast<uint64_t>(completion_ring_mmap) + off.cr.consumer);
-  completion_ring.mask = completion_queue_size - 1;
+  _completion_ring.desc = reinterpret_cast<uint64_t*>(reinterpret_cast<uint64_t>(completion_ring_mmap) + off.cr.desc);
+  _completion_ring.producer = reinterpret_cast<uint32_t*>(reinterpret_cast<uint64_t>(completion_ring_mmap) + off.cr.producer);
+  _completion_ring.consumer = reinterpret_cast<uint32_t*>(reinterpret_cast<uint64_t>(completion_ring_mmap) + off.cr.consumer);
+  _completion_ring.mask = completion_queue_size - 1;
 
   void* rx_map = ::mmap(nullptr,
                         off.rx.desc + nr_descs * sizeof(struct xdp_desc),
@@ -146,11 +195,11 @@ Reactor::setup()
   if (rx_map == MAP_FAILED) {
     throw std::system_error(errno, std::system_category(), "mmap(XDP_PGOFF_RX_RING)");
   }
-  for (uint64_t i = 0; i < uint64_t(nr_descs * frame_size); i += frame_size) {
-    _fill_ring.desc[(*_fill_ring.producer)++ & _fill_ring.mask] = i;
+  for (uint64_t i = 0; i < uint64_t(nr_descs); i++) {
+    _fill_ring.desc[(*_fill_ring.producer)++ & _fill_ring.mask] = _frame_base + i * frame_size;
   }
   void* tx_map = ::mmap(nullptr,
-                        off.rx.desc + nr_descs * sizeof(struct xdp_desc),
+                        off.tx.desc + nr_descs * sizeof(struct xdp_desc),
                         PROT_READ | PROT_WRITE,
                         MAP_SHARED | MAP_POPULATE,
                         _sockfd,
@@ -160,20 +209,83 @@ Reactor::setup()
   }
   ::sockaddr_xdp saddr;
   saddr.sxdp_family = AF_XDP;
-  saddr.sxdp_ifindex = _ifindex;
-  saddr.sxdp_queue_id = 0;
+  saddr.sxdp_flags = _zero_copy ? XDP_ZEROCOPY : 0;
+  // Replies that send a payload from item memory are multi-buffer packets.
+  if (_umem->item_len() > 0) {
+    saddr.sxdp_flags |= XDP_USE_SG;
+  }
+  saddr.sxdp_ifindex = _program->ifindex();
+  saddr.sxdp_queue_id = _queue;
   if (::bind(_sockfd, (struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
     throw std::system_error(errno, std::system_category(), "bind");
   }
-  int key = 0;
-  err = bpf_map_update_elem(xsks_map, &key, reinterpret_cast<void*>(&_sockfd), 0);
+  int err = bpf_map_update_elem(xsks_map, &_slot, reinterpret_cast<void*>(&_sockfd), 0);
   if (err) {
-    throw std::system_error(errno, std::system_category(), "bpf_map_update_elem()");
+    throw std::system_error(errno, std::system_category(), "bpf_map_update_elem(xsks_map)");
+  }
+  _rx_ring.producer = reinterpret_cast<uint32_t*>(reinterpret_cast<uint64_t>(rx_map) + off.rx.producer);
+  _rx_ring.consumer = reinterpret_cast<uint32_t*>(reinterpret_cast<uint64_t>(rx_map) + off.rx.consumer);
+  _rx_ring.desc = reinterpret_cast<struct xdp_desc*>(reinterpret_cast<uint64_t>(rx_map) + off.rx.desc);
+  _rx_ring.mask = nr_descs - 1;
+  _tx_ring.producer = reinterpret_cast<uint32_t*>(reinterpret_cast<uint64_t>(tx_map) + off.tx.producer);
+  _tx_ring.consumer = reinterpret_cast<uint32_t*>(reinterpret_cast<uint64_t>(tx_map) + off.tx.consumer);
+  _tx_ring.desc = reinterpret_cast<struct xdp_desc*>(reinterpret_cast<uint64_t>(tx_map) + off.tx.desc);
+  _tx_ring.mask = nr_descs - 1;
+  // The frames after the ones on the fill ring are used for replies.
+  for (uint64_t i = 0; i < uint64_t(nr_descs); i++) {
+    _tx_frames.push_back(_frame_base + (nr_descs + i) * frame_size);
+  }
+}
+
+/// Sets up a socket that only has an RX ring, and that the kernel fills from
+/// the fill ring of the owner's socket on the same queue.
+void
+Reactor::setup_shared(int xsks_map)
+{
+  _sockfd = ::socket(AF_XDP, SOCK_RAW, 0);
+  if (_sockfd < 0) {
+    throw std::system_error(errno, std::system_category(), "socket(AF_XDP)");
+  }
+  if (::setsockopt(_sockfd, SOL_XDP, XDP_RX_RING, &nr_descs, sizeof(int)) < 0) {
+    throw std::system_error(errno, std::system_category(), "setsockopt(SOL_XDP, XDP_RX_RING)");
+  }
+  ::xdp_mmap_offsets off;
+  socklen_t optlen = sizeof(off);
+  if (::getsockopt(_sockfd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+    throw std::system_error(errno, std::system_category(), "getsockopt(SOL_XDP, XDP_MMAP_OFFSETS)");
+  }
+  void* rx_map = ::mmap(nullptr,
+                        off.rx.desc + nr_descs * sizeof(struct xdp_desc),
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        _sockfd,
+                        XDP_PGOFF_RX_RING);
+  if (rx_map == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(), "mmap(XDP_PGOFF_RX_RING)");
+  }
+  // The other bind flags, such as zero-copy, come from the owner's socket.
+  ::sockaddr_xdp saddr{};
+  saddr.sxdp_family = AF_XDP;
+  saddr.sxdp_flags = XDP_SHARED_UMEM;
+  saddr.sxdp_ifindex = _program->ifindex();
+  saddr.sxdp_queue_id = _queue;
+  saddr.sxdp_shared_umem_fd = _owner->_sockfd;
+  if (::bind(_sockfd, (struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
+    throw std::system_error(errno, std::system_category(), "bind(XDP_SHARED_UMEM)");
+  }
+  if (bpf_map_update_elem(xsks_map, &_slot, reinterpret_cast<void*>(&_sockfd), 0)) {
+    throw std::system_error(errno, std::system_category(), "bpf_map_update_elem(xsks_map)");
   }
   _rx_ring.producer = reinterpret_cast<uint32_t*>(reinterpret_cast<uint64_t>(rx_map) + off.rx.producer);
   _rx_ring.consumer = reinterpret_cast<uint32_t*>(reinterpret_cast<uint64_t>(rx_map) + off.rx.consumer);
   _rx_ring.desc = reinterpret_cast<struct xdp_desc*>(reinterpret_cast<uint64_t>(rx_map) + off.rx.desc);
   _rx_ring.mask = nr_descs - 1;
+  _umem = _owner->_umem;
+  // The owner has no more frames than fit on its fill ring, so the ring
+  // never fills up.
+  _returned = std::make_unique<SpscRing<uint64_t>>(nr_descs);
+  std::lock_guard<std::mutex> guard{_owner->_sharers_lock};
+  _owner->_sharers.push_back(this);
 }
 
 void
@@ -184,23 +296,135 @@ Reactor::run_once()
     // empty or not before dequeuing a descriptor from it.
     std::atomic_thread_fence(std::memory_order_acquire);
     struct xdp_desc desc = _rx_ring.desc[(*_rx_ring.consumer)++ & _rx_ring.mask];
-    Packet packet{reinterpret_cast<const char*>(reinterpret_cast<uint64_t>(_bufs) + desc.addr), desc.len};
-    auto ret = _fn(packet);
-    if (!ret) {
-      std::cout << "warning: Packet processing error: " << ret.error() << std::endl;
+    if (_owner) {
+      _replier->process(Packet{_umem->data() + desc.addr, desc.len});
+      _returned->try_push(uint64_t{desc.addr});
+    } else {
+      process(Packet{_umem->data() + desc.addr, desc.len});
+      _fill_ring.desc[(*_fill_ring.producer)++ & _fill_ring.mask] = desc.addr;
+    }
+  }
+  for (auto* sharer : _sharers) {
+    uint64_t addr;
+    while (sharer->_returned->try_pop(addr)) {
+      _fill_ring.desc[(*_fill_ring.producer)++ & _fill_ring.mask] = addr;
     }
-    _fill_ring.desc[(*_fill_ring.producer)++ & _fill_ring.mask] = desc.addr;
   }
   std::atomic_thread_fence(std::memory_order::memory_order_seq_cst);
 }
 
+void
+Reactor::resume()
+{
+  auto parked = std::move(_parked);
+  _parked.clear();
+  for (auto& p : parked) {
+    process(Packet{p.data.data(), p.data.size()}, std::move(p.progress));
+  }
+}
+
+void
+Reactor::process(const Packet& packet, Progress&& progress)
+{
+  reclaim_tx_frames();
+  Frame reply{nullptr, 0, 0};
+  uint64_t reply_addr = 0;
+  if (!_tx_frames.empty()) {
+    reply_addr = _tx_frames.back();
+    _tx_frames.pop_back();
+    reply = Frame{_umem->data() + reply_addr, 0, frame_size};
+  }
+  reply.progress = std::move(progress);
+  auto ret = _fn(packet, reply);
+  if (!ret) {
+    std::cout << "warning: Packet processing error: " << ret.error() << std::endl;
+  }
+  // The frame goes back on the fill ring, so keep a copy of the packet.
+  if (reply.deferred && _parked.size() < max_parked) {
+    _parked.push_back(Parked{std::vector<char>(packet.data, packet.data + packet.len), std::move(reply.progress)});
+  }
+  if (reply.len == 0 || !transmit(reply_addr, reply)) {
+    if (reply.data) {
+      _tx_frames.push_back(reply_addr);
+    }
+    if (reply.payload_owner) {
+      _tx_complete_fn(reply.payload_owner);
+    }
+  }
+}
+
+void
+Reactor::reclaim_tx_frames()
+{
+  while (*_completion_ring.consumer != *_completion_ring.producer) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t addr = _completion_ring.desc[(*_completion_ring.consumer)++ & _completion_ring.mask];
+    // Payload descriptors point outside of the frame area.
+    if (addr - _frame_base < Umem::frame_area_len) {
+      _tx_frames.push_back(addr);
+    }
+    // Descriptors complete in the order they were put on the TX ring.
+    const void* owner = _tx_owners.front();
+    _tx_owners.pop_front();
+    if (owner) {
+      _tx_complete_fn(owner);
+    }
+  }
+}
+
+/// Puts a reply on the TX ring: the frame at `addr` first, followed by the
+/// payload, split at frame boundaries because a descriptor cannot cross
+/// one. Returns false if the reply cannot be sent.
+bool
+Reactor::transmit(uint64_t addr, const Frame& reply)
+{
+  uint64_t payload_addr = 0;
+  size_t nr_descs_needed = 1;
+  if (!reply.payload.empty()) {
+    if (!_umem->contains(reply.payload.data(), reply.payload.size())) {
+      std::cout << "warning: Reply payload is outside of the UMEM" << std::endl;
+      return false;
+    }
+    payload_addr = reply.payload.data() - _umem->data();
+    uint64_t payload_end = payload_addr + reply.payload.size();
+    nr_descs_needed += (payload_end - 1) / frame_size - payload_addr / frame_size + 1;
+    if (nr_descs_needed > max_tx_descs) {
+      std::cout << "warning: Reply payload of " << reply.payload.size() << " bytes is too large" << std::endl;
+      return false;
+    }
+  }
+  uint32_t nr_free = nr_descs - (*_tx_ring.producer - *_tx_ring.consumer);
+  if (nr_descs_needed > nr_free) {
+    return false;
+  }
+  uint32_t producer = *_tx_ring.producer;
+  uint32_t options = reply.payload.empty() ? 0 : XDP_PKT_CONTD;
+  _tx_ring.desc[producer++ & _tx_ring.mask] = xdp_desc{addr, uint32_t(reply.len), options};
+  _tx_owners.push_back(reply.payload.empty() ? reply.payload_owner : nullptr);
+  size_t remaining = reply.payload.size();
+  while (remaining > 0) {
+    size_t len = std::min(remaining, frame_size - payload_addr % frame_size);
+    remaining -= len;
+    options = remaining > 0 ? XDP_PKT_CONTD : 0;
+    _tx_ring.desc[producer++ & _tx_ring.mask] = xdp_desc{payload_addr, uint32_t(len), options};
+    _tx_owners.push_back(remaining > 0 ? nullptr : reply.payload_owner);
+    payload_addr += len;
+  }
+  // Use a release fence ("write barrier") to publish the descriptors before
+  // the producer index.
+  std::atomic_thread_fence(std::memory_order_release);
+  *_tx_ring.producer = producer;
+  // Kick the kernel to start transmitting.
+  ::sendto(_sockfd, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+  return true;
+}
+
 void
 Reactor::teardown()
 {
-  // FIXME: Unsafe if someone else changed the XDP program while we were
-  // running.
-  ::bpf_set_link_xdp_fd(_ifindex, -1, 0);
-  ::close(_sockfd);
+  if (_sockfd >= 0) {
+    ::close(_sockfd);
+  }
 }
 
 }
@@ -0,0 +1,178 @@
+#include "rainbow/region.hpp"
+
+#include "rainbow/numa.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+namespace rainbow {
+
+/// "RAINBOW" in little-endian byte order.
+static constexpr uint64_t region_magic = 0x574f424e494152;
+
+/// The index and the item memory start at multiples of the huge page size.
+static constexpr size_t part_alignment = 2 << 20;
+
+static constexpr size_t boot_id_len = 40;
+
+struct Region::Header
+{
+  uint64_t magic;
+  uint32_t version;
+  /// Set when a daemon closes the region cleanly, and cleared while one uses
+  /// it, so that a region left behind by a crash is not reattached.
+  uint32_t clean;
+  Layout layout;
+  /// The boot that item expiration times are relative to, because they are
+  /// kept on the monotonic clock.
+  char boot_id[boot_id_len];
+};
+
+static_assert(sizeof(Region::Layout) == 40, "Layout must not have padding, because it is compared bytewise");
+
+static size_t
+align_up(size_t n, size_t alignment)
+{
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+static std::string
+read_boot_id()
+{
+  std::ifstream file{"/proc/sys/kernel/random/boot_id"};
+  std::string boot_id;
+  std::getline(file, boot_id);
+  return boot_id.substr(0, boot_id_len - 1);
+}
+
+Region::Region(const std::string& path, const Layout& layout, const Topology* topology, int numa_node)
+  : _path{path}
+  , _layout{layout}
+{
+  _state_offset = align_up(sizeof(Header), 64);
+  _index_offset = align_up(_state_offset + layout.state_len, part_alignment);
+  _mem_offset = align_up(_index_offset + layout.index_len, part_alignment);
+  _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (_fd < 0) {
+    throw std::system_error(errno, std::system_category(), "open(" + path + ")");
+  }
+  try {
+    if (::flock(_fd, LOCK_EX | LOCK_NB) < 0) {
+      throw std::system_error(errno, std::system_category(), "flock(" + path + ")");
+    }
+    // On hugetlbfs, the block size is the huge page size, and the file size
+    // must be a multiple of it.
+    struct ::statfs fs;
+    if (::fstatfs(_fd, &fs) < 0) {
+      throw std::system_error(errno, std::system_category(), "fstatfs(" + path + ")");
+    }
+    _len = align_up(_mem_offset + layout.mem_len, std::max<size_t>(fs.f_bsize, part_alignment));
+    struct ::stat st;
+    if (::fstat(_fd, &st) < 0) {
+      throw std::system_error(errno, std::system_category(), "fstat(" + path + ")");
+    }
+    std::string reason;
+    if (st.st_size > 0) {
+      Header header;
+      if (size_t(st.st_size) != _len || ::pread(_fd, &header, sizeof(header), 0) != sizeof(header)) {
+        reason = "the memory limit has changed";
+      } else {
+        _reattached = validate(header, reason);
+      }
+      if (!_reattached) {
+        std::cout << "warning: Not reattaching to " << path << ": " << reason << "." << std::endl;
+      }
+    }
+    if (!_reattached) {
+      reset();
+    }
+    void* mem = ::mmap(nullptr, _len, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (mem == MAP_FAILED) {
+      throw std::system_error(errno, std::system_category(), "mmap(" + path + ")");
+    }
+    _mem = reinterpret_cast<char*>(mem);
+    if (topology) {
+      topology->bind_memory(_mem, _len, numa_node);
+    }
+  } catch (...) {
+    if (_mem) {
+      ::munmap(_mem, _len);
+    }
+    ::close(_fd);
+    throw;
+  }
+  auto* hdr = header();
+  if (!_reattached) {
+    hdr->magic = region_magic;
+    hdr->version = layout_version;
+    hdr->layout = layout;
+    auto boot_id = read_boot_id();
+    std::memcpy(hdr->boot_id, boot_id.c_str(), boot_id.size() + 1);
+  }
+  hdr->clean = 0;
+}
+
+Region::~Region()
+{
+  ::munmap(_mem, _len);
+  ::close(_fd);
+}
+
+void
+Region::close_cleanly()
+{
+  header()->clean = 1;
+}
+
+Region::Header*
+Region::header() const
+{
+  return reinterpret_cast<Header*>(_mem);
+}
+
+bool
+Region::validate(const Header& header, std::string& reason) const
+{
+  if (header.magic != region_magic) {
+    reason = "not a rainbow region";
+    return false;
+  }
+  if (header.version != layout_version) {
+    reason = "layout version " + std::to_string(header.version) + " is not " + std::to_string(layout_version);
+    return false;
+  }
+  if (std::memcmp(&header.layout, &_layout, sizeof(_layout)) != 0) {
+    reason = "the memory limit, partitions, item layout, or key hash function have changed";
+    return false;
+  }
+  if (!header.clean) {
+    reason = "the previous daemon did not shut down cleanly";
+    return false;
+  }
+  if (std::string_view{header.boot_id, strnlen(header.boot_id, sizeof(header.boot_id))} != read_boot_id()) {
+    reason = "the system has rebooted";
+    return false;
+  }
+  return true;
+}
+
+/// Zeroes the file, which also releases the memory it held.
+void
+Region::reset()
+{
+  if (::ftruncate(_fd, 0) < 0 || ::ftruncate(_fd, _len) < 0) {
+    throw std::system_error(errno, std::system_category(), "ftruncate(" + _path + ")");
+  }
+}
+
+}
@@ -0,0 +1,166 @@
+#include "rainbow/replication.hpp"
+
+#include "rainbow/steering.hpp"
+#include "rainbow/store.hpp"
+
+#include "steering.h"
+
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+extern "C" {
+#include <bpf.h>
+}
+
+namespace rainbow {
+
+Replication::Replication(unsigned int nr_partitions, int replica_map_fd)
+  : _nr_partitions{nr_partitions}
+  , _replica_map_fd{replica_map_fd}
+{
+  if (nr_partitions > RAINBOW_MAX_REPLICAS) {
+    throw std::invalid_argument("hot key replication supports at most " + std::to_string(RAINBOW_MAX_REPLICAS) +
+                                " partitions");
+  }
+  for (unsigned int i = 0; i < nr_partitions * nr_partitions; i++) {
+    _channels.push_back(std::make_unique<Channel>());
+  }
+}
+
+Replication::Channel&
+Replication::channel(uint32_t src, uint32_t dst)
+{
+  return *_channels[src * _nr_partitions + dst];
+}
+
+void
+Replication::send(uint32_t src, uint32_t dst, std::unique_ptr<ReplicaUpdate> update)
+{
+  auto& ch = channel(src, dst);
+  if (!ch.backlog.empty() || !ch.ring.try_push(std::move(update))) {
+    ch.backlog.push_back(std::move(update));
+  }
+}
+
+void
+Replication::flush(uint32_t src)
+{
+  for (uint32_t dst = 0; dst < _nr_partitions; dst++) {
+    auto& ch = channel(src, dst);
+    while (!ch.backlog.empty() && ch.ring.try_push(std::move(ch.backlog.front()))) {
+      ch.backlog.pop_front();
+    }
+  }
+}
+
+bool
+Replication::drained(uint32_t src, uint32_t dst)
+{
+  auto& ch = channel(src, dst);
+  return ch.backlog.empty() && ch.ring.empty();
+}
+
+bool
+Replication::receive(uint32_t src, uint32_t dst, std::unique_ptr<ReplicaUpdate>& update)
+{
+  return channel(src, dst).ring.try_pop(update);
+}
+
+void
+Replication::publish(uint32_t hash, const std::vector<uint32_t>& partitions)
+{
+  rainbow_replicas replicas = {};
+  replicas.nr_partitions = std::min<size_t>(partitions.size(), RAINBOW_MAX_REPLICAS);
+  std::copy_n(partitions.begin(), replicas.nr_partitions, replicas.partitions);
+  if (bpf_map_update_elem(_replica_map_fd, &hash, &replicas, BPF_ANY)) {
+    throw std::system_error(errno, std::system_category(), "bpf_map_update_elem(replica_map)");
+  }
+}
+
+void
+Replication::unpublish(uint32_t hash)
+{
+  if (bpf_map_delete_elem(_replica_map_fd, &hash) && errno != ENOENT) {
+    throw std::system_error(errno, std::system_category(), "bpf_map_delete_elem(replica_map)");
+  }
+}
+
+HotKeyReplicator::HotKeyReplicator(SteeringTable& steering,
+                                   std::vector<Store*> stores,
+                                   unsigned int nr_replicas,
+                                   uint64_t min_count)
+  : _steering{steering}
+  , _stores{std::move(stores)}
+  , _nr_replicas{nr_replicas}
+  , _min_count{min_count}
+{
+}
+
+static void
+submit(Store* store, std::unique_ptr<ReplicationCommand> command)
+{
+  while (!store->submit_replication(std::move(command))) {
+    std::this_thread::yield();
+  }
+}
+
+void
+HotKeyReplicator::update(const HotKeys& hot_keys)
+{
+  unsigned int nr_partitions = _stores.size();
+  if (nr_partitions < 2) {
+    return;
+  }
+  unsigned int nr_replicas = _nr_replicas == 0 ? nr_partitions : std::min(_nr_replicas, nr_partitions);
+  std::set<std::string> hot;
+  for (auto& hot_key : hot_keys) {
+    if (hot_key.count < _min_count || _replicated.size() >= RAINBOW_MAX_REPLICATED_KEYS) {
+      continue;
+    }
+    hot.insert(hot_key.key);
+    uint32_t bucket = rainbow_bucket(hot_key.hash);
+    uint32_t owner = _steering.partition_of(bucket);
+    auto it = _replicated.find(hot_key.key);
+    if (it != _replicated.end()) {
+      continue;
+    }
+    std::vector<uint32_t> partitions;
+    for (unsigned int i = 0; i < nr_replicas; i++) {
+      partitions.push_back((owner + i) % nr_partitions);
+    }
+    submit(_stores[owner], std::make_unique<ReplicationCommand>(ReplicationCommand{hot_key.key, std::move(partitions)}));
+    _replicated.emplace(hot_key.key, std::make_pair(bucket, owner));
+  }
+  for (auto it = _replicated.begin(); it != _replicated.end();) {
+    if (hot.count(it->first)) {
+      ++it;
+      continue;
+    }
+    unreplicate(it->first, it->second.second);
+    it = _replicated.erase(it);
+  }
+}
+
+void
+HotKeyReplicator::forget_bucket(uint32_t bucket)
+{
+  for (auto it = _replicated.begin(); it != _replicated.end();) {
+    if (it->second.first != bucket) {
+      ++it;
+      continue;
+    }
+    unreplicate(it->first, it->second.second);
+    it = _replicated.erase(it);
+  }
+}
+
+void
+HotKeyReplicator::unreplicate(const std::string& key, uint32_t owner)
+{
+  submit(_stores[owner], std::make_unique<ReplicationCommand>(ReplicationCommand{key, {}}));
+}
+
+}
@@ -0,0 +1,107 @@
+#include "rainbow/reuseport.hpp"
+
+#include <iostream>
+#include <string>
+#include <system_error>
+
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace rainbow {
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+static constexpr int listen_backlog = 1024;
+
+/// Builds a classic BPF program that returns the index of the partition that
+/// owns the current CPU. For CPUs that no partition owns, it returns an
+/// out-of-range index, which makes the kernel fall back to hashing.
+static std::vector<::sock_filter>
+steer_by_cpu_program(const std::vector<std::vector<unsigned int>>& partition_cpus)
+{
+  std::vector<::sock_filter> prog;
+  prog.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, uint32_t(SKF_AD_OFF + SKF_AD_CPU)));
+  for (size_t partition = 0; partition < partition_cpus.size(); partition++) {
+    for (auto cpu : partition_cpus[partition]) {
+      prog.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu, 0, 1));
+      prog.push_back(BPF_STMT(BPF_RET | BPF_K, uint32_t(partition)));
+    }
+  }
+  prog.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+  return prog;
+}
+
+std::vector<int>
+bind_reuseport_group(int type, uint16_t port, const std::vector<std::vector<unsigned int>>& partition_cpus)
+{
+  std::vector<int> fds;
+  try {
+    // The kernel numbers the sockets of a reuseport group in the order they
+    // join it, which is when they bind for datagram sockets and when they
+    // start listening for stream sockets. The steering program returns that
+    // number.
+    for (size_t i = 0; i < partition_cpus.size(); i++) {
+      // Serve IPv4 and IPv6 from one dual-stack socket, unless the kernel has
+      // no IPv6 support.
+      int fd = ::socket(AF_INET6, type | SOCK_NONBLOCK, 0);
+      bool ipv6 = fd >= 0;
+      if (!ipv6 && errno == EAFNOSUPPORT) {
+        fd = ::socket(AF_INET, type | SOCK_NONBLOCK, 0);
+      }
+      if (fd < 0) {
+        throw std::system_error(errno, std::system_category(), "socket");
+      }
+      fds.push_back(fd);
+      int one = 1;
+      if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        throw std::system_error(errno, std::system_category(), "setsockopt(SO_REUSEPORT)");
+      }
+      ::sockaddr_storage addr{};
+      socklen_t addr_len;
+      if (ipv6) {
+        int zero = 0;
+        if (::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero)) < 0) {
+          throw std::system_error(errno, std::system_category(), "setsockopt(IPV6_V6ONLY)");
+        }
+        auto* sin6 = reinterpret_cast<::sockaddr_in6*>(&addr);
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = in6addr_any;
+        sin6->sin6_port = htons(port);
+        addr_len = sizeof(*sin6);
+      } else {
+        auto* sin = reinterpret_cast<::sockaddr_in*>(&addr);
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(INADDR_ANY);
+        sin->sin_port = htons(port);
+        addr_len = sizeof(*sin);
+      }
+      if (::bind(fd, reinterpret_cast<::sockaddr*>(&addr), addr_len) < 0) {
+        throw std::system_error(errno, std::system_category(), "bind(" + std::to_string(port) + ")");
+      }
+      if (type == SOCK_STREAM && ::listen(fd, listen_backlog) < 0) {
+        throw std::system_error(errno, std::system_category(), "listen");
+      }
+    }
+    auto prog = steer_by_cpu_program(partition_cpus);
+    if (prog.size() > BPF_MAXINSNS) {
+      std::cerr << "warning: Too many CPUs to steer sockets by CPU" << std::endl;
+      return fds;
+    }
+    ::sock_fprog fprog{static_cast<unsigned short>(prog.size()), prog.data()};
+    if (!fds.empty() && ::setsockopt(fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog)) < 0) {
+      throw std::system_error(errno, std::system_category(), "setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+    }
+  } catch (...) {
+    for (auto fd : fds) {
+      ::close(fd);
+    }
+    throw;
+  }
+  return fds;
+}
+
+}
@@ -0,0 +1,69 @@
+#ifndef RAINBOW_SKETCH_H
+#define RAINBOW_SKETCH_H
+
+/*
+ * Hot key detection shared by the XDP program and userspace.
+ *
+ * The XDP program counts every request in a per-CPU count-min sketch, indexed
+ * by the key hash that it already computes for steering. A sketch only knows
+ * about hashes, so when the estimate for a key reaches
+ * RAINBOW_HOT_KEY_THRESHOLD, the program also records the key itself in a
+ * small per-CPU candidate table. Userspace periodically sums both over all
+ * CPUs, extracts the top-K keys, and clears the sketch to start a new period.
+ */
+
+#include <linux/types.h>
+
+#define RAINBOW_SKETCH_DEPTH 4
+#define RAINBOW_SKETCH_WIDTH_SHIFT 10
+#define RAINBOW_SKETCH_WIDTH (1 << RAINBOW_SKETCH_WIDTH_SHIFT)
+
+#define RAINBOW_NR_HOT_KEY_SLOTS 256
+#define RAINBOW_HOT_KEY_THRESHOLD 64
+
+/* Same as RAINBOW_MAX_KEY_LEN in keyhash.h. */
+#define RAINBOW_HOT_KEY_MAX_LEN 250
+
+struct rainbow_sketch {
+	__u32 counters[RAINBOW_SKETCH_DEPTH][RAINBOW_SKETCH_WIDTH];
+};
+
+struct rainbow_hot_key {
+	__u32 hash;
+	__u32 count;
+	__u16 key_len;
+	__u8 key[RAINBOW_HOT_KEY_MAX_LEN];
+};
+
+/*
+ * Derive an independent row index from one hash by multiplying with a
+ * different odd constant per row. A switch, rather than a table, keeps the
+ * constants out of global data, which older kernels do not support.
+ */
+static inline __u32 rainbow_sketch_index(__u32 hash, int row)
+{
+	__u32 seed;
+
+	switch (row) {
+	case 0:
+		seed = 0x9e3779b1;
+		break;
+	case 1:
+		seed = 0x85ebca77;
+		break;
+	case 2:
+		seed = 0xc2b2ae3d;
+		break;
+	default:
+		seed = 0x27d4eb2f;
+		break;
+	}
+	return (hash * seed) >> (32 - RAINBOW_SKETCH_WIDTH_SHIFT);
+}
+
+static inline __u32 rainbow_hot_key_slot(__u32 hash)
+{
+	return hash % RAINBOW_NR_HOT_KEY_SLOTS;
+}
+
+#endif
@@ -0,0 +1,225 @@
+#include "rainbow/slab.hpp"
+
+#include "rainbow/numa.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <sys/mman.h>
+
+namespace rainbow {
+
+SlabAllocator::SlabAllocator(size_t mem_limit, const Topology* topology, int numa_node, bool hugepages)
+  : _mem_limit{mem_limit - mem_limit % page_size}
+  , _owned_state{new char[state_len(_mem_limit)]()}
+  , _state{reinterpret_cast<State*>(_owned_state.get())}
+  , _page_classes{reinterpret_cast<uint8_t*>(_state + 1)}
+{
+  if (_mem_limit == 0) {
+    throw std::invalid_argument("memory limit must be at least " + std::to_string(page_size) + " bytes");
+  }
+  // Reserve the address space, but let the kernel populate it lazily as
+  // pages are handed out to size classes.
+  void* mem = ::mmap(nullptr, _mem_limit, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(), "mmap");
+  }
+  _mem = reinterpret_cast<char*>(mem);
+  if (hugepages && ::madvise(_mem, _mem_limit, MADV_HUGEPAGE) < 0) {
+    throw std::system_error(errno, std::system_category(), "madvise(MADV_HUGEPAGE)");
+  }
+  if (topology) {
+    topology->bind_memory(_mem, _mem_limit, numa_node);
+  }
+  init_classes();
+}
+
+SlabAllocator::SlabAllocator(char* mem, size_t mem_limit, State* state)
+  : _mem{mem}
+  , _mem_limit{mem_limit - mem_limit % page_size}
+  , _owns_mem{false}
+  , _owned_state{state ? nullptr : new char[state_len(_mem_limit)]()}
+  , _state{state ? state : reinterpret_cast<State*>(_owned_state.get())}
+  , _page_classes{reinterpret_cast<uint8_t*>(_state + 1)}
+{
+  if (_mem_limit == 0) {
+    throw std::invalid_argument("memory limit must be at least " + std::to_string(page_size) + " bytes");
+  }
+  if (_state->nr_classes == 0) {
+    init_classes();
+  }
+}
+
+SlabAllocator::~SlabAllocator()
+{
+  if (_owns_mem) {
+    ::munmap(_mem, _mem_limit);
+  }
+}
+
+size_t
+SlabAllocator::state_len(size_t mem_limit)
+{
+  return sizeof(State) + mem_limit / page_size;
+}
+
+void
+SlabAllocator::init_classes()
+{
+  size_t size = min_chunk_size;
+  while (size < page_size / 2 && _state->nr_classes < max_classes - 1) {
+    _state->classes[_state->nr_classes++].chunk_size = size;
+    size = size * growth_factor;
+    size = (size + 7) & ~size_t(7);
+  }
+  _state->classes[_state->nr_classes++].chunk_size = page_size;
+}
+
+int
+SlabAllocator::class_for(size_t size) const
+{
+  for (size_t cls = 0; cls < _state->nr_classes; cls++) {
+    if (size <= _state->classes[cls].chunk_size) {
+      return cls;
+    }
+  }
+  return -1;
+}
+
+void*
+SlabAllocator::alloc(int cls)
+{
+  auto& slab_class = _state->classes[cls];
+  for (;;) {
+    if (!slab_class.free_list && !grow(slab_class)) {
+      return nullptr;
+    }
+    FreeChunk* chunk = slab_class.free_list;
+    // Do not leave the walk of the free list pointing into a chunk that is
+    // no longer on it.
+    if (_move && _move->cursor == &chunk->next) {
+      _move->cursor = &slab_class.free_list;
+    }
+    slab_class.free_list = chunk->next;
+    slab_class.nr_free--;
+    if (!_move || page_of(chunk) != _move->page) {
+      return chunk;
+    }
+    // A free chunk of the page that is being moved, which the walk has not
+    // got to yet.
+    keep_for_move(chunk);
+  }
+}
+
+void
+SlabAllocator::free(int cls, void* chunk)
+{
+  if (_move && page_of(chunk) == _move->page) {
+    keep_for_move(chunk);
+    return;
+  }
+  auto& slab_class = _state->classes[cls];
+  auto* free_chunk = reinterpret_cast<FreeChunk*>(chunk);
+  free_chunk->next = slab_class.free_list;
+  slab_class.free_list = free_chunk;
+  slab_class.nr_free++;
+}
+
+char*
+SlabAllocator::alloc_page()
+{
+  if (_state->mem_used + page_size > _mem_limit) {
+    return nullptr;
+  }
+  char* page = _mem + _state->mem_used;
+  _state->mem_used += page_size;
+  return page;
+}
+
+bool
+SlabAllocator::grow(SlabClass& slab_class)
+{
+  char* page = alloc_page();
+  if (!page) {
+    return false;
+  }
+  carve(&slab_class - _state->classes, page);
+  return true;
+}
+
+void
+SlabAllocator::carve(int cls, char* page)
+{
+  auto& slab_class = _state->classes[cls];
+  size_t nr_chunks = page_size / slab_class.chunk_size;
+  for (size_t i = nr_chunks; i > 0; i--) {
+    auto* chunk = reinterpret_cast<FreeChunk*>(page + (i - 1) * slab_class.chunk_size);
+    chunk->next = slab_class.free_list;
+    slab_class.free_list = chunk;
+  }
+  slab_class.nr_pages++;
+  slab_class.nr_free += nr_chunks;
+  _page_classes[page_of(page)] = cls + 1;
+}
+
+void
+SlabAllocator::start_move(size_t n)
+{
+  int cls = page_class(n);
+  _move = Move{n, cls, std::vector<bool>(nr_chunks(cls)), 0, &_state->classes[cls].free_list};
+}
+
+bool
+SlabAllocator::walk_free_list(size_t budget)
+{
+  // The class that a page is taken from tends to be the one with the most
+  // free chunks, so its free list is walked a slice at a time.
+  auto& slab_class = _state->classes[_move->cls];
+  for (size_t i = 0; i < budget && _move->cursor; i++) {
+    FreeChunk* chunk = *_move->cursor;
+    if (!chunk) {
+      _move->cursor = nullptr;
+    } else if (page_of(chunk) == _move->page) {
+      *_move->cursor = chunk->next;
+      slab_class.nr_free--;
+      keep_for_move(chunk);
+    } else {
+      _move->cursor = &chunk->next;
+    }
+  }
+  return !_move->cursor;
+}
+
+void
+SlabAllocator::keep_for_move(void* chunk)
+{
+  size_t i = (reinterpret_cast<char*>(chunk) - page(_move->page)) / chunk_size(_move->cls);
+  _move->free[i] = true;
+  _move->nr_free++;
+}
+
+void
+SlabAllocator::finish_move(int cls)
+{
+  auto& from = _state->classes[_move->cls];
+  from.nr_pages--;
+  carve(cls, page(_move->page));
+  _move.reset();
+}
+
+void
+SlabAllocator::abort_move()
+{
+  auto move = std::move(*_move);
+  _move.reset();
+  size_t len = chunk_size(move.cls);
+  for (size_t i = 0; i < move.free.size(); i++) {
+    if (move.free[i]) {
+      free(move.cls, page(move.page) + i * len);
+    }
+  }
+}
+
+}
@@ -0,0 +1,280 @@
+#include "rainbow/snapshot.hpp"
+
+#include "rainbow/store.hpp"
+
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace rainbow {
+
+/// Size of the buffers that records are gathered into. Writes of this size
+/// keep the disk busy without holding up the partition for long when the
+/// kernel copies a buffer inline.
+static constexpr size_t buffer_size = 256 << 10;
+
+/// Maximum number of buffers that are written or waiting to be written.
+static constexpr size_t max_writes_in_flight = 8;
+
+static constexpr unsigned int sq_entries = 16;
+static constexpr unsigned int cq_entries = 64;
+
+static constexpr uint64_t header_tag = max_writes_in_flight;
+static constexpr uint64_t fsync_tag = max_writes_in_flight + 1;
+
+Snapshot::Snapshot(const std::string& path, uint32_t partition, uint32_t nr_partitions)
+  : _path{path}
+  , _tmp_path{path + ".tmp"}
+  , _ring{sq_entries, cq_entries}
+  , _writes(max_writes_in_flight)
+{
+  _fd = ::open(_tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (_fd < 0) {
+    throw std::system_error(errno, std::system_category(), "open(" + _tmp_path + ")");
+  }
+  _header.magic = magic;
+  _header.version = version;
+  _header.partition = partition;
+  _header.nr_partitions = nr_partitions;
+  for (uint32_t i = 0; i < max_writes_in_flight; i++) {
+    _free_writes.push_back(max_writes_in_flight - i - 1);
+  }
+  _buf.reserve(buffer_size);
+}
+
+Snapshot::~Snapshot()
+{
+  // The kernel may still be reading from the buffers.
+  while (_nr_in_flight > 0) {
+    try {
+      _ring.submit(1);
+    } catch (const std::system_error&) {
+      break;
+    }
+    _ring.reap([this](const ::io_uring_cqe&) { _nr_in_flight--; });
+  }
+  ::close(_fd);
+  if (!_done) {
+    ::unlink(_tmp_path.c_str());
+  }
+}
+
+void
+Snapshot::append(const Item& item)
+{
+  auto value = item.plain_value(_plain);
+  if (!value) {
+    return;
+  }
+  Record record{};
+  record.value_len = value->size();
+  record.flags = item.flags;
+  record.exptime = to_unix_time(item.exptime);
+  record.key_len = item.key_len;
+  size_t len = sizeof(record) + item.key_len + value->size();
+  if (!_buf.empty() && _buf.size() + len > buffer_size) {
+    queue_buf();
+  }
+  size_t offset = _buf.size();
+  _buf.resize(offset + len);
+  std::memcpy(&_buf[offset], &record, sizeof(record));
+  std::memcpy(&_buf[offset + sizeof(record)], item.key().data(), item.key_len);
+  std::memcpy(&_buf[offset + sizeof(record) + item.key_len], value->data(), value->size());
+  _header.nr_items++;
+  _header.len += len;
+}
+
+bool
+Snapshot::backlogged() const
+{
+  return _full.size() + _nr_in_flight >= max_writes_in_flight;
+}
+
+void
+Snapshot::queue_buf()
+{
+  _full.push_back(std::move(_buf));
+  _buf = {};
+  if (!_spare.empty()) {
+    _buf = std::move(_spare.back());
+    _spare.pop_back();
+  } else {
+    _buf.reserve(buffer_size);
+  }
+}
+
+void
+Snapshot::poll()
+{
+  bool submitted = false;
+  while (!_full.empty() && !_free_writes.empty()) {
+    auto* sqe = _ring.get_sqe();
+    if (!sqe) {
+      break;
+    }
+    uint32_t slot = _free_writes.back();
+    _free_writes.pop_back();
+    _writes[slot] = std::move(_full.front());
+    _full.pop_front();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = _fd;
+    sqe->addr = reinterpret_cast<uint64_t>(_writes[slot].data());
+    sqe->len = _writes[slot].size();
+    sqe->off = _offset;
+    sqe->user_data = slot;
+    _offset += _writes[slot].size();
+    _nr_in_flight++;
+    submitted = true;
+  }
+  if (!submitted && _nr_in_flight == 0) {
+    return;
+  }
+  _ring.submit();
+  _ring.reap([this](const ::io_uring_cqe& cqe) {
+    _nr_in_flight--;
+    if (cqe.res < 0) {
+      const char* call = cqe.user_data == fsync_tag ? "fsync(" : "write(";
+      throw std::system_error(-cqe.res, std::system_category(), call + _tmp_path + ")");
+    }
+    if (cqe.user_data < max_writes_in_flight) {
+      auto& buf = _writes[cqe.user_data];
+      if (size_t(cqe.res) != buf.size()) {
+        throw std::runtime_error("write(" + _tmp_path + "): short write");
+      }
+      buf.clear();
+      _spare.push_back(std::move(buf));
+      _free_writes.push_back(cqe.user_data);
+    } else if (cqe.user_data == header_tag && size_t(cqe.res) != sizeof(_header)) {
+      throw std::runtime_error("write(" + _tmp_path + "): short write");
+    }
+  });
+}
+
+bool
+Snapshot::finish()
+{
+  if (!_buf.empty()) {
+    queue_buf();
+  }
+  poll();
+  if (!_full.empty() || _nr_in_flight > 0) {
+    return false;
+  }
+  if (!_synced) {
+    // The header goes out after the records, and the sync is linked to it,
+    // so that it covers everything.
+    auto* write = _ring.get_sqe();
+    auto* sync = write ? _ring.get_sqe() : nullptr;
+    if (!sync) {
+      return false;
+    }
+    write->opcode = IORING_OP_WRITE;
+    write->fd = _fd;
+    write->addr = reinterpret_cast<uint64_t>(&_header);
+    write->len = sizeof(_header);
+    write->off = 0;
+    write->flags = IOSQE_IO_LINK;
+    write->user_data = header_tag;
+    sync->opcode = IORING_OP_FSYNC;
+    sync->fd = _fd;
+    sync->user_data = fsync_tag;
+    _nr_in_flight += 2;
+    _synced = true;
+    _ring.submit();
+    return false;
+  }
+  if (::rename(_tmp_path.c_str(), _path.c_str()) < 0) {
+    throw std::system_error(errno, std::system_category(), "rename(" + _tmp_path + ")");
+  }
+  _done = true;
+  return true;
+}
+
+size_t
+load_snapshot(const std::string& path,
+              Store& store,
+              uint32_t partition,
+              uint32_t nr_partitions,
+              const std::function<bool(uint32_t hash)>& owns)
+{
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    throw std::system_error(errno, std::system_category(), "open(" + path + ")");
+  }
+  struct ::stat st;
+  if (::fstat(fd, &st) < 0) {
+    int err = errno;
+    ::close(fd);
+    throw std::system_error(err, std::system_category(), "fstat(" + path + ")");
+  }
+  size_t len = st.st_size;
+  if (len < sizeof(Snapshot::Header)) {
+    ::close(fd);
+    throw std::runtime_error(path + " is not a snapshot");
+  }
+  void* mem = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  int err = errno;
+  ::close(fd);
+  if (mem == MAP_FAILED) {
+    throw std::system_error(err, std::system_category(), "mmap(" + path + ")");
+  }
+  ::madvise(mem, len, MADV_SEQUENTIAL);
+  auto* data = reinterpret_cast<const char*>(mem);
+  size_t nr_loaded = 0;
+  try {
+    Snapshot::Header header;
+    std::memcpy(&header, data, sizeof(header));
+    if (header.magic != Snapshot::magic || header.version != Snapshot::version) {
+      throw std::runtime_error(path + " is not a version " + std::to_string(Snapshot::version) + " snapshot");
+    }
+    if (header.partition != partition || header.nr_partitions != nr_partitions) {
+      throw std::runtime_error(path + " is a snapshot of partition " + std::to_string(header.partition) + " of " +
+                               std::to_string(header.nr_partitions));
+    }
+    if (header.len != len - sizeof(header)) {
+      throw std::runtime_error(path + " is truncated");
+    }
+    uint32_t now = std::time(nullptr);
+    const char* p = data + sizeof(header);
+    const char* end = data + len;
+    for (uint64_t i = 0; i < header.nr_items; i++) {
+      Snapshot::Record record;
+      if (size_t(end - p) < sizeof(record)) {
+        throw std::runtime_error(path + " is truncated");
+      }
+      std::memcpy(&record, p, sizeof(record));
+      p += sizeof(record);
+      if (size_t(end - p) < size_t(record.key_len) + record.value_len) {
+        throw std::runtime_error(path + " is truncated");
+      }
+      std::string_view key{p, record.key_len};
+      std::string_view value{p + record.key_len, record.value_len};
+      p += record.key_len + record.value_len;
+      if (record.exptime != 0 && record.exptime <= now) {
+        continue;
+      }
+      if (!owns(store.hasher()(key.data(), key.size()))) {
+        continue;
+      }
+      if (store.set(key, value, record.flags, record.exptime) == SetResult::Stored) {
+        nr_loaded++;
+      }
+    }
+  } catch (...) {
+    ::munmap(mem, len);
+    throw;
+  }
+  ::munmap(mem, len);
+  return nr_loaded;
+}
+
+}
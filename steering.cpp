@@ -0,0 +1,138 @@
+#include "rainbow/steering.hpp"
+
+#include "steering.h"
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+extern "C" {
+#include <bpf.h>
+}
+
+namespace rainbow {
+
+SteeringTable::SteeringTable(int map_fd)
+  : _map_fd{map_fd}
+  , _buckets(RAINBOW_NR_BUCKETS)
+{
+}
+
+void
+SteeringTable::fill(unsigned int nr_partitions)
+{
+  if (nr_partitions == 0) {
+    throw std::invalid_argument("number of partitions must be positive");
+  }
+  _nr_partitions = nr_partitions;
+  for (uint32_t bucket = 0; bucket < _buckets.size(); bucket++) {
+    assign(bucket, bucket % nr_partitions);
+  }
+}
+
+size_t
+SteeringTable::resize(unsigned int nr_partitions)
+{
+  if (nr_partitions == 0) {
+    throw std::invalid_argument("number of partitions must be positive");
+  }
+  // Every partition ends up with either `quota` or `quota + 1` buckets. Only
+  // buckets whose owner is gone or over its share move, and they move to the
+  // partitions that are under their share.
+  size_t quota = _buckets.size() / nr_partitions;
+  size_t nr_larger = _buckets.size() % nr_partitions;
+  std::vector<size_t> counts(nr_partitions);
+  std::vector<uint32_t> moving;
+  for (uint32_t bucket = 0; bucket < _buckets.size(); bucket++) {
+    uint32_t owner = _buckets[bucket];
+    if (owner < nr_partitions && counts[owner] < quota) {
+      counts[owner]++;
+    } else {
+      moving.push_back(bucket);
+    }
+  }
+  // Buckets over the base quota stay put while there is room for partitions
+  // with one extra bucket.
+  std::vector<uint32_t> orphans;
+  for (auto bucket : moving) {
+    uint32_t owner = _buckets[bucket];
+    if (owner < nr_partitions && counts[owner] == quota && nr_larger > 0) {
+      counts[owner]++;
+      nr_larger--;
+    } else {
+      orphans.push_back(bucket);
+    }
+  }
+  uint32_t partition = 0;
+  for (auto bucket : orphans) {
+    while (counts[partition] > quota || (counts[partition] == quota && nr_larger == 0)) {
+      partition++;
+    }
+    if (counts[partition] == quota) {
+      nr_larger--;
+    }
+    counts[partition]++;
+    assign(bucket, partition);
+  }
+  _nr_partitions = nr_partitions;
+  return orphans.size();
+}
+
+void
+SteeringTable::assign(uint32_t bucket, uint32_t partition)
+{
+  if (bucket >= _buckets.size()) {
+    throw std::out_of_range("bucket out of range: " + std::to_string(bucket));
+  }
+  int err = bpf_map_update_elem(_map_fd, &bucket, &partition, 0);
+  if (err) {
+    throw std::system_error(errno, std::system_category(), "bpf_map_update_elem(bucket_map)");
+  }
+  _buckets[bucket] = partition;
+}
+
+void
+SteeringTable::save(const std::string& path) const
+{
+  // Replace the old table in one step, so that it is never half written.
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream file{tmp_path, std::ios::binary | std::ios::trunc};
+    uint32_t header[] = {uint32_t(_buckets.size()), _nr_partitions};
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(_buckets.data()), _buckets.size() * sizeof(_buckets[0]));
+    if (!file.flush()) {
+      throw std::runtime_error("cannot write " + tmp_path);
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) < 0) {
+    throw std::system_error(errno, std::system_category(), "rename(" + path + ")");
+  }
+}
+
+bool
+SteeringTable::load(const std::string& path, unsigned int nr_partitions)
+{
+  std::ifstream file{path, std::ios::binary};
+  uint32_t header[2];
+  std::vector<uint32_t> buckets(_buckets.size());
+  if (!file.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != buckets.size() ||
+      header[1] != nr_partitions ||
+      !file.read(reinterpret_cast<char*>(buckets.data()), buckets.size() * sizeof(buckets[0]))) {
+    return false;
+  }
+  for (auto partition : buckets) {
+    if (partition >= nr_partitions) {
+      return false;
+    }
+  }
+  _nr_partitions = nr_partitions;
+  for (uint32_t bucket = 0; bucket < buckets.size(); bucket++) {
+    assign(bucket, buckets[bucket]);
+  }
+  return true;
+}
+
+}
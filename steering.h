@@ -0,0 +1,56 @@
+#ifndef RAINBOW_STEERING_H
+#define RAINBOW_STEERING_H
+
+/*
+ * Bucket-to-partition indirection table shared by the XDP program and
+ * userspace.
+ *
+ * The XDP program maps a key hash to one of RAINBOW_NR_BUCKETS buckets and
+ * looks up the owning partition in an array map that userspace fills in.
+ * Changing the number of partitions only rewrites the entries of the buckets
+ * that move, instead of remapping almost every key like `hash % nr_cpus`.
+ */
+
+#include <linux/types.h>
+
+#define RAINBOW_NR_BUCKETS_SHIFT 12
+#define RAINBOW_NR_BUCKETS (1 << RAINBOW_NR_BUCKETS_SHIFT)
+
+/*
+ * Use the high bits of the hash for the bucket so that the low bits, which
+ * the per-partition store indexes by, stay evenly distributed within a
+ * partition.
+ */
+static inline __u32 rainbow_bucket(__u32 hash)
+{
+	return hash >> (32 - RAINBOW_NR_BUCKETS_SHIFT);
+}
+
+/*
+ * AF_XDP sockets, keyed by NIC queue and partition. A socket only receives
+ * the packets of the queue it is bound to, so every partition has a socket on
+ * every queue, and the XDP program picks the one of the partition that owns
+ * the key on the queue that the packet arrived on.
+ */
+#define RAINBOW_MAX_QUEUES 64
+#define RAINBOW_MAX_PARTITIONS 64
+
+static inline __u32 rainbow_xsk_slot(__u32 queue, __u32 partition)
+{
+	return queue * RAINBOW_MAX_PARTITIONS + partition;
+}
+
+/*
+ * Hot keys that are replicated read-only to several partitions, keyed by key
+ * hash. The XDP program spreads GET requests for these keys over the replica
+ * partitions; every other request still goes to the owning partition.
+ */
+#define RAINBOW_MAX_REPLICATED_KEYS 1024
+#define RAINBOW_MAX_REPLICAS 64
+
+struct rainbow_replicas {
+	__u32 nr_partitions;
+	__u32 partitions[RAINBOW_MAX_REPLICAS];
+};
+
+#endif
@@ -0,0 +1,1923 @@
+#include "rainbow/store.hpp"
+
+#include "rainbow/compress.hpp"
+#include "rainbow/extstore.hpp"
+#include "rainbow/frequency_sketch.hpp"
+#include "rainbow/log_allocator.hpp"
+#include "rainbow/migration.hpp"
+#include "rainbow/replication.hpp"
+#include "rainbow/snapshot.hpp"
+#include "rainbow/umem.hpp"
+
+#include "steering.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <new>
+#include <system_error>
+
+#include <sys/mman.h>
+
+namespace rainbow {
+
+static constexpr size_t initial_index_size = 1 << 16;
+
+/// Maximum number of index slots a migration scans per poll.
+static constexpr size_t migration_scan_budget = 256;
+
+/// Maximum number of migration records a destination applies per poll.
+static constexpr size_t migration_apply_budget = 256;
+
+/// Maximum number of index slots a snapshot scans per poll.
+static constexpr size_t snapshot_scan_budget = 1024;
+
+/// Maximum number of index slots the sweeper scans per poll, for the items
+/// of a flush.
+static constexpr size_t sweep_scan_budget = 1024;
+
+/// Maximum number of chains that a growing index splits per poll.
+static constexpr size_t index_grow_budget = 1024;
+
+/// Number of LRU tail items to try to evict before giving up on an allocation.
+static constexpr int max_evictions = 5;
+
+/// Items with smaller values are evicted rather than moved to flash, where
+/// they would not save much memory.
+static constexpr size_t min_cold_value_len = 64;
+
+/// Bounds on the copies of items on flash that are kept around after they
+/// have been read.
+static constexpr size_t max_staged = 1024;
+static constexpr size_t max_staged_len = 64 << 20;
+
+/// The log cleaner keeps this many segments free, so that stores seldom
+/// have to wait for evictions.
+static constexpr size_t min_free_segments = 2;
+
+/// Segments with more live bytes than this are evicted rather than cleaned,
+/// because moving their items would take nearly as much memory as it frees.
+static constexpr size_t max_clean_live = LogAllocator::segment_size * 7 / 8;
+
+/// Maximum number of items the log cleaner looks at per poll.
+static constexpr size_t log_clean_budget = 256;
+
+/// The slab mover compares the pressure on size classes over windows of
+/// this many seconds, and moves a page to the class that had the most for
+/// this many windows in a row.
+static constexpr uint32_t slab_move_window = 1;
+static constexpr int slab_move_streak = 3;
+
+/// Maximum number of chunks the slab mover looks at per poll.
+static constexpr size_t slab_move_budget = 64;
+
+/// Maximum number of free chunks the slab mover walks past per poll, while
+/// it takes the free chunks of the page it moves off the free list.
+static constexpr size_t slab_walk_budget = 1024;
+
+/// The window of new items of the admission filter holds this percentage
+/// of the items of a size class.
+static constexpr size_t window_percent = 1;
+
+/// The frequency sketch of the admission filter has a counter for every
+/// this many bytes of item memory, which is about one per item.
+static constexpr size_t sketch_bytes_per_key = 256;
+
+/// Expiration times larger than this are absolute Unix times.
+static constexpr uint32_t max_relative_exptime = 60 * 60 * 24 * 30;
+
+/// The last flush of all partitions, with a sequence number in the high 32
+/// bits, and the time at which it takes effect, on the store clock, in the
+/// low 32 bits. Every partition picks it up in its own time.
+static std::atomic<uint64_t> flush_request{0};
+
+uint32_t
+current_time()
+{
+  ::timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  // Start at one so that an expiration time of zero can mean "never".
+  return ts.tv_sec + 1;
+}
+
+uint32_t
+to_exptime(uint32_t exptime)
+{
+  if (exptime == 0) {
+    return 0;
+  }
+  uint32_t now = current_time();
+  if (exptime > max_relative_exptime) {
+    int64_t delta = int64_t(exptime) - int64_t(std::time(nullptr));
+    if (delta <= 0) {
+      return 1;
+    }
+    return now + delta;
+  }
+  return now + exptime;
+}
+
+uint32_t
+to_unix_time(uint32_t exptime)
+{
+  if (exptime == 0) {
+    return 0;
+  }
+  return std::time(nullptr) + (int64_t(exptime) - int64_t(current_time()));
+}
+
+static bool
+is_expired(const Item* item, uint32_t now)
+{
+  return item->exptime != 0 && item->exptime <= now;
+}
+
+/// Returns where the value of an item on flash is.
+static ExtLoc
+ext_loc(const Item* item)
+{
+  ExtLoc loc;
+  std::memcpy(&loc, item->key().data() + item->key_len, sizeof(loc));
+  return loc;
+}
+
+size_t
+Item::plain_len() const
+{
+  if (!compressed) {
+    return value_len;
+  }
+  return uncompressed_len(value()).value_or(0);
+}
+
+std::optional<std::string_view>
+Item::plain_value(std::string& buf) const
+{
+  if (!compressed) {
+    return value();
+  }
+  if (!decompress_value(value(), buf)) {
+    return std::nullopt;
+  }
+  return std::string_view{buf};
+}
+
+/// Returns the number of bytes of item memory that `item` takes, which is
+/// the key and where the value is for an item on flash, and the owner's CAS
+/// value for a replica.
+static size_t
+item_len(const Item* item)
+{
+  return sizeof(Item) + item->key_len + (item->external ? sizeof(ExtLoc) : item->value_len) +
+         (item->replica ? sizeof(uint64_t) : 0);
+}
+
+/// Brings the copy of an item on flash up to date with the item, which is
+/// what changes when the item is touched or invalidated.
+static void
+refresh_staged(Item* image, const Item* stub)
+{
+  image->cas = stub->cas;
+  image->flags = stub->flags;
+  image->exptime = stub->exptime;
+  image->stale = stub->stale;
+  image->won = stub->won;
+}
+
+/// Returns the number of index slots to reserve for `mem_limit` bytes of
+/// item memory, which is enough for the index to never fill up.
+static size_t
+index_capacity(size_t mem_limit)
+{
+  size_t capacity = initial_index_size;
+  while (capacity < mem_limit / SlabAllocator::min_chunk_size) {
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+/// Reserves `len` bytes of index in anonymous memory, which the kernel
+/// populates as the index grows into it.
+static void*
+reserve_index(size_t len)
+{
+  void* mem = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(), "mmap");
+  }
+  return mem;
+}
+
+Store::Store(size_t mem_limit, KeyHasher hasher, const Topology* topology, int numa_node, bool hugepages)
+  : _owned_state{std::make_unique<State>()}
+  , _state{_owned_state.get()}
+  , _slabs{mem_limit, topology, numa_node, hugepages}
+  , _hasher{hasher}
+  , _index_capacity{index_capacity(mem_limit)}
+{
+  _index = reinterpret_cast<Slot*>(reserve_index(index_len(_index_capacity)));
+  _keys = reinterpret_cast<KeyBucket*>(_index + _index_capacity);
+  init_state();
+}
+
+Store::Store(Umem& umem, KeyHasher hasher)
+  : _owned_state{std::make_unique<State>()}
+  , _state{_owned_state.get()}
+  , _slabs{umem.items(), umem.item_len()}
+  , _hasher{hasher}
+  , _index_capacity{index_capacity(umem.item_len())}
+{
+  _index = reinterpret_cast<Slot*>(reserve_index(index_len(_index_capacity)));
+  _keys = reinterpret_cast<KeyBucket*>(_index + _index_capacity);
+  init_state();
+}
+
+Store::Store(std::unique_ptr<Region> region, KeyHasher hasher)
+  : _region{std::move(region)}
+  , _state{reinterpret_cast<State*>(_region->state())}
+  , _slabs{_region->mem(),
+           _region->layout().mem_len,
+           reinterpret_cast<SlabAllocator::State*>(_region->state() + sizeof(State))}
+  , _hasher{hasher}
+  , _index{reinterpret_cast<Slot*>(_region->index())}
+  , _index_capacity{_region->layout().index_len / index_len(slots_per_key_bucket) * slots_per_key_bucket}
+{
+  _keys = reinterpret_cast<KeyBucket*>(_index + _index_capacity);
+  init_state();
+}
+
+Store::~Store()
+{
+  if (!_region) {
+    ::munmap(_index, index_len(_index_capacity));
+    return;
+  }
+  // Replicas are only reachable from the heap, so free them instead of
+  // leaking their memory into the next run.
+  for (auto& [key, item] : _replicas) {
+    free_item(item);
+  }
+  if (_slabs.moving_page()) {
+    _slabs.abort_move();
+  }
+  // Both ends of a bucket migration that is in flight have items of the
+  // bucket, so neither is safe to reattach to.
+  if (_migrations_out.empty() && _migrations_in.empty()) {
+    _region->close_cleanly();
+  }
+}
+
+/// Returns the number of bytes of index, slots and key buckets, for
+/// `capacity` slots.
+size_t
+Store::index_len(size_t capacity)
+{
+  return capacity * sizeof(Slot) + capacity / slots_per_key_bucket * sizeof(KeyBucket);
+}
+
+Region::Layout
+Store::region_layout(size_t mem_limit, KeyHasher hasher)
+{
+  Region::Layout layout{};
+  layout.mem_len = mem_limit - mem_limit % SlabAllocator::page_size;
+  layout.state_len = sizeof(State) + SlabAllocator::state_len(layout.mem_len);
+  layout.index_len = index_len(index_capacity(mem_limit));
+  layout.item_header_len = sizeof(Item);
+  layout.key_hash = static_cast<uint32_t>(hasher.kind());
+  return layout;
+}
+
+void
+Store::init_state()
+{
+  if (_state->index_size == 0) {
+    _state->index_size = initial_index_size;
+    _state->next_cas = 1;
+  }
+}
+
+void
+Store::set_partition(uint32_t partition)
+{
+  _partition = partition;
+}
+
+void
+Store::attach_replication(Replication* replication)
+{
+  _replication = replication;
+}
+
+const Item*
+Store::get(std::string_view key)
+{
+  uint32_t hash = _hasher(key.data(), key.size());
+  // Misses count too, because they are what the item would be accessed as.
+  if (_sketch) {
+    _sketch->increment(hash);
+  }
+  auto* item = find(key, hash);
+  if (!item && !_replicas.empty()) {
+    item = find_replica(key);
+  }
+  const Item* found = item;
+  if (item && item->external) {
+    lru_bump(item);
+    bool pending = false;
+    found = stage(item, pending);
+    // The request is processed again once the value is in, and counted then.
+    if (pending) {
+      return nullptr;
+    }
+  }
+  if (!found) {
+    _state->stats.get_misses++;
+    return nullptr;
+  }
+  _state->stats.get_hits++;
+  if (!item->replica && !item->external) {
+    lru_bump(item);
+  }
+  return found;
+}
+
+const Item*
+Store::peek(std::string_view key)
+{
+  auto* item = find(key, _hasher(key.data(), key.size()));
+  if (!item && !_replicas.empty()) {
+    item = find_replica(key);
+  }
+  if (item && item->external) {
+    bool pending = false;
+    return stage(item, pending);
+  }
+  return item;
+}
+
+SetResult
+Store::set(std::string_view key,
+           std::string_view value,
+           uint32_t flags,
+           uint32_t exptime,
+           SetMode mode,
+           uint64_t cas,
+           bool compressed)
+{
+  return store(key, _hasher(key.data(), key.size()), value, flags, to_exptime(exptime), mode, cas, compressed);
+}
+
+bool
+Store::remove(std::string_view key)
+{
+  return erase(key, _hasher(key.data(), key.size()));
+}
+
+RemoveResult
+Store::remove(std::string_view key, uint64_t cas)
+{
+  uint32_t hash = _hasher(key.data(), key.size());
+  auto* item = find(key, hash);
+  if (!item) {
+    return RemoveResult::NotFound;
+  }
+  if (cas && cas_of(item) != cas) {
+    return RemoveResult::Exists;
+  }
+  erase(key, hash);
+  return RemoveResult::Removed;
+}
+
+RemoveResult
+Store::invalidate(std::string_view key, uint64_t cas, std::optional<uint32_t> exptime)
+{
+  uint32_t hash = _hasher(key.data(), key.size());
+  auto* item = find(key, hash);
+  if (!item) {
+    return RemoveResult::NotFound;
+  }
+  if (cas && cas_of(item) != cas) {
+    return RemoveResult::Exists;
+  }
+  item->stale = true;
+  item->won = false;
+  if (exptime) {
+    touch(item, *exptime);
+  } else if (!_replicated.empty()) {
+    invalidate_replicas(key);
+  }
+  return RemoveResult::Removed;
+}
+
+void
+Store::touch(const Item* item, uint32_t exptime)
+{
+  auto* it = const_cast<Item*>(item);
+  if (it->replica) {
+    return;
+  }
+  if (it->staged) {
+    // Touch the item that the copy is of, and keep the copy in line.
+    it->exptime = to_exptime(exptime);
+    it = it->h_next;
+  }
+  it->exptime = to_exptime(exptime);
+  if (!_migrations_out.empty()) {
+    forward(it->hash, it->key(), it);
+  }
+  if (!_migrations_in.empty()) {
+    shadow_migrations(it->hash, it->key());
+  }
+  if (!_replicated.empty()) {
+    invalidate_replicas(it->key());
+  }
+}
+
+void
+Store::claim(const Item* item)
+{
+  auto* it = const_cast<Item*>(item);
+  it->won = true;
+  if (it->staged) {
+    it->h_next->won = true;
+  }
+}
+
+void
+Store::hold(const Item* item)
+{
+  _holds[item]++;
+}
+
+void
+Store::release(const Item* item)
+{
+  auto it = _holds.find(item);
+  if (it == _holds.end() || --it->second > 0) {
+    return;
+  }
+  _holds.erase(it);
+  if (item->zombie) {
+    free_memory(const_cast<Item*>(item));
+  }
+}
+
+/// Returns the top bits of `hash` that a slot keeps of its first item. The
+/// bottom bits pick the slot.
+static uint32_t
+hash_tag(uint32_t hash)
+{
+  return hash >> 17;
+}
+
+size_t
+Store::slot_index(uint32_t hash) const
+{
+  size_t i = hash & (_state->index_size - 1);
+  if (i >= _state->index_size - _state->index_unsplit) {
+    i -= _state->index_size / 2;
+  }
+  return i;
+}
+
+Store::Slot&
+Store::slot_for(uint32_t hash)
+{
+  return _index[slot_index(hash)];
+}
+
+Item*
+Store::head_of(const Slot& slot) const
+{
+  if (!slot.head) {
+    return nullptr;
+  }
+  return reinterpret_cast<Item*>(_slabs.page(0) + (slot.head - 1) * 8);
+}
+
+/// Makes `item` the first item in the chain of slot `i`, and brings the
+/// slot up to date with it.
+void
+Store::set_head(size_t i, Item* item)
+{
+  _index[i].head = item ? (reinterpret_cast<char*>(item) - _slabs.page(0)) / 8 + 1 : 0;
+  refresh_slot(i);
+}
+
+/// Makes what points to `item` in the chain of slot `i` point to `next`
+/// instead.
+void
+Store::replace_in_chain(size_t i, Item* item, Item* next)
+{
+  Item* prev = head_of(_index[i]);
+  if (prev == item) {
+    set_head(i, next);
+    return;
+  }
+  while (prev->h_next != item) {
+    prev = prev->h_next;
+  }
+  prev->h_next = next;
+  refresh_slot(i);
+}
+
+Item*
+Store::find(std::string_view key, uint32_t hash)
+{
+  size_t i = slot_index(hash);
+  auto& slot = _index[i];
+  Item* item = head_of(slot);
+  if (!item) {
+    return nullptr;
+  }
+  // Only a key that is not inline takes looking at the first item to
+  // compare.
+  bool first = slot.tag == hash_tag(hash) &&
+               (slot.key ? slot.key_len == key.size() &&
+                             std::memcmp(_keys[i / slots_per_key_bucket].keys[slot.key - 1], key.data(), key.size()) == 0
+                         : item->hash == hash && item->key() == key);
+  if (!first) {
+    item = slot.chained ? item->h_next.get() : nullptr;
+    while (item && (item->hash != hash || item->key() != key)) {
+      item = item->h_next;
+    }
+    if (!item) {
+      return nullptr;
+    }
+  }
+  if (is_dead(item, current_time())) {
+    unlink(item);
+    _state->stats.expired++;
+    return nullptr;
+  }
+  return item;
+}
+
+/// Returns true if `item` has expired, or was stored before a flush.
+/// Replicas go away when the flush takes effect.
+bool
+Store::is_dead(const Item* item, uint32_t now) const
+{
+  return is_expired(item, now) || (!item->replica && item->cas < _state->flush_cas);
+}
+
+void
+Store::flush(uint32_t exptime)
+{
+  uint32_t at = exptime ? to_exptime(exptime) : current_time();
+  uint64_t request = flush_request.load();
+  uint64_t next;
+  do {
+    next = ((request >> 32) + 1) << 32 | at;
+  } while (!flush_request.compare_exchange_weak(request, next));
+  poll_flush();
+}
+
+/// Picks up a flush of all partitions, and makes a flush take effect once
+/// its time has come. Doing so only takes remembering the CAS value that the
+/// next item gets, which makes all the items before it dead.
+void
+Store::poll_flush()
+{
+  uint64_t request = flush_request.load(std::memory_order_relaxed);
+  if (uint32_t(request >> 32) != _flush_seen) {
+    _flush_seen = request >> 32;
+    _state->flush_at = uint32_t(request);
+  }
+  if (!_state->flush_at || _state->flush_at > current_time()) {
+    return;
+  }
+  _state->flush_at = 0;
+  _state->flush_cas = _state->next_cas;
+  for (auto& [key, item] : _replicas) {
+    free_item(item);
+  }
+  _replicas.clear();
+  _sweep = 0;
+}
+
+/// Unlinks the dead items in the next slice of index slots, so that the
+/// memory of the items of a flush is reused without waiting for them to be
+/// evicted.
+void
+Store::sweep()
+{
+  uint32_t now = current_time();
+  size_t end = std::min(*_sweep + sweep_scan_budget, _state->index_size);
+  for (; *_sweep < end; (*_sweep)++) {
+    Item* item = head_of(_index[*_sweep]);
+    while (item) {
+      Item* next = item->h_next;
+      if (is_dead(item, now)) {
+        unlink(item);
+        _state->stats.expired++;
+      }
+      item = next;
+    }
+  }
+  if (*_sweep >= _state->index_size) {
+    _sweep.reset();
+  }
+}
+
+/// Brings what slot `i` keeps of the first item in its chain up to date,
+/// after the chain has changed. The key goes into the entry of the key
+/// bucket that the slot has already, or into a free one.
+void
+Store::refresh_slot(size_t i)
+{
+  auto& slot = _index[i];
+  Item* head = head_of(slot);
+  if (!head) {
+    slot = Slot{};
+    return;
+  }
+  slot.tag = hash_tag(head->hash);
+  slot.chained = head->h_next != nullptr;
+  if (head->key_len > inline_key_len) {
+    slot.key = 0;
+    return;
+  }
+  size_t first = i - i % slots_per_key_bucket;
+  if (!slot.key) {
+    unsigned int used = 0;
+    for (size_t j = first; j < first + slots_per_key_bucket; j++) {
+      if (_index[j].key) {
+        used |= 1u << (_index[j].key - 1);
+      }
+    }
+    unsigned int free = ~used & ((1u << keys_per_bucket) - 1);
+    if (!free) {
+      return;
+    }
+    slot.key = __builtin_ctz(free) + 1;
+  }
+  slot.key_len = head->key_len;
+  std::memcpy(_keys[i / slots_per_key_bucket].keys[slot.key - 1], head->data(), head->key_len);
+}
+
+SetResult
+Store::store(std::string_view key,
+             uint32_t hash,
+             std::string_view value,
+             uint32_t flags,
+             uint32_t exptime,
+             SetMode mode,
+             uint64_t cas,
+             bool compressed)
+{
+  if (key.size() > Item::max_key_len) {
+    return SetResult::TooLarge;
+  }
+  if (_sketch) {
+    _sketch->increment(hash);
+  }
+  // Take in a flush before handing out a CAS value, because an item that is
+  // stored after the flush must not get a value below its cut-off. Another
+  // partition may have published the flush and answered it since this one
+  // last polled, and a delayed flush may have become due.
+  if (_state->flush_at || uint32_t(flush_request.load(std::memory_order_relaxed) >> 32) != _flush_seen) {
+    poll_flush();
+  }
+  auto* old = find(key, hash);
+  if (cas && !old) {
+    return SetResult::NotFound;
+  }
+  if (cas && cas_of(old) != cas) {
+    return SetResult::Exists;
+  }
+  if ((mode == SetMode::Add && old) || (mode == SetMode::Replace && !old)) {
+    return SetResult::NotStored;
+  }
+  size_t plain_len = value.size();
+  if (compressed) {
+    plain_len = uncompressed_len(value).value_or(0);
+  } else if (_compress_threshold && value.size() >= _compress_threshold && compress_value(value, _compress_buf)) {
+    value = _compress_buf;
+    compressed = true;
+  }
+  int cls = _slabs.class_for(sizeof(Item) + key.size() + value.size());
+  if (cls < 0) {
+    return SetResult::TooLarge;
+  }
+  if (compressed) {
+    _state->stats.uncompressed_bytes += plain_len;
+    _state->stats.compressed_bytes += value.size();
+  }
+  // Like memcached, a failed update leaves no stale value behind.
+  if (old) {
+    unlink(old);
+  }
+  Item* item = nullptr;
+  if (_ext && value.size() >= _ext_item_size) {
+    item = store_external(key, hash, value);
+  }
+  if (!item) {
+    item = alloc_item(cls, sizeof(Item) + key.size() + value.size());
+    if (!item) {
+      return SetResult::OutOfMemory;
+    }
+    item->slab_class = cls;
+    item->external = false;
+    std::memcpy(item->data(), key.data(), key.size());
+    std::memcpy(item->data() + key.size(), value.data(), value.size());
+  }
+  item->cas = _state->next_cas++;
+  item->hash = hash;
+  item->flags = flags;
+  item->exptime = exptime;
+  item->key_len = key.size();
+  item->value_len = value.size();
+  item->replica = false;
+  item->zombie = false;
+  item->stale = false;
+  item->won = false;
+  item->staged = false;
+  item->compressed = compressed;
+  item->freed = false;
+  link(item);
+  if (!_migrations_out.empty()) {
+    forward(hash, key, item);
+  }
+  if (!_migrations_in.empty()) {
+    shadow_migrations(hash, key);
+  }
+  if (!_replicated.empty()) {
+    invalidate_replicas(key);
+  }
+  return SetResult::Stored;
+}
+
+bool
+Store::erase(std::string_view key, uint32_t hash)
+{
+  auto* item = find(key, hash);
+  if (!item) {
+    return false;
+  }
+  unlink(item);
+  if (!_migrations_out.empty()) {
+    forward(hash, key, nullptr);
+  }
+  if (!_migrations_in.empty()) {
+    shadow_migrations(hash, key);
+  }
+  if (!_replicated.empty()) {
+    invalidate_replicas(key);
+  }
+  return true;
+}
+
+/// Writes `value` to flash, and returns an item for `key` that points to
+/// it, or nullptr if the value has to stay in memory after all. The caller
+/// fills in the rest of the item.
+Item*
+Store::store_external(std::string_view key, uint32_t hash, std::string_view value)
+{
+  int cls = _slabs.class_for(sizeof(Item) + key.size() + sizeof(ExtLoc));
+  if (cls < 0) {
+    return nullptr;
+  }
+  Item image{};
+  image.hash = hash;
+  image.key_len = key.size();
+  image.value_len = value.size();
+  auto loc = _ext->append(image, key, value);
+  if (!loc) {
+    return nullptr;
+  }
+  auto* item = alloc_item(cls, sizeof(Item) + key.size() + sizeof(ExtLoc));
+  if (!item) {
+    return nullptr;
+  }
+  item->slab_class = cls;
+  item->external = true;
+  std::memcpy(item->data(), key.data(), key.size());
+  std::memcpy(item->data() + key.size(), &*loc, sizeof(*loc));
+  return item;
+}
+
+/// Allocates an item of `len` bytes in size class `cls`, and evicts items to
+/// make room if need be.
+Item*
+Store::alloc_item(int cls, size_t len)
+{
+  if (_log) {
+    for (int i = 0; i < max_evictions; i++) {
+      if (void* mem = _log->alloc(len)) {
+        return reinterpret_cast<Item*>(mem);
+      }
+      // The cleaner has fallen behind.
+      if (!evict_segment()) {
+        break;
+      }
+    }
+    return nullptr;
+  }
+  for (int i = 0; i < max_evictions; i++) {
+    void* chunk = _slabs.alloc(cls);
+    if (chunk) {
+      return reinterpret_cast<Item*>(chunk);
+    }
+    Item* victim = eviction_victim(cls);
+    if (!victim) {
+      break;
+    }
+    if (is_dead(victim, current_time())) {
+      unlink(victim);
+      _state->stats.expired++;
+      continue;
+    }
+    _pressure[cls]++;
+    if (!demote(victim)) {
+      unlink(victim);
+      _state->stats.evictions++;
+    }
+  }
+  _pressure[cls]++;
+  return nullptr;
+}
+
+/// Returns the item to evict from size class `cls`. With an admission
+/// filter, the least recently used new item is evicted unless it is accessed
+/// more often than the least recently used item of the main list, in which
+/// case it replaces that item there.
+Item*
+Store::eviction_victim(int cls)
+{
+  Item* victim = _state->lru[cls].tail;
+  Item* candidate = _state->window[cls].tail;
+  // Without a filter, new items that one left behind go first.
+  if (!_sketch || !victim || !candidate) {
+    return candidate ? candidate : victim;
+  }
+  if (_sketch->frequency(candidate->hash) <= _sketch->frequency(victim->hash)) {
+    _state->stats.window_rejected++;
+    return candidate;
+  }
+  lru_remove(_state->window[cls], candidate);
+  candidate->windowed = false;
+  lru_insert(_state->lru[cls], candidate);
+  _state->stats.window_admitted++;
+  return victim;
+}
+
+/// Moves the value of `victim`, which is about to be evicted, to flash, and
+/// replaces the item with a smaller one that points to it. Returns false if
+/// the item should be evicted instead.
+bool
+Store::demote(Item* victim)
+{
+  if (!_ext || _demoting || victim->external || victim->replica || victim->value_len < min_cold_value_len) {
+    return false;
+  }
+  int cls = _slabs.class_for(sizeof(Item) + victim->key_len + sizeof(ExtLoc));
+  if (cls < 0 || cls >= victim->slab_class) {
+    return false;
+  }
+  auto loc = _ext->append(*victim, victim->key(), victim->value());
+  if (!loc) {
+    return false;
+  }
+  // Making room for the smaller item must not demote more items in turn.
+  _demoting = true;
+  auto* stub = alloc_item(cls, sizeof(Item) + victim->key_len + sizeof(ExtLoc));
+  _demoting = false;
+  if (!stub) {
+    return false;
+  }
+  stub->cas = victim->cas;
+  stub->hash = victim->hash;
+  stub->flags = victim->flags;
+  stub->exptime = victim->exptime;
+  stub->key_len = victim->key_len;
+  stub->value_len = victim->value_len;
+  stub->slab_class = cls;
+  stub->replica = false;
+  stub->zombie = false;
+  stub->stale = victim->stale;
+  stub->won = victim->won;
+  stub->external = true;
+  stub->staged = false;
+  stub->compressed = victim->compressed;
+  stub->freed = false;
+  std::memcpy(stub->data(), victim->key().data(), victim->key_len);
+  std::memcpy(stub->data() + victim->key_len, &*loc, sizeof(*loc));
+  unlink(victim);
+  link(stub);
+  return true;
+}
+
+/// Returns a copy of the item on flash `stub` to serve a request from. If
+/// the value has to be read first, starts reading it, sets `pending`, and
+/// returns nullptr.
+const Item*
+Store::stage(Item* stub, bool& pending)
+{
+  auto it = _staged.find(stub);
+  if (it != _staged.end()) {
+    auto* image = reinterpret_cast<Item*>(it->second.get());
+    refresh_staged(image, stub);
+    return image;
+  }
+  auto loc = ext_loc(stub);
+  if (auto* image = _ext->buffered(loc)) {
+    return stage_copy(stub, image);
+  }
+  if (!_ext->valid(loc)) {
+    // The segment has been reused for newer items.
+    unlink(stub);
+    _ext->stats().misses++;
+    return nullptr;
+  }
+  if (_ext_reads.find(stub) == _ext_reads.end()) {
+    if (!_ext->read(loc, stub, stub->cas)) {
+      return nullptr;
+    }
+    _ext_reads.emplace(stub, uint64_t{stub->cas});
+  }
+  pending = true;
+  _deferred = true;
+  return nullptr;
+}
+
+/// Keeps a copy of `image`, the item on flash `stub` as it was read back,
+/// and drops the oldest copies if there are too many.
+const Item*
+Store::stage_copy(Item* stub, const Item* image)
+{
+  size_t len = sizeof(Item) + stub->key_len + stub->value_len;
+  std::unique_ptr<char[]> buf{new char[len]};
+  auto* copy = new (buf.get()) Item{};
+  copy->h_next = stub;
+  copy->hash = stub->hash;
+  copy->key_len = stub->key_len;
+  copy->value_len = stub->value_len;
+  copy->slab_class = stub->slab_class;
+  copy->staged = true;
+  copy->compressed = stub->compressed;
+  refresh_staged(copy, stub);
+  std::memcpy(copy->data(), image->key().data(), stub->key_len + stub->value_len);
+  drop_staged(stub);
+  _staged.emplace(stub, std::move(buf));
+  _staged_order.push_back(stub);
+  _staged_len += len;
+  while ((_staged_order.size() > max_staged || _staged_len > max_staged_len) && _staged_order.front() != stub) {
+    drop_staged(_staged_order.front());
+    _staged_order.pop_front();
+  }
+  return copy;
+}
+
+void
+Store::drop_staged(const Item* stub)
+{
+  auto it = _staged.find(stub);
+  if (it == _staged.end()) {
+    return;
+  }
+  auto* image = reinterpret_cast<const Item*>(it->second.get());
+  _staged_len -= sizeof(Item) + image->key_len + image->value_len;
+  _staged.erase(it);
+}
+
+/// Handles the value of item on flash `stub`, which was `cas` when the read
+/// started, once it has been read.
+void
+Store::complete_read(Item* stub, uint64_t cas, const Item* image)
+{
+  // A request may be waiting for the read even if its item is gone.
+  _values_ready = true;
+  auto it = _ext_reads.find(stub);
+  // The item has been replaced or removed since.
+  if (it == _ext_reads.end() || it->second != cas) {
+    return;
+  }
+  _ext_reads.erase(it);
+  if (image && image->hash == stub->hash && image->key_len == stub->key_len && image->value_len == stub->value_len &&
+      image->key() == stub->key()) {
+    stage_copy(stub, image);
+  } else {
+    unlink(stub);
+    _ext->stats().misses++;
+  }
+}
+
+/// Returns the value of `item` uncompressed, or nothing if it is gone. If
+/// the value is on flash and has to be read first, starts reading it, sets
+/// `pending`, and returns nothing, for the caller to try again later rather
+/// than wait for the read on the reactor thread.
+std::optional<std::string>
+Store::value_of(Item* item, bool& pending)
+{
+  std::string_view value = item->value();
+  if (item->external) {
+    auto loc = ext_loc(item);
+    const Item* image = nullptr;
+    auto it = _staged.find(item);
+    if (it != _staged.end()) {
+      image = reinterpret_cast<const Item*>(it->second.get());
+    } else if (!(image = _ext->buffered(loc))) {
+      if (!_ext->valid(loc)) {
+        return std::nullopt;
+      }
+      if (_ext_reads.find(item) == _ext_reads.end() && _ext->read(loc, item, item->cas)) {
+        _ext_reads.emplace(item, uint64_t{item->cas});
+      }
+      pending = true;
+      return std::nullopt;
+    }
+    if (image->value_len != item->value_len || image->key() != item->key()) {
+      return std::nullopt;
+    }
+    value = image->value();
+  }
+  if (!item->compressed) {
+    return std::string{value};
+  }
+  std::string plain;
+  if (!decompress_value(value, plain)) {
+    return std::nullopt;
+  }
+  return plain;
+}
+
+void
+Store::free_item(Item* item)
+{
+  if (_holds.count(item)) {
+    item->zombie = true;
+    return;
+  }
+  free_memory(item);
+}
+
+void
+Store::free_memory(Item* item)
+{
+  if (_log) {
+    item->freed = true;
+    _log->free(item, item_len(item));
+    return;
+  }
+  _slabs.free(item->slab_class, item);
+}
+
+void
+Store::use_admission_filter()
+{
+  _sketch = std::make_unique<FrequencySketch>(_slabs.mem_limit() / sketch_bytes_per_key);
+}
+
+void
+Store::use_log_allocator()
+{
+  _log = std::make_unique<LogAllocator>(_slabs);
+}
+
+/// Evicts `item` to make room.
+void
+Store::evict(Item* item)
+{
+  if (item->replica) {
+    drop_replica(std::string{item->key()});
+    return;
+  }
+  bool dead = is_dead(item, current_time());
+  unlink(item);
+  if (dead) {
+    _state->stats.expired++;
+  } else {
+    _state->stats.evictions++;
+  }
+}
+
+/// Evicts the items in the oldest segment of the log, so that it can be
+/// reused. Returns false if there is no segment to evict.
+bool
+Store::evict_segment()
+{
+  auto victim = _log->oldest();
+  if (!victim) {
+    return false;
+  }
+  uint32_t n = *victim;
+  uint64_t seq = _log->seq(n);
+  // The segment is reused as soon as its last live item is gone.
+  for (uint32_t pos = 0; _log->seq(n) == seq && pos < _log->used(n);) {
+    auto* item = reinterpret_cast<Item*>(_log->begin(n) + pos);
+    pos += LogAllocator::aligned_len(item_len(item));
+    if (!item->freed && !item->zombie) {
+      evict(item);
+    }
+  }
+  _log->stats().segments_evicted++;
+  return true;
+}
+
+/// Moves the live items out of the segment with the most holes, a slice of
+/// items at a time, whenever few segments are free. Evicts the oldest
+/// segment instead if even the emptiest one is nearly full.
+void
+Store::clean_log()
+{
+  if (_cleaning && _log->seq(*_cleaning) != _cleaning_seq) {
+    _cleaning.reset();
+  }
+  if (!_cleaning) {
+    if (_log->nr_free() >= min_free_segments) {
+      return;
+    }
+    auto victim = _log->emptiest();
+    if (!victim) {
+      return;
+    }
+    if (_log->live(*victim) > max_clean_live) {
+      evict_segment();
+      return;
+    }
+    _cleaning = victim;
+    _cleaning_seq = _log->seq(*victim);
+    _clean_pos = 0;
+  }
+  uint32_t n = *_cleaning;
+  for (size_t i = 0; i < log_clean_budget && _log->seq(n) == _cleaning_seq && _clean_pos < _log->used(n); i++) {
+    auto* item = reinterpret_cast<Item*>(_log->begin(n) + _clean_pos);
+    _clean_pos += LogAllocator::aligned_len(item_len(item));
+    if (!item->freed && !item->zombie) {
+      relocate(item);
+    }
+  }
+  // Items with replies in flight keep the segment until they complete.
+  if (_log->seq(n) != _cleaning_seq || _clean_pos >= _log->used(n)) {
+    _log->stats().segments_cleaned++;
+    _cleaning.reset();
+  }
+}
+
+/// Moves live item `item` to the end of the log, or to another chunk of its
+/// size class, or evicts it if it cannot be moved. Returns true if it was
+/// moved.
+bool
+Store::relocate(Item* item)
+{
+  if (!item->replica && is_dead(item, current_time())) {
+    unlink(item);
+    _state->stats.expired++;
+    return false;
+  }
+  size_t len = item_len(item);
+  void* mem = nullptr;
+  // A read from flash that is in flight refers to the item where it is.
+  if (!_ext_reads.count(item)) {
+    mem = _log ? _log->alloc(len, true) : _slabs.alloc(item->slab_class);
+  }
+  if (!mem) {
+    evict(item);
+    return false;
+  }
+  auto* copy = reinterpret_cast<Item*>(mem);
+  std::memcpy(mem, item, len);
+  // Offset pointers are relative to where they are.
+  copy->h_next = item->h_next.get();
+  copy->lru_prev = item->lru_prev.get();
+  copy->lru_next = item->lru_next.get();
+  if (item->replica) {
+    _replicas[std::string{item->key()}] = copy;
+  } else {
+    replace_in_chain(slot_index(item->hash), item, copy);
+    auto& lru = lru_of(item);
+    if (copy->lru_prev) {
+      copy->lru_prev->lru_next = copy;
+    } else {
+      lru.head = copy;
+    }
+    if (copy->lru_next) {
+      copy->lru_next->lru_prev = copy;
+    } else {
+      lru.tail = copy;
+    }
+    // The copy of its value that was read back points to the item.
+    if (item->external) {
+      drop_staged(item);
+    }
+  }
+  free_item(item);
+  return true;
+}
+
+/// Moves pages from size classes that have little pressure to the one that
+/// has the most, one at a time. The items in a page are moved to other
+/// pages of their class, or evicted, a slice at a time, and the page goes
+/// to its new class once they are all gone.
+void
+Store::move_slabs()
+{
+  auto page = _slabs.moving_page();
+  if (!page) {
+    pick_slab_move();
+    return;
+  }
+  if (!_slabs.walk_free_list(slab_walk_budget)) {
+    return;
+  }
+  int cls = _slabs.page_class(*page);
+  size_t chunk_size = _slabs.chunk_size(cls);
+  size_t nr_chunks = _slabs.nr_chunks(cls);
+  for (size_t i = 0; i < slab_move_budget && _move_pos < nr_chunks; i++, _move_pos++) {
+    if (!_slabs.in_use(_move_pos)) {
+      continue;
+    }
+    auto* item = reinterpret_cast<Item*>(_slabs.page(*page) + _move_pos * chunk_size);
+    // Items with replies in flight free their chunk once they complete.
+    if (item->zombie) {
+      continue;
+    }
+    if (relocate(item)) {
+      _state->stats.slab_reassign_rescues++;
+    } else {
+      _state->stats.slab_reassign_evictions++;
+    }
+  }
+  if (_slabs.move_ready()) {
+    _slabs.finish_move(_move_to);
+    _state->stats.slabs_moved++;
+  }
+}
+
+/// Starts moving a page, at the end of a window in which the class with the
+/// most pressure has had it for long enough, from the class that has the
+/// least pressure per page, if that is much less.
+void
+Store::pick_slab_move()
+{
+  uint32_t now = current_time();
+  if (now - _window_start < slab_move_window) {
+    return;
+  }
+  _window_start = now;
+  auto pressure = _pressure;
+  _pressure.fill(0);
+  int receiver = std::max_element(pressure.begin(), pressure.end()) - pressure.begin();
+  if (pressure[receiver] == 0) {
+    _receiver = -1;
+    _streak = 0;
+    return;
+  }
+  _streak = receiver == _receiver ? _streak + 1 : 1;
+  _receiver = receiver;
+  if (_streak < slab_move_streak) {
+    return;
+  }
+  int donor = -1;
+  for (size_t cls = 0; cls < _slabs.nr_classes(); cls++) {
+    // A class keeps one page, so that it never runs out of memory altogether.
+    if (int(cls) == receiver || _slabs.nr_pages(cls) < 2) {
+      continue;
+    }
+    // Compare pressure per page, without dividing.
+    if (donor < 0 || pressure[cls] * _slabs.nr_pages(donor) < pressure[donor] * _slabs.nr_pages(cls)) {
+      donor = cls;
+    }
+  }
+  if (donor < 0 ||
+      pressure[donor] * _slabs.nr_pages(receiver) * 2 >= pressure[receiver] * _slabs.nr_pages(donor)) {
+    return;
+  }
+  // The page of the least recently used item has the coldest items.
+  size_t page = 0;
+  if (Item* tail = _state->lru[donor].tail) {
+    page = _slabs.page_of(tail);
+  } else {
+    while (_slabs.page_class(page) != donor) {
+      page++;
+    }
+  }
+  _slabs.start_move(page);
+  _move_to = receiver;
+  _move_pos = 0;
+}
+
+void
+Store::link(Item* item)
+{
+  maybe_grow_index();
+  size_t i = slot_index(item->hash);
+  item->h_next = head_of(_index[i]);
+  set_head(i, item);
+  item->windowed = _sketch != nullptr;
+  lru_insert(lru_of(item), item);
+  // Memory is not full yet if the window grows past its share, so its
+  // oldest item goes into the main list without a contest.
+  auto& window = _state->window[item->slab_class];
+  auto& main = _state->lru[item->slab_class];
+  if (window.nr_items > 1 && window.nr_items * 100 > (window.nr_items + main.nr_items) * window_percent) {
+    Item* oldest = window.tail;
+    lru_remove(window, oldest);
+    oldest->windowed = false;
+    lru_insert(main, oldest);
+  }
+  _state->stats.nr_items++;
+}
+
+void
+Store::unlink(Item* item)
+{
+  if (item->external) {
+    _ext_reads.erase(item);
+    drop_staged(item);
+  }
+  // Values on flash are not part of snapshots.
+  if (_snapshot && item->cas < _snapshot->_start_cas && !item->replica && !item->external &&
+      slot_index(item->hash) >= _snapshot->_cursor && !is_dead(item, current_time())) {
+    // The scan has yet to reach the item, so copy it into the snapshot as
+    // it is before it goes away.
+    _snapshot->append(*item);
+  }
+  replace_in_chain(slot_index(item->hash), item, item->h_next);
+  lru_remove(lru_of(item), item);
+  free_item(item);
+  _state->stats.nr_items--;
+}
+
+void
+Store::lru_bump(Item* item)
+{
+  auto& lru = lru_of(item);
+  if (lru.head == item) {
+    return;
+  }
+  lru_remove(lru, item);
+  lru_insert(lru, item);
+}
+
+/// Returns the LRU list that `item` is on.
+Store::Lru&
+Store::lru_of(const Item* item)
+{
+  return item->windowed ? _state->window[item->slab_class] : _state->lru[item->slab_class];
+}
+
+void
+Store::lru_insert(Lru& lru, Item* item)
+{
+  item->lru_prev = nullptr;
+  item->lru_next = lru.head;
+  if (lru.head) {
+    lru.head->lru_prev = item;
+  }
+  lru.head = item;
+  if (!lru.tail) {
+    lru.tail = item;
+  }
+  lru.nr_items++;
+}
+
+void
+Store::lru_remove(Lru& lru, Item* item)
+{
+  if (item->lru_prev) {
+    item->lru_prev->lru_next = item->lru_next;
+  } else {
+    lru.head = item->lru_next;
+  }
+  if (item->lru_next) {
+    item->lru_next->lru_prev = item->lru_prev;
+  } else {
+    lru.tail = item->lru_prev;
+  }
+  lru.nr_items--;
+}
+
+/// Starts doubling the index once chains get long. The chains are split a
+/// slice at a time by grow_index().
+void
+Store::maybe_grow_index()
+{
+  // Keep the average chain length below 1.5.
+  size_t size = _state->index_size;
+  if (_state->index_unsplit || _state->stats.nr_items < size + size / 2 || size * 2 > _index_capacity) {
+    return;
+  }
+  // Moving items around would lose the place of a snapshot scan, so chains
+  // get longer until it completes.
+  if (_snapshot) {
+    return;
+  }
+  _state->index_size = size * 2;
+  _state->index_unsplit = size;
+}
+
+/// Splits the next slice of chains of a doubling index in place: the next
+/// bit of the hash decides whether an item stays in its chain or moves to
+/// the one half the index up, which is still empty. Items only ever move
+/// up, so a scan of the index that is under way still sees all of them.
+void
+Store::grow_index()
+{
+  size_t half = _state->index_size / 2;
+  for (size_t n = 0; n < index_grow_budget && _state->index_unsplit; n++) {
+    size_t i = half - _state->index_unsplit;
+    // Split the chain into the items that stay and the ones that move, in
+    // order.
+    Item* stay = nullptr;
+    Item* move = nullptr;
+    Item* stay_tail = nullptr;
+    Item* move_tail = nullptr;
+    for (Item* item = head_of(_index[i]); item;) {
+      Item* next = item->h_next;
+      item->h_next = nullptr;
+      auto& head = item->hash & half ? move : stay;
+      auto& tail = item->hash & half ? move_tail : stay_tail;
+      if (tail) {
+        tail->h_next = item;
+      } else {
+        head = item;
+      }
+      tail = item;
+      item = next;
+    }
+    set_head(i, stay);
+    set_head(i + half, move);
+    _state->index_unsplit--;
+  }
+}
+
+bool
+Store::submit_migration(std::shared_ptr<Migration> migration)
+{
+  return _migration_inbox.try_push(std::move(migration));
+}
+
+bool
+Store::submit_replication(std::unique_ptr<ReplicationCommand>&& command)
+{
+  return _replication_inbox.try_push(std::move(command));
+}
+
+bool
+Store::start_snapshot(std::unique_ptr<Snapshot> snapshot)
+{
+  if (_snapshot) {
+    return false;
+  }
+  _snapshot = std::move(snapshot);
+  _snapshot->_start_cas = _state->next_cas;
+  _snapshot->_cursor = 0;
+  return true;
+}
+
+void
+Store::attach_extstore(std::unique_ptr<Extstore> ext, size_t item_size)
+{
+  _ext = std::move(ext);
+  _ext_item_size = item_size;
+}
+
+void
+Store::poll()
+{
+  if (_ext) {
+    _ext->poll([this](Item* stub, uint64_t cas, const Item* image) { complete_read(stub, cas, image); });
+  }
+  poll_flush();
+  if (_sweep) {
+    sweep();
+  }
+  if (_state->index_unsplit && !_snapshot) {
+    grow_index();
+  }
+  poll_replication();
+  poll_migrations();
+  if (_snapshot) {
+    poll_snapshot();
+  }
+  if (_log) {
+    clean_log();
+  } else {
+    move_slabs();
+  }
+}
+
+/// Appends the items in the next slice of index slots to the snapshot, or
+/// completes it once the scan is done.
+void
+Store::poll_snapshot()
+{
+  try {
+    auto& s = *_snapshot;
+    s.poll();
+    if (s._cursor < _state->index_size) {
+      if (s.backlogged()) {
+        return;
+      }
+      uint32_t now = current_time();
+      size_t end = std::min(s._cursor + snapshot_scan_budget, _state->index_size);
+      for (; s._cursor < end; s._cursor++) {
+        for (Item* item = head_of(_index[s._cursor]); item; item = item->h_next) {
+          if (item->cas < s._start_cas && !item->external && !is_dead(item, now)) {
+            s.append(*item);
+          }
+        }
+      }
+      return;
+    }
+    if (s.finish()) {
+      _snapshot.reset();
+    }
+  } catch (const std::exception& ex) {
+    std::cout << "warning: Snapshot " << _snapshot->path() << " failed: " << ex.what() << std::endl;
+    _snapshot.reset();
+  }
+}
+
+void
+Store::poll_migrations()
+{
+  std::shared_ptr<Migration> migration;
+  while (_migration_inbox.try_pop(migration)) {
+    if (migration->source() == this) {
+      _migrations_out.push_back(std::move(migration));
+    } else {
+      _migrations_in.push_back(std::move(migration));
+    }
+  }
+  for (auto& m : _migrations_in) {
+    if (m->state() == Migration::State::Aborted) {
+      // The bucket stays with the source, so the copy here would only go
+      // stale.
+      drop_bucket(m->bucket(), m->_drop_cursor, m->_drop_index_size, migration_scan_budget);
+      continue;
+    }
+    std::unique_ptr<MigrationRecord> record;
+    for (size_t i = 0; i < migration_apply_budget && m->receive(record); i++) {
+      switch (record->kind) {
+        case MigrationRecord::Kind::Upsert:
+          if (!m->_written.count(record->key)) {
+            _applying_migration = true;
+            store(record->key, _hasher(record->key.data(), record->key.size()), record->value, record->flags,
+                  record->exptime, SetMode::Set);
+            _applying_migration = false;
+          }
+          break;
+        case MigrationRecord::Kind::Delete:
+          if (!m->_written.count(record->key)) {
+            _applying_migration = true;
+            erase(record->key, _hasher(record->key.data(), record->key.size()));
+            _applying_migration = false;
+          }
+          break;
+        case MigrationRecord::Kind::Done:
+          m->advance(Migration::State::Streaming, Migration::State::Streamed);
+          break;
+        case MigrationRecord::Kind::Close:
+          m->set_state(Migration::State::Closed);
+          break;
+      }
+    }
+  }
+  _migrations_in.erase(std::remove_if(_migrations_in.begin(), _migrations_in.end(),
+                                      [](const auto& m) {
+                                        return m->state() == Migration::State::Closed ||
+                                               (m->state() == Migration::State::Aborted &&
+                                                m->_drop_cursor == SIZE_MAX);
+                                      }),
+                       _migrations_in.end());
+  _migrations_out.erase(std::remove_if(_migrations_out.begin(), _migrations_out.end(),
+                                       [](const auto& m) { return m->state() == Migration::State::Aborted; }),
+                        _migrations_out.end());
+  bool dropped = false;
+  for (auto& m : _migrations_out) {
+    bool flushed = m->flush();
+    bool unread = !m->_close_sent && !send_unread(*m);
+    if (m->state() < Migration::State::Finished) {
+      // Do not let the backlog grow without bound if the destination is
+      // slower than the scan.
+      if (!m->_scan_done && flushed) {
+        if (stream_bucket(*m, migration_scan_budget) == 0 && !unread) {
+          m->_scan_done = true;
+          m->send(std::make_unique<MigrationRecord>(MigrationRecord{MigrationRecord::Kind::Done}));
+        }
+      }
+      continue;
+    }
+    if (!m->_close_sent) {
+      if (unread) {
+        continue;
+      }
+      m->send(std::make_unique<MigrationRecord>(MigrationRecord{MigrationRecord::Kind::Close}));
+      m->_close_sent = true;
+      m->_cursor = 0;
+      m->_index_size = _state->index_size;
+    }
+    if (flushed && drop_bucket(m->bucket(), m->_cursor, m->_index_size, migration_scan_budget) == 0) {
+      dropped = true;
+    }
+  }
+  if (dropped) {
+    _migrations_out.erase(std::remove_if(_migrations_out.begin(), _migrations_out.end(),
+                                         [](const auto& m) { return m->_close_sent && m->_cursor == SIZE_MAX; }),
+                          _migrations_out.end());
+  }
+}
+
+/// Sends the items of the migrating bucket in the next `budget` index slots.
+/// Returns the number of slots scanned, which is zero once the scan is done.
+size_t
+Store::stream_bucket(Migration& m, size_t budget)
+{
+  if (m._index_size != _state->index_size) {
+    // The index was resized and the items moved around, so start over.
+    // Sending an item twice is harmless.
+    m._index_size = _state->index_size;
+    m._cursor = 0;
+  }
+  uint32_t now = current_time();
+  size_t end = std::min(m._cursor + budget, _state->index_size);
+  size_t nr_scanned = end - m._cursor;
+  for (; m._cursor < end; m._cursor++) {
+    for (Item* item = head_of(_index[m._cursor]); item; item = item->h_next) {
+      if (rainbow_bucket(item->hash) != m.bucket() || is_dead(item, now)) {
+        continue;
+      }
+      bool pending = false;
+      auto value = value_of(item, pending);
+      if (pending) {
+        m._unread.emplace(item->key());
+      }
+      if (!value) {
+        continue;
+      }
+      m.send(std::make_unique<MigrationRecord>(MigrationRecord{
+        MigrationRecord::Kind::Upsert, item->flags, item->exptime, std::string{item->key()}, std::move(*value)}));
+    }
+  }
+  return nr_scanned;
+}
+
+/// Sends the items of the migrating bucket whose values had to be read from
+/// flash, once they are in. Returns true if none are left.
+bool
+Store::send_unread(Migration& m)
+{
+  uint32_t now = current_time();
+  for (auto it = m._unread.begin(); it != m._unread.end();) {
+    const std::string& key = *it;
+    // An item that is gone since has had its delete forwarded, if it was
+    // deleted rather than evicted.
+    auto* item = find(key, _hasher(key.data(), key.size()));
+    bool pending = false;
+    auto value = item && !is_dead(item, now) ? value_of(item, pending) : std::nullopt;
+    if (pending) {
+      ++it;
+      continue;
+    }
+    if (value) {
+      m.send(std::make_unique<MigrationRecord>(
+        MigrationRecord{MigrationRecord::Kind::Upsert, item->flags, item->exptime, key, std::move(*value)}));
+    }
+    it = m._unread.erase(it);
+  }
+  return m._unread.empty();
+}
+
+/// Drops the local copy of `bucket`, a slice at a time, from the index slot
+/// at `cursor` on. Returns the number of slots scanned, which is zero once the
+/// drop is done and `cursor` is SIZE_MAX.
+size_t
+Store::drop_bucket(uint32_t bucket, size_t& cursor, size_t& index_size, size_t budget)
+{
+  if (cursor == SIZE_MAX) {
+    return 0;
+  }
+  if (index_size != _state->index_size) {
+    index_size = _state->index_size;
+    cursor = 0;
+  }
+  size_t end = std::min(cursor + budget, _state->index_size);
+  size_t nr_scanned = end - cursor;
+  for (; cursor < end; cursor++) {
+    Item* item = head_of(_index[cursor]);
+    while (item) {
+      Item* next = item->h_next;
+      if (rainbow_bucket(item->hash) == bucket) {
+        unlink(item);
+      }
+      item = next;
+    }
+  }
+  if (nr_scanned == 0) {
+    cursor = SIZE_MAX;
+  }
+  return nr_scanned;
+}
+
+void
+Store::forward(uint32_t hash, std::string_view key, Item* item)
+{
+  uint32_t bucket = rainbow_bucket(hash);
+  for (auto& m : _migrations_out) {
+    if (m->bucket() != bucket || m->_close_sent) {
+      continue;
+    }
+    bool pending = false;
+    auto value = item ? value_of(item, pending) : std::nullopt;
+    // Until the new value is in from flash, the destination drops the old
+    // one rather than serve it.
+    if (pending) {
+      m->_unread.emplace(key);
+    }
+    if (value) {
+      m->send(std::make_unique<MigrationRecord>(MigrationRecord{
+        MigrationRecord::Kind::Upsert, item->flags, item->exptime, std::string{key}, std::move(*value)}));
+    } else {
+      m->send(std::make_unique<MigrationRecord>(MigrationRecord{MigrationRecord::Kind::Delete, 0, 0, std::string{key}}));
+    }
+  }
+}
+
+/// Remembers that the destination of a migration has written `key` itself,
+/// so that records for the key that the source still has in flight do not
+/// overwrite the newer value.
+void
+Store::shadow_migrations(uint32_t hash, std::string_view key)
+{
+  if (_applying_migration) {
+    return;
+  }
+  uint32_t bucket = rainbow_bucket(hash);
+  for (auto& m : _migrations_in) {
+    if (m->bucket() == bucket) {
+      m->_written.emplace(key);
+    }
+  }
+}
+
+Item*
+Store::find_replica(std::string_view key)
+{
+  auto it = _replicas.find(std::string{key});
+  if (it == _replicas.end()) {
+    return nullptr;
+  }
+  if (is_expired(it->second, current_time())) {
+    free_item(it->second);
+    _replicas.erase(it);
+    return nullptr;
+  }
+  return it->second;
+}
+
+void
+Store::poll_replication()
+{
+  if (!_replication) {
+    return;
+  }
+  auto unread = std::move(_replication_unread);
+  _replication_unread.clear();
+  for (auto& command : unread) {
+    if (!replicate(command->key, command->partitions)) {
+      _replication_unread.push_back(std::move(command));
+    }
+  }
+  std::unique_ptr<ReplicationCommand> command;
+  while (_replication_inbox.try_pop(command)) {
+    if (command->partitions.empty()) {
+      // The key cooled down before its value was in from flash.
+      _replication_unread.erase(std::remove_if(_replication_unread.begin(), _replication_unread.end(),
+                                               [&](const auto& unread) { return unread->key == command->key; }),
+                                _replication_unread.end());
+      invalidate_replicas(command->key);
+    } else if (!replicate(command->key, command->partitions)) {
+      _replication_unread.push_back(std::move(command));
+    }
+  }
+  std::unique_ptr<ReplicaUpdate> update;
+  for (uint32_t src = 0; src < _replication->nr_partitions(); src++) {
+    while (_replication->receive(src, _partition, update)) {
+      switch (update->kind) {
+        case ReplicaUpdate::Kind::Fill:
+          fill_replica(update->key, update->value, update->flags, update->exptime, update->cas);
+          break;
+        case ReplicaUpdate::Kind::Invalidate:
+          drop_replica(update->key);
+          break;
+      }
+    }
+  }
+  _replication->flush(_partition);
+  // Spread reads over the replicas only once they all have their copy.
+  for (auto& [key, replicated] : _replicated) {
+    if (replicated.published) {
+      continue;
+    }
+    bool drained = std::all_of(replicated.partitions.begin(), replicated.partitions.end(),
+                               [this](uint32_t dst) { return _replication->drained(_partition, dst); });
+    if (drained) {
+      _replication->publish(replicated.hash, replicated.partitions);
+      replicated.published = true;
+    }
+  }
+}
+
+/// Sends copies of `key` to `partitions`. Returns false if its value has to
+/// be read from flash first, and the command should be tried again.
+bool
+Store::replicate(const std::string& key, const std::vector<uint32_t>& partitions)
+{
+  invalidate_replicas(key);
+  uint32_t hash = _hasher(key.data(), key.size());
+  auto* item = find(key, hash);
+  if (!item) {
+    return true;
+  }
+  bool pending = false;
+  auto value = value_of(item, pending);
+  if (!value) {
+    return !pending;
+  }
+  for (auto dst : partitions) {
+    if (dst == _partition) {
+      continue;
+    }
+    _replication->send(_partition, dst, std::make_unique<ReplicaUpdate>(ReplicaUpdate{
+      ReplicaUpdate::Kind::Fill, item->flags, item->exptime, key, *value, cas_of(item)}));
+  }
+  _replicated.emplace(key, Replicated{hash, partitions});
+  return true;
+}
+
+void
+Store::invalidate_replicas(std::string_view key)
+{
+  auto it = _replicated.find(std::string{key});
+  if (it == _replicated.end()) {
+    return;
+  }
+  // Stop spreading reads before dropping the copies, so that no read is sent
+  // to a replica that no longer has the key.
+  if (it->second.published) {
+    _replication->unpublish(it->second.hash);
+  }
+  for (auto dst : it->second.partitions) {
+    if (dst == _partition) {
+      continue;
+    }
+    _replication->send(
+      _partition, dst, std::make_unique<ReplicaUpdate>(ReplicaUpdate{ReplicaUpdate::Kind::Invalidate, 0, 0, it->first}));
+  }
+  _replicated.erase(it);
+}
+
+void
+Store::fill_replica(const std::string& key, std::string_view value, uint32_t flags, uint32_t exptime, uint64_t cas)
+{
+  drop_replica(key);
+  size_t len = sizeof(Item) + key.size() + value.size() + sizeof(cas);
+  int cls = _slabs.class_for(len);
+  if (cls < 0) {
+    return;
+  }
+  auto* item = alloc_item(cls, len);
+  if (!item) {
+    return;
+  }
+  item->h_next = nullptr;
+  item->lru_prev = nullptr;
+  item->lru_next = nullptr;
+  item->cas = 0;
+  item->hash = _hasher(key.data(), key.size());
+  item->flags = flags;
+  item->exptime = exptime;
+  item->key_len = key.size();
+  item->value_len = value.size();
+  item->slab_class = cls;
+  item->replica = true;
+  item->zombie = false;
+  item->stale = false;
+  item->won = false;
+  item->external = false;
+  item->staged = false;
+  item->compressed = false;
+  item->freed = false;
+  std::memcpy(item->data(), key.data(), key.size());
+  std::memcpy(item->data() + key.size(), value.data(), value.size());
+  std::memcpy(item->data() + key.size() + value.size(), &cas, sizeof(cas));
+  _replicas.emplace(key, item);
+}
+
+void
+Store::drop_replica(const std::string& key)
+{
+  auto it = _replicas.find(key);
+  if (it == _replicas.end()) {
+    return;
+  }
+  free_item(it->second);
+  _replicas.erase(it);
+}
+
+}
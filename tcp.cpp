@@ -0,0 +1,216 @@
+#include "rainbow/tcp.hpp"
+
+#include <iostream>
+#include <system_error>
+#include <vector>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace rainbow {
+
+static constexpr int max_events = 64;
+
+static constexpr size_t recv_chunk_size = 16 * 1024;
+
+TcpServer::TcpServer(int listen_fd)
+  : _listen_fd{listen_fd}
+{
+}
+
+TcpServer::~TcpServer()
+{
+  for (auto& [fd, conn] : _connections) {
+    ::close(fd);
+  }
+  if (_epoll_fd >= 0) {
+    ::close(_epoll_fd);
+  }
+  ::close(_listen_fd);
+}
+
+void
+TcpServer::on_stream(OnStreamFn&& fn)
+{
+  _fn = std::move(fn);
+}
+
+void
+TcpServer::setup()
+{
+  _epoll_fd = ::epoll_create1(0);
+  if (_epoll_fd < 0) {
+    throw std::system_error(errno, std::system_category(), "epoll_create1");
+  }
+  ::epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.fd = _listen_fd;
+  if (::epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _listen_fd, &ev) < 0) {
+    throw std::system_error(errno, std::system_category(), "epoll_ctl(EPOLL_CTL_ADD)");
+  }
+}
+
+void
+TcpServer::run_once()
+{
+  ::epoll_event events[max_events];
+  int nr_events = ::epoll_wait(_epoll_fd, events, max_events, 0);
+  for (int i = 0; i < nr_events; i++) {
+    int fd = events[i].data.fd;
+    if (fd == _listen_fd) {
+      accept_connections();
+      continue;
+    }
+    auto it = _connections.find(fd);
+    if (it == _connections.end()) {
+      continue;
+    }
+    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+      close_connection(fd);
+      continue;
+    }
+    if (events[i].events & EPOLLOUT) {
+      transmit(fd, it->second);
+      it = _connections.find(fd);
+      if (it == _connections.end()) {
+        continue;
+      }
+    }
+    if (events[i].events & EPOLLIN) {
+      receive(fd, it->second);
+    }
+  }
+}
+
+void
+TcpServer::accept_connections()
+{
+  for (;;) {
+    int fd = ::accept4(_listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+        std::cout << "warning: accept4: " << std::system_category().message(errno) << std::endl;
+      }
+      return;
+    }
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ::epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (::epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      ::close(fd);
+      continue;
+    }
+    _connections.emplace(fd, Connection{});
+  }
+}
+
+void
+TcpServer::receive(int fd, Connection& conn)
+{
+  for (;;) {
+    size_t len = conn.input.size();
+    conn.input.resize(len + recv_chunk_size);
+    ssize_t nr = ::recv(fd, conn.input.data() + len, recv_chunk_size, 0);
+    conn.input.resize(len + (nr > 0 ? nr : 0));
+    if (nr == 0) {
+      close_connection(fd);
+      return;
+    }
+    if (nr < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      close_connection(fd);
+      return;
+    }
+  }
+  process(fd, conn);
+}
+
+void
+TcpServer::resume()
+{
+  std::vector<int> fds;
+  for (auto& [fd, conn] : _connections) {
+    if (!conn.input.empty()) {
+      fds.push_back(fd);
+    }
+  }
+  for (int fd : fds) {
+    auto it = _connections.find(fd);
+    if (it != _connections.end()) {
+      process(fd, it->second);
+    }
+  }
+}
+
+/// Processes the complete requests in the input of a connection, and sends
+/// their responses.
+void
+TcpServer::process(int fd, Connection& conn)
+{
+  size_t pos = 0;
+  while (pos < conn.input.size()) {
+    auto consumed = _fn(std::string_view{conn.input}.substr(pos), conn.output);
+    if (!consumed) {
+      std::cout << "warning: Closing TCP connection: " << consumed.error() << std::endl;
+      close_connection(fd);
+      return;
+    }
+    if (*consumed == 0) {
+      break;
+    }
+    pos += *consumed;
+  }
+  conn.input.erase(0, pos);
+  transmit(fd, conn);
+}
+
+void
+TcpServer::transmit(int fd, Connection& conn)
+{
+  while (conn.output_pos < conn.output.size()) {
+    ssize_t nr =
+      ::send(fd, conn.output.data() + conn.output_pos, conn.output.size() - conn.output_pos, MSG_NOSIGNAL);
+    if (nr < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        close_connection(fd);
+        return;
+      }
+      // Wait for the socket to drain before sending the rest.
+      if (!conn.want_write) {
+        ::epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.fd = fd;
+        ::epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        conn.want_write = true;
+      }
+      return;
+    }
+    conn.output_pos += nr;
+  }
+  conn.output.clear();
+  conn.output_pos = 0;
+  if (conn.want_write) {
+    ::epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    ::epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    conn.want_write = false;
+  }
+}
+
+void
+TcpServer::close_connection(int fd)
+{
+  ::epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  ::close(fd);
+  _connections.erase(fd);
+}
+
+}
@@ -0,0 +1,69 @@
+// Checks that userspace hashes keys bit for bit like the XDP program, which
+// computes rainbow_key_hash() from keyhash.h, and that every hash function
+// hashes a key that is too long like its first RAINBOW_MAX_KEY_LEN bytes.
+
+#include "rainbow/hash.hpp"
+
+#include "keyhash.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+/// Number of starting addresses to hash every key length from, each one byte
+/// further from an aligned address.
+static constexpr size_t nr_offsets = 16;
+
+/// Longest key to hash, which is well past what the protocol allows.
+static constexpr size_t max_test_key_len = 2 * RAINBOW_MAX_KEY_LEN;
+
+int
+main()
+{
+  std::mt19937 rng{42};
+  std::vector<char> buf(nr_offsets + max_test_key_len);
+  for (auto& c : buf) {
+    c = static_cast<char>(rng());
+  }
+  struct
+  {
+    const char* name;
+    rainbow::KeyHash kind;
+  } hashes[] = {
+    {"murmur3", rainbow::KeyHash::Murmur3},
+    {"crc32c", rainbow::KeyHash::CRC32C},
+    {"xxh32", rainbow::KeyHash::XXH32},
+  };
+  size_t nr_failures = 0;
+  for (auto& hash : hashes) {
+    rainbow::KeyHasher hasher{hash.kind};
+    for (size_t offset = 0; offset < nr_offsets; offset++) {
+      for (size_t len = 0; len <= max_test_key_len; len++) {
+        const char* key = buf.data() + offset;
+        uint32_t expected = rainbow_key_hash(static_cast<uint32_t>(hash.kind), key, len, key + len);
+        uint32_t actual = hasher(key, len);
+        if (actual != expected && nr_failures++ < 10) {
+          std::cerr << hash.name << ": key of " << len << " bytes at offset " << offset << " hashes to " << std::hex
+                    << actual << " instead of " << expected << std::dec << std::endl;
+        }
+        uint32_t truncated = hasher(key, std::min<size_t>(len, RAINBOW_MAX_KEY_LEN));
+        if (actual != truncated && nr_failures++ < 10) {
+          std::cerr << hash.name << ": key of " << len << " bytes at offset " << offset
+                    << " does not hash like its first " << RAINBOW_MAX_KEY_LEN << " bytes" << std::endl;
+        }
+      }
+    }
+  }
+#if defined(__x86_64__)
+  if (!__builtin_cpu_supports("sse4.2")) {
+    std::cout << "warning: No SSE4.2, so CRC32C was only checked against itself." << std::endl;
+  }
+#endif
+  if (nr_failures > 0) {
+    std::cerr << nr_failures << " keys hash differently in userspace and XDP" << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
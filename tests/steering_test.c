@@ -0,0 +1,180 @@
+/*
+ * Runs the steering XDP program on the host, with its BPF helpers replaced
+ * by ones that back the maps with plain arrays, and checks which AF_XDP
+ * socket it redirects requests to as the bucket table and the replicated
+ * keys change.
+ */
+
+#include "../rainbow_kern.c"
+
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PORT 11211
+
+static __u32 buckets[RAINBOW_NR_BUCKETS];
+static __u32 port;
+static __u32 key_hash = RAINBOW_KEY_HASH_MURMUR3;
+static __u32 replicated_hash;
+static struct rainbow_replicas replicas;
+static struct rainbow_sketch sketch;
+static struct rainbow_hot_key hot_keys[RAINBOW_NR_HOT_KEY_SLOTS];
+static __u32 cpu;
+
+static void *lookup(struct bpf_map_def *map, const void *key)
+{
+	__u32 index = *(const __u32 *)key;
+
+	if (map == &bucket_map)
+		return index < RAINBOW_NR_BUCKETS ? &buckets[index] : NULL;
+	if (map == &port_map)
+		return &port;
+	if (map == &key_hash_map)
+		return &key_hash;
+	if (map == &replica_map)
+		return replicas.nr_partitions > 0 && index == replicated_hash ? &replicas : NULL;
+	if (map == &sketch_map)
+		return &sketch;
+	if (map == &hot_key_map)
+		return index < RAINBOW_NR_HOT_KEY_SLOTS ? &hot_keys[index] : NULL;
+	return NULL;
+}
+
+static __u32 smp_processor_id(void)
+{
+	return cpu;
+}
+
+static __u32 redirected_slot;
+
+static int redirect_map(struct bpf_map_def *map, __u32 key, __u64 flags)
+{
+	if (map != &xsks_map)
+		return XDP_ABORTED;
+	redirected_slot = key;
+	return XDP_REDIRECT;
+}
+
+struct packet {
+	__u8 data[256];
+	size_t len;
+};
+
+/* Builds an IPv4 UDP packet to the store's port around `payload`. */
+static void build_packet(struct packet *pkt, const void *payload, size_t len)
+{
+	struct ethhdr *eth = (struct ethhdr *)pkt->data;
+	struct iphdr *iph = (struct iphdr *)(eth + 1);
+	struct udphdr *udph = (struct udphdr *)(iph + 1);
+
+	memset(pkt, 0, sizeof(*pkt));
+	eth->h_proto = htobe16(ETH_P_IP);
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->protocol = IPPROTO_UDP;
+	iph->tot_len = htobe16(sizeof(*iph) + sizeof(*udph) + len);
+	udph->dest = htobe16(PORT);
+	udph->len = htobe16(sizeof(*udph) + len);
+	memcpy(udph + 1, payload, len);
+	pkt->len = (__u8 *)(udph + 1) - pkt->data + len;
+}
+
+static void build_binary(struct packet *pkt, __u8 opcode, const char *key)
+{
+	__u8 payload[sizeof(struct mchdr) + RAINBOW_MAX_KEY_LEN];
+	struct mchdr *mch = (struct mchdr *)payload;
+	size_t key_len = strlen(key);
+
+	memset(mch, 0, sizeof(*mch));
+	mch->magic = MC_MAGIC_REQUEST;
+	mch->opcode = opcode;
+	mch->key_len = htobe16(key_len);
+	mch->body_len = htobe32(key_len);
+	memcpy(mch + 1, key, key_len);
+	build_packet(pkt, payload, sizeof(*mch) + key_len);
+}
+
+static void build_ascii(struct packet *pkt, const char *line)
+{
+	build_packet(pkt, line, strlen(line));
+}
+
+static int nr_failures;
+
+/* Checks that `pkt`, arriving on `queue`, goes to the socket of `partition`. */
+static void expect(const char *what, struct packet *pkt, __u32 queue, __u32 partition)
+{
+	redirected_slot = ~0U;
+	int action = process_packet(pkt->data, pkt->data + pkt->len, queue);
+	if (action != XDP_REDIRECT || redirected_slot != rainbow_xsk_slot(queue, partition)) {
+		fprintf(stderr, "%s: expected partition %u on queue %u, got action %d to slot %u\n", what, partition,
+			queue, action, redirected_slot);
+		nr_failures++;
+	}
+}
+
+static __u32 bucket_of(const char *key)
+{
+	return rainbow_bucket(rainbow_key_hash(key_hash, key, strlen(key), key + strlen(key)));
+}
+
+int main(void)
+{
+	struct packet get, set, text_get, text_gets;
+
+	bpf_map_lookup_elem = lookup;
+	bpf_get_smp_processor_id = smp_processor_id;
+	bpf_redirect_map = redirect_map;
+	port = htobe16(PORT);
+
+	build_binary(&get, MC_OP_GET, "foo");
+	build_binary(&set, MC_OP_SET, "foo");
+	build_ascii(&text_get, "get foo\r\n");
+	build_ascii(&text_gets, "gets foo\r\n");
+
+	expect("binary GET", &get, 2, 0);
+	expect("text GET", &text_get, 2, 0);
+
+	/* Moving the bucket of a key, as a migration does when it flips the
+	 * bucket table, moves the requests for it on every queue. */
+	buckets[bucket_of("foo")] = 3;
+	expect("binary GET after flip", &get, 2, 3);
+	expect("binary SET after flip", &set, 2, 3);
+	expect("text GET after flip", &text_get, 0, 3);
+
+	struct packet other;
+	const char *other_key = "bar";
+	if (bucket_of(other_key) == bucket_of("foo"))
+		other_key = "baz";
+	build_binary(&other, MC_OP_GET, other_key);
+	expect("GET of a key in another bucket", &other, 2, 0);
+
+	/* GETs of a replicated key go to a replica picked by the CPU, and
+	 * everything else still goes to the owner. */
+	replicated_hash = rainbow_key_hash(key_hash, "foo", 3, "foo" + 3);
+	replicas.nr_partitions = 2;
+	replicas.partitions[0] = 1;
+	replicas.partitions[1] = 5;
+	cpu = 3;
+	expect("GET of a replicated key", &get, 2, 5);
+	expect("text GET of a replicated key", &text_get, 2, 5);
+	expect("text GETS of a replicated key", &text_gets, 2, 5);
+	expect("SET of a replicated key", &set, 2, 3);
+	replicas.nr_partitions = 0;
+	expect("GET of a key that is no longer replicated", &get, 2, 3);
+
+	/* The key hash function is configurable, and the bucket table follows
+	 * the one the program is configured with. */
+	key_hash = RAINBOW_KEY_HASH_CRC32C;
+	memset(buckets, 0, sizeof(buckets));
+	buckets[bucket_of("foo")] = 7;
+	expect("binary GET with CRC32C", &get, 1, 7);
+
+	if (nr_failures > 0) {
+		fprintf(stderr, "%d steering checks failed\n", nr_failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
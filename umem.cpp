@@ -0,0 +1,46 @@
+#include "rainbow/umem.hpp"
+
+#include "rainbow/numa.hpp"
+
+#include <system_error>
+
+#include <sys/mman.h>
+
+namespace rainbow {
+
+Umem::Umem(unsigned int nr_frame_areas, size_t item_len, const Topology* topology, int numa_node, bool hugepages)
+  : _nr_frame_areas{nr_frame_areas}
+  , _item_len{item_len - item_len % frame_size}
+{
+  _len = _nr_frame_areas * frame_area_len + _item_len;
+  // The kernel pins the whole region when a socket registers it, so there
+  // is no point in reserving it lazily.
+  void* mem = ::mmap(nullptr, _len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(), "mmap");
+  }
+  _mem = reinterpret_cast<char*>(mem);
+  // Huge pages cut the IOTLB and TLB misses of a region that spans hundreds
+  // of megabytes. The advice must be in place before the pages are pinned.
+  if (hugepages && ::madvise(_mem, _len, MADV_HUGEPAGE) < 0) {
+    ::munmap(_mem, _len);
+    throw std::system_error(errno, std::system_category(), "madvise(MADV_HUGEPAGE)");
+  }
+  // The region is not touched yet, so binding it makes the kernel allocate
+  // the pages on the node when it pins them at registration.
+  if (topology) {
+    try {
+      topology->bind_memory(_mem, _len, numa_node);
+    } catch (...) {
+      ::munmap(_mem, _len);
+      throw;
+    }
+  }
+}
+
+Umem::~Umem()
+{
+  ::munmap(_mem, _len);
+}
+
+}
@@ -0,0 +1,260 @@
+#include "rainbow/uring.hpp"
+
+#include "rainbow/packet.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <system_error>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace rainbow {
+
+static constexpr unsigned int sq_entries = 256;
+static constexpr unsigned int cq_entries = 4096;
+
+/// A receive buffer holds the recvmsg header, the sender address, and a
+/// datagram of up to a frame, which is what the AF_XDP path receives too.
+static constexpr size_t recv_buf_size = sizeof(::io_uring_recvmsg_out) + sizeof(::sockaddr_storage) + Umem::frame_size;
+
+static constexpr uint16_t recv_buf_group = 0;
+
+static constexpr uint64_t recv_tag = ~uint64_t(0);
+
+UringReactor::UringReactor(int sockfd)
+  : _sockfd{sockfd}
+{
+}
+
+UringReactor::~UringReactor()
+{
+  // Close the ring first, so that the kernel is done with the buffers.
+  _ring.reset();
+  if (_bufs) {
+    ::munmap(_bufs, size_t(nr_recv_bufs) * recv_buf_size);
+  }
+  if (_buf_ring) {
+    ::munmap(_buf_ring, _buf_ring_len);
+  }
+  ::close(_sockfd);
+}
+
+void
+UringReactor::on_packet(OnPacketFn&& fn)
+{
+  _fn = std::move(fn);
+}
+
+void
+UringReactor::on_tx_complete(OnTxCompleteFn&& fn)
+{
+  _tx_complete_fn = std::move(fn);
+}
+
+void
+UringReactor::setup()
+{
+  _ring = std::make_unique<IoRing>(sq_entries, cq_entries);
+
+  _buf_ring_len = nr_recv_bufs * sizeof(::io_uring_buf);
+  void* buf_ring = ::mmap(nullptr, _buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(), "mmap");
+  }
+  _buf_ring = reinterpret_cast<::io_uring_buf_ring*>(buf_ring);
+  void* bufs = ::mmap(
+    nullptr, size_t(nr_recv_bufs) * recv_buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufs == MAP_FAILED) {
+    throw std::system_error(errno, std::system_category(), "mmap");
+  }
+  _bufs = reinterpret_cast<char*>(bufs);
+  ::io_uring_buf_reg reg{};
+  reg.ring_addr = reinterpret_cast<uint64_t>(_buf_ring);
+  reg.ring_entries = nr_recv_bufs;
+  reg.bgid = recv_buf_group;
+  _ring->register_resource(IORING_REGISTER_PBUF_RING, &reg, 1, "IORING_REGISTER_PBUF_RING");
+  for (unsigned i = 0; i < nr_recv_bufs; i++) {
+    recycle_buf(i);
+  }
+
+  // The kernel lays out every received datagram in its buffer as described
+  // by this header: room for a full address and no control messages.
+  _recv_msg.msg_namelen = sizeof(::sockaddr_storage);
+  _recv_msg.msg_controllen = 0;
+
+  _send_slots = std::make_unique<SendSlot[]>(nr_send_slots);
+  for (uint32_t i = 0; i < nr_send_slots; i++) {
+    _free_send_slots.push_back(i);
+  }
+  arm_recv();
+  _ring->submit();
+}
+
+void
+UringReactor::run_once()
+{
+  if (!_recv_armed) {
+    arm_recv();
+  }
+  _ring->reap([this](const ::io_uring_cqe& cqe) {
+    if (cqe.user_data == recv_tag) {
+      receive(cqe);
+    } else {
+      complete_send(cqe.user_data, cqe.res);
+    }
+  });
+  // Submit the replies of the whole batch, and pick up new completions, with
+  // a single system call.
+  _ring->submit();
+}
+
+/// Starts a multishot recvmsg, which keeps receiving datagrams into provided
+/// buffers until the kernel runs out of them.
+void
+UringReactor::arm_recv()
+{
+  auto* sqe = _ring->get_sqe();
+  if (!sqe) {
+    return;
+  }
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = _sockfd;
+  sqe->addr = reinterpret_cast<uint64_t>(&_recv_msg);
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = recv_buf_group;
+  sqe->user_data = recv_tag;
+  _recv_armed = true;
+}
+
+void
+UringReactor::recycle_buf(uint16_t bid)
+{
+  // The entries start at the ring itself. Do not use the flexible `bufs`
+  // member, which C++ places after the empty struct that the UAPI header
+  // declares it with.
+  auto* bufs = reinterpret_cast<::io_uring_buf*>(_buf_ring);
+  auto& buf = bufs[_buf_tail & (nr_recv_bufs - 1)];
+  buf.addr = reinterpret_cast<uint64_t>(_bufs + size_t(bid) * recv_buf_size);
+  buf.len = recv_buf_size;
+  buf.bid = bid;
+  _buf_tail++;
+  __atomic_store_n(&_buf_ring->tail, _buf_tail, __ATOMIC_RELEASE);
+}
+
+void
+UringReactor::receive(const ::io_uring_cqe& cqe)
+{
+  if (!(cqe.flags & IORING_CQE_F_MORE)) {
+    _recv_armed = false;
+  }
+  if (cqe.res < 0) {
+    // Running out of buffers ends the multishot request, which is re-armed
+    // once replies have returned some.
+    if (cqe.res != -ENOBUFS) {
+      std::cout << "warning: recvmsg: " << std::system_category().message(-cqe.res) << std::endl;
+    }
+    return;
+  }
+  if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+    return;
+  }
+  uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+  char* buf = _bufs + size_t(bid) * recv_buf_size;
+  auto* out = reinterpret_cast<const ::io_uring_recvmsg_out*>(buf);
+  const char* name = buf + sizeof(*out);
+  const char* payload = name + _recv_msg.msg_namelen + _recv_msg.msg_controllen;
+  // Datagrams that do not fit in a buffer are dropped, like oversized
+  // frames are on the AF_XDP path.
+  if (out->flags & MSG_TRUNC) {
+    recycle_buf(bid);
+    return;
+  }
+  process(Packet{payload, out->payloadlen}, name, std::min<size_t>(out->namelen, sizeof(::sockaddr_storage)));
+  recycle_buf(bid);
+}
+
+void
+UringReactor::resume()
+{
+  auto parked = std::move(_parked);
+  _parked.clear();
+  for (auto& p : parked) {
+    process(Packet{p.data.data(), p.data.size()}, &p.addr, p.namelen, std::move(p.progress));
+  }
+}
+
+/// Processes a datagram from the sender at `name`, and queues the reply.
+void
+UringReactor::process(const Packet& packet, const void* name, size_t namelen, Progress&& progress)
+{
+  SendSlot* slot = nullptr;
+  uint32_t slot_idx = 0;
+  Frame reply{nullptr, 0, 0};
+  if (!_free_send_slots.empty()) {
+    slot_idx = _free_send_slots.back();
+    _free_send_slots.pop_back();
+    slot = &_send_slots[slot_idx];
+    reply = Frame{slot->data, 0, sizeof(slot->data)};
+  }
+  reply.progress = std::move(progress);
+  auto ret = _fn(packet, reply);
+  if (!ret) {
+    std::cout << "warning: Packet processing error: " << ret.error() << std::endl;
+  }
+  // The receive buffer is recycled, so keep a copy of the datagram.
+  if (reply.deferred && _parked.size() < max_parked) {
+    Parked p{std::vector<char>(packet.data, packet.data + packet.len), {}, namelen, std::move(reply.progress)};
+    std::memcpy(&p.addr, name, namelen);
+    _parked.push_back(std::move(p));
+  }
+  ::io_uring_sqe* sqe = nullptr;
+  if (slot && (reply.len > 0 || !reply.payload.empty())) {
+    sqe = _ring->get_sqe();
+  }
+  if (!sqe) {
+    if (slot) {
+      _free_send_slots.push_back(slot_idx);
+    }
+    if (reply.payload_owner) {
+      _tx_complete_fn(reply.payload_owner);
+    }
+    return;
+  }
+  std::memcpy(&slot->addr, name, namelen);
+  slot->iov[0] = ::iovec{slot->data, reply.len};
+  slot->iov[1] = ::iovec{const_cast<char*>(reply.payload.data()), reply.payload.size()};
+  slot->msg = ::msghdr{};
+  slot->msg.msg_name = &slot->addr;
+  slot->msg.msg_namelen = namelen;
+  slot->msg.msg_iov = slot->iov;
+  slot->msg.msg_iovlen = reply.payload.empty() ? 1 : 2;
+  slot->payload_owner = reply.payload_owner;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = _sockfd;
+  sqe->addr = reinterpret_cast<uint64_t>(&slot->msg);
+  sqe->len = 1;
+  sqe->user_data = slot_idx;
+}
+
+void
+UringReactor::complete_send(uint32_t slot_idx, int res)
+{
+  if (slot_idx >= nr_send_slots) {
+    return;
+  }
+  if (res < 0) {
+    std::cout << "warning: sendmsg: " << std::system_category().message(-res) << std::endl;
+  }
+  auto& slot = _send_slots[slot_idx];
+  if (slot.payload_owner) {
+    _tx_complete_fn(slot.payload_owner);
+    slot.payload_owner = nullptr;
+  }
+  _free_send_slots.push_back(slot_idx);
+}
+
+}
@@ -0,0 +1,85 @@
+#include "rainbow/xdp.hpp"
+
+#include <system_error>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/resource.h>
+
+extern "C" {
+#include <bpf.h>
+#include <libbpf.h>
+}
+
+namespace rainbow {
+
+/// Stores `value` at index zero of single-entry array map `name`, if the
+/// program has such a map.
+static void
+set_config(::bpf_object* obj, const char* name, uint32_t value)
+{
+  ::bpf_map* map = bpf_object__find_map_by_name(obj, name);
+  if (!map) {
+    return;
+  }
+  int zero = 0;
+  if (bpf_map_update_elem(bpf_map__fd(map), &zero, &value, 0)) {
+    throw std::system_error(errno, std::system_category(), std::string{"bpf_map_update_elem("} + name + ")");
+  }
+}
+
+XdpProgram::XdpProgram(const std::string& ifname, const std::string& path, KeyHash key_hash, uint16_t port)
+  : _ifname{ifname}
+{
+  ::rlimit rlim = {RLIM_INFINITY, RLIM_INFINITY};
+  if (setrlimit(RLIMIT_MEMLOCK, &rlim)) {
+    throw std::system_error(errno, std::system_category(), "setrlimit(RLIMIT_MEMLOCK)");
+  }
+  _ifindex = if_nametoindex(_ifname.c_str());
+  if (_ifindex == 0) {
+    throw std::system_error(errno, std::system_category(), "if_nametoindex(" + _ifname + ")");
+  }
+  ::bpf_prog_load_attr prog_load_attr = {
+    .prog_type = BPF_PROG_TYPE_XDP,
+  };
+  prog_load_attr.file = path.c_str();
+  int progfd;
+  int err = bpf_prog_load_xattr(&prog_load_attr, &_obj, &progfd);
+  if (err < 0) {
+    throw std::system_error(-err, std::system_category(), "bpf_prog_load_xattr(" + path + ")");
+  }
+  // Programs that steer by key hash must use the same hash function as the
+  // store, so configure it before the program starts seeing packets.
+  set_config(_obj, "key_hash_map", static_cast<uint32_t>(key_hash));
+  set_config(_obj, "port_map", htons(port));
+  err = bpf_set_link_xdp_fd(_ifindex, progfd, 0);
+  if (err < 0) {
+    throw std::system_error(-err, std::system_category(), "bpf_set_link_xdp_fd");
+  }
+}
+
+XdpProgram::~XdpProgram()
+{
+  // FIXME: Unsafe if someone else changed the XDP program while we were
+  // running.
+  ::bpf_set_link_xdp_fd(_ifindex, -1, 0);
+  ::bpf_object__close(_obj);
+}
+
+int
+XdpProgram::map_fd(const char* name) const
+{
+  ::bpf_map* map = bpf_object__find_map_by_name(_obj, name);
+  if (!map) {
+    return -1;
+  }
+  return bpf_map__fd(map);
+}
+
+bool
+XdpProgram::steers_by_key() const
+{
+  return map_fd("bucket_map") >= 0;
+}
+
+}